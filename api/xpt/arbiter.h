@@ -0,0 +1,113 @@
+#pragma once
+
+/**
+ * @file
+ * @brief Bus arbitration
+ *
+ * One arbiter per i2c or spi bus, shared by every context opened on that
+ * bus, hands the bus to one transaction at a time. Waiting transactions
+ * are served by priority class, first come first served within a class,
+ * so a sensor read at XPT_ARBITER_PRIO_HIGH waits for at most the
+ * transaction in progress. Contexts doing long transfers bound that with
+ * a slice: the transfer is split at transaction boundaries and the bus is
+ * handed over in between when someone is waiting.
+ *
+ * Contexts take their bus's arbiter on init; the functions below are for
+ * code that wants to hold a bus across several calls or read statistics.
+ */
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "common.h"
+
+/**
+ * Bus types, i2c and spi buses of the same number have separate arbiters
+ */
+typedef enum {
+    XPT_ARBITER_I2C = 0,
+    XPT_ARBITER_SPI = 1
+} xpt_arbiter_bus_t;
+
+/**
+ * Priority classes, lower values are served first
+ */
+typedef enum {
+    XPT_ARBITER_PRIO_HIGH = 0,   /**< latency sensitive, e.g. periodic sensor reads */
+    XPT_ARBITER_PRIO_NORMAL = 1, /**< default of new contexts */
+    XPT_ARBITER_PRIO_BULK = 2    /**< long transfers, e.g. memory dumps */
+} xpt_arbiter_prio_t;
+
+#define XPT_ARBITER_PRIO_COUNT 3
+
+/**
+ * Counters of one priority class
+ */
+typedef struct {
+    unsigned long long acquired; /**< transactions granted the bus */
+    unsigned long long contended; /**< of those, ones that had to queue */
+    unsigned long long wait_ns; /**< total time spent queued */
+    unsigned long long max_wait_ns; /**< longest time spent queued */
+} xpt_arbiter_stats_t;
+
+/** Xpt arbiter context */
+typedef struct _arbiter* xpt_arbiter_context;
+
+/**
+ * Get the arbiter of a bus, creating it on first use. Every call takes a
+ * reference that xpt_arbiter_put() drops.
+ *
+ * @param type bus type
+ * @param bus bus number, as in /dev/i2c-N or /dev/spidevN.x
+ * @return arbiter or NULL if out of memory
+ */
+xpt_arbiter_context xpt_arbiter_get(xpt_arbiter_bus_t type, unsigned int bus);
+
+/**
+ * Drop a reference, the last one frees the arbiter
+ *
+ * @param arb arbiter
+ */
+void xpt_arbiter_put(xpt_arbiter_context arb);
+
+/**
+ * Wait for the bus and take it. Not recursive: a thread holding the bus
+ * must not call i2c or spi functions on a context of the same bus.
+ *
+ * @param arb arbiter
+ * @param prio priority class of the waiter
+ */
+void xpt_arbiter_acquire(xpt_arbiter_context arb, xpt_arbiter_prio_t prio);
+
+/**
+ * Hand the bus to the first waiter of the highest priority class
+ *
+ * @param arb arbiter
+ */
+void xpt_arbiter_release(xpt_arbiter_context arb);
+
+/**
+ * Release and take the bus again if anyone of the same or a higher
+ * priority class is waiting, to be called by the holder at a transaction
+ * boundary
+ *
+ * @param arb arbiter
+ * @param prio priority class of the holder
+ * @return 1 if the bus was handed over in between, else 0
+ */
+int xpt_arbiter_yield(xpt_arbiter_context arb, xpt_arbiter_prio_t prio);
+
+/**
+ * Read the queueing counters of a priority class
+ *
+ * @param arb arbiter
+ * @param prio priority class
+ * @param stats filled with the counters
+ * @return Result of operation
+ */
+xpt_result_t xpt_arbiter_get_stats(xpt_arbiter_context arb, xpt_arbiter_prio_t prio, xpt_arbiter_stats_t* stats);
+
+#ifdef __cplusplus
+}
+#endif
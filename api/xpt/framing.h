@@ -0,0 +1,156 @@
+#pragma once
+
+/**
+ * @file
+ * @brief COBS and SLIP framing
+ *
+ * Packet framing for binary protocols on a byte stream. The codecs find
+ * delimiters and escape bytes 16 at a time with SSE2 or NEON where the
+ * compiler targets them, and fall back to a plain loop elsewhere; the
+ * bytes in between are moved as whole runs instead of one at a time.
+ * Decoding works in place.
+ *
+ * A framing context sits on top of a xpt_uart_context and turns its
+ * byte stream into decoded frames.
+ */
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "common.h"
+#include "uart.h"
+
+/** worst case COBS encoding of len bytes, trailing delimiter included */
+#define XPT_COBS_MAX_ENCODED(len) ((len) + (len) / 254 + 2)
+/** worst case SLIP encoding of len bytes, both END bytes included */
+#define XPT_SLIP_MAX_ENCODED(len) (2 * (len) + 2)
+
+/** SLIP special bytes, RFC 1055 */
+#define XPT_SLIP_END 0xc0
+#define XPT_SLIP_ESC 0xdb
+#define XPT_SLIP_ESC_END 0xdc
+#define XPT_SLIP_ESC_ESC 0xdd
+
+/**
+ * Framing schemes
+ */
+typedef enum {
+    XPT_FRAMING_COBS = 0, /**< consistent overhead byte stuffing, 0x00 delimited */
+    XPT_FRAMING_SLIP = 1  /**< RFC 1055, 0xc0 delimited */
+} xpt_framing_mode_t;
+
+/** Xpt framing context */
+typedef struct _framing* xpt_framing_context;
+
+/**
+ * Counters kept by a framing context
+ */
+typedef struct {
+    unsigned long long frames; /**< frames decoded */
+    unsigned long long errors; /**< frames that failed to decode */
+    unsigned long long oversize; /**< frames dropped for exceeding max_frame */
+} xpt_framing_stats_t;
+
+/**
+ * COBS encode a buffer and append the 0x00 delimiter
+ *
+ * @param src data to encode
+ * @param len length of src
+ * @param dst output, at least XPT_COBS_MAX_ENCODED(len) bytes
+ * @return encoded length including the delimiter
+ */
+size_t xpt_cobs_encode(const uint8_t* src, size_t len, uint8_t* dst);
+
+/**
+ * COBS decode a frame in place. buf holds one frame without its
+ * delimiter.
+ *
+ * @param buf frame to decode, overwritten with the decoded data
+ * @param len length of the encoded frame
+ * @return decoded length or -1 for a malformed frame
+ */
+int xpt_cobs_decode(uint8_t* buf, size_t len);
+
+/**
+ * SLIP encode a buffer, with an END byte before and after the frame
+ *
+ * @param src data to encode
+ * @param len length of src
+ * @param dst output, at least XPT_SLIP_MAX_ENCODED(len) bytes
+ * @return encoded length
+ */
+size_t xpt_slip_encode(const uint8_t* src, size_t len, uint8_t* dst);
+
+/**
+ * SLIP decode a frame in place. buf holds one frame without END bytes.
+ *
+ * @param buf frame to decode, overwritten with the decoded data
+ * @param len length of the encoded frame
+ * @return decoded length or -1 for a malformed escape sequence
+ */
+int xpt_slip_decode(uint8_t* buf, size_t len);
+
+/**
+ * Enable or disable the SSE2/NEON scanning, e.g. to compare against the
+ * plain loop. Has no effect in builds without SIMD support.
+ *
+ * @param enable 0 to use the plain loop
+ * @return 1 if SIMD scanning is in use afterwards
+ */
+int xpt_framing_use_simd(xpt_boolean_t enable);
+
+/**
+ * Create a framing stage on top of an initialised uart
+ *
+ * @param uart the uart to read from and write to
+ * @param mode framing scheme
+ * @param max_frame largest decoded frame accepted
+ * @return framing context or NULL
+ */
+xpt_framing_context xpt_framing_init(xpt_uart_context uart, xpt_framing_mode_t mode, size_t max_frame);
+
+/**
+ * Read the next frame. The uart is read in large chunks and frames are
+ * decoded in the receive buffer, no copy is made.
+ *
+ * @param dev framing context
+ * @param frame set to the decoded frame, valid until the next call
+ * @return length of the decoded frame, or -1 when the uart read returned
+ * no data: a timeout, a non-blocking port without data, or an error
+ */
+int xpt_framing_read_frame(xpt_framing_context dev, uint8_t** frame);
+
+/**
+ * Encode a frame and write it to the uart
+ *
+ * @param dev framing context
+ * @param data frame payload
+ * @param len length of data, at most max_frame
+ * @return Result of operation
+ */
+xpt_result_t xpt_framing_write_frame(xpt_framing_context dev, const uint8_t* data, size_t len);
+
+/**
+ * Read the context's counters
+ *
+ * @param dev framing context
+ * @param stats filled with the counters
+ * @return Result of operation
+ */
+xpt_result_t xpt_framing_get_stats(xpt_framing_context dev, xpt_framing_stats_t* stats);
+
+/**
+ * Destroy a framing context. The uart is not closed.
+ *
+ * @param dev framing context
+ * @return Result of operation
+ */
+xpt_result_t xpt_framing_stop(xpt_framing_context dev);
+
+#ifdef __cplusplus
+}
+#endif
@@ -21,6 +21,7 @@ extern "C" {
 #include <stdint.h>
 
 #include "common.h"
+#include "arbiter.h"
 #include "gpio.h"
 
 /**
@@ -100,6 +101,32 @@ int xpt_i2c_read_word_data(xpt_i2c_context dev, const uint8_t command);
  */
 int xpt_i2c_read_bytes_data(xpt_i2c_context dev, uint8_t command, uint8_t* data, int length);
 
+/**
+ * Bulk read from i2c context, starting from a 16-bit register address
+ * sent high byte first, as used by 24Cxx EEPROMs above 16 Kbit and many
+ * sensors. Address and read run as one I2C_RDWR transaction.
+ *
+ * @param dev The i2c context
+ * @param reg The register
+ * @param data pointer to the byte array to read data in to
+ * @param length number of bytes to read
+ * @return The length in bytes passed to the function or -1
+ */
+int xpt_i2c_read_bytes_data16(xpt_i2c_context dev, uint16_t reg, uint8_t* data, int length);
+
+/**
+ * Bulk write to a 16-bit register address, sent high byte first and
+ * followed by the data in the same message. Unlike xpt_i2c_write() the
+ * length is not limited to an SMBus block.
+ *
+ * @param dev The i2c context
+ * @param reg The register
+ * @param data pointer to the byte array to be written
+ * @param length the number of bytes to write
+ * @return Result of operation
+ */
+xpt_result_t xpt_i2c_write_bytes_data16(xpt_i2c_context dev, uint16_t reg, const uint8_t* data, int length);
+
 /**
  * Write length bytes to the bus, the first byte in the array is the
  * command/register to write
@@ -149,6 +176,39 @@ xpt_result_t xpt_i2c_write_word_data(xpt_i2c_context dev, const uint16_t data, c
  */
 xpt_result_t xpt_i2c_address(xpt_i2c_context dev, uint8_t address);
 
+/**
+ * Set the priority class of this context's transactions on the bus
+ * arbiter. Contexts start at XPT_ARBITER_PRIO_NORMAL.
+ *
+ * @param dev The i2c context
+ * @param prio priority class
+ * @return Result of operation
+ */
+xpt_result_t xpt_i2c_priority(xpt_i2c_context dev, xpt_arbiter_prio_t prio);
+
+/**
+ * Bound the bulk register reads, xpt_i2c_read_bytes_data() and
+ * xpt_i2c_read_bytes_data16(), to bytes per transaction. Longer reads
+ * continue in further transactions at the register where the previous
+ * one stopped, with other contexts given the bus in between. Only for
+ * devices whose register address auto-increments, like EEPROMs. 0, the
+ * default, reads in one transaction.
+ *
+ * @param dev The i2c context
+ * @param bytes slice length
+ * @return Result of operation
+ */
+xpt_result_t xpt_i2c_slice(xpt_i2c_context dev, int bytes);
+
+/**
+ * The arbiter of the context's bus, to hold the bus across calls or to
+ * read its statistics
+ *
+ * @param dev The i2c context
+ * @return arbiter, NULL if there is none
+ */
+xpt_arbiter_context xpt_i2c_get_arbiter(xpt_i2c_context dev);
+
 /**
  * De-inits an xpt_i2c_context device
  *
@@ -0,0 +1,192 @@
+#pragma once
+
+/**
+ * @file
+ * @brief Modbus RTU master
+ *
+ * Modbus RTU master on top of a xpt_uart_context. The inter-frame gap is
+ * derived from the port's baudrate, the end of a response frame is taken
+ * from the arrival time of its last byte (or its known length) instead of
+ * fixed sleeps, and queued register reads of the same slave that sit next
+ * to each other are folded into a single request on the wire.
+ *
+ * The master is driven from a single thread. xpt_modbus_submit() may be
+ * called from any thread.
+ */
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+
+#include "common.h"
+#include "uart.h"
+
+/** largest register count of one read request */
+#define XPT_MODBUS_MAX_READ_REGS 125
+/** largest coil count of one read request */
+#define XPT_MODBUS_MAX_READ_BITS 2000
+/** largest register count of one write multiple registers request */
+#define XPT_MODBUS_MAX_WRITE_REGS 123
+
+/**
+ * Supported function codes
+ */
+typedef enum {
+    XPT_MODBUS_READ_COILS = 0x01,
+    XPT_MODBUS_READ_DISCRETE_INPUTS = 0x02,
+    XPT_MODBUS_READ_HOLDING_REGISTERS = 0x03,
+    XPT_MODBUS_READ_INPUT_REGISTERS = 0x04,
+    XPT_MODBUS_WRITE_SINGLE_COIL = 0x05,
+    XPT_MODBUS_WRITE_SINGLE_REGISTER = 0x06,
+    XPT_MODBUS_WRITE_MULTIPLE_REGISTERS = 0x10
+} xpt_modbus_function_t;
+
+/** Xpt Modbus master context */
+typedef struct _modbus* xpt_modbus_context;
+
+typedef struct _xpt_modbus_request xpt_modbus_request_t;
+
+/**
+ * Completion callback, called from xpt_modbus_process() once the request
+ * finished, successfully or not.
+ */
+typedef void (*xpt_modbus_callback_t)(xpt_modbus_request_t* req, void* arg);
+
+/**
+ * One Modbus request. Owned by the caller, it must stay valid from
+ * xpt_modbus_submit() until it completes.
+ */
+struct _xpt_modbus_request {
+    uint8_t slave; /**< slave address, 0 broadcasts (writes only) */
+    uint8_t function; /**< one of xpt_modbus_function_t */
+    uint16_t address; /**< first register or coil */
+    uint16_t count; /**< registers or coils, 1 for single writes */
+    uint16_t* regs; /**< registers read into or written from */
+    uint8_t* bits; /**< coils read into, one per byte, or bits[0] for a single coil write */
+    xpt_modbus_callback_t callback; /**< optional completion callback */
+    void* arg; /**< passed to callback */
+
+    xpt_result_t status; /**< result once completed */
+    uint8_t exception; /**< exception code with XPT_ERROR_MODBUS_EXCEPTION */
+    xpt_boolean_t done; /**< set once completed */
+
+    xpt_modbus_request_t* next; /**< private: queue linkage */
+};
+
+/**
+ * Counters kept by the master
+ */
+typedef struct {
+    unsigned long long requests; /**< requests completed */
+    unsigned long long transactions; /**< request/response cycles on the wire */
+    unsigned long long coalesced; /**< requests answered by another one's transaction */
+    unsigned long long timeouts; /**< transactions without a response */
+    unsigned long long crc_errors; /**< corrupt or malformed responses */
+    unsigned long long exceptions; /**< exception responses */
+} xpt_modbus_stats_t;
+
+/**
+ * Create a master on an initialised uart. Baudrate and framing must be
+ * set on the uart first; call xpt_modbus_update_timing() after changing
+ * them later. The uart is not closed by xpt_modbus_stop().
+ *
+ * @param uart the uart the bus is attached to
+ * @return modbus context or NULL
+ */
+xpt_modbus_context xpt_modbus_init(xpt_uart_context uart);
+
+/**
+ * Destroy the master. Queued requests are completed with
+ * XPT_ERROR_INVALID_HANDLE.
+ *
+ * @param dev modbus context
+ * @return Result of operation
+ */
+xpt_result_t xpt_modbus_stop(xpt_modbus_context dev);
+
+/**
+ * Recompute the character time and the 3.5 character inter-frame gap
+ * from the uart's current baudrate and framing. Above 19200 baud the
+ * fixed 1750us gap of the Modbus serial line specification is used.
+ *
+ * @param dev modbus context
+ * @return Result of operation
+ */
+xpt_result_t xpt_modbus_update_timing(xpt_modbus_context dev);
+
+/**
+ * Set the response timeout and extra gap slack. The slack is added to
+ * the frame end gap for adapters that deliver bytes in bursts, e.g. the
+ * latency timer of USB serial converters.
+ *
+ * @param dev modbus context
+ * @param response_ms time to wait for the first byte of a response
+ * @param slack_us extra silence required before a frame is considered
+ * complete
+ * @return Result of operation
+ */
+xpt_result_t xpt_modbus_set_timeout(xpt_modbus_context dev, unsigned int response_ms, unsigned int slack_us);
+
+/**
+ * Control coalescing of queued reads. Two reads of the same slave and
+ * function are merged when the combined range fits in one request and
+ * the hole between them is at most max_hole registers (or coils).
+ *
+ * @param dev modbus context
+ * @param enable 0 sends every request as submitted
+ * @param max_hole largest gap that is read and thrown away
+ * @return Result of operation
+ */
+xpt_result_t xpt_modbus_set_coalesce(xpt_modbus_context dev, xpt_boolean_t enable, unsigned int max_hole);
+
+/**
+ * Queue a request. Reads may be merged with requests already queued.
+ *
+ * @param dev modbus context
+ * @param req the request, owned by the caller until it completes
+ * @return Result of operation
+ */
+xpt_result_t xpt_modbus_submit(xpt_modbus_context dev, xpt_modbus_request_t* req);
+
+/**
+ * Run queued transactions back to back.
+ *
+ * @param dev modbus context
+ * @param max stop after this many transactions, 0 runs until the queue
+ * is empty
+ * @return number of transactions run, or -1 for an invalid context
+ */
+int xpt_modbus_process(xpt_modbus_context dev, int max);
+
+/**
+ * Queue a request and run the queue until it has completed.
+ *
+ * @param dev modbus context
+ * @param req the request
+ * @return the request's status
+ */
+xpt_result_t xpt_modbus_execute(xpt_modbus_context dev, xpt_modbus_request_t* req);
+
+/**
+ * Read the master's counters.
+ *
+ * @param dev modbus context
+ * @param stats filled with the counters
+ * @return Result of operation
+ */
+xpt_result_t xpt_modbus_get_stats(xpt_modbus_context dev, xpt_modbus_stats_t* stats);
+
+/**
+ * Compute the Modbus CRC16 of a buffer
+ *
+ * @param buffer the data
+ * @param length number of bytes
+ * @return the CRC, to be sent low byte first
+ */
+uint16_t xpt_modbus_crc16(const uint8_t* buffer, uint16_t length);
+
+#ifdef __cplusplus
+}
+#endif
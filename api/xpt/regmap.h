@@ -0,0 +1,183 @@
+#pragma once
+
+/**
+ * @file
+ * @brief Register map
+ *
+ * A register cache on top of an i2c or spi context, for devices whose
+ * registers are read and written by address. The map describes which
+ * registers are volatile (status, data), read-only or write-only; all
+ * others are cached after the first read or write, so reads and
+ * read-modify-write updates of configuration registers cost no bus
+ * traffic. Writes are only recorded, xpt_regmap_flush() then writes the
+ * dirty registers in bursts over contiguous address ranges, relying on
+ * the device incrementing the register address within a burst.
+ *
+ * Volatile registers are always read from and written to the device at
+ * once. Register values are 8 bits wide, addresses 8 or 16 bits.
+ */
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+
+#include "common.h"
+#include "i2c.h"
+#include "spi.h"
+
+/**
+ * Register properties, combined in xpt_regmap_range_t
+ */
+typedef enum {
+    XPT_REGMAP_VOLATILE = 0x01,   /**< changes on its own, never cached */
+    XPT_REGMAP_READ_ONLY = 0x02,  /**< writes are rejected */
+    XPT_REGMAP_WRITE_ONLY = 0x04, /**< reads come from what was last written */
+    XPT_REGMAP_NO_ACCESS = 0x08   /**< reserved, neither read nor written, never part of a burst */
+} xpt_regmap_flag_t;
+
+/**
+ * Registers first to last, inclusive, share flags. Registers outside all
+ * ranges are plain read/write and cached.
+ */
+typedef struct {
+    uint16_t first;
+    uint16_t last;
+    unsigned int flags;
+} xpt_regmap_range_t;
+
+/**
+ * Device description
+ */
+typedef struct {
+    int reg_bits; /**< register address width, 8 or 16 */
+    unsigned int max_register; /**< highest register address */
+    const xpt_regmap_range_t* ranges; /**< register properties, may be NULL */
+    int num_ranges; /**< entries in ranges */
+    const uint8_t* defaults; /**< reset values of registers 0 to max_register, or NULL if unknown */
+    unsigned int max_burst; /**< most registers per bus transfer, 0 for the bus's limit */
+    uint8_t spi_read_flag; /**< spi: or'ed into the first address byte of reads, e.g. 0x80 */
+    uint8_t spi_write_flag; /**< spi: or'ed into the first address byte of writes */
+} xpt_regmap_config_t;
+
+/**
+ * Counters kept by a register map
+ */
+typedef struct {
+    unsigned long long reads; /**< registers read by the caller */
+    unsigned long long cache_hits; /**< of those, served from the cache */
+    unsigned long long writes; /**< registers written by the caller */
+    unsigned long long skipped; /**< of those, already holding the value */
+    unsigned long long bus_reads; /**< read transfers on the bus */
+    unsigned long long bus_writes; /**< write transfers on the bus */
+} xpt_regmap_stats_t;
+
+/** Xpt register map context */
+typedef struct _regmap* xpt_regmap_context;
+
+/**
+ * Create a register map on an i2c context whose slave address is set.
+ * 8-bit register writes use SMBus block writes of up to 32 bytes.
+ *
+ * @param dev i2c context, it stays owned by the caller
+ * @param config device description, copied except for ranges and defaults
+ * @return register map or NULL
+ */
+xpt_regmap_context xpt_regmap_init_i2c(xpt_i2c_context dev, const xpt_regmap_config_t* config);
+
+/**
+ * Create a register map on an spi context. A transfer is the address
+ * byte(s), flagged with spi_read_flag or spi_write_flag, then the data.
+ *
+ * @param dev spi context, it stays owned by the caller
+ * @param config device description, copied except for ranges and defaults
+ * @return register map or NULL
+ */
+xpt_regmap_context xpt_regmap_init_spi(xpt_spi_context dev, const xpt_regmap_config_t* config);
+
+/**
+ * Read a register, from the cache unless it is volatile or not cached yet
+ *
+ * @param map register map
+ * @param reg register address
+ * @return register value or -1
+ */
+int xpt_regmap_read(xpt_regmap_context map, unsigned int reg);
+
+/**
+ * Read count consecutive registers, with one bus transfer per run of
+ * registers missing from the cache
+ *
+ * @param map register map
+ * @param reg first register address
+ * @param data filled with the values
+ * @param count number of registers
+ * @return Result of operation
+ */
+xpt_result_t xpt_regmap_bulk_read(xpt_regmap_context map, unsigned int reg, uint8_t* data, int count);
+
+/**
+ * Write a register. The write reaches the device on xpt_regmap_flush(),
+ * or at once for volatile registers; writing the value the register
+ * already holds does nothing.
+ *
+ * @param map register map
+ * @param reg register address
+ * @param value new value
+ * @return Result of operation
+ */
+xpt_result_t xpt_regmap_write(xpt_regmap_context map, unsigned int reg, uint8_t value);
+
+/**
+ * Change the bits of mask to those of value, reading the register only
+ * if it is not cached
+ *
+ * @param map register map
+ * @param reg register address
+ * @param mask bits to change
+ * @param value new bits
+ * @return Result of operation
+ */
+xpt_result_t xpt_regmap_update_bits(xpt_regmap_context map, unsigned int reg, uint8_t mask, uint8_t value);
+
+/**
+ * Write all dirty registers. Runs of dirty registers become one burst
+ * each; runs separated by a few clean cached registers are merged, the
+ * clean ones rewritten with their cached values, when that saves a
+ * transfer.
+ *
+ * @param map register map
+ * @return Result of operation
+ */
+xpt_result_t xpt_regmap_flush(xpt_regmap_context map);
+
+/**
+ * Forget the cached values, e.g. after the device was reset. Writes not
+ * flushed yet are kept.
+ *
+ * @param map register map
+ * @return Result of operation
+ */
+xpt_result_t xpt_regmap_invalidate(xpt_regmap_context map);
+
+/**
+ * Read the map's counters
+ *
+ * @param map register map
+ * @param stats filled with the counters
+ * @return Result of operation
+ */
+xpt_result_t xpt_regmap_get_stats(xpt_regmap_context map, xpt_regmap_stats_t* stats);
+
+/**
+ * Destroy a register map without flushing. The bus context is not closed.
+ *
+ * @param map register map
+ * @return Result of operation
+ */
+xpt_result_t xpt_regmap_stop(xpt_regmap_context map);
+
+#ifdef __cplusplus
+}
+#endif
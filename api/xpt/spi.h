@@ -22,6 +22,7 @@ extern "C" {
 #include <stdint.h>
 
 #include "common.h"
+#include "arbiter.h"
 
 /**
  * XPT SPI Modes
@@ -37,6 +38,42 @@ typedef enum {
                            output data (change) on falling edge */
 } xpt_spi_mode_t;
 
+/**
+ * SPI mode flags for xpt_spi_mode_flags(), or'ed together
+ */
+typedef enum {
+    XPT_SPI_3WIRE = 0x10,     /**< one shared data line, half duplex */
+    XPT_SPI_TX_DUAL = 0x100,  /**< transmit on 2 data lines */
+    XPT_SPI_TX_QUAD = 0x200,  /**< transmit on 4 data lines */
+    XPT_SPI_RX_DUAL = 0x400,  /**< receive on 2 data lines */
+    XPT_SPI_RX_QUAD = 0x800   /**< receive on 4 data lines */
+} xpt_spi_mode_flag_t;
+
+/**
+ * One segment of xpt_spi_transfer_segments()
+ */
+typedef struct {
+    const uint8_t* txbuf; /**< data to send, NULL to send nothing */
+    uint8_t* rxbuf;       /**< buffer to receive into, may be NULL */
+    int length;           /**< bytes in this segment */
+    uint8_t tx_nbits;     /**< data lines to send on: 1, 2 or 4, 0 is 1 */
+    uint8_t rx_nbits;     /**< data lines to receive on: 1, 2 or 4, 0 is 1 */
+    uint16_t delay_usecs; /**< delay after the segment */
+    xpt_boolean_t cs_change; /**< release chip select after the segment */
+} xpt_spi_segment_t;
+
+/**
+ * Transfer counters of a spi context. Transfers longer than spidev's
+ * bufsiz are split into several messages.
+ */
+typedef struct {
+    uint64_t calls;       /**< transfer calls */
+    uint64_t messages;    /**< spidev messages, more than calls when split */
+    uint64_t bytes;       /**< bytes transferred */
+    uint64_t busy_ns;     /**< time spent in the transfer ioctl */
+    double bytes_per_sec; /**< bytes over busy_ns, the effective throughput */
+} xpt_spi_stats_t;
+
 /**
  * Opaque pointer definition to the internal struct _spi
  */
@@ -68,6 +105,18 @@ xpt_spi_context xpt_spi_init_raw(unsigned int bus, unsigned int cs);
  */
 xpt_result_t xpt_spi_mode(xpt_spi_context dev, xpt_spi_mode_t mode);
 
+/**
+ * Enable 3-wire or dual/quad data lines, on top of the mode set by
+ * xpt_spi_mode(). The mode is read back from the driver, since the SPI
+ * core silently drops lane flags the controller cannot do.
+ *
+ * @param dev The Spi context
+ * @param flags xpt_spi_mode_flag_t values or'ed together, 0 for plain SPI
+ * @return Result of operation, XPT_ERROR_FEATURE_NOT_SUPPORTED if the
+ * controller did not accept all flags; the previous mode stays in effect
+ */
+xpt_result_t xpt_spi_mode_flags(xpt_spi_context dev, unsigned int flags);
+
 /**
  * Set the SPI device operating clock frequency.
  *
@@ -101,7 +150,7 @@ int xpt_spi_write_word(xpt_spi_context dev, uint16_t data);
  *
  * @param dev The Spi context
  * @param data to send
- * @param length elements within buffer, Max 4096
+ * @param length elements within buffer, longer than spidev's bufsiz is split
  * @return Data received on the miso line, same length as passed in
  */
 uint8_t* xpt_spi_write_buf(xpt_spi_context dev, uint8_t* data, int length);
@@ -112,7 +161,7 @@ uint8_t* xpt_spi_write_buf(xpt_spi_context dev, uint8_t* data, int length);
  *
  * @param dev The Spi context
  * @param data to send
- * @param length elements (in bytes) within buffer, Max 4096
+ * @param length elements (in bytes) within buffer, longer than spidev's bufsiz is split
  * @return Data received on the miso line, same length as passed in
  */
 uint16_t* xpt_spi_write_buf_word(xpt_spi_context dev, uint16_t* data, int length);
@@ -124,11 +173,25 @@ uint16_t* xpt_spi_write_buf_word(xpt_spi_context dev, uint16_t* data, int length
  * @param dev The Spi context
  * @param data to send
  * @param rxbuf buffer to recv data back, may be NULL
- * @param length elements within buffer, Max 4096
+ * @param length elements within buffer, longer than spidev's bufsiz is split
  * @return Result of operation
  */
 xpt_result_t xpt_spi_transfer_buf(xpt_spi_context dev, uint8_t* data, uint8_t* rxbuf, int length);
 
+/**
+ * Transfer several segments as one message with chip select held across
+ * them, e.g. a command on one data line followed by a quad read. Segments
+ * using more than one data line, or any segment on a 3-wire bus, must
+ * have either txbuf or rxbuf, not both.
+ *
+ * @param dev The Spi context
+ * @param segs the segments
+ * @param count number of segments
+ * @return Result of operation, XPT_ERROR_FEATURE_NOT_SUPPORTED if a
+ * segment asks for data lines not enabled with xpt_spi_mode_flags()
+ */
+xpt_result_t xpt_spi_transfer_segments(xpt_spi_context dev, xpt_spi_segment_t* segs, int count);
+
 /**
  * Transfer Buffer of uint16 to the SPI device. Both send and recv buffers
  * are passed in
@@ -136,7 +199,7 @@ xpt_result_t xpt_spi_transfer_buf(xpt_spi_context dev, uint8_t* data, uint8_t* r
  * @param dev The Spi context
  * @param data to send
  * @param rxbuf buffer to recv data back, may be NULL
- * @param length elements (in bytes) within buffer, Max 4096
+ * @param length elements (in bytes) within buffer, longer than spidev's bufsiz is split
  * @return Result of operation
  */
 xpt_result_t xpt_spi_transfer_buf_word(xpt_spi_context dev, uint16_t* data, uint16_t* rxbuf, int length);
@@ -159,6 +222,55 @@ xpt_result_t xpt_spi_lsbmode(xpt_spi_context dev, xpt_boolean_t lsb);
  */
 xpt_result_t xpt_spi_bit_per_word(xpt_spi_context dev, unsigned int bits);
 
+/**
+ * Read the transfer counters
+ *
+ * @param dev The Spi context
+ * @param stats filled with the counters
+ * @return Result of operation
+ */
+xpt_result_t xpt_spi_get_stats(xpt_spi_context dev, xpt_spi_stats_t* stats);
+
+/**
+ * Set the priority class of this context's transfers on the bus arbiter.
+ * Contexts start at XPT_ARBITER_PRIO_NORMAL.
+ *
+ * @param dev The Spi context
+ * @param prio priority class
+ * @return Result of operation
+ */
+xpt_result_t xpt_spi_priority(xpt_spi_context dev, xpt_arbiter_prio_t prio);
+
+/**
+ * Bound how long a segmented transfer holds the bus: once bytes have been
+ * moved, the transfer hands the bus to waiting contexts at the next chip
+ * select cycle boundary, a segment with cs_change set, and continues
+ * after them. A single chip select cycle is never split. 0, the default,
+ * keeps the bus for the whole transfer.
+ *
+ * @param dev The Spi context
+ * @param bytes slice length
+ * @return Result of operation
+ */
+xpt_result_t xpt_spi_slice(xpt_spi_context dev, unsigned int bytes);
+
+/**
+ * The arbiter of the context's bus, to hold the bus across calls on other
+ * buses' contexts or to read its statistics
+ *
+ * @param dev The Spi context
+ * @return arbiter, NULL if there is none
+ */
+xpt_arbiter_context xpt_spi_get_arbiter(xpt_spi_context dev);
+
+/**
+ * Largest number of bytes spidev moves in each direction of one message,
+ * its bufsiz module parameter. Read once, 4096 if it cannot be read.
+ *
+ * @return bufsiz in bytes
+ */
+unsigned int xpt_spi_get_bufsiz(void);
+
 /**
  * De-inits an xpt_spi_context device
  *
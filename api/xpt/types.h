@@ -198,6 +198,9 @@ typedef enum {
     XPT_ERROR_UART_OW_SHORTED = 12,              /**< UART OW Short Circuit Detected*/
     XPT_ERROR_UART_OW_NO_DEVICES = 13,           /**< UART OW No devices detected */
     XPT_ERROR_UART_OW_DATA_ERROR = 14,           /**< UART OW Data/Bus error detected */
+    XPT_ERROR_MODBUS_TIMEOUT = 15,               /**< Modbus slave did not answer */
+    XPT_ERROR_MODBUS_CRC = 16,                   /**< Modbus frame corrupt or malformed */
+    XPT_ERROR_MODBUS_EXCEPTION = 17,             /**< Modbus slave returned an exception */
 
     XPT_ERROR_UNSPECIFIED = 99 /**< Unknown Error */
 } xpt_result_t;
@@ -22,6 +22,18 @@ extern "C" {
 /** Xpt Uart Context */
 typedef struct _uart* xpt_uart_context;
 
+/**
+ * RS-485 direction control performed by the serial driver
+ */
+typedef struct {
+    xpt_boolean_t enabled; /**< driver toggles RTS around transmissions */
+    xpt_boolean_t rts_on_send; /**< RTS level while sending is logical 1 */
+    xpt_boolean_t rts_after_send; /**< RTS level after sending is logical 1 */
+    xpt_boolean_t rx_during_tx; /**< keep the receiver on while sending */
+    unsigned int delay_before_send; /**< ms between RTS and the first bit */
+    unsigned int delay_after_send; /**< ms between the last bit and RTS release */
+} xpt_uart_rs485_t;
+
 /**
  * Initialise uart_context, uses board mapping
  *
@@ -62,7 +74,9 @@ xpt_result_t xpt_uart_sendbreak(xpt_uart_context dev, int duration);
 /**
  * Set the baudrate.
  * Takes an int and will attempt to decide what baudrate  is
- * to be used on the UART hardware.
+ * to be used on the UART hardware. Rates without a standard termios
+ * constant (e.g. 3686400) are set through termios2/BOTHER where the
+ * kernel supports it.
  *
  * @param dev The UART context
  * @param baud unsigned int of baudrate i.e. 9600
@@ -70,6 +84,30 @@ xpt_result_t xpt_uart_sendbreak(xpt_uart_context dev, int duration);
  */
 xpt_result_t xpt_uart_set_baudrate(xpt_uart_context dev, unsigned int baud);
 
+/**
+ * Hand RS-485 driver-enable handling to the kernel (TIOCSRS485), so the
+ * bus turnaround happens in the serial driver instead of a GPIO toggled
+ * after each write. The structure is updated with the settings the
+ * driver reports back, which may be clamped.
+ *
+ * @param dev The UART context
+ * @param rs485 requested settings, replaced by the applied ones
+ * @return Result of operation, XPT_ERROR_FEATURE_NOT_SUPPORTED when the
+ * driver has no RS-485 support or did not enable it
+ */
+xpt_result_t xpt_uart_set_rs485(xpt_uart_context dev, xpt_uart_rs485_t* rs485);
+
+/**
+ * Get the baudrate the driver actually programmed on the last
+ * xpt_uart_set_baudrate(), which can differ from the requested one
+ * when the UART clock divisor cannot hit it exactly.
+ *
+ * @param dev The UART context
+ * @param baud pointer to receive the rate
+ * @return Result of operation
+ */
+xpt_result_t xpt_uart_get_baudrate(xpt_uart_context dev, unsigned int* baud);
+
 /**
  * Set the transfer mode
  * For example setting the mode to 8N1 would be
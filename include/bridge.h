@@ -0,0 +1,44 @@
+#ifndef BRIDGE_H
+#define BRIDGE_H
+
+#include "socket.h"
+#include "reactor.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* One direction of the bridge: in -> pipe -> out */
+struct bridge_dir_t {
+	int in;
+	int out;
+	int pipefd[2];
+	int pending;
+	int splice_in;
+	unsigned long long bytes;
+};
+
+struct bridge_t {
+	struct sock_info_t *sock;
+	int uart_fd;
+	int uart_flags;
+	int sock_flags;
+	int status;
+	struct bridge_dir_t u2s;
+	struct bridge_dir_t s2u;
+	struct reactor_t reactor;
+	struct reactor_handler_t uart_handler;
+	struct reactor_handler_t sock_handler;
+};
+
+extern int bridge_open(struct bridge_t *bridge, int com, struct sock_info_t *sock);
+extern int bridge_open_fd(struct bridge_t *bridge, int fd, struct sock_info_t *sock);
+extern int bridge_run(struct bridge_t *bridge);
+extern int bridge_stop(struct bridge_t *bridge);
+extern int bridge_close(struct bridge_t *bridge);
+
+#ifdef __cplusplus
+} /* extern "C" */
+#endif
+
+#endif
@@ -30,11 +30,35 @@ enum {
      LIBCOMMBUS_ERROR_NOT_SUPPORT,
      LIBCOMMBUS_ERROR_NO_DEVICE,
      LIBCOMMBUS_ERROR_ACCESS,
-     LIBCOMMBUS_ERROR_MALLOC
-     
-     
+     LIBCOMMBUS_ERROR_MALLOC,
+     LIBCOMMBUS_ERROR_AGAIN,
+     LIBCOMMBUS_ERROR_EOF,
+     LIBCOMMBUS_ERROR_PROTOCOL
 };
 
+#ifdef __linux__
+#include <sys/uio.h>
+
+/*
+ * Drop the first n bytes from an iovec array, moving *iov past the entries
+ * that are done and trimming the first one that is only partly done. Used
+ * to resume a short writev()/sendmsg() on a private copy of the array.
+ */
+static inline void commbus_iov_advance(struct iovec **iov, int *iovcnt, size_t n)
+{
+	while (*iovcnt > 0 && n >= (*iov)->iov_len) {
+		n -= (*iov)->iov_len;
+		(*iov)++;
+		(*iovcnt)--;
+	}
+
+	if (*iovcnt > 0) {
+		(*iov)->iov_base = (unsigned char *)(*iov)->iov_base + n;
+		(*iov)->iov_len -= n;
+	}
+}
+#endif
+
 #ifdef __cplusplus
 } /* extern "C" */
 #endif
@@ -0,0 +1,35 @@
+#ifndef FRAME_H
+#define FRAME_H
+
+#include "socket.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* size of the big-endian length prefix in front of every frame */
+enum {
+	FRAME_HDR_16 = 2,
+	FRAME_HDR_32 = 4
+};
+
+struct frame_t {
+	struct sock_info_t *sock;
+	unsigned char *buf;
+	int size;
+	int head;
+	int tail;
+	int hdr_len;
+	int consumed;
+};
+
+extern int frame_open(struct frame_t *frame, struct sock_info_t *sock, int hdr_len, int size);
+extern int frame_read(struct frame_t *frame, unsigned char **payload);
+extern int frame_write(struct frame_t *frame, unsigned char *payload, int len);
+extern int frame_close(struct frame_t *frame);
+
+#ifdef __cplusplus
+} /* extern "C" */
+#endif
+
+#endif
@@ -0,0 +1,136 @@
+#ifndef GATEWAY_H
+#define GATEWAY_H
+
+#include <time.h>
+#include "socket.h"
+#include "uart.h"
+#include "reactor.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* MBAP header: transaction id, protocol id, length, unit id */
+#define GATEWAY_MBAP_LEN	7
+/* largest Modbus PDU, function code included */
+#define GATEWAY_PDU_MAX		253
+/* requests a client may have outstanding before it is answered "busy" */
+#define GATEWAY_CLIENT_QUEUE	16
+/* responses waiting for room in a client's socket buffer */
+#define GATEWAY_CLIENT_TXBUF	(GATEWAY_CLIENT_QUEUE * (GATEWAY_MBAP_LEN + GATEWAY_PDU_MAX))
+
+/* exception codes sent back by the gateway itself */
+enum {
+	GATEWAY_EX_BUSY = 0x06,
+	GATEWAY_EX_PATH_UNAVAILABLE = 0x0a,
+	GATEWAY_EX_NO_RESPONSE = 0x0b
+};
+
+struct gateway_t;
+
+struct gateway_req_t {
+	unsigned short tid;
+	unsigned char unit;
+	unsigned char pdu[GATEWAY_PDU_MAX];
+	int pdu_len;
+	struct timespec arrival;
+};
+
+/*
+ * One Modbus TCP connection. Its requests are answered strictly in order:
+ * only the head of the queue is ever on the bus.
+ */
+struct gateway_client_t {
+	struct gateway_t *gw;
+	struct sock_info_t sock;
+	struct reactor_handler_t handler;
+	int used;
+	int busy;
+	struct gateway_req_t queue[GATEWAY_CLIENT_QUEUE];
+	int head;
+	int count;
+	unsigned char rx[GATEWAY_MBAP_LEN + GATEWAY_PDU_MAX];
+	int rx_len;
+	unsigned char tx[GATEWAY_CLIENT_TXBUF];
+	int tx_len;
+	unsigned long long answered;
+};
+
+struct gateway_stats_t {
+	unsigned long long requests;
+	unsigned long long transactions;
+	unsigned long long deduplicated;
+	unsigned long long timeouts;
+	unsigned long long crc_errors;
+	unsigned long long expired;
+	unsigned long long busy;
+	unsigned long long clients;
+};
+
+enum {
+	GATEWAY_IDLE = 0,
+	GATEWAY_TURNAROUND,
+	GATEWAY_WAIT
+};
+
+/*
+ * Modbus TCP to RTU gateway. Any number of TCP clients share one serial
+ * line; the bus goes round-robin over the clients that have a request
+ * queued, so a client that polls fast cannot starve the others, and
+ * identical reads that are queued at the same time are answered from a
+ * single transaction on the wire. Everything runs in the thread calling
+ * gateway_run().
+ */
+struct gateway_t {
+	struct uart_ctx_t *uart;
+	int uart_flags;
+	struct sock_info_t sock;
+	struct reactor_t reactor;
+	struct reactor_handler_t listen_handler;
+	struct reactor_handler_t uart_handler;
+	struct reactor_handler_t timer_handler;
+	int timerfd;
+
+	struct gateway_client_t *clients;
+	int max_clients;
+	int rr;
+
+	/* character time and inter-frame gap, in microseconds */
+	unsigned int char_us;
+	unsigned int gap_us;
+	/* timeouts, in milliseconds */
+	unsigned int response_ms;
+	unsigned int queue_ms;
+	unsigned int turnaround_ms;
+	int dedup;
+
+	/* the transaction on the bus */
+	int state;
+	int flush_rx;
+	unsigned char unit;
+	unsigned char pdu[GATEWAY_PDU_MAX];
+	int pdu_len;
+	unsigned char frame[GATEWAY_PDU_MAX + 3];
+	int frame_len;
+	int expect;
+	struct timespec tx_end;
+	struct timespec last_rx;
+	struct timespec bus_idle;
+
+	int status;
+	struct gateway_stats_t stats;
+};
+
+extern int gateway_open(struct gateway_t *gw, struct uart_ctx_t *uart, int port, int max_clients);
+extern int gateway_set_timeout(struct gateway_t *gw, unsigned int response_ms, unsigned int queue_ms);
+extern int gateway_set_dedup(struct gateway_t *gw, int enable);
+extern int gateway_run(struct gateway_t *gw);
+extern int gateway_stop(struct gateway_t *gw);
+extern int gateway_close(struct gateway_t *gw);
+extern unsigned short gateway_crc16(const unsigned char *data, int len);
+
+#ifdef __cplusplus
+} /* extern "C" */
+#endif
+
+#endif
@@ -1,6 +1,8 @@
 #ifndef I2C_H
 #define I2C_H
 
+#include <pthread.h>
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -17,8 +19,87 @@ extern int i2c_read(int bus, unsigned short slave_addr, unsigned char reg_addr,
                  unsigned char *data, unsigned short len);
 extern int i2c_write(int bus, unsigned short slave_addr, unsigned char reg_addr, 
                  unsigned char *data, unsigned short len);
+extern int i2c_read16(int bus, unsigned short slave_addr, unsigned short reg_addr,
+		unsigned char *data, unsigned short len);
+extern int i2c_write16(int bus, unsigned short slave_addr, unsigned short reg_addr,
+		unsigned char *data, unsigned short len);
 extern int i2c_close(int bus);
 
+/*
+ * An open i2c adapter. Allocated by the caller, any number of them, the
+ * fields are private to the library; lock serializes transactions.
+ */
+struct i2c_ctx_t {
+	int fd;
+	pthread_mutex_t lock;
+	/* reused for the register byte plus data of i2c_ctx_write() */
+	unsigned char *wbuf;
+	unsigned int wbuf_size;
+};
+
+extern int i2c_ctx_open(struct i2c_ctx_t *ctx, const char *path);
+extern int i2c_ctx_read(struct i2c_ctx_t *ctx, unsigned short slave_addr, unsigned char reg_addr,
+		unsigned char *data, unsigned short len);
+extern int i2c_ctx_write(struct i2c_ctx_t *ctx, unsigned short slave_addr, unsigned char reg_addr,
+		unsigned char *data, unsigned short len);
+extern int i2c_ctx_read16(struct i2c_ctx_t *ctx, unsigned short slave_addr, unsigned short reg_addr,
+		unsigned char *data, unsigned short len);
+extern int i2c_ctx_write16(struct i2c_ctx_t *ctx, unsigned short slave_addr, unsigned short reg_addr,
+		unsigned char *data, unsigned short len);
+extern int i2c_ctx_close(struct i2c_ctx_t *ctx);
+
+/* most messages in one transaction, the limit of the I2C_RDWR ioctl */
+#define I2C_XACT_MSGS_MAX	42
+
+/* message flags */
+enum {
+	I2C_XACT_READ = 0x0001
+};
+
+struct i2c_xact_msg_t {
+	unsigned short addr;
+	unsigned short flags;
+	unsigned short len;
+	unsigned char *buf;
+};
+
+/*
+ * A chain of messages sent as one transaction, with a repeated start
+ * between them and one stop at the end. Built in place, usually on the
+ * stack, with no allocation: messages point at the caller's buffers,
+ * except that the register byte of i2c_xact_write_reg()/read_reg() and
+ * the data written after it are copied into the arena given to
+ * i2c_xact_init(). The _reg16 variants send a 16-bit register address,
+ * high byte first. The first builder call that does not fit records the
+ * error, which i2c_ctx_submit() then returns. i2c_xact_reset() empties
+ * the transaction for reuse with the same arena.
+ */
+struct i2c_xact_t {
+	struct i2c_xact_msg_t msgs[I2C_XACT_MSGS_MAX];
+	int nmsgs;
+	unsigned char *arena;
+	unsigned int arena_size;
+	unsigned int arena_used;
+	int error;
+};
+
+extern void i2c_xact_init(struct i2c_xact_t *xact, unsigned char *arena, unsigned int arena_size);
+extern void i2c_xact_reset(struct i2c_xact_t *xact);
+extern int i2c_xact_write(struct i2c_xact_t *xact, unsigned short slave_addr, unsigned char *data,
+		unsigned short len);
+extern int i2c_xact_read(struct i2c_xact_t *xact, unsigned short slave_addr, unsigned char *data,
+		unsigned short len);
+extern int i2c_xact_write_reg(struct i2c_xact_t *xact, unsigned short slave_addr, unsigned char reg_addr,
+		const unsigned char *data, unsigned short len);
+extern int i2c_xact_read_reg(struct i2c_xact_t *xact, unsigned short slave_addr, unsigned char reg_addr,
+		unsigned char *data, unsigned short len);
+extern int i2c_xact_write_reg16(struct i2c_xact_t *xact, unsigned short slave_addr, unsigned short reg_addr,
+		const unsigned char *data, unsigned short len);
+extern int i2c_xact_read_reg16(struct i2c_xact_t *xact, unsigned short slave_addr, unsigned short reg_addr,
+		unsigned char *data, unsigned short len);
+extern int i2c_ctx_submit(struct i2c_ctx_t *ctx, struct i2c_xact_t *xact);
+extern int i2c_submit(int bus, struct i2c_xact_t *xact);
+
 #ifdef __cplusplus
 } /* extern "C" */
 #endif
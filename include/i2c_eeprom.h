@@ -0,0 +1,63 @@
+#ifndef I2C_EEPROM_H
+#define I2C_EEPROM_H
+
+#include "i2c.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* largest page in the chip table */
+#define I2C_EEPROM_PAGE_MAX	256
+
+/*
+ * One entry of the chip table. Address bits beyond addr_bytes select the
+ * block, they go into the low bits of the slave address (24c04 to 24c16,
+ * 24cm01/02). write_ms bounds the internal write cycle.
+ */
+struct i2c_eeprom_chip_t {
+	const char *name;
+	unsigned int size;
+	unsigned int page_size;
+	int addr_bytes;
+	unsigned int write_ms;
+};
+
+/* known chips, terminated by an entry without a name */
+extern const struct i2c_eeprom_chip_t i2c_eeprom_chips[];
+
+struct i2c_eeprom_stats_t {
+	unsigned long long reads;
+	unsigned long long writes;
+	unsigned long long pages;
+	unsigned long long polls;
+};
+
+/*
+ * A 24Cxx EEPROM on an open adapter. Writes are split on page boundaries,
+ * one write cycle per page. The chip does not acknowledge its address
+ * while a write cycle runs, so instead of sleeping for the worst case the
+ * next transfer is retried until it is acknowledged, and a write returns
+ * as soon as the chip acknowledges after its last page. Not thread safe.
+ */
+struct i2c_eeprom_t {
+	struct i2c_ctx_t *ctx;
+	unsigned short slave_addr;
+	const struct i2c_eeprom_chip_t *chip;
+	/* a write cycle may be running */
+	int busy;
+	struct i2c_eeprom_stats_t stats;
+};
+
+extern int i2c_eeprom_open(struct i2c_eeprom_t *eep, struct i2c_ctx_t *ctx, unsigned short slave_addr,
+		const char *name);
+extern int i2c_eeprom_read(struct i2c_eeprom_t *eep, unsigned int addr, unsigned char *buf, unsigned int len);
+extern int i2c_eeprom_write(struct i2c_eeprom_t *eep, unsigned int addr, const unsigned char *buf,
+		unsigned int len);
+extern int i2c_eeprom_get_stats(struct i2c_eeprom_t *eep, struct i2c_eeprom_stats_t *stats);
+
+#ifdef __cplusplus
+} /* extern "C" */
+#endif
+
+#endif
@@ -0,0 +1,70 @@
+#ifndef LISTENER_H
+#define LISTENER_H
+
+#include <pthread.h>
+#include "socket.h"
+#include "reactor.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct listener_t;
+
+/*
+ * Called on the accepting shard's thread for every new connection. conn is
+ * non-blocking and only valid during the call, copy it into the
+ * connection's own state; reactor is the shard's loop, where the
+ * connection should be registered so it stays on the same core.
+ */
+typedef void (*listener_conn_cb_t)(struct listener_t *listener, struct reactor_t *reactor,
+		struct sock_info_t *conn, void *arg);
+
+/* retry delay of the accept queue after accept() ran out of resources */
+#define LISTENER_RETRY_MS	50
+
+/*
+ * One SO_REUSEPORT socket with its acceptor thread and event loop.
+ * reserve_fd is a spare descriptor given up when accept() fails with
+ * EMFILE/ENFILE, to accept and close the pending connection instead of
+ * leaving it queued; shed counts those. Other accept failures arm
+ * retry_fd, a timerfd that drains the queue again after LISTENER_RETRY_MS,
+ * as the edge-triggered listening socket reports nothing until the next
+ * connection arrives.
+ */
+struct listener_shard_t {
+	struct listener_t *listener;
+	int index;
+	int cpu;
+	struct sock_info_t sock;
+	struct reactor_t reactor;
+	struct reactor_handler_t handler;
+	int reserve_fd;
+	int retry_fd;
+	struct reactor_handler_t retry_handler;
+	pthread_t tid;
+	int started;
+	unsigned long long accepted;
+	unsigned long long errors;
+	unsigned long long shed;
+};
+
+struct listener_t {
+	int port;
+	int nshards;
+	listener_conn_cb_t on_conn;
+	void *arg;
+	struct listener_shard_t *shards;
+};
+
+extern int listener_open(struct listener_t *listener, int port, int nshards,
+		listener_conn_cb_t on_conn, void *arg);
+extern int listener_start(struct listener_t *listener);
+extern int listener_stop(struct listener_t *listener);
+extern int listener_close(struct listener_t *listener);
+
+#ifdef __cplusplus
+} /* extern "C" */
+#endif
+
+#endif
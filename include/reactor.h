@@ -0,0 +1,62 @@
+#ifndef REACTOR_H
+#define REACTOR_H
+
+#include <sys/epoll.h>
+#include "socket.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+enum {
+	REACTOR_EV_READ = 0x01,
+	REACTOR_EV_WRITE = 0x02,
+	REACTOR_EV_HUP = 0x04,
+	REACTOR_EV_ERROR = 0x08
+};
+
+struct reactor_t;
+struct reactor_handler_t;
+
+typedef void (*reactor_cb_t)(struct reactor_t *reactor,
+		struct reactor_handler_t *handler, int events);
+
+/*
+ * One registration. The handler is owned by the caller and must stay valid
+ * until reactor_del() is called on it; it may be freed from inside its own
+ * callback once it has been deleted.
+ */
+struct reactor_handler_t {
+	int fd;
+	struct sock_info_t *sock;
+	reactor_cb_t cb;
+	void *arg;
+};
+
+struct reactor_t {
+	int epfd;
+	int wakefd;
+	volatile int running;
+	int max_events;
+	int cur;
+	int nready;
+	struct epoll_event *events;
+};
+
+extern int reactor_open(struct reactor_t *reactor, int max_events);
+extern int reactor_add(struct reactor_t *reactor, struct reactor_handler_t *handler,
+		struct sock_info_t *sock, int events);
+extern int reactor_add_fd(struct reactor_t *reactor, struct reactor_handler_t *handler,
+		int fd, int events);
+extern int reactor_mod(struct reactor_t *reactor, struct reactor_handler_t *handler, int events);
+extern int reactor_del(struct reactor_t *reactor, struct reactor_handler_t *handler);
+extern int reactor_poll(struct reactor_t *reactor, int timeout_ms);
+extern int reactor_run(struct reactor_t *reactor);
+extern int reactor_stop(struct reactor_t *reactor);
+extern int reactor_close(struct reactor_t *reactor);
+
+#ifdef __cplusplus
+} /* extern "C" */
+#endif
+
+#endif
@@ -4,6 +4,8 @@
 #ifdef __linux__
 #include <sys/socket.h>
 #include <sys/types.h>
+#include <sys/un.h>
+#include <sys/uio.h>
 #include <arpa/inet.h>
 #else
 #include <windows.h>
@@ -18,7 +20,9 @@ extern "C" {
 struct sock_info_t {
 #ifdef __linux__
 	int fd;
+	int type;
 	struct sockaddr_in addr;
+	struct sockaddr_un un_addr;
 #else
 	WSADATA wsa_data;
 	SOCKET fd;
@@ -41,6 +45,40 @@ extern int socket_read(struct sock_info_t *sock, unsigned char *data, int len);
 extern int socket_write(struct sock_info_t *sock, unsigned char *data, int len);
 extern int socket_close(struct sock_info_t *sock);
 
+#ifdef __linux__
+/*
+ * One datagram of a batch. For sending, len is the payload size; for
+ * receiving, len is the buffer size. result holds the number of bytes
+ * actually transferred for that message. flags is set on receive:
+ * SOCK_MSG_TRUNC when the datagram was longer than len and its tail was
+ * discarded.
+ */
+struct sock_msg_t {
+	unsigned char *data;
+	int len;
+	int result;
+	int flags;
+};
+
+/* sock_msg_t flags */
+enum {
+	SOCK_MSG_TRUNC = 0x01
+};
+
+/* largest iovec array accepted by socket_writev()/socket_readv() */
+#define SOCK_IOV_MAX	64
+
+extern int socket_bind_path(struct sock_info_t *sock, const char *path);
+extern int socket_connect_path(struct sock_info_t *sock, const char *path);
+extern int socket_sendmmsg(struct sock_info_t *sock, struct sock_msg_t *msgs, int count);
+extern int socket_recvmmsg(struct sock_info_t *sock, struct sock_msg_t *msgs, int count);
+extern int socket_set_nonblock(struct sock_info_t *sock, int enable);
+extern int socket_recv(struct sock_info_t *sock, unsigned char *data, int len);
+extern int socket_send(struct sock_info_t *sock, unsigned char *data, int len);
+extern int socket_writev(struct sock_info_t *sock, const struct iovec *iov, int iovcnt);
+extern int socket_readv(struct sock_info_t *sock, const struct iovec *iov, int iovcnt);
+#endif
+
 #ifdef __cplusplus
 } /* extern "C" */
 #endif
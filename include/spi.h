@@ -1,6 +1,8 @@
 #ifndef SPI_H
 #define SPI_H
 
+#include <pthread.h>
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -25,10 +27,84 @@ enum {
      SPI_MODE3
 };
 
+/*
+ * Flags or'ed into the mode of spi_open()/spi_ctx_open(). 3-wire shares
+ * one data line for both directions; the dual and quad flags enable the
+ * extra data lines, which segments then use through tx_nbits/rx_nbits.
+ * Open fails with -LIBCOMMBUS_ERROR_NOT_SUPPORT if the controller drops
+ * any of them.
+ */
+enum {
+     SPI_FLAG_3WIRE = 0x10,
+     SPI_FLAG_TX_DUAL = 0x100,
+     SPI_FLAG_TX_QUAD = 0x200,
+     SPI_FLAG_RX_DUAL = 0x400,
+     SPI_FLAG_RX_QUAD = 0x800
+};
+
+/* largest number of segments in one spi_xfer_multi() */
+#define SPI_SEG_MAX	32
+
+/*
+ * One segment of a multi-segment transfer. tx or rx may be NULL for
+ * receive-only or transmit-only segments. speed and bits of 0 use the
+ * device's settings; delay_us is waited after the segment. Chip select
+ * stays asserted from one segment to the next unless cs_change is set,
+ * which on the last segment instead keeps it asserted after the transfer.
+ * tx_nbits/rx_nbits select 1, 2 or 4 data lines (0 is 1); a segment on
+ * more than one line, or on a 3-wire bus, moves data in one direction only.
+ */
+struct spi_seg_t {
+	unsigned char *tx;
+	unsigned char *rx;
+	unsigned int len;
+	unsigned int speed;
+	unsigned char bits;
+	unsigned char tx_nbits;
+	unsigned char rx_nbits;
+	unsigned short delay_us;
+	int cs_change;
+};
+
 extern int spi_open(int bus, int cs, int mode, unsigned int speed);
 extern int spi_xfer(int bus, int cs, unsigned char *tx, unsigned char *rx, int len);
+extern int spi_xfer_multi(int bus, int cs, struct spi_seg_t *segs, int nsegs);
 extern int spi_close(int bus, int cs);
 
+/*
+ * Transfer counters of a context. Transfers longer than spidev's bufsiz
+ * are split into several messages, so messages - calls is the number of
+ * extra messages splitting took; bytes_per_sec is bytes over the time
+ * spent inside the transfer ioctls.
+ */
+struct spi_stats_t {
+	unsigned long long calls;
+	unsigned long long messages;
+	unsigned long long bytes;
+	unsigned long long busy_ns;
+	unsigned long long bytes_per_sec;
+};
+
+/*
+ * An open spidev device. Allocated by the caller, any number of them, the
+ * fields are private to the library; lock serializes transfers.
+ */
+struct spi_ctx_t {
+	int fd;
+	int mode;
+	unsigned char bits;
+	unsigned int speed;
+	pthread_mutex_t lock;
+	struct spi_stats_t stats;
+};
+
+extern int spi_ctx_open(struct spi_ctx_t *ctx, const char *path, int mode, unsigned int speed);
+extern int spi_ctx_xfer(struct spi_ctx_t *ctx, unsigned char *tx, unsigned char *rx, int len);
+extern int spi_ctx_xfer_multi(struct spi_ctx_t *ctx, struct spi_seg_t *segs, int nsegs);
+extern int spi_ctx_get_stats(struct spi_ctx_t *ctx, struct spi_stats_t *stats);
+extern int spi_ctx_close(struct spi_ctx_t *ctx);
+extern unsigned int spi_get_bufsiz(void);
+
 #ifdef __cplusplus
 } /* extern "C" */
 #endif
@@ -0,0 +1,113 @@
+#ifndef SPI_MEM_H
+#define SPI_MEM_H
+
+#include "spi.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* longest JEDEC ID in the chip table */
+#define SPI_MEM_ID_MAX		9
+/* read-ahead when spi_mem_open() is given a cache size of 0 */
+#define SPI_MEM_CACHE_DEFAULT	4096
+/* writes combined into one command on chips without pages (FRAM) */
+#define SPI_MEM_FRAM_CHUNK	1024
+
+/* chip flags */
+enum {
+	/* writes and erases run on after the command, poll the busy bit */
+	SPI_MEM_POLL = 0x01
+};
+
+/*
+ * How to reach the chip. xfer runs segments as one transaction, with
+ * the semantics of spi_ctx_xfer_multi(), and returns the number of bytes
+ * moved or a negative error. spi_mem_ctx_ops goes through a
+ * struct spi_ctx_t passed as priv; a test can plug in a simulated chip.
+ */
+struct spi_mem_ops_t {
+	int (*xfer)(void *priv, struct spi_seg_t *segs, int nsegs);
+};
+
+extern const struct spi_mem_ops_t spi_mem_ctx_ops;
+
+/*
+ * One entry of the chip table. page_size 0 means writes may cross any
+ * boundary (FRAM), erase_size 0 that the chip needs no erase. Timeouts
+ * bound the busy polling of SPI_MEM_POLL chips.
+ */
+struct spi_mem_chip_t {
+	const char *name;
+	unsigned char id[SPI_MEM_ID_MAX];
+	int id_len;
+	unsigned int size;
+	unsigned int page_size;
+	unsigned int erase_size;
+	unsigned char addr_bytes;
+	unsigned char rdid;
+	unsigned char wren;
+	unsigned char rdsr;
+	unsigned char read;
+	unsigned char read_dummy;
+	unsigned char write;
+	unsigned char erase;
+	int flags;
+	unsigned int write_ms;
+	unsigned int erase_ms;
+};
+
+/* known chips, terminated by an entry without a name */
+extern const struct spi_mem_chip_t spi_mem_chips[];
+
+struct spi_mem_stats_t {
+	unsigned long long reads;
+	unsigned long long cache_hits;
+	unsigned long long writes;
+	unsigned long long programs;
+	unsigned long long erases;
+	unsigned long long polls;
+	unsigned long long xfers;
+};
+
+/*
+ * An SPI NOR flash or FRAM. Reads are served from a read-ahead cache
+ * filled with one command per cache line, so small sequential reads
+ * cost no bus traffic most of the time. Writes are collected and
+ * programmed a page at a time; they reach the chip once a page is full,
+ * the next write is not contiguous, an overlapping read or erase comes
+ * in, or on spi_mem_flush()/spi_mem_close(). Not thread safe.
+ */
+struct spi_mem_t {
+	const struct spi_mem_ops_t *ops;
+	void *priv;
+	const struct spi_mem_chip_t *chip;
+
+	unsigned char *cache;
+	unsigned int cache_size;
+	unsigned int cache_addr;
+	unsigned int cache_len;
+
+	unsigned char *wbuf;
+	unsigned int wbuf_size;
+	unsigned int wbuf_addr;
+	unsigned int wbuf_len;
+
+	struct spi_mem_stats_t stats;
+};
+
+extern int spi_mem_open(struct spi_mem_t *mem, const struct spi_mem_ops_t *ops, void *priv,
+		unsigned int cache_size);
+extern int spi_mem_read(struct spi_mem_t *mem, unsigned int addr, unsigned char *buf, unsigned int len);
+extern int spi_mem_write(struct spi_mem_t *mem, unsigned int addr, const unsigned char *buf,
+		unsigned int len);
+extern int spi_mem_erase(struct spi_mem_t *mem, unsigned int addr, unsigned int len);
+extern int spi_mem_flush(struct spi_mem_t *mem);
+extern int spi_mem_get_stats(struct spi_mem_t *mem, struct spi_mem_stats_t *stats);
+extern int spi_mem_close(struct spi_mem_t *mem);
+
+#ifdef __cplusplus
+} /* extern "C" */
+#endif
+
+#endif
@@ -1,6 +1,12 @@
 #ifndef UART_H
 #define UART_H
 
+#ifdef __linux__
+#include <pthread.h>
+#include <time.h>
+#include <sys/uio.h>
+#endif
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -39,6 +45,137 @@ extern int uart_read(int com, unsigned char *data, int len);
 extern int uart_write(int com, unsigned char *data, int len);
 extern int uart_flush(int com);
 extern int uart_close(int com);
+extern int uart_get_fd(int com);
+
+#ifdef __linux__
+/* largest iovec array accepted by uart_writev() */
+#define UART_IOV_MAX	64
+
+extern int uart_writev(int com, const struct iovec *iov, int iovcnt);
+
+/*
+ * RS-485 direction control done by the serial driver: RTS drives the
+ * transceiver's driver-enable around every transmission, so no GPIO
+ * toggling is needed in userspace. Delays are in milliseconds.
+ */
+struct uart_rs485_t {
+	int enable;
+	int rts_on_send;
+	int rts_after_send;
+	int rx_during_tx;
+	unsigned int delay_before_send;
+	unsigned int delay_after_send;
+};
+
+/*
+ * Flow control, may be or'ed together. UART_FLOW_RTSCTS has the driver
+ * drop RTS while its receive buffer is full and hold transmission while
+ * CTS is low; UART_FLOW_XONXOFF sends and obeys XOFF/XON (^S/^Q) in band,
+ * so it must not be used with binary data.
+ */
+enum {
+	UART_FLOW_NONE = 0,
+	UART_FLOW_RTSCTS = 1,
+	UART_FLOW_XONXOFF = 2
+};
+
+/*
+ * Background receive ring. A dedicated thread drains the port into a
+ * single-producer/single-consumer ring that is mapped twice back to back,
+ * so any run of queued bytes is contiguous in memory and can be handed to
+ * the consumer without copying. head is only written by the rx thread,
+ * tail only by the consumer, so uart_ctx_rx_peek()/commit() must be used
+ * from one thread at a time.
+ */
+struct uart_ring_t {
+	unsigned char *buf;
+	unsigned int size;
+	unsigned int head;
+	unsigned int tail;
+	int waiting;
+	int full;
+	int evfd;
+	int spacefd;
+	int stopfd;
+	int status;
+	pthread_t tid;
+	unsigned long long bytes;
+	unsigned long long dropped;
+	unsigned long long throttled;
+	unsigned int high_water;
+};
+
+/*
+ * Receive counters. bytes, dropped, throttled and high_water describe
+ * the ring; the rest are the driver's line error counters (TIOCGICOUNT),
+ * valid only when icount_valid is set, since not every driver keeps them.
+ */
+struct uart_rx_stats_t {
+	unsigned long long bytes;
+	unsigned long long dropped;
+	unsigned long long throttled;
+	unsigned int high_water;
+	int icount_valid;
+	unsigned int rx;
+	unsigned int overrun;
+	unsigned int buf_overrun;
+	unsigned int frame;
+	unsigned int parity;
+	unsigned int brk;
+};
+
+/*
+ * An open serial port. Allocated by the caller, any number of them, the
+ * fields are private to the library. rx_lock serializes readers and
+ * tx_lock writers, so one thread can receive while another transmits.
+ */
+struct uart_ctx_t {
+	int fd;
+	int baudrate;
+	unsigned int actual_baud;
+	int parity;
+	int databits;
+	int stopbits;
+	int vmin;
+	int vtime;
+	int cur_vmin;
+	int flow;
+	pthread_mutex_t rx_lock;
+	pthread_mutex_t tx_lock;
+	struct uart_ring_t *ring;
+};
+
+extern int uart_ctx_open(struct uart_ctx_t *ctx, const char *path, int baudrate, int parity,
+		int databits, int stopbits);
+extern int uart_ctx_read(struct uart_ctx_t *ctx, unsigned char *data, int len);
+extern int uart_ctx_write(struct uart_ctx_t *ctx, unsigned char *data, int len);
+extern int uart_ctx_writev(struct uart_ctx_t *ctx, const struct iovec *iov, int iovcnt);
+extern int uart_ctx_flush(struct uart_ctx_t *ctx);
+extern int uart_ctx_get_fd(struct uart_ctx_t *ctx);
+extern unsigned int uart_ctx_get_baudrate(struct uart_ctx_t *ctx);
+extern int uart_ctx_set_vmin_vtime(struct uart_ctx_t *ctx, int vmin, int vtime);
+extern int uart_ctx_set_rs485(struct uart_ctx_t *ctx, struct uart_rs485_t *rs485);
+extern int uart_ctx_set_flowcontrol(struct uart_ctx_t *ctx, int flow);
+extern int uart_ctx_read_deadline(struct uart_ctx_t *ctx, unsigned char *data, int len, int min,
+		const struct timespec *deadline);
+
+extern int uart_ctx_rx_start(struct uart_ctx_t *ctx, unsigned int size);
+extern int uart_ctx_rx_peek(struct uart_ctx_t *ctx, unsigned char **data, int min,
+		const struct timespec *deadline);
+extern int uart_ctx_rx_commit(struct uart_ctx_t *ctx, int len);
+extern int uart_ctx_rx_read(struct uart_ctx_t *ctx, unsigned char *data, int len, int min,
+		const struct timespec *deadline);
+extern int uart_ctx_rx_stop(struct uart_ctx_t *ctx);
+extern int uart_ctx_get_rx_stats(struct uart_ctx_t *ctx, struct uart_rx_stats_t *stats);
+
+extern void uart_deadline(struct timespec *deadline, int timeout_ms);
+extern int uart_set_vmin_vtime(int com, int vmin, int vtime);
+extern int uart_set_rs485(int com, struct uart_rs485_t *rs485);
+extern int uart_set_flowcontrol(int com, int flow);
+extern int uart_read_deadline(int com, unsigned char *data, int len, int min,
+		const struct timespec *deadline);
+extern int uart_ctx_close(struct uart_ctx_t *ctx);
+#endif
 
 #ifdef __cplusplus
 } /* extern "C" */
@@ -0,0 +1,46 @@
+#ifndef URING_H
+#define URING_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* set in the environment to force the read()/write() fallback */
+#define URING_DISABLE_ENV	"COMMBUS_NO_IO_URING"
+
+/*
+ * Completion of one request. For reads and writes res is the number of
+ * bytes transferred (0 on a read means end of file), or a negative
+ * LIBCOMMBUS error code.
+ */
+struct uring_cqe_t {
+	unsigned long long user_data;
+	int res;
+};
+
+struct uring_t {
+	int fd;
+	int fallback;
+	int nbufs;
+	int buf_size;
+	unsigned char *bufs;
+	unsigned long long syscalls;
+	void *priv;
+};
+
+extern int uring_open(struct uring_t *ring, unsigned int entries, int nbufs, int buf_size);
+extern unsigned char *uring_buf(struct uring_t *ring, int index);
+extern int uring_prep_read(struct uring_t *ring, int fd, int index, int len,
+		unsigned long long user_data);
+extern int uring_prep_write(struct uring_t *ring, int fd, int index, int len,
+		unsigned long long user_data);
+extern int uring_link(struct uring_t *ring);
+extern int uring_submit(struct uring_t *ring, int wait_nr);
+extern int uring_reap(struct uring_t *ring, struct uring_cqe_t *cqes, int max);
+extern int uring_close(struct uring_t *ring);
+
+#ifdef __cplusplus
+} /* extern "C" */
+#endif
+
+#endif
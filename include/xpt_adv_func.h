@@ -99,4 +99,5 @@ typedef struct {
     int (*uart_read_replace) (xpt_uart_context dev, char* buf, size_t len);
     int (*uart_write_replace)(xpt_uart_context dev, const char* buf, size_t len);
     xpt_boolean_t (*uart_data_available_replace) (xpt_uart_context dev, unsigned int millis);
+    xpt_result_t (*uart_set_rs485_replace) (xpt_uart_context dev, xpt_uart_rs485_t* rs485);
 } xpt_adv_func_t;
@@ -121,6 +121,9 @@ struct _i2c {
     int addr; /**< the address of the i2c slave */
     unsigned long funcs; /**< /dev/i2c-* device capabilities as per https://www.kernel.org/doc/Documentation/i2c/functionality */
     void *handle; /**< generic handle for non-standard drivers that don't use file descriptors  */
+    xpt_arbiter_context arbiter; /**< shared by all contexts on the bus */
+    xpt_arbiter_prio_t prio; /**< priority class of this context's transactions */
+    int slice; /**< longest register read in one transaction, 0 for no limit */
     xpt_adv_func_t* advance_func; /**< override function table */
 #if defined(MOCKPLAT)
     uint8_t mock_dev_addr; /**< address of the mock I2C device */
@@ -144,6 +147,11 @@ struct _spi {
     int clock;          /**< clock to run transactions at */
     xpt_boolean_t lsb; /**< least significant bit mode */
     unsigned int bpw;   /**< Bits per word */
+    xpt_spi_stats_t stats; /**< transfer counters */
+    unsigned int bus;   /**< bus number, as in /dev/spidevN.x */
+    xpt_arbiter_context arbiter; /**< shared by all contexts on the bus */
+    xpt_arbiter_prio_t prio; /**< priority class of this context's transfers */
+    unsigned int slice; /**< bytes after which to yield between chip select cycles, 0 for never */
     xpt_adv_func_t* advance_func; /**< override function table */
     /*@}*/
 #ifdef PERIPHERALMAN
@@ -188,6 +196,7 @@ struct _uart {
     int index; /**< the uart index, as known to the os. */
     const char* path; /**< the uart device path. */
     int fd; /**< file descriptor for device. */
+    unsigned int baudrate; /**< rate read back from the driver after the last set_baudrate */
     xpt_adv_func_t* advance_func; /**< override function table */
     /*@}*/
 #if defined(PERIPHERALMAN)
@@ -0,0 +1,250 @@
+/***************************************************************************
+ *   Copyright (C) 2015 by Tse-Lun Bien                                    *
+ *   allanbian@gmail.com                                                   *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include "commbus.h"
+#include "socket.h"
+#include "uart.h"
+#include "reactor.h"
+#include "bridge.h"
+
+#define BRIDGE_PIPE_SIZE	(64 * 1024)
+#define BRIDGE_COPY_SIZE	4096
+
+static int bridge_dir_init(struct bridge_dir_t *dir, int in, int out)
+{
+	memset(dir, 0, sizeof(*dir));
+
+	dir->in = in;
+	dir->out = out;
+	dir->splice_in = 1;
+
+	if (pipe2(dir->pipefd, O_NONBLOCK | O_CLOEXEC) != 0) {
+		perror("pipe2");
+		return -LIBCOMMBUS_ERROR_ACCESS;
+	}
+
+	/* best effort, the default pipe size still works */
+	fcntl(dir->pipefd[1], F_SETPIPE_SZ, BRIDGE_PIPE_SIZE);
+
+	return LIBCOMMBUS_SUCCESS;
+}
+
+static void bridge_dir_close(struct bridge_dir_t *dir)
+{
+	close(dir->pipefd[0]);
+	close(dir->pipefd[1]);
+}
+
+/*
+ * Move one direction through its pipe until the input is drained or the
+ * output is full. The data only passes through kernel pipe pages; when the
+ * input driver cannot splice, the input side falls back to read() into a
+ * small bounce buffer while the output side keeps splicing.
+ * Returns LIBCOMMBUS_SUCCESS when it has to wait for the next edge.
+ */
+static int bridge_pump(struct bridge_dir_t *dir)
+{
+	unsigned char buf[BRIDGE_COPY_SIZE];
+	ssize_t n;
+
+	while (1) {
+		while (dir->pending > 0) {
+			n = splice(dir->pipefd[0], NULL, dir->out, NULL, dir->pending,
+					SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+			if (n < 0) {
+				if (errno == EINTR)
+					continue;
+				if (errno == EAGAIN)
+					return LIBCOMMBUS_SUCCESS;
+				if (errno == EPIPE || errno == ECONNRESET || errno == EIO)
+					return -LIBCOMMBUS_ERROR_EOF;
+
+				perror("splice");
+				return -LIBCOMMBUS_ERROR_ACCESS;
+			}
+
+			dir->pending -= n;
+			dir->bytes += n;
+		}
+
+		if (dir->splice_in) {
+			n = splice(dir->in, NULL, dir->pipefd[1], NULL, BRIDGE_PIPE_SIZE,
+					SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+			if (n < 0 && errno == EINVAL) {
+				dir->splice_in = 0;
+				continue;
+			}
+		} else {
+			/* the pipe is empty here, a PIPE_BUF sized write always fits */
+			n = read(dir->in, buf, sizeof(buf));
+			if (n > 0)
+				n = write(dir->pipefd[1], buf, n);
+		}
+
+		if (n == 0)
+			return -LIBCOMMBUS_ERROR_EOF;
+
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN)
+				return LIBCOMMBUS_SUCCESS;
+			/* tty hangup of the other end */
+			if (errno == EIO || errno == ECONNRESET)
+				return -LIBCOMMBUS_ERROR_EOF;
+
+			perror("splice");
+			return -LIBCOMMBUS_ERROR_ACCESS;
+		}
+
+		dir->pending += n;
+	}
+}
+
+static void bridge_event(struct reactor_t *reactor, struct reactor_handler_t *handler, int events)
+{
+	struct bridge_t *bridge = (struct bridge_t *)handler->arg;
+	int ret;
+
+	/* either edge may unblock either direction, so pump both */
+	ret = bridge_pump(&bridge->u2s);
+	if (ret == LIBCOMMBUS_SUCCESS)
+		ret = bridge_pump(&bridge->s2u);
+
+	if (ret != LIBCOMMBUS_SUCCESS) {
+		bridge->status = ret;
+		reactor_stop(reactor);
+	}
+}
+
+int bridge_open_fd(struct bridge_t *bridge, int fd, struct sock_info_t *sock)
+{
+	int ret;
+
+	memset(bridge, 0, sizeof(*bridge));
+
+	bridge->uart_fd = fd;
+	bridge->sock = sock;
+
+	bridge->uart_flags = fcntl(fd, F_GETFL);
+	bridge->sock_flags = fcntl(sock->fd, F_GETFL);
+	if (bridge->uart_flags == -1 || bridge->sock_flags == -1) {
+		perror("fcntl");
+		return -LIBCOMMBUS_ERROR_ACCESS;
+	}
+
+	ret = bridge_dir_init(&bridge->u2s, fd, sock->fd);
+	if (ret != LIBCOMMBUS_SUCCESS)
+		return ret;
+
+	ret = bridge_dir_init(&bridge->s2u, sock->fd, fd);
+	if (ret != LIBCOMMBUS_SUCCESS)
+		goto out_u2s;
+
+	ret = reactor_open(&bridge->reactor, 8);
+	if (ret != LIBCOMMBUS_SUCCESS)
+		goto out_s2u;
+
+	fcntl(fd, F_SETFL, bridge->uart_flags | O_NONBLOCK);
+	fcntl(sock->fd, F_SETFL, bridge->sock_flags | O_NONBLOCK);
+
+	bridge->uart_handler.cb = bridge_event;
+	bridge->uart_handler.arg = bridge;
+	ret = reactor_add_fd(&bridge->reactor, &bridge->uart_handler, fd,
+			REACTOR_EV_READ | REACTOR_EV_WRITE);
+	if (ret != LIBCOMMBUS_SUCCESS)
+		goto out_reactor;
+
+	bridge->sock_handler.cb = bridge_event;
+	bridge->sock_handler.arg = bridge;
+	ret = reactor_add(&bridge->reactor, &bridge->sock_handler, sock,
+			REACTOR_EV_READ | REACTOR_EV_WRITE);
+	if (ret != LIBCOMMBUS_SUCCESS)
+		goto out_reactor;
+
+	return LIBCOMMBUS_SUCCESS;
+
+out_reactor:
+	fcntl(fd, F_SETFL, bridge->uart_flags);
+	fcntl(sock->fd, F_SETFL, bridge->sock_flags);
+	reactor_close(&bridge->reactor);
+out_s2u:
+	bridge_dir_close(&bridge->s2u);
+out_u2s:
+	bridge_dir_close(&bridge->u2s);
+	return ret;
+}
+
+int bridge_open(struct bridge_t *bridge, int com, struct sock_info_t *sock)
+{
+	int fd;
+
+	fd = uart_get_fd(com);
+	if (fd < 0)
+		return -LIBCOMMBUS_ERROR_NO_DEVICE;
+
+	return bridge_open_fd(bridge, fd, sock);
+}
+
+/*
+ * Run both directions in the calling thread until one side closes, an
+ * error occurs or bridge_stop() is called. Returns LIBCOMMBUS_SUCCESS
+ * after bridge_stop(), -LIBCOMMBUS_ERROR_EOF when a peer went away.
+ */
+int bridge_run(struct bridge_t *bridge)
+{
+	int ret;
+
+	bridge->status = LIBCOMMBUS_SUCCESS;
+
+	/* the registration edges may have fired before we got here */
+	bridge_event(&bridge->reactor, &bridge->uart_handler, 0);
+	if (bridge->status != LIBCOMMBUS_SUCCESS)
+		return bridge->status;
+
+	ret = reactor_run(&bridge->reactor);
+	if (ret != LIBCOMMBUS_SUCCESS)
+		return ret;
+
+	return bridge->status;
+}
+
+int bridge_stop(struct bridge_t *bridge)
+{
+	return reactor_stop(&bridge->reactor);
+}
+
+int bridge_close(struct bridge_t *bridge)
+{
+	fcntl(bridge->uart_fd, F_SETFL, bridge->uart_flags);
+	fcntl(bridge->sock->fd, F_SETFL, bridge->sock_flags);
+
+	bridge_dir_close(&bridge->u2s);
+	bridge_dir_close(&bridge->s2u);
+
+	return reactor_close(&bridge->reactor);
+}
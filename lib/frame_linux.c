@@ -0,0 +1,170 @@
+/***************************************************************************
+ *   Copyright (C) 2015 by Tse-Lun Bien                                    *
+ *   allanbian@gmail.com                                                   *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/uio.h>
+#include "commbus.h"
+#include "socket.h"
+#include "frame.h"
+
+#define FRAME_DEFAULT_SIZE	(64 * 1024)
+
+static unsigned int frame_get_len(struct frame_t *frame, unsigned char *hdr)
+{
+	if (frame->hdr_len == FRAME_HDR_16)
+		return (hdr[0] << 8) | hdr[1];
+
+	return ((unsigned int)hdr[0] << 24) | (hdr[1] << 16) | (hdr[2] << 8) | hdr[3];
+}
+
+static void frame_put_len(struct frame_t *frame, unsigned char *hdr, unsigned int len)
+{
+	if (frame->hdr_len == FRAME_HDR_16) {
+		hdr[0] = len >> 8;
+		hdr[1] = len;
+	} else {
+		hdr[0] = len >> 24;
+		hdr[1] = len >> 16;
+		hdr[2] = len >> 8;
+		hdr[3] = len;
+	}
+}
+
+/*
+ * size is the receive buffer size and bounds the largest frame that can be
+ * received (size - hdr_len bytes of payload).
+ */
+int frame_open(struct frame_t *frame, struct sock_info_t *sock, int hdr_len, int size)
+{
+	memset(frame, 0, sizeof(*frame));
+
+	if (hdr_len != FRAME_HDR_16 && hdr_len != FRAME_HDR_32)
+		return -LIBCOMMBUS_ERROR_NOT_SUPPORT;
+
+	if (size <= 0)
+		size = FRAME_DEFAULT_SIZE;
+	if (size <= hdr_len)
+		return -LIBCOMMBUS_ERROR_NOT_SUPPORT;
+
+	frame->buf = (unsigned char *)malloc(size);
+	if (!frame->buf)
+		return -LIBCOMMBUS_ERROR_MALLOC;
+
+	frame->sock = sock;
+	frame->size = size;
+	frame->hdr_len = hdr_len;
+
+	return LIBCOMMBUS_SUCCESS;
+}
+
+/*
+ * Return the next frame. *payload points into the receive buffer and stays
+ * valid until the next frame_read() call, nothing is copied out. Data is
+ * read in chunks as large as the free buffer space, so a burst of small
+ * frames costs one read(). The buffer only gets compacted when the frame
+ * being assembled would run past its end.
+ *
+ * Returns the payload length, -LIBCOMMBUS_ERROR_EOF when the peer closed
+ * (also in the middle of a frame), -LIBCOMMBUS_ERROR_PROTOCOL for a frame
+ * larger than the buffer and -LIBCOMMBUS_ERROR_AGAIN on a drained
+ * non-blocking socket; in that case call again once it is readable.
+ */
+int frame_read(struct frame_t *frame, unsigned char **payload)
+{
+	unsigned int len;
+	int avail;
+	int need;
+	int n;
+
+	/* release the frame handed out by the previous call */
+	frame->head += frame->consumed;
+	frame->consumed = 0;
+	if (frame->head == frame->tail)
+		frame->head = frame->tail = 0;
+
+	while (1) {
+		avail = frame->tail - frame->head;
+		need = frame->hdr_len;
+
+		if (avail >= frame->hdr_len) {
+			len = frame_get_len(frame, &frame->buf[frame->head]);
+			if (len > (unsigned int)(frame->size - frame->hdr_len))
+				return -LIBCOMMBUS_ERROR_PROTOCOL;
+
+			need += len;
+			if (avail >= need) {
+				*payload = &frame->buf[frame->head + frame->hdr_len];
+				frame->consumed = need;
+				return len;
+			}
+		}
+
+		if (frame->head + need > frame->size) {
+			memmove(frame->buf, &frame->buf[frame->head], avail);
+			frame->head = 0;
+			frame->tail = avail;
+		}
+
+		n = socket_recv(frame->sock, &frame->buf[frame->tail], frame->size - frame->tail);
+		if (n < 0)
+			return n;
+
+		frame->tail += n;
+	}
+}
+
+/*
+ * Send one frame. Header and payload go out together with socket_writev(),
+ * no copy of the payload is made. Blocks until the whole frame is queued,
+ * also on a non-blocking socket.
+ */
+int frame_write(struct frame_t *frame, unsigned char *payload, int len)
+{
+	unsigned char hdr[FRAME_HDR_32];
+	struct iovec iov[2];
+	int ret;
+
+	if (len < 0 || (frame->hdr_len == FRAME_HDR_16 && len > 0xffff))
+		return -LIBCOMMBUS_ERROR_PROTOCOL;
+
+	frame_put_len(frame, hdr, len);
+
+	iov[0].iov_base = hdr;
+	iov[0].iov_len = frame->hdr_len;
+	iov[1].iov_base = payload;
+	iov[1].iov_len = len;
+
+	ret = socket_writev(frame->sock, iov, 2);
+	if (ret < 0)
+		return ret;
+
+	return len;
+}
+
+int frame_close(struct frame_t *frame)
+{
+	free(frame->buf);
+	frame->buf = NULL;
+
+	return LIBCOMMBUS_SUCCESS;
+}
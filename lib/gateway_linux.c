@@ -0,0 +1,838 @@
+/***************************************************************************
+ *   Copyright (C) 2015 by Tse-Lun Bien                                    *
+ *   allanbian@gmail.com                                                   *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdint.h>
+#include <termios.h>
+#include <sys/socket.h>
+#include <sys/timerfd.h>
+#include "commbus.h"
+#include "socket.h"
+#include "uart.h"
+#include "reactor.h"
+#include "gateway.h"
+
+#define GATEWAY_DEFAULT_RESPONSE_MS	500
+#define GATEWAY_DEFAULT_QUEUE_MS	5000
+#define GATEWAY_DEFAULT_TURNAROUND_MS	100
+/* Modbus over serial line spec: fixed timing above 19200 baud */
+#define GATEWAY_FIXED_GAP_US		1750
+#define GATEWAY_FRAME_MAX		(GATEWAY_PDU_MAX + 3)
+
+static const unsigned short crc_table[256] = {
+	0x0000, 0xc0c1, 0xc181, 0x0140, 0xc301, 0x03c0, 0x0280, 0xc241,
+	0xc601, 0x06c0, 0x0780, 0xc741, 0x0500, 0xc5c1, 0xc481, 0x0440,
+	0xcc01, 0x0cc0, 0x0d80, 0xcd41, 0x0f00, 0xcfc1, 0xce81, 0x0e40,
+	0x0a00, 0xcac1, 0xcb81, 0x0b40, 0xc901, 0x09c0, 0x0880, 0xc841,
+	0xd801, 0x18c0, 0x1980, 0xd941, 0x1b00, 0xdbc1, 0xda81, 0x1a40,
+	0x1e00, 0xdec1, 0xdf81, 0x1f40, 0xdd01, 0x1dc0, 0x1c80, 0xdc41,
+	0x1400, 0xd4c1, 0xd581, 0x1540, 0xd701, 0x17c0, 0x1680, 0xd641,
+	0xd201, 0x12c0, 0x1380, 0xd341, 0x1100, 0xd1c1, 0xd081, 0x1040,
+	0xf001, 0x30c0, 0x3180, 0xf141, 0x3300, 0xf3c1, 0xf281, 0x3240,
+	0x3600, 0xf6c1, 0xf781, 0x3740, 0xf501, 0x35c0, 0x3480, 0xf441,
+	0x3c00, 0xfcc1, 0xfd81, 0x3d40, 0xff01, 0x3fc0, 0x3e80, 0xfe41,
+	0xfa01, 0x3ac0, 0x3b80, 0xfb41, 0x3900, 0xf9c1, 0xf881, 0x3840,
+	0x2800, 0xe8c1, 0xe981, 0x2940, 0xeb01, 0x2bc0, 0x2a80, 0xea41,
+	0xee01, 0x2ec0, 0x2f80, 0xef41, 0x2d00, 0xedc1, 0xec81, 0x2c40,
+	0xe401, 0x24c0, 0x2580, 0xe541, 0x2700, 0xe7c1, 0xe681, 0x2640,
+	0x2200, 0xe2c1, 0xe381, 0x2340, 0xe101, 0x21c0, 0x2080, 0xe041,
+	0xa001, 0x60c0, 0x6180, 0xa141, 0x6300, 0xa3c1, 0xa281, 0x6240,
+	0x6600, 0xa6c1, 0xa781, 0x6740, 0xa501, 0x65c0, 0x6480, 0xa441,
+	0x6c00, 0xacc1, 0xad81, 0x6d40, 0xaf01, 0x6fc0, 0x6e80, 0xae41,
+	0xaa01, 0x6ac0, 0x6b80, 0xab41, 0x6900, 0xa9c1, 0xa881, 0x6840,
+	0x7800, 0xb8c1, 0xb981, 0x7940, 0xbb01, 0x7bc0, 0x7a80, 0xba41,
+	0xbe01, 0x7ec0, 0x7f80, 0xbf41, 0x7d00, 0xbdc1, 0xbc81, 0x7c40,
+	0xb401, 0x74c0, 0x7580, 0xb541, 0x7700, 0xb7c1, 0xb681, 0x7640,
+	0x7200, 0xb2c1, 0xb381, 0x7340, 0xb101, 0x71c0, 0x7080, 0xb041,
+	0x5000, 0x90c1, 0x9181, 0x5140, 0x9301, 0x53c0, 0x5280, 0x9241,
+	0x9601, 0x56c0, 0x5780, 0x9741, 0x5500, 0x95c1, 0x9481, 0x5440,
+	0x9c01, 0x5cc0, 0x5d80, 0x9d41, 0x5f00, 0x9fc1, 0x9e81, 0x5e40,
+	0x5a00, 0x9ac1, 0x9b81, 0x5b40, 0x9901, 0x59c0, 0x5880, 0x9841,
+	0x8801, 0x48c0, 0x4980, 0x8941, 0x4b00, 0x8bc1, 0x8a81, 0x4a40,
+	0x4e00, 0x8ec1, 0x8f81, 0x4f40, 0x8d01, 0x4dc0, 0x4c80, 0x8c41,
+	0x4400, 0x84c1, 0x8581, 0x4540, 0x8701, 0x47c0, 0x4680, 0x8641,
+	0x8201, 0x42c0, 0x4380, 0x8341, 0x4100, 0x81c1, 0x8081, 0x4040
+};
+
+unsigned short gateway_crc16(const unsigned char *data, int len)
+{
+	unsigned short crc = 0xffff;
+	int i;
+
+	for (i = 0; i < len; i++)
+		crc = (crc >> 8) ^ crc_table[(crc ^ data[i]) & 0xff];
+
+	return crc;
+}
+
+static void ts_add_us(struct timespec *ts, long us)
+{
+	ts->tv_sec += us / 1000000;
+	ts->tv_nsec += (us % 1000000) * 1000;
+	if (ts->tv_nsec >= 1000000000) {
+		ts->tv_sec++;
+		ts->tv_nsec -= 1000000000;
+	}
+}
+
+/* a - b in microseconds */
+static long ts_diff_us(const struct timespec *a, const struct timespec *b)
+{
+	return (a->tv_sec - b->tv_sec) * 1000000L + (a->tv_nsec - b->tv_nsec) / 1000;
+}
+
+static void gateway_timer_at(struct gateway_t *gw, const struct timespec *when)
+{
+	struct itimerspec its;
+
+	memset(&its, 0, sizeof(its));
+	its.it_value = *when;
+	/* an all zero value would disarm the timer instead */
+	if (its.it_value.tv_sec == 0 && its.it_value.tv_nsec == 0)
+		its.it_value.tv_nsec = 1;
+
+	timerfd_settime(gw->timerfd, TFD_TIMER_ABSTIME, &its, NULL);
+}
+
+/*
+ * Character time from the port's actual rate and framing, and the 3.5
+ * character silence that ends an RTU frame.
+ */
+static void gateway_timing(struct gateway_t *gw)
+{
+	unsigned int baud;
+	unsigned int bits;
+
+	baud = uart_ctx_get_baudrate(gw->uart);
+	if (baud == 0)
+		baud = 9600;
+
+	/* start bit and data bits */
+	switch (gw->uart->databits) {
+		case DATBITS_6:
+			bits = 1 + 6;
+			break;
+		case DATBITS_7:
+			bits = 1 + 7;
+			break;
+		default:
+			bits = 1 + 8;
+			break;
+	}
+	if (gw->uart->parity != PAR_NONE)
+		bits++;
+	bits += (gw->uart->stopbits == STOPBITS_2) ? 2 : 1;
+
+	gw->char_us = (bits * 1000000 + baud - 1) / baud;
+	if (baud > 19200)
+		gw->gap_us = GATEWAY_FIXED_GAP_US;
+	else
+		gw->gap_us = (gw->char_us * 7 + 1) / 2;
+}
+
+/*
+ * Length of the response to the request on the bus, as far as it can be
+ * told from the bytes received so far. 0 means not known yet, -1 that
+ * only the silence after the frame will tell.
+ */
+static int gateway_expect(struct gateway_t *gw)
+{
+	if (gw->frame_len < 2)
+		return 0;
+
+	if (gw->frame[1] & 0x80)
+		return 5;
+
+	switch (gw->pdu[0]) {
+		case 0x01:
+		case 0x02:
+		case 0x03:
+		case 0x04:
+			if (gw->frame_len < 3)
+				return 0;
+			return 5 + gw->frame[2];
+
+		case 0x05:
+		case 0x06:
+		case 0x0f:
+		case 0x10:
+			return 8;
+
+		default:
+			return -1;
+	}
+}
+
+static int gateway_same(struct gateway_t *gw, struct gateway_req_t *req)
+{
+	return req->unit == gw->unit && req->pdu_len == gw->pdu_len &&
+		memcmp(req->pdu, gw->pdu, gw->pdu_len) == 0;
+}
+
+/* only reads are safe to answer from another client's transaction */
+static int gateway_is_read(struct gateway_req_t *req)
+{
+	return req->unit != 0 && req->pdu_len == 5 && req->pdu[0] >= 0x01 && req->pdu[0] <= 0x04;
+}
+
+static void client_close(struct gateway_client_t *client)
+{
+	reactor_del(&client->gw->reactor, &client->handler);
+	socket_close(&client->sock);
+
+	client->used = 0;
+	client->busy = 0;
+	client->count = 0;
+	client->gw->stats.clients--;
+}
+
+static int client_flush(struct gateway_client_t *client)
+{
+	int n;
+
+	while (client->tx_len > 0) {
+		n = socket_send(&client->sock, client->tx, client->tx_len);
+		if (n == -LIBCOMMBUS_ERROR_AGAIN)
+			return LIBCOMMBUS_SUCCESS;
+		if (n < 0)
+			return n;
+
+		client->tx_len -= n;
+		memmove(client->tx, &client->tx[n], client->tx_len);
+	}
+
+	return LIBCOMMBUS_SUCCESS;
+}
+
+/* queue one MBAP framed response and push out as much as the socket takes */
+static void client_reply(struct gateway_client_t *client, unsigned short tid, unsigned char unit,
+		const unsigned char *pdu, int pdu_len)
+{
+	unsigned char *p;
+
+	/* a client that does not read its answers is dropped */
+	if (client->tx_len + GATEWAY_MBAP_LEN + pdu_len > GATEWAY_CLIENT_TXBUF) {
+		client_close(client);
+		return;
+	}
+
+	p = &client->tx[client->tx_len];
+	p[0] = tid >> 8;
+	p[1] = tid & 0xff;
+	p[2] = 0;
+	p[3] = 0;
+	p[4] = (pdu_len + 1) >> 8;
+	p[5] = (pdu_len + 1) & 0xff;
+	p[6] = unit;
+	memcpy(&p[GATEWAY_MBAP_LEN], pdu, pdu_len);
+	client->tx_len += GATEWAY_MBAP_LEN + pdu_len;
+
+	if (client_flush(client) != LIBCOMMBUS_SUCCESS)
+		client_close(client);
+}
+
+static void client_exception(struct gateway_client_t *client, struct gateway_req_t *req,
+		unsigned char code)
+{
+	unsigned char pdu[2];
+
+	pdu[0] = req->pdu[0] | 0x80;
+	pdu[1] = code;
+	client_reply(client, req->tid, req->unit, pdu, sizeof(pdu));
+}
+
+static void client_pop(struct gateway_client_t *client)
+{
+	client->head = (client->head + 1) % GATEWAY_CLIENT_QUEUE;
+	client->count--;
+	client->busy = 0;
+	client->answered++;
+}
+
+static void gateway_send(struct gateway_t *gw)
+{
+	unsigned char frame[GATEWAY_FRAME_MAX];
+	struct iovec iov;
+	struct timespec when;
+	unsigned short crc;
+	int len;
+	int i;
+
+	if (gw->flush_rx) {
+		tcflush(gw->uart->fd, TCIFLUSH);
+		gw->flush_rx = 0;
+	}
+
+	frame[0] = gw->unit;
+	memcpy(&frame[1], gw->pdu, gw->pdu_len);
+	len = 1 + gw->pdu_len;
+	crc = gateway_crc16(frame, len);
+	frame[len++] = crc & 0xff;
+	frame[len++] = crc >> 8;
+
+	iov.iov_base = frame;
+	iov.iov_len = len;
+	if (uart_ctx_writev(gw->uart, &iov, 1) != len)
+		gw->flush_rx = 1;
+
+	gw->stats.transactions++;
+	gw->frame_len = 0;
+	clock_gettime(CLOCK_MONOTONIC, &gw->tx_end);
+	ts_add_us(&gw->tx_end, (long)len * gw->char_us);
+
+	if (gw->unit == 0) {
+		/* broadcast: nobody answers, give the slaves time to act on it */
+		gw->bus_idle = gw->tx_end;
+		ts_add_us(&gw->bus_idle, gw->turnaround_ms * 1000L);
+		for (i = 0; i < gw->max_clients; i++) {
+			if (gw->clients[i].used && gw->clients[i].busy)
+				client_pop(&gw->clients[i]);
+		}
+		gw->state = GATEWAY_IDLE;
+		return;
+	}
+
+	gw->state = GATEWAY_WAIT;
+	when = gw->tx_end;
+	ts_add_us(&when, gw->response_ms * 1000L);
+	gateway_timer_at(gw, &when);
+}
+
+/*
+ * Put the next request on the bus: round-robin over the clients, one
+ * request per client and turn. Clients whose next request is the same
+ * read ride along on the transaction.
+ */
+static void gateway_schedule(struct gateway_t *gw)
+{
+	struct gateway_client_t *client;
+	struct gateway_req_t *req;
+	struct timespec now;
+	int i;
+	int n;
+
+	while (gw->state == GATEWAY_IDLE) {
+		client = NULL;
+		for (n = 1; n <= gw->max_clients; n++) {
+			i = (gw->rr + n) % gw->max_clients;
+			if (gw->clients[i].used && gw->clients[i].count > 0) {
+				client = &gw->clients[i];
+				gw->rr = i;
+				break;
+			}
+		}
+		if (client == NULL)
+			return;
+
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		req = &client->queue[client->head];
+
+		/* the client has long given up on it, do not spend bus time */
+		if (gw->queue_ms && ts_diff_us(&now, &req->arrival) > gw->queue_ms * 1000L) {
+			gw->stats.expired++;
+			client_exception(client, req, GATEWAY_EX_NO_RESPONSE);
+			if (client->used)
+				client_pop(client);
+			continue;
+		}
+
+		gw->unit = req->unit;
+		gw->pdu_len = req->pdu_len;
+		memcpy(gw->pdu, req->pdu, req->pdu_len);
+		client->busy = 1;
+
+		if (gw->dedup && gateway_is_read(req)) {
+			for (i = 0; i < gw->max_clients; i++) {
+				if (!gw->clients[i].used || gw->clients[i].count == 0 ||
+				    gw->clients[i].busy)
+					continue;
+				if (gateway_same(gw, &gw->clients[i].queue[gw->clients[i].head])) {
+					gw->clients[i].busy = 1;
+					gw->stats.deduplicated++;
+				}
+			}
+		}
+
+		if (ts_diff_us(&gw->bus_idle, &now) > 0) {
+			gw->state = GATEWAY_TURNAROUND;
+			gateway_timer_at(gw, &gw->bus_idle);
+			return;
+		}
+
+		gateway_send(gw);
+	}
+}
+
+/* answer everyone waiting on the transaction and move on */
+static void gateway_complete(struct gateway_t *gw, int ok)
+{
+	struct gateway_client_t *client;
+	struct gateway_req_t *req;
+	int i;
+
+	gw->state = GATEWAY_IDLE;
+
+	for (i = 0; i < gw->max_clients; i++) {
+		client = &gw->clients[i];
+		if (!client->used || !client->busy)
+			continue;
+
+		req = &client->queue[client->head];
+		if (ok)
+			client_reply(client, req->tid, gw->unit, &gw->frame[1], gw->frame_len - 3);
+		else
+			client_exception(client, req, GATEWAY_EX_NO_RESPONSE);
+
+		if (client->used)
+			client_pop(client);
+	}
+
+	gateway_schedule(gw);
+}
+
+static void gateway_frame_end(struct gateway_t *gw)
+{
+	unsigned short crc;
+	int expect;
+	int ok;
+
+	gw->bus_idle = gw->last_rx;
+	ts_add_us(&gw->bus_idle, gw->gap_us);
+
+	expect = gateway_expect(gw);
+	ok = gw->frame_len >= 5 && (expect <= 0 || gw->frame_len == expect);
+	if (ok) {
+		crc = gateway_crc16(gw->frame, gw->frame_len - 2);
+		ok = gw->frame[gw->frame_len - 2] == (crc & 0xff) &&
+			gw->frame[gw->frame_len - 1] == (crc >> 8) &&
+			gw->frame[0] == gw->unit &&
+			(gw->frame[1] & 0x7f) == gw->pdu[0];
+	}
+
+	if (!ok) {
+		gw->stats.crc_errors++;
+		gw->flush_rx = 1;
+	}
+
+	gateway_complete(gw, ok);
+}
+
+static void gateway_uart_read(struct gateway_t *gw)
+{
+	unsigned char junk[64];
+	struct timespec when;
+	int expect;
+	int n;
+
+	while (1) {
+		if (gw->state != GATEWAY_WAIT) {
+			/* late answers and line noise between transactions */
+			n = read(gw->uart->fd, junk, sizeof(junk));
+			if (n > 0) {
+				gw->flush_rx = 1;
+				continue;
+			}
+		} else {
+			n = read(gw->uart->fd, &gw->frame[gw->frame_len],
+					GATEWAY_FRAME_MAX - gw->frame_len);
+			if (n > 0) {
+				gw->frame_len += n;
+				clock_gettime(CLOCK_MONOTONIC, &gw->last_rx);
+				expect = gateway_expect(gw);
+				if ((expect > 0 && gw->frame_len >= expect) ||
+				    gw->frame_len == GATEWAY_FRAME_MAX) {
+					gateway_frame_end(gw);
+					continue;
+				}
+
+				/* the frame ends when the line stays quiet for one gap */
+				when = gw->last_rx;
+				ts_add_us(&when, gw->gap_us);
+				gateway_timer_at(gw, &when);
+				continue;
+			}
+		}
+
+		if (n < 0 && errno == EINTR)
+			continue;
+		return;
+	}
+}
+
+static void gateway_uart_event(struct reactor_t *reactor, struct reactor_handler_t *handler,
+		int events)
+{
+	gateway_uart_read((struct gateway_t *)handler->arg);
+}
+
+static void gateway_timer_event(struct reactor_t *reactor, struct reactor_handler_t *handler,
+		int events)
+{
+	struct gateway_t *gw = (struct gateway_t *)handler->arg;
+	struct timespec now;
+	struct timespec when;
+	uint64_t val;
+
+	while (read(gw->timerfd, &val, sizeof(val)) > 0)
+		;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	/* an expiry of the previous arming may still have been queued */
+	if (gw->state == GATEWAY_TURNAROUND) {
+		if (ts_diff_us(&gw->bus_idle, &now) > 0) {
+			gateway_timer_at(gw, &gw->bus_idle);
+			return;
+		}
+		gateway_send(gw);
+		gateway_schedule(gw);
+		return;
+	}
+
+	if (gw->state != GATEWAY_WAIT)
+		return;
+
+	/* bytes of this batch may not have been dispatched yet */
+	gateway_uart_read(gw);
+	if (gw->state != GATEWAY_WAIT)
+		return;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	if (gw->frame_len == 0) {
+		when = gw->tx_end;
+		ts_add_us(&when, gw->response_ms * 1000L);
+		if (ts_diff_us(&when, &now) > 0) {
+			gateway_timer_at(gw, &when);
+			return;
+		}
+
+		gw->stats.timeouts++;
+		gw->flush_rx = 1;
+		gw->bus_idle = now;
+		gateway_complete(gw, 0);
+		return;
+	}
+
+	when = gw->last_rx;
+	ts_add_us(&when, gw->gap_us);
+	if (ts_diff_us(&when, &now) > 0) {
+		gateway_timer_at(gw, &when);
+		return;
+	}
+
+	gateway_frame_end(gw);
+}
+
+/* a new request reached the head of its client's queue */
+static void gateway_join(struct gateway_t *gw, struct gateway_client_t *client)
+{
+	struct gateway_req_t *req = &client->queue[client->head];
+
+	if (!gw->dedup || !gateway_is_read(req) || !gateway_same(gw, req))
+		return;
+
+	/* too late once the answer has started coming in */
+	if (gw->state == GATEWAY_TURNAROUND ||
+	    (gw->state == GATEWAY_WAIT && gw->frame_len == 0)) {
+		client->busy = 1;
+		gw->stats.deduplicated++;
+	}
+}
+
+static void client_request(struct gateway_client_t *client, const unsigned char *adu, int len)
+{
+	struct gateway_t *gw = client->gw;
+	struct gateway_req_t *req;
+	struct gateway_req_t busy;
+
+	gw->stats.requests++;
+
+	if (client->count == GATEWAY_CLIENT_QUEUE) {
+		gw->stats.busy++;
+		busy.tid = (adu[0] << 8) | adu[1];
+		busy.unit = adu[6];
+		busy.pdu[0] = adu[7];
+		client_exception(client, &busy, GATEWAY_EX_BUSY);
+		return;
+	}
+
+	req = &client->queue[(client->head + client->count) % GATEWAY_CLIENT_QUEUE];
+	req->tid = (adu[0] << 8) | adu[1];
+	req->unit = adu[6];
+	req->pdu_len = len - GATEWAY_MBAP_LEN;
+	memcpy(req->pdu, &adu[GATEWAY_MBAP_LEN], req->pdu_len);
+	clock_gettime(CLOCK_MONOTONIC, &req->arrival);
+	client->count++;
+
+	if (client->count == 1) {
+		if (gw->state != GATEWAY_IDLE)
+			gateway_join(gw, client);
+		else
+			gateway_schedule(gw);
+	}
+}
+
+/* split the received stream into MBAP frames */
+static int client_parse(struct gateway_client_t *client)
+{
+	int len;
+	int total;
+
+	while (client->used && client->rx_len >= GATEWAY_MBAP_LEN) {
+		len = (client->rx[4] << 8) | client->rx[5];
+		if (client->rx[2] != 0 || client->rx[3] != 0 || len < 2 || len > GATEWAY_PDU_MAX + 1)
+			return -LIBCOMMBUS_ERROR_PROTOCOL;
+
+		total = 6 + len;
+		if (client->rx_len < total)
+			break;
+
+		client_request(client, client->rx, total);
+
+		client->rx_len -= total;
+		memmove(client->rx, &client->rx[total], client->rx_len);
+	}
+
+	return LIBCOMMBUS_SUCCESS;
+}
+
+static void client_event(struct reactor_t *reactor, struct reactor_handler_t *handler, int events)
+{
+	struct gateway_client_t *client = (struct gateway_client_t *)handler->arg;
+	int n;
+
+	if (client_flush(client) != LIBCOMMBUS_SUCCESS) {
+		client_close(client);
+		return;
+	}
+
+	while (client->used) {
+		n = socket_recv(&client->sock, &client->rx[client->rx_len],
+				sizeof(client->rx) - client->rx_len);
+		if (n == -LIBCOMMBUS_ERROR_AGAIN)
+			return;
+
+		if (n < 0) {
+			client_close(client);
+			return;
+		}
+
+		client->rx_len += n;
+		if (client_parse(client) != LIBCOMMBUS_SUCCESS) {
+			client_close(client);
+			return;
+		}
+	}
+}
+
+static void gateway_accept(struct reactor_t *reactor, struct reactor_handler_t *handler, int events)
+{
+	struct gateway_t *gw = (struct gateway_t *)handler->arg;
+	struct gateway_client_t *client;
+	struct sock_info_t conn;
+	int i;
+
+	/* edge triggered, drain the whole accept queue */
+	while (socket_accept(&gw->sock, &conn) == LIBCOMMBUS_SUCCESS) {
+		client = NULL;
+		for (i = 0; i < gw->max_clients; i++) {
+			if (!gw->clients[i].used) {
+				client = &gw->clients[i];
+				break;
+			}
+		}
+
+		if (client == NULL) {
+			socket_close(&conn);
+			continue;
+		}
+
+		memset(client, 0, sizeof(*client));
+		client->gw = gw;
+		client->sock = conn;
+		socket_set_nonblock(&client->sock, 1);
+		client->handler.cb = client_event;
+		client->handler.arg = client;
+		if (reactor_add(reactor, &client->handler, &client->sock,
+					REACTOR_EV_READ | REACTOR_EV_WRITE) != LIBCOMMBUS_SUCCESS) {
+			socket_close(&client->sock);
+			continue;
+		}
+
+		client->used = 1;
+		gw->stats.clients++;
+
+		/* a request may already be queued, the edge has passed */
+		client_event(reactor, &client->handler, REACTOR_EV_READ);
+	}
+}
+
+/*
+ * Listen for Modbus TCP clients on port and forward their requests to the
+ * RTU slaves on uart, which must be open with the bus's rate and framing.
+ * At most max_clients connections are served, more are closed right away.
+ * Requests for unit 0 are broadcast on the bus and, like on the wire, get
+ * no answer.
+ */
+int gateway_open(struct gateway_t *gw, struct uart_ctx_t *uart, int port, int max_clients)
+{
+	int one = 1;
+	int ret;
+
+	memset(gw, 0, sizeof(*gw));
+
+	if (uart == NULL || uart->fd < 0 || max_clients <= 0)
+		return -LIBCOMMBUS_ERROR_NO_DEVICE;
+
+	gw->uart = uart;
+	gw->max_clients = max_clients;
+	gw->rr = max_clients - 1;
+	gw->response_ms = GATEWAY_DEFAULT_RESPONSE_MS;
+	gw->queue_ms = GATEWAY_DEFAULT_QUEUE_MS;
+	gw->turnaround_ms = GATEWAY_DEFAULT_TURNAROUND_MS;
+	gw->dedup = 1;
+	gw->flush_rx = 1;
+	gateway_timing(gw);
+
+	gw->clients = (struct gateway_client_t *)calloc(max_clients, sizeof(struct gateway_client_t));
+	if (gw->clients == NULL)
+		return -LIBCOMMBUS_ERROR_MALLOC;
+
+	gw->timerfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (gw->timerfd == -1) {
+		perror("timerfd_create");
+		ret = -LIBCOMMBUS_ERROR_ACCESS;
+		goto out_clients;
+	}
+
+	ret = socket_open(&gw->sock, TYPE_TCP);
+	if (ret != LIBCOMMBUS_SUCCESS)
+		goto out_timer;
+
+	setsockopt(gw->sock.fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+	/* socket_bind()/socket_listen() close the socket on failure */
+	ret = socket_bind(&gw->sock, port);
+	if (ret != LIBCOMMBUS_SUCCESS)
+		goto out_timer;
+
+	ret = socket_listen(&gw->sock);
+	if (ret != LIBCOMMBUS_SUCCESS)
+		goto out_timer;
+
+	ret = socket_set_nonblock(&gw->sock, 1);
+	if (ret != LIBCOMMBUS_SUCCESS)
+		goto out_sock;
+
+	ret = reactor_open(&gw->reactor, 0);
+	if (ret != LIBCOMMBUS_SUCCESS)
+		goto out_sock;
+
+	gw->uart_flags = fcntl(uart->fd, F_GETFL);
+	fcntl(uart->fd, F_SETFL, gw->uart_flags | O_NONBLOCK);
+
+	gw->listen_handler.cb = gateway_accept;
+	gw->listen_handler.arg = gw;
+	ret = reactor_add(&gw->reactor, &gw->listen_handler, &gw->sock, REACTOR_EV_READ);
+	if (ret != LIBCOMMBUS_SUCCESS)
+		goto out_reactor;
+
+	gw->uart_handler.cb = gateway_uart_event;
+	gw->uart_handler.arg = gw;
+	ret = reactor_add_fd(&gw->reactor, &gw->uart_handler, uart->fd, REACTOR_EV_READ);
+	if (ret != LIBCOMMBUS_SUCCESS)
+		goto out_reactor;
+
+	gw->timer_handler.cb = gateway_timer_event;
+	gw->timer_handler.arg = gw;
+	ret = reactor_add_fd(&gw->reactor, &gw->timer_handler, gw->timerfd, REACTOR_EV_READ);
+	if (ret != LIBCOMMBUS_SUCCESS)
+		goto out_reactor;
+
+	return LIBCOMMBUS_SUCCESS;
+
+out_reactor:
+	fcntl(uart->fd, F_SETFL, gw->uart_flags);
+	reactor_close(&gw->reactor);
+out_sock:
+	socket_close(&gw->sock);
+out_timer:
+	close(gw->timerfd);
+out_clients:
+	free(gw->clients);
+	return ret;
+}
+
+/*
+ * response_ms is how long a slave gets to start answering, queue_ms how
+ * long a request may wait for the bus before it is answered with
+ * "gateway target device failed to respond" without being sent; 0 waits
+ * forever.
+ */
+int gateway_set_timeout(struct gateway_t *gw, unsigned int response_ms, unsigned int queue_ms)
+{
+	if (response_ms == 0)
+		return -LIBCOMMBUS_ERROR_NOT_SUPPORT;
+
+	gw->response_ms = response_ms;
+	gw->queue_ms = queue_ms;
+
+	return LIBCOMMBUS_SUCCESS;
+}
+
+int gateway_set_dedup(struct gateway_t *gw, int enable)
+{
+	gw->dedup = enable;
+
+	return LIBCOMMBUS_SUCCESS;
+}
+
+/* Serve clients in the calling thread until gateway_stop() is called */
+int gateway_run(struct gateway_t *gw)
+{
+	return reactor_run(&gw->reactor);
+}
+
+int gateway_stop(struct gateway_t *gw)
+{
+	return reactor_stop(&gw->reactor);
+}
+
+int gateway_close(struct gateway_t *gw)
+{
+	int i;
+
+	for (i = 0; i < gw->max_clients; i++) {
+		if (gw->clients[i].used)
+			client_close(&gw->clients[i]);
+	}
+
+	fcntl(gw->uart->fd, F_SETFL, gw->uart_flags);
+	socket_close(&gw->sock);
+	close(gw->timerfd);
+	free(gw->clients);
+
+	return reactor_close(&gw->reactor);
+}
@@ -0,0 +1,212 @@
+/***************************************************************************
+ *   Copyright (C) 2015 by Tse-Lun Bien                                    *
+ *   allanbian@gmail.com                                                   *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include "commbus.h"
+#include "i2c.h"
+#include "i2c_eeprom.h"
+
+/* one read message, the 16-bit length field of struct i2c_msg */
+#define I2C_EEPROM_READ_MAX	32768
+
+const struct i2c_eeprom_chip_t i2c_eeprom_chips[] = {
+	{"24c01", 128, 8, 1, 10},
+	{"24c02", 256, 8, 1, 10},
+	{"24c04", 512, 16, 1, 10},
+	{"24c08", 1024, 16, 1, 10},
+	{"24c16", 2048, 16, 1, 10},
+	{"24c32", 4096, 32, 2, 10},
+	{"24c64", 8192, 32, 2, 10},
+	{"24c128", 16384, 64, 2, 10},
+	{"24c256", 32768, 64, 2, 10},
+	{"24c512", 65536, 128, 2, 10},
+	{"24cm01", 131072, 256, 2, 10},
+	{"24cm02", 262144, 256, 2, 10},
+	{ }
+};
+
+static unsigned long long i2c_eeprom_now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000ULL + ts.tv_nsec / 1000000;
+}
+
+/* block select bits and the register address of a memory address */
+static unsigned short i2c_eeprom_slave(struct i2c_eeprom_t *eep, unsigned int addr)
+{
+	return eep->slave_addr | (addr >> (8 * eep->chip->addr_bytes));
+}
+
+static unsigned int i2c_eeprom_block_left(struct i2c_eeprom_t *eep, unsigned int addr)
+{
+	unsigned int block = 1U << (8 * eep->chip->addr_bytes);
+
+	return block - addr % block;
+}
+
+/*
+ * Submit, retrying while the chip does not acknowledge because a write
+ * cycle still runs. Only a write leaves the chip busy, so any other
+ * missing acknowledge is returned at once. The chip counts as stuck only
+ * when an attempt started after write_ms fails, not when the caller was
+ * merely descheduled across the deadline.
+ */
+static int i2c_eeprom_submit(struct i2c_eeprom_t *eep, struct i2c_xact_t *xact)
+{
+	unsigned long long end = i2c_eeprom_now_ms() + eep->chip->write_ms;
+	unsigned long long start;
+	int ret;
+
+	while (1) {
+		start = i2c_eeprom_now_ms();
+		ret = i2c_ctx_submit(eep->ctx, xact);
+		if (ret >= 0) {
+			eep->busy = 0;
+			return LIBCOMMBUS_SUCCESS;
+		}
+		if (ret != -LIBCOMMBUS_ERROR_NO_DEVICE || !eep->busy)
+			return ret;
+
+		if (start > end) {
+			debug_print("i2c_eeprom: %s still busy after %u ms\n", eep->chip->name, eep->chip->write_ms);
+			return -LIBCOMMBUS_ERROR_AGAIN;
+		}
+		eep->stats.polls++;
+	}
+}
+
+/* the chip has no ID, so it is only checked to acknowledge a read */
+int i2c_eeprom_open(struct i2c_eeprom_t *eep, struct i2c_ctx_t *ctx, unsigned short slave_addr,
+		const char *name)
+{
+	const struct i2c_eeprom_chip_t *chip;
+	unsigned char byte;
+
+	memset(eep, 0, sizeof(*eep));
+
+	for (chip = i2c_eeprom_chips; chip->name; chip++) {
+		if (strcmp(chip->name, name) == 0)
+			break;
+	}
+	if (chip->name == NULL)
+		return -LIBCOMMBUS_ERROR_NOT_SUPPORT;
+
+	eep->ctx = ctx;
+	eep->slave_addr = slave_addr;
+	eep->chip = chip;
+
+	return i2c_eeprom_read(eep, 0, &byte, 1);
+}
+
+int i2c_eeprom_read(struct i2c_eeprom_t *eep, unsigned int addr, unsigned char *buf, unsigned int len)
+{
+	struct i2c_xact_t xact;
+	unsigned char arena[2];
+	unsigned int chunk;
+	int ret;
+
+	if (addr > eep->chip->size || len > eep->chip->size - addr)
+		return -LIBCOMMBUS_ERROR_NOT_SUPPORT;
+
+	eep->stats.reads++;
+	i2c_xact_init(&xact, arena, sizeof(arena));
+
+	while (len > 0) {
+		chunk = i2c_eeprom_block_left(eep, addr);
+		if (chunk > I2C_EEPROM_READ_MAX)
+			chunk = I2C_EEPROM_READ_MAX;
+		if (chunk > len)
+			chunk = len;
+
+		i2c_xact_reset(&xact);
+		if (eep->chip->addr_bytes == 2)
+			i2c_xact_read_reg16(&xact, i2c_eeprom_slave(eep, addr), addr, buf, chunk);
+		else
+			i2c_xact_read_reg(&xact, i2c_eeprom_slave(eep, addr), addr, buf, chunk);
+
+		ret = i2c_eeprom_submit(eep, &xact);
+		if (ret != LIBCOMMBUS_SUCCESS)
+			return ret;
+
+		addr += chunk;
+		buf += chunk;
+		len -= chunk;
+	}
+
+	return LIBCOMMBUS_SUCCESS;
+}
+
+/* returns once the last page is written */
+int i2c_eeprom_write(struct i2c_eeprom_t *eep, unsigned int addr, const unsigned char *buf,
+		unsigned int len)
+{
+	struct i2c_xact_t xact;
+	unsigned char arena[2 + I2C_EEPROM_PAGE_MAX];
+	unsigned int page = eep->chip->page_size;
+	unsigned int chunk;
+	unsigned char byte;
+	int ret;
+
+	if (addr > eep->chip->size || len > eep->chip->size - addr)
+		return -LIBCOMMBUS_ERROR_NOT_SUPPORT;
+
+	eep->stats.writes++;
+	i2c_xact_init(&xact, arena, sizeof(arena));
+
+	while (len > 0) {
+		chunk = page - addr % page;
+		if (chunk > len)
+			chunk = len;
+
+		i2c_xact_reset(&xact);
+		if (eep->chip->addr_bytes == 2)
+			i2c_xact_write_reg16(&xact, i2c_eeprom_slave(eep, addr), addr, buf, chunk);
+		else
+			i2c_xact_write_reg(&xact, i2c_eeprom_slave(eep, addr), addr, buf, chunk);
+
+		/* the previous page may still be in its write cycle */
+		ret = i2c_eeprom_submit(eep, &xact);
+		if (ret != LIBCOMMBUS_SUCCESS)
+			return ret;
+
+		eep->busy = 1;
+		eep->stats.pages++;
+		addr += chunk;
+		buf += chunk;
+		len -= chunk;
+	}
+
+	/* poll with a read of the current address, it changes nothing */
+	i2c_xact_reset(&xact);
+	i2c_xact_read(&xact, eep->slave_addr, &byte, 1);
+
+	return i2c_eeprom_submit(eep, &xact);
+}
+
+int i2c_eeprom_get_stats(struct i2c_eeprom_t *eep, struct i2c_eeprom_stats_t *stats)
+{
+	*stats = eep->stats;
+
+	return LIBCOMMBUS_SUCCESS;
+}
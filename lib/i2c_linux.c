@@ -19,63 +19,188 @@
  ***************************************************************************/
 
 #include <stdio.h>
+#include <errno.h>
 #include <stdlib.h>
 #include <string.h>
 #include <fcntl.h>
 #include <unistd.h>
+#include <pthread.h>
 #include <sys/ioctl.h>
 #include <linux/i2c.h>
 #include <linux/i2c-dev.h>
 #include "commbus.h"
 #include "i2c.h"
 
-static int i2c_fd[I2C_BUS_MAX];
+/* preallocated for i2c_ctx_write(), grown when a write is longer */
+#define I2C_WBUF_DEFAULT	64
 
-int i2c_open(int bus)
+/* contexts behind the bus number API, bus n is /dev/i2c-n */
+static struct i2c_ctx_t i2c_ctx[I2C_BUS_MAX];
+
+void i2c_xact_init(struct i2c_xact_t *xact, unsigned char *arena, unsigned int arena_size)
 {
-	char path[16];
+	xact->nmsgs = 0;
+	xact->arena = arena;
+	xact->arena_size = arena_size;
+	xact->arena_used = 0;
+	xact->error = LIBCOMMBUS_SUCCESS;
+}
 
-	if (bus >= I2C_BUS_MAX || bus < 0)
-		return -LIBCOMMBUS_ERROR_NO_DEVICE;
+void i2c_xact_reset(struct i2c_xact_t *xact)
+{
+	xact->nmsgs = 0;
+	xact->arena_used = 0;
+	xact->error = LIBCOMMBUS_SUCCESS;
+}
 
-	sprintf(path, "/dev/i2c-%d", bus);
+static int i2c_xact_add(struct i2c_xact_t *xact, unsigned short slave_addr, unsigned short flags,
+		unsigned char *buf, unsigned short len)
+{
+	struct i2c_xact_msg_t *msg;
 
-	i2c_fd[bus] = open(path, O_RDWR);
-	if (i2c_fd[bus] < 0) {
-		perror("open");
-		return -LIBCOMMBUS_ERROR_ACCESS;
+	if (xact->error != LIBCOMMBUS_SUCCESS)
+		return xact->error;
+
+	if (xact->nmsgs >= I2C_XACT_MSGS_MAX) {
+		debug_print("i2c: more than %d messages in a transaction\n", I2C_XACT_MSGS_MAX);
+		xact->error = -LIBCOMMBUS_ERROR_NOT_SUPPORT;
+		return xact->error;
 	}
 
+	msg = &xact->msgs[xact->nmsgs++];
+	msg->addr = slave_addr;
+	msg->flags = flags;
+	msg->len = len;
+	msg->buf = buf;
+
 	return LIBCOMMBUS_SUCCESS;
 }
 
-int i2c_read(int bus, unsigned short slave_addr, unsigned char reg_addr, 
-		unsigned char *data, unsigned short len)
+/* take len bytes of the arena, NULL and the error recorded if it is full */
+static unsigned char *i2c_xact_alloc(struct i2c_xact_t *xact, unsigned int len)
+{
+	unsigned char *p;
+
+	if (xact->error != LIBCOMMBUS_SUCCESS)
+		return NULL;
+
+	if (len > xact->arena_size - xact->arena_used) {
+		debug_print("i2c: transaction arena of %u bytes is full\n", xact->arena_size);
+		xact->error = -LIBCOMMBUS_ERROR_MALLOC;
+		return NULL;
+	}
+
+	p = xact->arena + xact->arena_used;
+	xact->arena_used += len;
+
+	return p;
+}
+
+/* data is sent from the caller's buffer, it must stay valid until submitted */
+int i2c_xact_write(struct i2c_xact_t *xact, unsigned short slave_addr, unsigned char *data,
+		unsigned short len)
+{
+	return i2c_xact_add(xact, slave_addr, 0, data, len);
+}
+
+int i2c_xact_read(struct i2c_xact_t *xact, unsigned short slave_addr, unsigned char *data,
+		unsigned short len)
+{
+	return i2c_xact_add(xact, slave_addr, I2C_XACT_READ, data, len);
+}
+
+/* the register address, big-endian in reg_bytes bytes, then data */
+static int i2c_xact_write_regn(struct i2c_xact_t *xact, unsigned short slave_addr, unsigned short reg_addr,
+		int reg_bytes, const unsigned char *data, unsigned short len)
+{
+	unsigned char *buf;
+
+	if (len > 0xffff - reg_bytes) {
+		xact->error = -LIBCOMMBUS_ERROR_NOT_SUPPORT;
+		return xact->error;
+	}
+
+	buf = i2c_xact_alloc(xact, reg_bytes + len);
+	if (buf == NULL)
+		return xact->error;
+
+	if (reg_bytes == 2) {
+		buf[0] = reg_addr >> 8;
+		buf[1] = reg_addr;
+	} else {
+		buf[0] = reg_addr;
+	}
+	if (len)
+		memcpy(buf + reg_bytes, data, len);
+
+	return i2c_xact_add(xact, slave_addr, 0, buf, reg_bytes + len);
+}
+
+static int i2c_xact_read_regn(struct i2c_xact_t *xact, unsigned short slave_addr, unsigned short reg_addr,
+		int reg_bytes, unsigned char *data, unsigned short len)
 {
 	int ret;
-	struct i2c_rdwr_ioctl_data xfer;
-	struct i2c_msg msg[2];
 
-	if (bus >= I2C_BUS_MAX || bus < 0)
-		return -LIBCOMMBUS_ERROR_NO_DEVICE;
+	ret = i2c_xact_write_regn(xact, slave_addr, reg_addr, reg_bytes, NULL, 0);
+	if (ret != LIBCOMMBUS_SUCCESS)
+		return ret;
 
-	memset(&xfer, 0, sizeof(xfer));
+	return i2c_xact_add(xact, slave_addr, I2C_XACT_READ, data, len);
+}
 
-	xfer.msgs = msg;
-	xfer.nmsgs = 2;
+/* one message of the register byte then data, copied to the arena */
+int i2c_xact_write_reg(struct i2c_xact_t *xact, unsigned short slave_addr, unsigned char reg_addr,
+		const unsigned char *data, unsigned short len)
+{
+	return i2c_xact_write_regn(xact, slave_addr, reg_addr, 1, data, len);
+}
 
-	msg[0].addr = slave_addr;
-	msg[0].flags = 0;
-	msg[0].len = 1;
-	msg[0].buf = &reg_addr;
+/* the register byte written, then len bytes read after a repeated start */
+int i2c_xact_read_reg(struct i2c_xact_t *xact, unsigned short slave_addr, unsigned char reg_addr,
+		unsigned char *data, unsigned short len)
+{
+	return i2c_xact_read_regn(xact, slave_addr, reg_addr, 1, data, len);
+}
 
-	msg[1].addr = slave_addr;
-	msg[1].flags = I2C_M_RD;
-	msg[1].len = len;
-	msg[1].buf = data;
+/* the same with a 16-bit register address, high byte first */
+int i2c_xact_write_reg16(struct i2c_xact_t *xact, unsigned short slave_addr, unsigned short reg_addr,
+		const unsigned char *data, unsigned short len)
+{
+	return i2c_xact_write_regn(xact, slave_addr, reg_addr, 2, data, len);
+}
 
-	ret = ioctl(i2c_fd[bus], I2C_RDWR, &xfer);
+int i2c_xact_read_reg16(struct i2c_xact_t *xact, unsigned short slave_addr, unsigned short reg_addr,
+		unsigned char *data, unsigned short len)
+{
+	return i2c_xact_read_regn(xact, slave_addr, reg_addr, 2, data, len);
+}
+
+/* ctx->lock held */
+static int i2c_ctx_rdwr(struct i2c_ctx_t *ctx, struct i2c_xact_t *xact)
+{
+	struct i2c_rdwr_ioctl_data rdwr;
+	struct i2c_msg msg[I2C_XACT_MSGS_MAX];
+	int ret;
+	int i;
+
+	for (i = 0; i < xact->nmsgs; i++) {
+		msg[i].addr = xact->msgs[i].addr;
+		msg[i].flags = (xact->msgs[i].flags & I2C_XACT_READ) ? I2C_M_RD : 0;
+		msg[i].len = xact->msgs[i].len;
+		msg[i].buf = xact->msgs[i].buf;
+	}
+
+	rdwr.msgs = msg;
+	rdwr.nmsgs = xact->nmsgs;
+
+	ret = ioctl(ctx->fd, I2C_RDWR, &rdwr);
 	if (ret < 0) {
+		/*
+		 * What adapters report for an address nobody acknowledged,
+		 * quietly: EEPROMs in a write cycle are polled this way.
+		 */
+		if (errno == ENXIO || errno == EREMOTEIO)
+			return -LIBCOMMBUS_ERROR_NO_DEVICE;
 		perror("ioctl");
 		return -LIBCOMMBUS_ERROR_ACCESS;
 	}
@@ -83,53 +208,133 @@ int i2c_read(int bus, unsigned short slave_addr, unsigned char reg_addr,
 	return ret;
 }
 
-int i2c_write(int bus, unsigned short slave_addr, unsigned char reg_addr, 
-		unsigned char *data, unsigned short len)
+/*
+ * Open the i2c adapter at path. Every call is one I2C_RDWR transaction
+ * and calls on one context are serialized, so it can be shared between
+ * threads.
+ */
+int i2c_ctx_open(struct i2c_ctx_t *ctx, const char *path)
 {
-	int ret = 0;
-	struct i2c_rdwr_ioctl_data xfer;
-	struct i2c_msg msg[1];
-	unsigned char *buf;
+	ctx->wbuf_size = I2C_WBUF_DEFAULT;
+	ctx->wbuf = (unsigned char *)malloc(ctx->wbuf_size);
+	if (!ctx->wbuf)
+		return -LIBCOMMBUS_ERROR_MALLOC;
 
-	if (bus >= I2C_BUS_MAX || bus < 0)
-		return -LIBCOMMBUS_ERROR_NO_DEVICE;
+	ctx->fd = open(path, O_RDWR);
+	if (ctx->fd < 0) {
+		perror("open");
+		free(ctx->wbuf);
+		ctx->wbuf = NULL;
+		return -LIBCOMMBUS_ERROR_ACCESS;
+	}
 
-	memset(&xfer, 0, sizeof(xfer));
+	pthread_mutex_init(&ctx->lock, NULL);
 
-	buf = (unsigned char *)malloc(len+1);
-	if (!buf)
-		return -LIBCOMMBUS_ERROR_MALLOC;
+	return LIBCOMMBUS_SUCCESS;
+}
+
+/*
+ * Send all messages of xact in one I2C_RDWR call. Returns the number of
+ * messages transferred, or the first error of building the transaction.
+ */
+int i2c_ctx_submit(struct i2c_ctx_t *ctx, struct i2c_xact_t *xact)
+{
+	int ret;
 
-	xfer.msgs = msg;
-	xfer.nmsgs = 1;
+	if (xact->error != LIBCOMMBUS_SUCCESS)
+		return xact->error;
+	if (xact->nmsgs == 0)
+		return 0;
 
-	buf[0] = reg_addr;
-	memcpy(buf + 1, data, len);
+	pthread_mutex_lock(&ctx->lock);
+	ret = i2c_ctx_rdwr(ctx, xact);
+	pthread_mutex_unlock(&ctx->lock);
 
-	msg[0].addr = slave_addr;
-	msg[0].flags = 0;
-	msg[0].len = len + 1;
-	msg[0].buf = buf;
+	return ret;
+}
 
-	ret = ioctl(i2c_fd[bus], I2C_RDWR, &xfer);
-	if (ret < 0) {
-		perror("ioctl");
-		free(buf);
-		return -LIBCOMMBUS_ERROR_ACCESS;
+static int i2c_ctx_read_regn(struct i2c_ctx_t *ctx, unsigned short slave_addr, unsigned short reg_addr,
+		int reg_bytes, unsigned char *data, unsigned short len)
+{
+	struct i2c_xact_t xact;
+	unsigned char reg[2];
+
+	i2c_xact_init(&xact, reg, reg_bytes);
+	i2c_xact_read_regn(&xact, slave_addr, reg_addr, reg_bytes, data, len);
+
+	return i2c_ctx_submit(ctx, &xact);
+}
+
+/*
+ * The register address and data go out as one message, assembled in the
+ * context's buffer: it only grows when a write is longer than any before.
+ */
+static int i2c_ctx_write_regn(struct i2c_ctx_t *ctx, unsigned short slave_addr, unsigned short reg_addr,
+		int reg_bytes, unsigned char *data, unsigned short len)
+{
+	int ret;
+	struct i2c_xact_t xact;
+	unsigned char *buf;
+
+	pthread_mutex_lock(&ctx->lock);
+
+	if (len + (unsigned int)reg_bytes > ctx->wbuf_size) {
+		buf = (unsigned char *)realloc(ctx->wbuf, len + reg_bytes);
+		if (!buf) {
+			pthread_mutex_unlock(&ctx->lock);
+			return -LIBCOMMBUS_ERROR_MALLOC;
+		}
+		ctx->wbuf = buf;
+		ctx->wbuf_size = len + reg_bytes;
 	}
 
-	free(buf);
+	i2c_xact_init(&xact, ctx->wbuf, ctx->wbuf_size);
+	ret = i2c_xact_write_regn(&xact, slave_addr, reg_addr, reg_bytes, data, len);
+	if (ret == LIBCOMMBUS_SUCCESS)
+		ret = i2c_ctx_rdwr(ctx, &xact);
+
+	pthread_mutex_unlock(&ctx->lock);
+
 	return ret;
 }
 
-int i2c_close(int bus)
+int i2c_ctx_read(struct i2c_ctx_t *ctx, unsigned short slave_addr, unsigned char reg_addr, 
+		unsigned char *data, unsigned short len)
+{
+	return i2c_ctx_read_regn(ctx, slave_addr, reg_addr, 1, data, len);
+}
+
+int i2c_ctx_write(struct i2c_ctx_t *ctx, unsigned short slave_addr, unsigned char reg_addr, 
+		unsigned char *data, unsigned short len)
+{
+	return i2c_ctx_write_regn(ctx, slave_addr, reg_addr, 1, data, len);
+}
+
+/* for devices with a 16-bit register address, sent high byte first */
+int i2c_ctx_read16(struct i2c_ctx_t *ctx, unsigned short slave_addr, unsigned short reg_addr,
+		unsigned char *data, unsigned short len)
+{
+	return i2c_ctx_read_regn(ctx, slave_addr, reg_addr, 2, data, len);
+}
+
+int i2c_ctx_write16(struct i2c_ctx_t *ctx, unsigned short slave_addr, unsigned short reg_addr,
+		unsigned char *data, unsigned short len)
+{
+	return i2c_ctx_write_regn(ctx, slave_addr, reg_addr, 2, data, len);
+}
+
+/* no other thread may still be using the context */
+int i2c_ctx_close(struct i2c_ctx_t *ctx)
 {
 	int ret;
 
-	if (bus >= I2C_BUS_MAX || bus < 0)
-		return -LIBCOMMBUS_ERROR_NO_DEVICE;
+	ret = close(ctx->fd);
+	ctx->fd = -1;
+
+	pthread_mutex_destroy(&ctx->lock);
+	free(ctx->wbuf);
+	ctx->wbuf = NULL;
 
-	ret = close(i2c_fd[bus]);
 	if (ret != 0) {
 		perror("close");
 		return -LIBCOMMBUS_ERROR_ACCESS;
@@ -137,3 +342,67 @@ int i2c_close(int bus)
 
 	return LIBCOMMBUS_SUCCESS;
 }
+
+int i2c_open(int bus)
+{
+	char path[32];
+
+	if (bus >= I2C_BUS_MAX || bus < 0)
+		return -LIBCOMMBUS_ERROR_NO_DEVICE;
+
+	sprintf(path, "/dev/i2c-%d", bus);
+
+	return i2c_ctx_open(&i2c_ctx[bus], path);
+}
+
+int i2c_read(int bus, unsigned short slave_addr, unsigned char reg_addr, 
+		unsigned char *data, unsigned short len)
+{
+	if (bus >= I2C_BUS_MAX || bus < 0)
+		return -LIBCOMMBUS_ERROR_NO_DEVICE;
+
+	return i2c_ctx_read(&i2c_ctx[bus], slave_addr, reg_addr, data, len);
+}
+
+int i2c_write(int bus, unsigned short slave_addr, unsigned char reg_addr, 
+		unsigned char *data, unsigned short len)
+{
+	if (bus >= I2C_BUS_MAX || bus < 0)
+		return -LIBCOMMBUS_ERROR_NO_DEVICE;
+
+	return i2c_ctx_write(&i2c_ctx[bus], slave_addr, reg_addr, data, len);
+}
+
+int i2c_read16(int bus, unsigned short slave_addr, unsigned short reg_addr,
+		unsigned char *data, unsigned short len)
+{
+	if (bus >= I2C_BUS_MAX || bus < 0)
+		return -LIBCOMMBUS_ERROR_NO_DEVICE;
+
+	return i2c_ctx_read16(&i2c_ctx[bus], slave_addr, reg_addr, data, len);
+}
+
+int i2c_write16(int bus, unsigned short slave_addr, unsigned short reg_addr,
+		unsigned char *data, unsigned short len)
+{
+	if (bus >= I2C_BUS_MAX || bus < 0)
+		return -LIBCOMMBUS_ERROR_NO_DEVICE;
+
+	return i2c_ctx_write16(&i2c_ctx[bus], slave_addr, reg_addr, data, len);
+}
+
+int i2c_submit(int bus, struct i2c_xact_t *xact)
+{
+	if (bus >= I2C_BUS_MAX || bus < 0)
+		return -LIBCOMMBUS_ERROR_NO_DEVICE;
+
+	return i2c_ctx_submit(&i2c_ctx[bus], xact);
+}
+
+int i2c_close(int bus)
+{
+	if (bus >= I2C_BUS_MAX || bus < 0)
+		return -LIBCOMMBUS_ERROR_NO_DEVICE;
+
+	return i2c_ctx_close(&i2c_ctx[bus]);
+}
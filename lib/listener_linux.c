@@ -0,0 +1,332 @@
+/***************************************************************************
+ *   Copyright (C) 2015 by Tse-Lun Bien                                    *
+ *   allanbian@gmail.com                                                   *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/socket.h>
+#include <sys/timerfd.h>
+#include "commbus.h"
+#include "socket.h"
+#include "reactor.h"
+#include "listener.h"
+
+/*
+ * Out of descriptors: give up the reserve to accept the connection at the
+ * head of the queue and close it at once, so its client sees the refusal
+ * and the queue keeps moving.
+ */
+static int listener_shed(struct listener_shard_t *shard)
+{
+	int fd;
+
+	if (shard->reserve_fd < 0)
+		return -LIBCOMMBUS_ERROR_ACCESS;
+
+	close(shard->reserve_fd);
+	fd = accept(shard->sock.fd, NULL, NULL);
+	if (fd >= 0) {
+		close(fd);
+		shard->shed++;
+	}
+	shard->reserve_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+
+	return fd >= 0 ? LIBCOMMBUS_SUCCESS : -LIBCOMMBUS_ERROR_ACCESS;
+}
+
+/* drain the accept queue again in LISTENER_RETRY_MS */
+static void listener_retry_later(struct listener_shard_t *shard)
+{
+	struct itimerspec its;
+
+	memset(&its, 0, sizeof(its));
+	its.it_value.tv_sec = LISTENER_RETRY_MS / 1000;
+	its.it_value.tv_nsec = (LISTENER_RETRY_MS % 1000) * 1000000L;
+	if (timerfd_settime(shard->retry_fd, 0, &its, NULL) != 0)
+		perror("timerfd_settime");
+}
+
+static void listener_accept_cb(struct reactor_t *reactor, struct reactor_handler_t *handler,
+		int events)
+{
+	struct listener_shard_t *shard = (struct listener_shard_t *)handler->arg;
+	struct listener_t *listener = shard->listener;
+	struct sock_info_t conn;
+	int ret;
+	int err;
+
+	/* edge triggered, drain the whole accept queue */
+	while (1) {
+		ret = socket_accept(&shard->sock, &conn);
+		if (ret == -LIBCOMMBUS_ERROR_AGAIN)
+			return;
+
+		/*
+		 * Out of descriptors or memory. No new edge comes for the
+		 * connections already queued, so shed the one at the head or
+		 * come back on the retry timer.
+		 */
+		if (ret != LIBCOMMBUS_SUCCESS) {
+			err = errno;
+			shard->errors++;
+			if ((err == EMFILE || err == ENFILE) && listener_shed(shard) == LIBCOMMBUS_SUCCESS)
+				continue;
+			listener_retry_later(shard);
+			return;
+		}
+
+		shard->accepted++;
+		socket_set_nonblock(&conn, 1);
+		listener->on_conn(listener, reactor, &conn, listener->arg);
+	}
+}
+
+static void listener_retry_cb(struct reactor_t *reactor, struct reactor_handler_t *handler,
+		int events)
+{
+	struct listener_shard_t *shard = (struct listener_shard_t *)handler->arg;
+	uint64_t expirations;
+
+	if (read(shard->retry_fd, &expirations, sizeof(expirations)) < 0 && errno != EAGAIN)
+		perror("read");
+
+	listener_accept_cb(reactor, &shard->handler, REACTOR_EV_READ);
+}
+
+static void *listener_thread(void *arg)
+{
+	struct listener_shard_t *shard = (struct listener_shard_t *)arg;
+	cpu_set_t cpus;
+
+	CPU_ZERO(&cpus);
+	CPU_SET(shard->cpu, &cpus);
+	if (pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus) != 0)
+		debug_print("listener: cannot pin shard %d to cpu %d\n", shard->index, shard->cpu);
+
+	/*
+	 * Not reactor_run(): running is raised before the thread starts so a
+	 * listener_stop() right after listener_start() cannot be missed.
+	 */
+	while (shard->reactor.running) {
+		if (reactor_poll(&shard->reactor, -1) < 0)
+			break;
+	}
+
+	return NULL;
+}
+
+static int listener_shard_open(struct listener_t *listener, struct listener_shard_t *shard)
+{
+	int one = 1;
+	int ret;
+
+	shard->reserve_fd = -1;
+	shard->retry_fd = -1;
+
+	ret = socket_open(&shard->sock, TYPE_TCP);
+	if (ret != LIBCOMMBUS_SUCCESS)
+		return ret;
+
+	/* every shard binds the same port, the kernel spreads connections */
+	if (setsockopt(shard->sock.fd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one)) != 0 ||
+	    setsockopt(shard->sock.fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one)) != 0) {
+		perror("setsockopt");
+		close(shard->sock.fd);
+		return -LIBCOMMBUS_ERROR_NOT_SUPPORT;
+	}
+
+	ret = socket_bind(&shard->sock, listener->port);
+	if (ret != LIBCOMMBUS_SUCCESS)
+		return ret;
+
+	ret = socket_listen(&shard->sock);
+	if (ret != LIBCOMMBUS_SUCCESS)
+		return ret;
+
+	socket_set_nonblock(&shard->sock, 1);
+
+	shard->reserve_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+	shard->retry_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (shard->reserve_fd < 0 || shard->retry_fd < 0) {
+		perror("listener");
+		ret = -LIBCOMMBUS_ERROR_ACCESS;
+		goto err_fds;
+	}
+
+	ret = reactor_open(&shard->reactor, 0);
+	if (ret != LIBCOMMBUS_SUCCESS)
+		goto err_fds;
+
+	shard->handler.cb = listener_accept_cb;
+	shard->handler.arg = shard;
+	ret = reactor_add(&shard->reactor, &shard->handler, &shard->sock, REACTOR_EV_READ);
+	if (ret != LIBCOMMBUS_SUCCESS)
+		goto err_reactor;
+
+	shard->retry_handler.cb = listener_retry_cb;
+	shard->retry_handler.arg = shard;
+	ret = reactor_add_fd(&shard->reactor, &shard->retry_handler, shard->retry_fd, REACTOR_EV_READ);
+	if (ret != LIBCOMMBUS_SUCCESS) {
+		reactor_del(&shard->reactor, &shard->handler);
+		goto err_reactor;
+	}
+
+	return LIBCOMMBUS_SUCCESS;
+
+err_reactor:
+	reactor_close(&shard->reactor);
+err_fds:
+	if (shard->retry_fd >= 0)
+		close(shard->retry_fd);
+	if (shard->reserve_fd >= 0)
+		close(shard->reserve_fd);
+	socket_close(&shard->sock);
+	return ret;
+}
+
+static void listener_shard_close(struct listener_shard_t *shard)
+{
+	reactor_del(&shard->reactor, &shard->retry_handler);
+	reactor_del(&shard->reactor, &shard->handler);
+	reactor_close(&shard->reactor);
+	close(shard->retry_fd);
+	if (shard->reserve_fd >= 0)
+		close(shard->reserve_fd);
+	socket_close(&shard->sock);
+}
+
+/*
+ * Open nshards listening sockets on port with SO_REUSEPORT, each with its
+ * own reactor. nshards <= 0 opens one per online cpu. Nothing is accepted
+ * until listener_start().
+ */
+int listener_open(struct listener_t *listener, int port, int nshards,
+		listener_conn_cb_t on_conn, void *arg)
+{
+	long ncpu;
+	int ret;
+	int i;
+
+	memset(listener, 0, sizeof(*listener));
+
+	if (!on_conn)
+		return -LIBCOMMBUS_ERROR_NOT_SUPPORT;
+
+	ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+	if (ncpu < 1)
+		ncpu = 1;
+	if (nshards <= 0)
+		nshards = ncpu;
+
+	listener->shards = (struct listener_shard_t *)calloc(nshards, sizeof(struct listener_shard_t));
+	if (!listener->shards)
+		return -LIBCOMMBUS_ERROR_MALLOC;
+
+	listener->port = port;
+	listener->on_conn = on_conn;
+	listener->arg = arg;
+
+	for (i = 0; i < nshards; i++) {
+		listener->shards[i].listener = listener;
+		listener->shards[i].index = i;
+		listener->shards[i].cpu = i % ncpu;
+
+		ret = listener_shard_open(listener, &listener->shards[i]);
+		if (ret != LIBCOMMBUS_SUCCESS) {
+			while (i-- > 0)
+				listener_shard_close(&listener->shards[i]);
+			free(listener->shards);
+			listener->shards = NULL;
+			return ret;
+		}
+	}
+
+	listener->nshards = nshards;
+
+	return LIBCOMMBUS_SUCCESS;
+}
+
+/* start one acceptor thread per shard, pinned to its cpu */
+int listener_start(struct listener_t *listener)
+{
+	struct listener_shard_t *shard;
+	int i;
+
+	for (i = 0; i < listener->nshards; i++) {
+		shard = &listener->shards[i];
+		shard->reactor.running = 1;
+		if (pthread_create(&shard->tid, NULL, listener_thread, shard) != 0) {
+			perror("pthread_create");
+			shard->reactor.running = 0;
+			listener_stop(listener);
+			return -LIBCOMMBUS_ERROR_ACCESS;
+		}
+		shard->started = 1;
+	}
+
+	return LIBCOMMBUS_SUCCESS;
+}
+
+/* stop every shard loop and wait for the threads to exit */
+int listener_stop(struct listener_t *listener)
+{
+	struct listener_shard_t *shard;
+	int i;
+
+	for (i = 0; i < listener->nshards; i++) {
+		shard = &listener->shards[i];
+		if (!shard->started)
+			continue;
+
+		reactor_stop(&shard->reactor);
+		pthread_join(shard->tid, NULL);
+		shard->started = 0;
+	}
+
+	return LIBCOMMBUS_SUCCESS;
+}
+
+/*
+ * Stops the shards if needed and closes the listening sockets and loops.
+ * Connections the callback registered on a shard reactor must be closed
+ * by the caller before this.
+ */
+int listener_close(struct listener_t *listener)
+{
+	int i;
+
+	listener_stop(listener);
+
+	for (i = 0; i < listener->nshards; i++)
+		listener_shard_close(&listener->shards[i]);
+
+	free(listener->shards);
+	listener->shards = NULL;
+	listener->nshards = 0;
+
+	return LIBCOMMBUS_SUCCESS;
+}
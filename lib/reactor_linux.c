@@ -0,0 +1,255 @@
+/***************************************************************************
+ *   Copyright (C) 2015 by Tse-Lun Bien                                    *
+ *   allanbian@gmail.com                                                   *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdint.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include "commbus.h"
+#include "socket.h"
+#include "reactor.h"
+
+#define REACTOR_DEFAULT_EVENTS	256
+
+static unsigned int reactor_to_epoll(int events)
+{
+	unsigned int ev = EPOLLET | EPOLLRDHUP;
+
+	if (events & REACTOR_EV_READ)
+		ev |= EPOLLIN;
+	if (events & REACTOR_EV_WRITE)
+		ev |= EPOLLOUT;
+
+	return ev;
+}
+
+static int reactor_from_epoll(unsigned int ev)
+{
+	int events = 0;
+
+	if (ev & EPOLLIN)
+		events |= REACTOR_EV_READ;
+	if (ev & EPOLLOUT)
+		events |= REACTOR_EV_WRITE;
+	if (ev & (EPOLLHUP | EPOLLRDHUP))
+		events |= REACTOR_EV_HUP;
+	if (ev & EPOLLERR)
+		events |= REACTOR_EV_ERROR;
+
+	return events;
+}
+
+int reactor_open(struct reactor_t *reactor, int max_events)
+{
+	struct epoll_event ev;
+
+	memset(reactor, 0, sizeof(*reactor));
+
+	if (max_events <= 0)
+		max_events = REACTOR_DEFAULT_EVENTS;
+
+	reactor->events = (struct epoll_event *)calloc(max_events, sizeof(struct epoll_event));
+	if (!reactor->events)
+		return -LIBCOMMBUS_ERROR_MALLOC;
+
+	reactor->max_events = max_events;
+
+	reactor->epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (reactor->epfd == -1) {
+		perror("epoll_create1");
+		free(reactor->events);
+		return -LIBCOMMBUS_ERROR_ACCESS;
+	}
+
+	/* eventfd used by reactor_stop() to kick a blocked epoll_wait() */
+	reactor->wakefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (reactor->wakefd == -1) {
+		perror("eventfd");
+		close(reactor->epfd);
+		free(reactor->events);
+		return -LIBCOMMBUS_ERROR_ACCESS;
+	}
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.ptr = &reactor->wakefd;
+	if (epoll_ctl(reactor->epfd, EPOLL_CTL_ADD, reactor->wakefd, &ev) != 0) {
+		perror("epoll_ctl");
+		close(reactor->wakefd);
+		close(reactor->epfd);
+		free(reactor->events);
+		return -LIBCOMMBUS_ERROR_ACCESS;
+	}
+
+	return LIBCOMMBUS_SUCCESS;
+}
+
+int reactor_add_fd(struct reactor_t *reactor, struct reactor_handler_t *handler,
+		int fd, int events)
+{
+	struct epoll_event ev;
+
+	handler->fd = fd;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = reactor_to_epoll(events);
+	ev.data.ptr = handler;
+
+	if (epoll_ctl(reactor->epfd, EPOLL_CTL_ADD, fd, &ev) != 0) {
+		perror("epoll_ctl");
+		return -LIBCOMMBUS_ERROR_ACCESS;
+	}
+
+	return LIBCOMMBUS_SUCCESS;
+}
+
+int reactor_add(struct reactor_t *reactor, struct reactor_handler_t *handler,
+		struct sock_info_t *sock, int events)
+{
+	handler->sock = sock;
+
+	return reactor_add_fd(reactor, handler, sock->fd, events);
+}
+
+int reactor_mod(struct reactor_t *reactor, struct reactor_handler_t *handler, int events)
+{
+	struct epoll_event ev;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = reactor_to_epoll(events);
+	ev.data.ptr = handler;
+
+	if (epoll_ctl(reactor->epfd, EPOLL_CTL_MOD, handler->fd, &ev) != 0) {
+		perror("epoll_ctl");
+		return -LIBCOMMBUS_ERROR_ACCESS;
+	}
+
+	return LIBCOMMBUS_SUCCESS;
+}
+
+int reactor_del(struct reactor_t *reactor, struct reactor_handler_t *handler)
+{
+	int i;
+
+	if (epoll_ctl(reactor->epfd, EPOLL_CTL_DEL, handler->fd, NULL) != 0) {
+		perror("epoll_ctl");
+		return -LIBCOMMBUS_ERROR_ACCESS;
+	}
+
+	/* drop events of this batch that are still queued for the handler */
+	for (i = reactor->cur + 1; i < reactor->nready; i++) {
+		if (reactor->events[i].data.ptr == handler)
+			reactor->events[i].data.ptr = NULL;
+	}
+
+	return LIBCOMMBUS_SUCCESS;
+}
+
+/*
+ * Wait up to timeout_ms for readiness and dispatch the callbacks.
+ * Registrations are edge-triggered: a callback has to read/write until
+ * socket_recv()/socket_send() report -LIBCOMMBUS_ERROR_AGAIN, otherwise
+ * it will not be called again for the remaining data.
+ * Returns the number of callbacks run.
+ */
+int reactor_poll(struct reactor_t *reactor, int timeout_ms)
+{
+	struct reactor_handler_t *handler;
+	uint64_t val;
+	int dispatched;
+	int n;
+
+	n = epoll_wait(reactor->epfd, reactor->events, reactor->max_events, timeout_ms);
+	if (n < 0) {
+		if (errno == EINTR)
+			return 0;
+
+		perror("epoll_wait");
+		return -LIBCOMMBUS_ERROR_ACCESS;
+	}
+
+	dispatched = 0;
+	reactor->nready = n;
+	for (reactor->cur = 0; reactor->cur < n; reactor->cur++) {
+		handler = (struct reactor_handler_t *)reactor->events[reactor->cur].data.ptr;
+		if (handler == NULL)
+			continue;
+
+		if ((void *)handler == (void *)&reactor->wakefd) {
+			while (read(reactor->wakefd, &val, sizeof(val)) > 0)
+				;
+			continue;
+		}
+
+		handler->cb(reactor, handler,
+				reactor_from_epoll(reactor->events[reactor->cur].events));
+		dispatched++;
+	}
+	reactor->nready = 0;
+	reactor->cur = 0;
+
+	return dispatched;
+}
+
+int reactor_run(struct reactor_t *reactor)
+{
+	int ret;
+
+	reactor->running = 1;
+	while (reactor->running) {
+		ret = reactor_poll(reactor, -1);
+		if (ret < 0)
+			return ret;
+	}
+
+	return LIBCOMMBUS_SUCCESS;
+}
+
+/* May be called from any thread or from inside a callback */
+int reactor_stop(struct reactor_t *reactor)
+{
+	uint64_t val = 1;
+
+	reactor->running = 0;
+	if (write(reactor->wakefd, &val, sizeof(val)) != sizeof(val)) {
+		if (errno != EAGAIN)
+			return -LIBCOMMBUS_ERROR_ACCESS;
+	}
+
+	return LIBCOMMBUS_SUCCESS;
+}
+
+int reactor_close(struct reactor_t *reactor)
+{
+	close(reactor->wakefd);
+
+	if (close(reactor->epfd) != 0) {
+		perror("close");
+		free(reactor->events);
+		return -LIBCOMMBUS_ERROR_ACCESS;
+	}
+
+	free(reactor->events);
+	return LIBCOMMBUS_SUCCESS;
+}
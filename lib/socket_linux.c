@@ -18,22 +18,32 @@
  *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
  ***************************************************************************/
 
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <poll.h>
 #include <sys/socket.h>
 #include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/un.h>
 #include <arpa/inet.h>
 #include "commbus.h"
 #include "socket.h"
 
+/* messages handed to the kernel per sendmmsg()/recvmmsg() call */
+#define SOCK_MMSG_MAX	64
+
 int socket_open(struct sock_info_t *sock, int type)
 {
 	int sock_type;
 	int sock_domain;
 
 	memset(&sock->addr, 0, sizeof(sock->addr));
+	memset(&sock->un_addr, 0, sizeof(sock->un_addr));
 
 	switch (type) {
 		case TYPE_TCP:
@@ -41,6 +51,17 @@ int socket_open(struct sock_info_t *sock, int type)
 			sock_type = SOCK_STREAM;
 			break;
 
+		case TYPE_UDP:
+			sock_domain = AF_INET;
+			sock_type = SOCK_DGRAM;
+			break;
+
+		/* datagram socket, message boundaries are kept like UDP */
+		case TYPE_UDS:
+			sock_domain = AF_UNIX;
+			sock_type = SOCK_DGRAM;
+			break;
+
 		default:
 			return LIBCOMMBUS_ERROR_NOT_SUPPORT;
 	}
@@ -49,7 +70,11 @@ int socket_open(struct sock_info_t *sock, int type)
 	if (sock->fd == -1)
 		return -LIBCOMMBUS_ERROR_ACCESS;
 
-	sock->addr.sin_family = sock_domain;
+	sock->type = type;
+	if (type == TYPE_UDS)
+		sock->un_addr.sun_family = AF_UNIX;
+	else
+		sock->addr.sin_family = sock_domain;
 
 	return LIBCOMMBUS_SUCCESS;
 }
@@ -85,15 +110,43 @@ int socket_listen(struct sock_info_t *sock)
 	return LIBCOMMBUS_SUCCESS;
 }
 
+/*
+ * Errors that concern only the connection being accepted or a temporary
+ * shortage of resources leave the listening socket open: a peer that
+ * reset before accept() is skipped, and EMFILE/ENFILE/ENOBUFS/ENOMEM
+ * return -LIBCOMMBUS_ERROR_ACCESS so the caller can retry later.
+ */
 int socket_accept(struct sock_info_t *sock_listen, struct sock_info_t *sock_conn)
 {
-	sock_conn->fd = accept(sock_listen->fd, (struct sockaddr *)NULL, NULL);
-	if (sock_conn->fd == -1) {
+	int err;
+
+	while (1) {
+		sock_conn->fd = accept(sock_listen->fd, (struct sockaddr *)NULL, NULL);
+		if (sock_conn->fd != -1)
+			break;
+
+		/* interrupted, or the peer went away before we got to it */
+		if (errno == EINTR || errno == ECONNABORTED || errno == EPROTO)
+			continue;
+
+		/* non-blocking listener has no pending connection */
+		if (errno == EAGAIN || errno == EWOULDBLOCK)
+			return -LIBCOMMBUS_ERROR_AGAIN;
+
+		err = errno;
 		perror("accept");
+		/* the listener stays open, errno tells the caller why */
+		if (err == EMFILE || err == ENFILE || err == ENOBUFS || err == ENOMEM) {
+			errno = err;
+			return -LIBCOMMBUS_ERROR_ACCESS;
+		}
+
 		close(sock_listen->fd);
 		return -LIBCOMMBUS_ERROR_ACCESS;
 	}
 
+	sock_conn->type = sock_listen->type;
+
 	return LIBCOMMBUS_SUCCESS;
 }
 
@@ -119,20 +172,85 @@ int socket_connect(struct sock_info_t *sock, char *host, int port)
 	return LIBCOMMBUS_SUCCESS;	
 }
 
+int socket_bind_path(struct sock_info_t *sock, const char *path)
+{
+	struct stat st;
+	int ret;
+
+	if (sock->type != TYPE_UDS)
+		return -LIBCOMMBUS_ERROR_NOT_SUPPORT;
+
+	if (strlen(path) >= sizeof(sock->un_addr.sun_path))
+		return -LIBCOMMBUS_ERROR_NO_DEVICE;
+
+	strcpy(sock->un_addr.sun_path, path);
+
+	/* remove a stale socket file left behind by a previous owner, nothing else */
+	if (lstat(path, &st) == 0) {
+		if (!S_ISSOCK(st.st_mode)) {
+			debug_print("bind: %s exists and is not a socket\n", path);
+			close(sock->fd);
+			return -LIBCOMMBUS_ERROR_ACCESS;
+		}
+		unlink(path);
+	}
+
+	ret = bind(sock->fd, (struct sockaddr *)&sock->un_addr, sizeof(sock->un_addr));
+	if (ret != 0) {
+		perror("bind");
+		close(sock->fd);
+		return -LIBCOMMBUS_ERROR_ACCESS;
+	}
+
+	return LIBCOMMBUS_SUCCESS;
+}
+
+int socket_connect_path(struct sock_info_t *sock, const char *path)
+{
+	int ret;
+
+	if (sock->type != TYPE_UDS)
+		return -LIBCOMMBUS_ERROR_NOT_SUPPORT;
+
+	if (strlen(path) >= sizeof(sock->un_addr.sun_path))
+		return -LIBCOMMBUS_ERROR_NO_DEVICE;
+
+	strcpy(sock->un_addr.sun_path, path);
+
+	ret = connect(sock->fd, (struct sockaddr *)&sock->un_addr, sizeof(sock->un_addr));
+	if (ret != 0) {
+		perror("connect");
+		close(sock->fd);
+		return -LIBCOMMBUS_ERROR_ACCESS;
+	}
+
+	return LIBCOMMBUS_SUCCESS;
+}
+
 int socket_read(struct sock_info_t *sock, unsigned char *data, int len)
 {
 	int recv;
 	int remain;
 	int n;
 
+	/* one datagram per call, it is never split across reads */
+	if (sock->type != TYPE_TCP)
+		return read(sock->fd, data, len);
+
 	recv = 0;
 	remain = len;
 	do {
 		n = read(sock->fd, &data[recv], remain);
 		if (n < 0) {
+			if (errno == EINTR)
+				continue;
 			return recv;
 		}
 
+		/* peer closed the connection, return what we have */
+		if (n == 0)
+			return recv;
+
 		recv += n;
 		remain = len - recv;
 	} while (remain != 0);
@@ -146,6 +264,9 @@ int socket_write(struct sock_info_t *sock, unsigned char *data, int len)
 	int remain;
 	int n;
 
+	if (sock->type != TYPE_TCP)
+		return write(sock->fd, data, len);
+
 	sent = 0;
 	remain = len;
 	do {
@@ -161,6 +282,354 @@ int socket_write(struct sock_info_t *sock, unsigned char *data, int len)
 	return sent;
 }
 
+/*
+ * Send count datagrams to the connected peer, up to SOCK_MMSG_MAX per
+ * syscall. Returns the number of messages sent, which is less than count
+ * when a non-blocking socket runs out of buffer space.
+ */
+int socket_sendmmsg(struct sock_info_t *sock, struct sock_msg_t *msgs, int count)
+{
+	struct mmsghdr hdr[SOCK_MMSG_MAX];
+	struct iovec iov[SOCK_MMSG_MAX];
+	int sent;
+	int batch;
+	int n;
+	int i;
+
+	if (sock->type == TYPE_TCP)
+		return -LIBCOMMBUS_ERROR_NOT_SUPPORT;
+
+	sent = 0;
+	while (sent < count) {
+		batch = count - sent;
+		if (batch > SOCK_MMSG_MAX)
+			batch = SOCK_MMSG_MAX;
+
+		memset(hdr, 0, sizeof(struct mmsghdr) * batch);
+		for (i = 0; i < batch; i++) {
+			iov[i].iov_base = msgs[sent + i].data;
+			iov[i].iov_len = msgs[sent + i].len;
+			hdr[i].msg_hdr.msg_iov = &iov[i];
+			hdr[i].msg_hdr.msg_iovlen = 1;
+		}
+
+		n = sendmmsg(sock->fd, hdr, batch, MSG_NOSIGNAL);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			if (sent == 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+				return -LIBCOMMBUS_ERROR_AGAIN;
+			if (sent == 0) {
+				perror("sendmmsg");
+				return -LIBCOMMBUS_ERROR_ACCESS;
+			}
+			break;
+		}
+
+		for (i = 0; i < n; i++)
+			msgs[sent + i].result = hdr[i].msg_len;
+
+		sent += n;
+		if (n < batch)
+			break;
+	}
+
+	return sent;
+}
+
+/*
+ * Receive up to count datagrams. Blocks until the first one arrives (unless
+ * the socket is non-blocking) and then returns whatever is already queued,
+ * up to SOCK_MMSG_MAX per syscall. Returns the number of messages received.
+ * A datagram longer than its buffer is cut to fit and flagged with
+ * SOCK_MSG_TRUNC.
+ */
+int socket_recvmmsg(struct sock_info_t *sock, struct sock_msg_t *msgs, int count)
+{
+	struct mmsghdr hdr[SOCK_MMSG_MAX];
+	struct iovec iov[SOCK_MMSG_MAX];
+	int recv;
+	int batch;
+	int flags;
+	int n;
+	int i;
+
+	if (sock->type == TYPE_TCP)
+		return -LIBCOMMBUS_ERROR_NOT_SUPPORT;
+
+	recv = 0;
+	flags = MSG_WAITFORONE;
+	while (recv < count) {
+		batch = count - recv;
+		if (batch > SOCK_MMSG_MAX)
+			batch = SOCK_MMSG_MAX;
+
+		memset(hdr, 0, sizeof(struct mmsghdr) * batch);
+		for (i = 0; i < batch; i++) {
+			iov[i].iov_base = msgs[recv + i].data;
+			iov[i].iov_len = msgs[recv + i].len;
+			hdr[i].msg_hdr.msg_iov = &iov[i];
+			hdr[i].msg_hdr.msg_iovlen = 1;
+		}
+
+		n = recvmmsg(sock->fd, hdr, batch, flags, NULL);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			if (recv > 0)
+				break;
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				return -LIBCOMMBUS_ERROR_AGAIN;
+
+			perror("recvmmsg");
+			return -LIBCOMMBUS_ERROR_ACCESS;
+		}
+
+		for (i = 0; i < n; i++) {
+			msgs[recv + i].result = hdr[i].msg_len;
+			msgs[recv + i].flags = 0;
+			if (hdr[i].msg_hdr.msg_flags & MSG_TRUNC)
+				msgs[recv + i].flags |= SOCK_MSG_TRUNC;
+		}
+
+		recv += n;
+		if (n < batch)
+			break;
+
+		/* only wait for the first message, then drain what is queued */
+		flags = MSG_DONTWAIT;
+	}
+
+	return recv;
+}
+
+int socket_set_nonblock(struct sock_info_t *sock, int enable)
+{
+	int flags;
+
+	flags = fcntl(sock->fd, F_GETFL);
+	if (flags == -1) {
+		perror("fcntl");
+		return -LIBCOMMBUS_ERROR_ACCESS;
+	}
+
+	if (enable)
+		flags |= O_NONBLOCK;
+	else
+		flags &= ~O_NONBLOCK;
+
+	if (fcntl(sock->fd, F_SETFL, flags) == -1) {
+		perror("fcntl");
+		return -LIBCOMMBUS_ERROR_ACCESS;
+	}
+
+	return LIBCOMMBUS_SUCCESS;
+}
+
+/*
+ * Single read() on the socket. Returns the number of bytes read,
+ * -LIBCOMMBUS_ERROR_AGAIN when a non-blocking socket is drained and
+ * -LIBCOMMBUS_ERROR_EOF when the peer has closed the connection.
+ */
+int socket_recv(struct sock_info_t *sock, unsigned char *data, int len)
+{
+	int n;
+
+	do {
+		n = read(sock->fd, data, len);
+	} while (n < 0 && errno == EINTR);
+
+	if (n < 0) {
+		if (errno == EAGAIN || errno == EWOULDBLOCK)
+			return -LIBCOMMBUS_ERROR_AGAIN;
+
+		return -LIBCOMMBUS_ERROR_ACCESS;
+	}
+
+	if (n == 0 && len != 0)
+		return -LIBCOMMBUS_ERROR_EOF;
+
+	return n;
+}
+
+/*
+ * Single send() on the socket. Returns the number of bytes queued, which
+ * may be less than len, or -LIBCOMMBUS_ERROR_AGAIN when a non-blocking
+ * socket has no room in its send buffer.
+ */
+int socket_send(struct sock_info_t *sock, unsigned char *data, int len)
+{
+	int n;
+
+	do {
+		n = send(sock->fd, data, len, MSG_NOSIGNAL);
+	} while (n < 0 && errno == EINTR);
+
+	if (n < 0) {
+		if (errno == EAGAIN || errno == EWOULDBLOCK)
+			return -LIBCOMMBUS_ERROR_AGAIN;
+
+		if (errno == EPIPE || errno == ECONNRESET)
+			return -LIBCOMMBUS_ERROR_EOF;
+
+		return -LIBCOMMBUS_ERROR_ACCESS;
+	}
+
+	return n;
+}
+
+static int socket_wait(struct sock_info_t *sock, short events)
+{
+	struct pollfd pfd;
+
+	pfd.fd = sock->fd;
+	pfd.events = events;
+
+	if (poll(&pfd, 1, -1) < 0 && errno != EINTR) {
+		perror("poll");
+		return -LIBCOMMBUS_ERROR_ACCESS;
+	}
+
+	return LIBCOMMBUS_SUCCESS;
+}
+
+static size_t socket_iov_len(const struct iovec *iov, int iovcnt)
+{
+	size_t total = 0;
+	int i;
+
+	for (i = 0; i < iovcnt; i++)
+		total += iov[i].iov_len;
+
+	return total;
+}
+
+/*
+ * Gather write: all buffers go out with one sendmsg(), so a header and its
+ * payload share a syscall and usually a TCP segment without being copied
+ * together first. Partial writes are resumed and a non-blocking socket is
+ * waited on, so on a stream socket everything is queued on return. A
+ * datagram socket sends exactly one message. The caller's iov array is
+ * left untouched.
+ *
+ * Returns the number of bytes sent, -LIBCOMMBUS_ERROR_EOF when the peer
+ * has gone away or -LIBCOMMBUS_ERROR_ACCESS.
+ */
+int socket_writev(struct sock_info_t *sock, const struct iovec *iov, int iovcnt)
+{
+	struct iovec vec[SOCK_IOV_MAX];
+	struct iovec *cur;
+	struct msghdr msg;
+	size_t total;
+	size_t sent;
+	ssize_t n;
+	int ret;
+
+	if (iovcnt < 0 || iovcnt > SOCK_IOV_MAX)
+		return -LIBCOMMBUS_ERROR_NOT_SUPPORT;
+
+	memcpy(vec, iov, iovcnt * sizeof(struct iovec));
+	cur = vec;
+	total = socket_iov_len(vec, iovcnt);
+
+	for (sent = 0; sent < total || sent == 0; sent += n) {
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_iov = cur;
+		msg.msg_iovlen = iovcnt;
+
+		n = sendmsg(sock->fd, &msg, MSG_NOSIGNAL);
+		if (n < 0) {
+			if (errno == EINTR) {
+				n = 0;
+				continue;
+			}
+			if (errno == EAGAIN || errno == EWOULDBLOCK) {
+				ret = socket_wait(sock, POLLOUT);
+				if (ret != LIBCOMMBUS_SUCCESS)
+					return ret;
+				n = 0;
+				continue;
+			}
+			if (errno == EPIPE || errno == ECONNRESET)
+				return -LIBCOMMBUS_ERROR_EOF;
+
+			perror("sendmsg");
+			return -LIBCOMMBUS_ERROR_ACCESS;
+		}
+
+		if (sock->type != TYPE_TCP || total == 0)
+			return n;
+
+		commbus_iov_advance(&cur, &iovcnt, n);
+	}
+
+	return sent;
+}
+
+/*
+ * Scatter read: fill the buffers in order with as few recvmsg() calls as
+ * the data arrival allows, e.g. a fixed size header straight into its
+ * struct and the payload into its own buffer. On a stream socket it
+ * returns once every buffer is full or the peer closed; a datagram socket
+ * receives exactly one message. The caller's iov array is left untouched.
+ *
+ * Returns the number of bytes read, which is short only at end of stream,
+ * -LIBCOMMBUS_ERROR_EOF when the peer closed before anything arrived or
+ * -LIBCOMMBUS_ERROR_ACCESS.
+ */
+int socket_readv(struct sock_info_t *sock, const struct iovec *iov, int iovcnt)
+{
+	struct iovec vec[SOCK_IOV_MAX];
+	struct iovec *cur;
+	struct msghdr msg;
+	size_t total;
+	size_t recv;
+	ssize_t n;
+	int ret;
+
+	if (iovcnt < 0 || iovcnt > SOCK_IOV_MAX)
+		return -LIBCOMMBUS_ERROR_NOT_SUPPORT;
+
+	memcpy(vec, iov, iovcnt * sizeof(struct iovec));
+	cur = vec;
+	total = socket_iov_len(vec, iovcnt);
+
+	for (recv = 0; recv < total; recv += n) {
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_iov = cur;
+		msg.msg_iovlen = iovcnt;
+
+		n = recvmsg(sock->fd, &msg, 0);
+		if (n < 0) {
+			if (errno == EINTR) {
+				n = 0;
+				continue;
+			}
+			if (errno == EAGAIN || errno == EWOULDBLOCK) {
+				ret = socket_wait(sock, POLLIN);
+				if (ret != LIBCOMMBUS_SUCCESS)
+					return ret;
+				n = 0;
+				continue;
+			}
+
+			perror("recvmsg");
+			return -LIBCOMMBUS_ERROR_ACCESS;
+		}
+
+		if (sock->type != TYPE_TCP)
+			return n;
+
+		/* peer closed the connection, return what we have */
+		if (n == 0)
+			return recv ? (int)recv : -LIBCOMMBUS_ERROR_EOF;
+
+		commbus_iov_advance(&cur, &iovcnt, n);
+	}
+
+	return recv;
+}
+
 int socket_close(struct sock_info_t *sock)
 {
 	int ret;
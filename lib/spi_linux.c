@@ -23,27 +23,96 @@
 #include <string.h>
 #include <fcntl.h>
 #include <unistd.h>
+#include <pthread.h>
+#include <time.h>
 #include <sys/ioctl.h>
 #include <linux/spi/spidev.h>
 #include "commbus.h"
 #include "spi.h"
 
-static int spi_fd[SPI_BUS_MAX][SPI_CS_MAX];
+/* contexts behind the bus/cs API, bus n cs m is /dev/spidevn.m */
+static struct spi_ctx_t spi_ctx[SPI_BUS_MAX][SPI_CS_MAX];
 
-int spi_open(int bus, int cs, int mode, unsigned int speed)
+#define SPI_BUFSIZ_PATH		"/sys/module/spidev/parameters/bufsiz"
+#define SPI_BUFSIZ_DEFAULT	4096
+
+/*
+ * spidev charges each transfer against bufsiz at its length rounded up
+ * to ARCH_DMA_MINALIGN, which user space cannot query; 128 is the
+ * largest any architecture uses.
+ */
+#define SPI_XFER_ALIGN		128
+
+static unsigned int spi_bufsiz;
+static pthread_once_t spi_bufsiz_once = PTHREAD_ONCE_INIT;
+
+static void spi_read_bufsiz(void)
+{
+	FILE *fp;
+	unsigned int n;
+
+	spi_bufsiz = SPI_BUFSIZ_DEFAULT;
+
+	fp = fopen(SPI_BUFSIZ_PATH, "r");
+	if (fp == NULL)
+		return;
+	if (fscanf(fp, "%u", &n) == 1 && n > 0)
+		spi_bufsiz = n;
+	fclose(fp);
+}
+
+/*
+ * Most bytes spidev moves in each direction of one message, the bufsiz
+ * module parameter, read once. Longer transfers are split.
+ */
+unsigned int spi_get_bufsiz(void)
+{
+	pthread_once(&spi_bufsiz_once, spi_read_bufsiz);
+	return spi_bufsiz;
+}
+
+#define SPI_FLAG_ALL	(SPI_FLAG_3WIRE | SPI_FLAG_TX_DUAL | SPI_FLAG_TX_QUAD | \
+			 SPI_FLAG_RX_DUAL | SPI_FLAG_RX_QUAD)
+
+/* kernel mode bits for the SPI_FLAG_* in mode */
+static unsigned int spi_mode_bits(int mode)
+{
+	unsigned int bits = 0;
+
+	if (mode & SPI_FLAG_3WIRE)
+		bits |= SPI_3WIRE;
+	if (mode & SPI_FLAG_TX_DUAL)
+		bits |= SPI_TX_DUAL;
+	if (mode & SPI_FLAG_TX_QUAD)
+		bits |= SPI_TX_QUAD;
+	if (mode & SPI_FLAG_RX_DUAL)
+		bits |= SPI_RX_DUAL;
+	if (mode & SPI_FLAG_RX_QUAD)
+		bits |= SPI_RX_QUAD;
+
+	return bits;
+}
+
+/*
+ * Open the spidev node at path and configure mode and clock, which are
+ * kept in the context. mode is SPI_MODE0..3, optionally or'ed with
+ * SPI_FLAG_*; the mode the driver accepted is read back, because the
+ * SPI core silently drops dual/quad bits the controller cannot do.
+ * Transfers on one context are serialized, so it can be shared between
+ * threads.
+ */
+int spi_ctx_open(struct spi_ctx_t *ctx, const char *path, int mode, unsigned int speed)
 {
-	char path[16];
 	int ret;
 	unsigned char xfer_bits;
 	unsigned char xfer_mode;
+	unsigned int wanted;
+	unsigned int actual;
 
-	if (bus >= SPI_BUS_MAX || bus < 0)
-		return -LIBCOMMBUS_ERROR_NO_DEVICE;
+	if (mode & ~(SPI_FLAG_ALL | SPI_MODE3))
+		return -LIBCOMMBUS_ERROR_NOT_SUPPORT;
 
-	if (cs >= SPI_CS_MAX || cs < 0)
-		return -LIBCOMMBUS_ERROR_NO_DEVICE;
-
-	switch (mode) {
+	switch (mode & SPI_MODE3) {
 		case SPI_MODE0:
 			xfer_mode = SPI_MODE_0;
 			break;         
@@ -63,48 +132,206 @@ int spi_open(int bus, int cs, int mode, unsigned int speed)
 	/* Only support 8-bit data mode */
 	xfer_bits = 8;
 
-	sprintf(path, "/dev/spidev%d.%d", bus, cs);
-
-	spi_fd[bus][cs] = open(path, O_RDWR);
-	if (spi_fd[bus][cs] < 0) {
+	ctx->fd = open(path, O_RDWR);
+	if (ctx->fd < 0) {
 		perror("open");
 		return -LIBCOMMBUS_ERROR_ACCESS;
 	}
 
-	ret = ioctl(spi_fd[bus][cs], SPI_IOC_WR_MODE, &xfer_mode);
+	if (mode & SPI_FLAG_ALL) {
+		/* the lane flags do not fit the 8-bit mode ioctl */
+		wanted = xfer_mode | spi_mode_bits(mode);
+		ret = ioctl(ctx->fd, SPI_IOC_WR_MODE32, &wanted);
+		if (ret != 0) {
+			close(ctx->fd);
+			perror("ioctl SPI_IOC_WR_MODE32");
+			return -LIBCOMMBUS_ERROR_NOT_SUPPORT;
+		}
+
+		ret = ioctl(ctx->fd, SPI_IOC_RD_MODE32, &actual);
+		if (ret != 0 || (actual & wanted) != wanted) {
+			close(ctx->fd);
+			debug_print("spi: %s: controller does not support mode 0x%x (got 0x%x)\n",
+					path, wanted, actual);
+			return -LIBCOMMBUS_ERROR_NOT_SUPPORT;
+		}
+	} else {
+		ret = ioctl(ctx->fd, SPI_IOC_WR_MODE, &xfer_mode);
+		if (ret != 0) {
+			close(ctx->fd);
+			perror("ioctl");
+			return -LIBCOMMBUS_ERROR_ACCESS;
+		}
+	}
+
+	ret = ioctl(ctx->fd, SPI_IOC_WR_BITS_PER_WORD, &xfer_bits);
 	if (ret != 0) {
-		close(spi_fd[bus][cs]);
+		close(ctx->fd);
 		perror("ioctl");
 		return -LIBCOMMBUS_ERROR_ACCESS;
 	}
 
-	ret = ioctl(spi_fd[bus][cs], SPI_IOC_WR_BITS_PER_WORD, &xfer_bits);
+	ret = ioctl(ctx->fd, SPI_IOC_WR_MAX_SPEED_HZ, &speed);
 	if (ret != 0) {
-		close(spi_fd[bus][cs]);
+		close(ctx->fd);
 		perror("ioctl");
 		return -LIBCOMMBUS_ERROR_ACCESS;
 	}
 
-	ret = ioctl(spi_fd[bus][cs], SPI_IOC_WR_MAX_SPEED_HZ, &speed);
-	if (ret != 0) {
-		close(spi_fd[bus][cs]);
+	ctx->mode = mode;
+	ctx->bits = xfer_bits;
+	ctx->speed = speed;
+	memset(&ctx->stats, 0, sizeof(ctx->stats));
+
+	pthread_mutex_init(&ctx->lock, NULL);
+
+	return LIBCOMMBUS_SUCCESS;
+}
+
+/*
+ * Send one message. Unless it is the last of a split transfer, its last
+ * transfer's cs_change is flipped: there it means "keep chip select
+ * asserted after the message", so a segment that wanted to keep it gets
+ * that across the message boundary, and one that wanted it released
+ * gets it released. The caller holds ctx->lock.
+ */
+static int spi_ctx_message(struct spi_ctx_t *ctx, struct spi_ioc_transfer *msg, int count, int last)
+{
+	struct timespec start;
+	struct timespec end;
+	int ret;
+
+	if (!last)
+		msg[count - 1].cs_change = !msg[count - 1].cs_change;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	ret = ioctl(ctx->fd, SPI_IOC_MESSAGE(count), msg);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	if (ret < 0) {
 		perror("ioctl");
 		return -LIBCOMMBUS_ERROR_ACCESS;
 	}
 
-	return LIBCOMMBUS_SUCCESS;
+	ctx->stats.messages++;
+	ctx->stats.bytes += ret;
+	ctx->stats.busy_ns += (end.tv_sec - start.tv_sec) * 1000000000ULL + end.tv_nsec - start.tv_nsec;
+
+	return ret;
 }
 
-int spi_xfer(int bus, int cs, unsigned char *tx, unsigned char *rx, int len)
+/* bytes per word, splits must not cut a word in half */
+static unsigned int spi_word_bytes(unsigned int bits)
 {
+	if (bits <= 8)
+		return 1;
+	if (bits <= 16)
+		return 2;
+	return 4;
+}
+
+/* what a transfer of len bytes counts against bufsiz */
+static unsigned int spi_xfer_charge(unsigned int len, unsigned int align)
+{
+	return (len + align - 1) / align * align;
+}
+
+/*
+ * Submit transfers, packed into as few messages as spidev's bufsiz
+ * allows; a transfer longer than that is cut into pieces without chip
+ * select changes between them. Returns the bytes transferred. The caller
+ * holds ctx->lock.
+ */
+static int spi_ctx_submit(struct spi_ctx_t *ctx, struct spi_ioc_transfer *xfer, int n)
+{
+	struct spi_ioc_transfer msg[SPI_SEG_MAX];
+	struct spi_ioc_transfer piece;
+	unsigned int bufsiz = spi_get_bufsiz();
+	unsigned int tx_total = 0;
+	unsigned int rx_total = 0;
+	unsigned int align;
+	unsigned int room;
+	unsigned int take;
+	unsigned int word;
+	int count = 0;
+	int total = 0;
 	int ret;
-	struct spi_ioc_transfer xfer;
+	int i;
 
-	if (bus >= SPI_BUS_MAX || bus < 0)
-		return -LIBCOMMBUS_ERROR_NO_DEVICE;
+	ctx->stats.calls++;
 
-	if (cs >= SPI_CS_MAX || cs < 0)
-		return -LIBCOMMBUS_ERROR_NO_DEVICE;
+	/* a bufsiz this small only works where the alignment is smaller too */
+	align = bufsiz < SPI_XFER_ALIGN ? 1 : SPI_XFER_ALIGN;
+
+	for (i = 0; i < n; i++) {
+		piece = xfer[i];
+		word = spi_word_bytes(piece.bits_per_word ? piece.bits_per_word : ctx->bits);
+
+		while (1) {
+			room = bufsiz;
+			if (piece.tx_buf)
+				room -= tx_total;
+			if (piece.rx_buf && bufsiz - rx_total < room)
+				room = bufsiz - rx_total;
+			room -= room % align;
+			room -= room % word;
+
+			if ((room == 0 && piece.len > 0) || count == SPI_SEG_MAX) {
+				ret = spi_ctx_message(ctx, msg, count, 0);
+				if (ret < 0)
+					return ret;
+				total += ret;
+				count = 0;
+				tx_total = 0;
+				rx_total = 0;
+				continue;
+			}
+
+			take = piece.len < room ? piece.len : room;
+			msg[count] = piece;
+			msg[count].len = take;
+			if (take < piece.len) {
+				/* the rest follows right away */
+				msg[count].cs_change = 0;
+				msg[count].delay_usecs = 0;
+			}
+			count++;
+			if (piece.tx_buf)
+				tx_total += spi_xfer_charge(take, align);
+			if (piece.rx_buf)
+				rx_total += spi_xfer_charge(take, align);
+
+			if (take == piece.len)
+				break;
+
+			piece.len -= take;
+			if (piece.tx_buf)
+				piece.tx_buf += take;
+			if (piece.rx_buf)
+				piece.rx_buf += take;
+		}
+	}
+
+	ret = spi_ctx_message(ctx, msg, count, 1);
+	if (ret < 0)
+		return ret;
+
+	return total + ret;
+}
+
+/*
+ * Full duplex transfer of len bytes. Lengths above spidev's bufsiz are
+ * split into several messages with chip select held in between. On a
+ * 3-wire bus only one of tx and rx may be given, as for segments.
+ */
+int spi_ctx_xfer(struct spi_ctx_t *ctx, unsigned char *tx, unsigned char *rx, int len)
+{
+	int ret;
+	struct spi_ioc_transfer xfer;
+
+	/* shared data lines carry one direction at a time */
+	if (tx && rx && (ctx->mode & SPI_FLAG_3WIRE))
+		return -LIBCOMMBUS_ERROR_NOT_SUPPORT;
 
 	memset((void *)&xfer, 0, sizeof(xfer));
 
@@ -112,26 +339,98 @@ int spi_xfer(int bus, int cs, unsigned char *tx, unsigned char *rx, int len)
 	xfer.rx_buf = (unsigned long)rx;
 	xfer.len = len;
 
-	ret = ioctl(spi_fd[bus][cs], SPI_IOC_MESSAGE(1), &xfer);
-	if (ret < 0) {
-		perror("ioctl");
-		return -LIBCOMMBUS_ERROR_ACCESS;
+	pthread_mutex_lock(&ctx->lock);
+	ret = spi_ctx_submit(ctx, &xfer, 1);
+	pthread_mutex_unlock(&ctx->lock);
+
+	return ret;
+}
+
+/* data lines a segment may use in one direction, given the open flags */
+static int spi_seg_lanes_ok(int mode, int nbits, int dual, int quad)
+{
+	switch (nbits) {
+		case 0:
+		case 1:
+			return 1;
+		case 2:
+			return (mode & (dual | quad)) != 0;
+		case 4:
+			return (mode & quad) != 0;
+		default:
+			return 0;
+	}
+}
+
+/*
+ * Run segments back to back as one SPI message, a single ioctl with chip
+ * select held across them, e.g. a command followed by the read of its
+ * answer. Segments beyond spidev's bufsiz go into further messages, chip
+ * select still held. Returns the total number of bytes transferred, or
+ * -LIBCOMMBUS_ERROR_NOT_SUPPORT for a segment asking for data lines the
+ * device was not opened with.
+ */
+int spi_ctx_xfer_multi(struct spi_ctx_t *ctx, struct spi_seg_t *segs, int nsegs)
+{
+	struct spi_ioc_transfer xfer[SPI_SEG_MAX];
+	int ret;
+	int i;
+
+	if (nsegs < 1 || nsegs > SPI_SEG_MAX)
+		return -LIBCOMMBUS_ERROR_NOT_SUPPORT;
+
+	memset((void *)xfer, 0, sizeof(xfer[0]) * nsegs);
+
+	for (i = 0; i < nsegs; i++) {
+		if (!spi_seg_lanes_ok(ctx->mode, segs[i].tx_nbits, SPI_FLAG_TX_DUAL, SPI_FLAG_TX_QUAD) ||
+		    !spi_seg_lanes_ok(ctx->mode, segs[i].rx_nbits, SPI_FLAG_RX_DUAL, SPI_FLAG_RX_QUAD))
+			return -LIBCOMMBUS_ERROR_NOT_SUPPORT;
+
+		/* shared data lines carry one direction at a time */
+		if (segs[i].tx && segs[i].rx &&
+		    ((ctx->mode & SPI_FLAG_3WIRE) || segs[i].tx_nbits > 1 || segs[i].rx_nbits > 1))
+			return -LIBCOMMBUS_ERROR_NOT_SUPPORT;
+
+		xfer[i].tx_buf = (unsigned long)segs[i].tx;
+		xfer[i].rx_buf = (unsigned long)segs[i].rx;
+		xfer[i].len = segs[i].len;
+		xfer[i].speed_hz = segs[i].speed;
+		xfer[i].bits_per_word = segs[i].bits;
+		xfer[i].tx_nbits = segs[i].tx_nbits;
+		xfer[i].rx_nbits = segs[i].rx_nbits;
+		xfer[i].delay_usecs = segs[i].delay_us;
+		xfer[i].cs_change = segs[i].cs_change ? 1 : 0;
 	}
 
+	pthread_mutex_lock(&ctx->lock);
+	ret = spi_ctx_submit(ctx, xfer, nsegs);
+	pthread_mutex_unlock(&ctx->lock);
+
 	return ret;
 }
 
-int spi_close(int bus, int cs)
+int spi_ctx_get_stats(struct spi_ctx_t *ctx, struct spi_stats_t *stats)
+{
+	pthread_mutex_lock(&ctx->lock);
+	*stats = ctx->stats;
+	pthread_mutex_unlock(&ctx->lock);
+
+	if (stats->busy_ns)
+		stats->bytes_per_sec = (double)stats->bytes * 1e9 / stats->busy_ns;
+
+	return LIBCOMMBUS_SUCCESS;
+}
+
+/* no other thread may still be using the context */
+int spi_ctx_close(struct spi_ctx_t *ctx)
 {
 	int ret;
 
-	if (bus >= SPI_BUS_MAX || bus < 0)
-		return -LIBCOMMBUS_ERROR_NO_DEVICE;
+	ret = close(ctx->fd);
+	ctx->fd = -1;
 
-	if (cs >= SPI_CS_MAX || cs < 0)
-		return -LIBCOMMBUS_ERROR_NO_DEVICE;
+	pthread_mutex_destroy(&ctx->lock);
 
-	ret = close(spi_fd[bus][cs]);
 	if (ret != 0) {
 		perror("close");
 		return -LIBCOMMBUS_ERROR_ACCESS;
@@ -139,3 +438,51 @@ int spi_close(int bus, int cs)
 
 	return LIBCOMMBUS_SUCCESS;
 }
+
+int spi_open(int bus, int cs, int mode, unsigned int speed)
+{
+	char path[32];
+
+	if (bus >= SPI_BUS_MAX || bus < 0)
+		return -LIBCOMMBUS_ERROR_NO_DEVICE;
+
+	if (cs >= SPI_CS_MAX || cs < 0)
+		return -LIBCOMMBUS_ERROR_NO_DEVICE;
+
+	sprintf(path, "/dev/spidev%d.%d", bus, cs);
+
+	return spi_ctx_open(&spi_ctx[bus][cs], path, mode, speed);
+}
+
+int spi_xfer(int bus, int cs, unsigned char *tx, unsigned char *rx, int len)
+{
+	if (bus >= SPI_BUS_MAX || bus < 0)
+		return -LIBCOMMBUS_ERROR_NO_DEVICE;
+
+	if (cs >= SPI_CS_MAX || cs < 0)
+		return -LIBCOMMBUS_ERROR_NO_DEVICE;
+
+	return spi_ctx_xfer(&spi_ctx[bus][cs], tx, rx, len);
+}
+
+int spi_xfer_multi(int bus, int cs, struct spi_seg_t *segs, int nsegs)
+{
+	if (bus >= SPI_BUS_MAX || bus < 0)
+		return -LIBCOMMBUS_ERROR_NO_DEVICE;
+
+	if (cs >= SPI_CS_MAX || cs < 0)
+		return -LIBCOMMBUS_ERROR_NO_DEVICE;
+
+	return spi_ctx_xfer_multi(&spi_ctx[bus][cs], segs, nsegs);
+}
+
+int spi_close(int bus, int cs)
+{
+	if (bus >= SPI_BUS_MAX || bus < 0)
+		return -LIBCOMMBUS_ERROR_NO_DEVICE;
+
+	if (cs >= SPI_CS_MAX || cs < 0)
+		return -LIBCOMMBUS_ERROR_NO_DEVICE;
+
+	return spi_ctx_close(&spi_ctx[bus][cs]);
+}
@@ -0,0 +1,451 @@
+/***************************************************************************
+ *   Copyright (C) 2015 by Tse-Lun Bien                                    *
+ *   allanbian@gmail.com                                                   *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "commbus.h"
+#include "spi.h"
+#include "spi_mem.h"
+
+/* status register write-in-progress bit */
+#define SPI_MEM_SR_WIP		0x01
+/* opcode, up to 4 address bytes and a dummy byte */
+#define SPI_MEM_CMD_MAX		6
+/* erases take milliseconds, do not spin on the bus meanwhile */
+#define SPI_MEM_ERASE_POLL_US	1000
+
+const struct spi_mem_chip_t spi_mem_chips[] = {
+	/* FRAM: no pages, no erase, writes complete at bus speed */
+	{"FM25V20", {0x7f, 0x7f, 0x7f, 0x7f, 0x7f, 0x7f, 0xc2, 0x25, 0x00}, 9, 256 * 1024, 0, 0, 3,
+		0x9f, 0x06, 0x05, 0x0b, 1, 0x02, 0x00, 0, 0, 0},
+	{"MB85RS2MT", {0x04, 0x7f, 0x28, 0x03}, 4, 256 * 1024, 0, 0, 3,
+		0x9f, 0x06, 0x05, 0x0b, 1, 0x02, 0x00, 0, 0, 0},
+	{"FM25V02A", {0x7f, 0x7f, 0x7f, 0x7f, 0x7f, 0x7f, 0xc2, 0x22, 0x08}, 9, 32 * 1024, 0, 0, 2,
+		0x9f, 0x06, 0x05, 0x0b, 1, 0x02, 0x00, 0, 0, 0},
+	{"MB85RS256B", {0x04, 0x7f, 0x05, 0x09}, 4, 32 * 1024, 0, 0, 2,
+		0x9f, 0x06, 0x05, 0x0b, 1, 0x02, 0x00, 0, 0, 0},
+	/* NOR flash: 256 byte pages, 4K sector erase */
+	{"W25Q32", {0xef, 0x40, 0x16}, 3, 4 * 1024 * 1024, 256, 4096, 3,
+		0x9f, 0x06, 0x05, 0x0b, 1, 0x02, 0x20, SPI_MEM_POLL, 5, 500},
+	{"W25Q128", {0xef, 0x40, 0x18}, 3, 16 * 1024 * 1024, 256, 4096, 3,
+		0x9f, 0x06, 0x05, 0x0b, 1, 0x02, 0x20, SPI_MEM_POLL, 5, 500},
+	{"MX25L3233F", {0xc2, 0x20, 0x16}, 3, 4 * 1024 * 1024, 256, 4096, 3,
+		0x9f, 0x06, 0x05, 0x0b, 1, 0x02, 0x20, SPI_MEM_POLL, 5, 500},
+	{"GD25Q32", {0xc8, 0x40, 0x16}, 3, 4 * 1024 * 1024, 256, 4096, 3,
+		0x9f, 0x06, 0x05, 0x0b, 1, 0x02, 0x20, SPI_MEM_POLL, 5, 500},
+	{ }
+};
+
+static int spi_mem_ctx_xfer(void *priv, struct spi_seg_t *segs, int nsegs)
+{
+	return spi_ctx_xfer_multi((struct spi_ctx_t *)priv, segs, nsegs);
+}
+
+const struct spi_mem_ops_t spi_mem_ctx_ops = {
+	spi_mem_ctx_xfer
+};
+
+static int spi_mem_xfer(struct spi_mem_t *mem, struct spi_seg_t *segs, int nsegs)
+{
+	int ret;
+
+	mem->stats.xfers++;
+	ret = mem->ops->xfer(mem->priv, segs, nsegs);
+
+	return ret < 0 ? ret : LIBCOMMBUS_SUCCESS;
+}
+
+/* opcode and big-endian address, plus the dummy byte of fast reads */
+static int spi_mem_cmd(const struct spi_mem_chip_t *chip, unsigned char *cmd, unsigned char op,
+		unsigned int addr, int dummy)
+{
+	int len = 0;
+	int i;
+
+	cmd[len++] = op;
+	for (i = chip->addr_bytes - 1; i >= 0; i--)
+		cmd[len++] = addr >> (8 * i);
+	while (dummy-- > 0)
+		cmd[len++] = 0;
+
+	return len;
+}
+
+static unsigned long long spi_mem_now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000ULL + ts.tv_nsec / 1000000;
+}
+
+/* wait for the end of a program or erase */
+static int spi_mem_wait(struct spi_mem_t *mem, unsigned int timeout_ms, unsigned int interval_us)
+{
+	struct spi_seg_t segs[2];
+	unsigned char op = mem->chip->rdsr;
+	unsigned char sr;
+	unsigned long long end = spi_mem_now_ms() + timeout_ms;
+	int ret;
+
+	if (!(mem->chip->flags & SPI_MEM_POLL))
+		return LIBCOMMBUS_SUCCESS;
+
+	memset(segs, 0, sizeof(segs));
+	segs[0].tx = &op;
+	segs[0].len = 1;
+	segs[1].rx = &sr;
+	segs[1].len = 1;
+
+	while (1) {
+		mem->stats.polls++;
+		ret = spi_mem_xfer(mem, segs, 2);
+		if (ret != LIBCOMMBUS_SUCCESS)
+			return ret;
+		if (!(sr & SPI_MEM_SR_WIP))
+			return LIBCOMMBUS_SUCCESS;
+
+		if (spi_mem_now_ms() > end) {
+			debug_print("spi_mem: %s still busy after %u ms\n", mem->chip->name, timeout_ms);
+			return -LIBCOMMBUS_ERROR_AGAIN;
+		}
+		if (interval_us)
+			usleep(interval_us);
+	}
+}
+
+/*
+ * WREN, then the command with its data, as one transaction: chip select
+ * is pulsed between the two, which is all the latch needs.
+ */
+static int spi_mem_wren_cmd(struct spi_mem_t *mem, unsigned char op, unsigned int addr,
+		const unsigned char *data, unsigned int len)
+{
+	struct spi_seg_t segs[3];
+	unsigned char wren = mem->chip->wren;
+	unsigned char cmd[SPI_MEM_CMD_MAX];
+
+	memset(segs, 0, sizeof(segs));
+	segs[0].tx = &wren;
+	segs[0].len = 1;
+	segs[0].cs_change = 1;
+	segs[1].tx = cmd;
+	segs[1].len = spi_mem_cmd(mem->chip, cmd, op, addr, 0);
+	segs[2].tx = (unsigned char *)data;
+	segs[2].len = len;
+
+	return spi_mem_xfer(mem, segs, len ? 3 : 2);
+}
+
+static int spi_mem_read_raw(struct spi_mem_t *mem, unsigned int addr, unsigned char *buf, unsigned int len)
+{
+	struct spi_seg_t segs[2];
+	unsigned char cmd[SPI_MEM_CMD_MAX];
+
+	memset(segs, 0, sizeof(segs));
+	segs[0].tx = cmd;
+	segs[0].len = spi_mem_cmd(mem->chip, cmd, mem->chip->read, addr, mem->chip->read_dummy);
+	segs[1].rx = buf;
+	segs[1].len = len;
+
+	return spi_mem_xfer(mem, segs, 2);
+}
+
+/* keep the cached copy in line with what the chip now holds */
+static void spi_mem_cache_update(struct spi_mem_t *mem, unsigned int addr, const unsigned char *data,
+		unsigned int len, int erase)
+{
+	unsigned int start;
+	unsigned int end;
+	unsigned int i;
+
+	start = addr > mem->cache_addr ? addr : mem->cache_addr;
+	end = addr + len < mem->cache_addr + mem->cache_len ? addr + len : mem->cache_addr + mem->cache_len;
+
+	for (i = start; i < end; i++) {
+		if (erase)
+			mem->cache[i - mem->cache_addr] = 0xff;
+		else if (mem->chip->erase_size)
+			/* programming NOR flash only clears bits */
+			mem->cache[i - mem->cache_addr] &= data[i - addr];
+		else
+			mem->cache[i - mem->cache_addr] = data[i - addr];
+	}
+}
+
+static int spi_mem_overlaps(unsigned int a, unsigned int a_len, unsigned int b, unsigned int b_len)
+{
+	return a < b + b_len && b < a + a_len;
+}
+
+/*
+ * Identify the chip by its JEDEC ID and set up the cache (cache_size 0
+ * picks SPI_MEM_CACHE_DEFAULT) and the write buffer. Returns
+ * -LIBCOMMBUS_ERROR_NO_DEVICE when the ID matches no table entry.
+ */
+int spi_mem_open(struct spi_mem_t *mem, const struct spi_mem_ops_t *ops, void *priv,
+		unsigned int cache_size)
+{
+	const struct spi_mem_chip_t *chip;
+	struct spi_seg_t segs[2];
+	unsigned char id[SPI_MEM_ID_MAX];
+	int op = -1;
+	int ret;
+
+	memset(mem, 0, sizeof(*mem));
+	mem->ops = ops;
+	mem->priv = priv;
+
+	memset(segs, 0, sizeof(segs));
+	for (chip = spi_mem_chips; chip->name; chip++) {
+		/* one ID read per distinct opcode */
+		if (chip->rdid != op) {
+			op = chip->rdid;
+			segs[0].tx = (unsigned char *)&chip->rdid;
+			segs[0].len = 1;
+			segs[1].rx = id;
+			segs[1].len = SPI_MEM_ID_MAX;
+
+			ret = spi_mem_xfer(mem, segs, 2);
+			if (ret != LIBCOMMBUS_SUCCESS)
+				return ret;
+		}
+
+		if (memcmp(id, chip->id, chip->id_len) == 0)
+			break;
+	}
+
+	if (chip->name == NULL)
+		return -LIBCOMMBUS_ERROR_NO_DEVICE;
+
+	mem->chip = chip;
+	mem->cache_size = cache_size ? cache_size : SPI_MEM_CACHE_DEFAULT;
+	if (mem->cache_size > chip->size)
+		mem->cache_size = chip->size;
+	mem->wbuf_size = chip->page_size ? chip->page_size : SPI_MEM_FRAM_CHUNK;
+
+	mem->cache = (unsigned char *)malloc(mem->cache_size);
+	mem->wbuf = (unsigned char *)malloc(mem->wbuf_size);
+	if (mem->cache == NULL || mem->wbuf == NULL) {
+		free(mem->cache);
+		free(mem->wbuf);
+		return -LIBCOMMBUS_ERROR_MALLOC;
+	}
+
+	return LIBCOMMBUS_SUCCESS;
+}
+
+/* program the collected writes */
+int spi_mem_flush(struct spi_mem_t *mem)
+{
+	int ret;
+
+	if (mem->wbuf_len == 0)
+		return LIBCOMMBUS_SUCCESS;
+
+	mem->stats.programs++;
+	ret = spi_mem_wren_cmd(mem, mem->chip->write, mem->wbuf_addr, mem->wbuf, mem->wbuf_len);
+	if (ret == LIBCOMMBUS_SUCCESS)
+		ret = spi_mem_wait(mem, mem->chip->write_ms, 0);
+
+	mem->wbuf_len = 0;
+
+	return ret;
+}
+
+/*
+ * Read len bytes at addr. Reads that fit the cache are served from it,
+ * a miss reads a whole cache line starting at addr; larger reads go to
+ * the chip directly.
+ */
+int spi_mem_read(struct spi_mem_t *mem, unsigned int addr, unsigned char *buf, unsigned int len)
+{
+	unsigned int line;
+	int ret;
+
+	if (addr > mem->chip->size || len > mem->chip->size - addr)
+		return -LIBCOMMBUS_ERROR_NOT_SUPPORT;
+
+	mem->stats.reads++;
+
+	if (mem->wbuf_len && spi_mem_overlaps(addr, len, mem->wbuf_addr, mem->wbuf_len)) {
+		ret = spi_mem_flush(mem);
+		if (ret != LIBCOMMBUS_SUCCESS)
+			return ret;
+	}
+
+	if (addr >= mem->cache_addr && addr + len <= mem->cache_addr + mem->cache_len) {
+		mem->stats.cache_hits++;
+		memcpy(buf, &mem->cache[addr - mem->cache_addr], len);
+		return LIBCOMMBUS_SUCCESS;
+	}
+
+	if (len >= mem->cache_size)
+		return spi_mem_read_raw(mem, addr, buf, len);
+
+	line = mem->cache_size;
+	if (line > mem->chip->size - addr)
+		line = mem->chip->size - addr;
+
+	/* the pending page may sit inside the line */
+	if (mem->wbuf_len && spi_mem_overlaps(addr, line, mem->wbuf_addr, mem->wbuf_len)) {
+		ret = spi_mem_flush(mem);
+		if (ret != LIBCOMMBUS_SUCCESS)
+			return ret;
+	}
+
+	mem->cache_len = 0;
+	ret = spi_mem_read_raw(mem, addr, mem->cache, line);
+	if (ret != LIBCOMMBUS_SUCCESS)
+		return ret;
+	mem->cache_addr = addr;
+	mem->cache_len = line;
+
+	memcpy(buf, mem->cache, len);
+
+	return LIBCOMMBUS_SUCCESS;
+}
+
+/*
+ * Write len bytes at addr. Contiguous writes are collected into one
+ * program command per page; NOR flash must have been erased first.
+ */
+int spi_mem_write(struct spi_mem_t *mem, unsigned int addr, const unsigned char *buf, unsigned int len)
+{
+	unsigned int page_end;
+	unsigned int chunk;
+	int ret;
+
+	if (addr > mem->chip->size || len > mem->chip->size - addr)
+		return -LIBCOMMBUS_ERROR_NOT_SUPPORT;
+
+	mem->stats.writes++;
+	spi_mem_cache_update(mem, addr, buf, len, 0);
+
+	while (len > 0) {
+		if (mem->wbuf_len) {
+			page_end = mem->wbuf_addr - mem->wbuf_addr % mem->wbuf_size + mem->wbuf_size;
+			if (addr != mem->wbuf_addr + mem->wbuf_len || addr >= page_end) {
+				ret = spi_mem_flush(mem);
+				if (ret != LIBCOMMBUS_SUCCESS)
+					return ret;
+			}
+		}
+		if (mem->wbuf_len == 0)
+			mem->wbuf_addr = addr;
+
+		page_end = addr - addr % mem->wbuf_size + mem->wbuf_size;
+		chunk = page_end - addr < len ? page_end - addr : len;
+
+		memcpy(&mem->wbuf[mem->wbuf_len], buf, chunk);
+		mem->wbuf_len += chunk;
+		addr += chunk;
+		buf += chunk;
+		len -= chunk;
+
+		if (addr == page_end) {
+			ret = spi_mem_flush(mem);
+			if (ret != LIBCOMMBUS_SUCCESS)
+				return ret;
+		}
+	}
+
+	return LIBCOMMBUS_SUCCESS;
+}
+
+/*
+ * Erase to 0xff. On flash addr and len must be multiples of the erase
+ * size; FRAM has no erase and is written with 0xff instead.
+ */
+int spi_mem_erase(struct spi_mem_t *mem, unsigned int addr, unsigned int len)
+{
+	const struct spi_mem_chip_t *chip = mem->chip;
+	unsigned char ff[256];
+	unsigned int chunk;
+	int ret;
+
+	if (addr > chip->size || len > chip->size - addr)
+		return -LIBCOMMBUS_ERROR_NOT_SUPPORT;
+
+	if (chip->erase_size == 0) {
+		memset(ff, 0xff, sizeof(ff));
+		while (len > 0) {
+			chunk = len < sizeof(ff) ? len : sizeof(ff);
+			ret = spi_mem_write(mem, addr, ff, chunk);
+			if (ret != LIBCOMMBUS_SUCCESS)
+				return ret;
+			addr += chunk;
+			len -= chunk;
+		}
+		return spi_mem_flush(mem);
+	}
+
+	if (addr % chip->erase_size || len % chip->erase_size)
+		return -LIBCOMMBUS_ERROR_NOT_SUPPORT;
+
+	/* pending data in the range would be programmed after the erase */
+	if (mem->wbuf_len && spi_mem_overlaps(addr, len, mem->wbuf_addr, mem->wbuf_len)) {
+		ret = spi_mem_flush(mem);
+		if (ret != LIBCOMMBUS_SUCCESS)
+			return ret;
+	}
+
+	spi_mem_cache_update(mem, addr, NULL, len, 1);
+
+	for (; len > 0; addr += chip->erase_size, len -= chip->erase_size) {
+		mem->stats.erases++;
+		ret = spi_mem_wren_cmd(mem, chip->erase, addr, NULL, 0);
+		if (ret == LIBCOMMBUS_SUCCESS)
+			ret = spi_mem_wait(mem, chip->erase_ms, SPI_MEM_ERASE_POLL_US);
+		if (ret != LIBCOMMBUS_SUCCESS) {
+			/* the cache no longer knows what the chip holds */
+			mem->cache_len = 0;
+			return ret;
+		}
+	}
+
+	return LIBCOMMBUS_SUCCESS;
+}
+
+int spi_mem_get_stats(struct spi_mem_t *mem, struct spi_mem_stats_t *stats)
+{
+	*stats = mem->stats;
+
+	return LIBCOMMBUS_SUCCESS;
+}
+
+/* flushes pending writes, the SPI device itself stays open */
+int spi_mem_close(struct spi_mem_t *mem)
+{
+	int ret;
+
+	ret = spi_mem_flush(mem);
+
+	free(mem->cache);
+	free(mem->wbuf);
+	mem->cache = NULL;
+	mem->wbuf = NULL;
+	mem->chip = NULL;
+
+	return ret;
+}
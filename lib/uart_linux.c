@@ -18,29 +18,125 @@
  *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
  ***************************************************************************/
 
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <string.h>
+#include <errno.h>
+#include <poll.h>
 #include <termios.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/ioctl.h>
+#include <sys/uio.h>
+#include <linux/serial.h>
 #include "commbus.h"
 #include "uart.h"
 
-static int uart_fd[COM_MAX];
+/*
+ * Rates outside the Bxxx table are set with termios2 and BOTHER, which
+ * glibc does not expose. TCGETS2 comes from the kernel's ioctl numbers
+ * and only exists on architectures that have struct termios2.
+ */
+#ifdef TCGETS2
+#define UART_HAVE_TERMIOS2
+
+#if defined(__mips__)
+#define UART_KERNEL_NCCS	23
+#elif defined(__sparc__)
+#define UART_KERNEL_NCCS	17
+#else
+#define UART_KERNEL_NCCS	19
+#endif
+
+#ifndef BOTHER
+#define BOTHER	0010000
+#endif
+
+#ifndef IBSHIFT
+#define IBSHIFT	16
+#endif
+
+struct termios2 {
+	tcflag_t c_iflag;
+	tcflag_t c_oflag;
+	tcflag_t c_cflag;
+	tcflag_t c_lflag;
+	cc_t c_line;
+	cc_t c_cc[UART_KERNEL_NCCS];
+	speed_t c_ispeed;
+	speed_t c_ospeed;
+};
+#endif
+
+/* contexts behind the COMn API, COMn is /dev/ttySn; fd is -1 while closed */
+static struct uart_ctx_t uart_ctx[COM_MAX] = {
+	[0 ... COM_MAX - 1] = { .fd = -1 }
+};
+
+#ifdef UART_HAVE_TERMIOS2
+/* program an arbitrary rate, the other line settings stay as they are */
+static int uart_set_custom_baud(int fd, int baudrate)
+{
+	struct termios2 tio;
 
-int uart_open(int com, int baudrate, int parity, int databits, int stopbits)
+	if (ioctl(fd, TCGETS2, &tio) != 0) {
+		perror("ioctl");
+		return -LIBCOMMBUS_ERROR_ACCESS;
+	}
+
+	tio.c_cflag &= ~(CBAUD | (CBAUD << IBSHIFT));
+	tio.c_cflag |= BOTHER | (BOTHER << IBSHIFT);
+	tio.c_ispeed = baudrate;
+	tio.c_ospeed = baudrate;
+
+	if (ioctl(fd, TCSETS2, &tio) != 0) {
+		perror("ioctl");
+		return -LIBCOMMBUS_ERROR_NOT_SUPPORT;
+	}
+
+	return LIBCOMMBUS_SUCCESS;
+}
+#endif
+
+/*
+ * Rate the driver actually programmed, which for a custom rate is the
+ * nearest its divisor can produce. Falls back to the requested rate when
+ * the kernel cannot report it.
+ */
+static unsigned int uart_get_actual_baud(int fd, int baudrate)
+{
+#ifdef UART_HAVE_TERMIOS2
+	struct termios2 tio;
+
+	if (ioctl(fd, TCGETS2, &tio) == 0 && tio.c_ospeed != 0)
+		return tio.c_ospeed;
+#endif
+
+	return baudrate;
+}
+
+/*
+ * Open the serial port at path (any tty, e.g. /dev/ttyUSB42) and apply
+ * the line settings, which are kept in the context. Rates outside the
+ * standard table (e.g. 2000000 or 3686400) are set with termios2/BOTHER
+ * where the kernel supports it; uart_ctx_get_baudrate() returns the rate
+ * the driver actually achieved. Reads and writes on
+ * one context may be issued from different threads: a reader and a writer
+ * run concurrently, concurrent readers (or writers) are serialized.
+ */
+int uart_ctx_open(struct uart_ctx_t *ctx, const char *path, int baudrate, int parity,
+		int databits, int stopbits)
 {
 	struct termios setting;
-	char path[32];
+	int custom = 0;
 	int ret;
 	int br;
 	int par;
 	int dbits;
 	int sbits;
 
-	if (com >= COM_MAX || com < 0)
-		return -LIBCOMMBUS_ERROR_NO_DEVICE;
-
 	switch (baudrate) {
 		case 50:
 			br = B50;
@@ -112,7 +208,17 @@ int uart_open(int com, int baudrate, int parity, int databits, int stopbits)
 			br = B1000000;
 			break;
 		default: 
+#ifdef UART_HAVE_TERMIOS2
+			if (baudrate <= 0)
+				return -LIBCOMMBUS_ERROR_NOT_SUPPORT;
+
+			/* placeholder, replaced by the custom rate below */
+			br = B38400;
+			custom = 1;
+			break;
+#else
 			return -LIBCOMMBUS_ERROR_NOT_SUPPORT;
+#endif
 	}
 
 	switch (parity) {
@@ -154,10 +260,8 @@ int uart_open(int com, int baudrate, int parity, int databits, int stopbits)
 			return -LIBCOMMBUS_ERROR_NOT_SUPPORT;
 	}
 
-	sprintf(path, "/dev/ttyS%d", com);
-
-	uart_fd[com] = open(path, O_RDWR | O_NOCTTY);
-	if (uart_fd[com] == -1) {
+	ctx->fd = open(path, O_RDWR | O_NOCTTY);
+	if (ctx->fd == -1) {
 		perror("open");
 		return -LIBCOMMBUS_ERROR_ACCESS;
 	}
@@ -173,75 +277,163 @@ int uart_open(int com, int baudrate, int parity, int databits, int stopbits)
 	setting.c_cc[VMIN] = 1;
 	setting.c_cc[VTIME] = 0;
 
-	ret = tcflush(uart_fd[com], TCIOFLUSH);
+	ret = tcflush(ctx->fd, TCIOFLUSH);
 
-	ret = tcsetattr(uart_fd[com], TCSANOW, &setting);
+	ret = tcsetattr(ctx->fd, TCSANOW, &setting);
 	if (ret != 0) {
-		close(uart_fd[com]);
+		close(ctx->fd);
+		ctx->fd = -1;
 		perror("tcsetattr");
 		return -LIBCOMMBUS_ERROR_ACCESS;
 	}
 
+#ifdef UART_HAVE_TERMIOS2
+	if (custom) {
+		ret = uart_set_custom_baud(ctx->fd, baudrate);
+		if (ret != LIBCOMMBUS_SUCCESS) {
+			close(ctx->fd);
+			ctx->fd = -1;
+			return ret;
+		}
+	}
+#endif
+
+	ctx->baudrate = baudrate;
+	ctx->actual_baud = uart_get_actual_baud(ctx->fd, baudrate);
+	ctx->parity = parity;
+	ctx->databits = databits;
+	ctx->stopbits = stopbits;
+	ctx->vmin = 1;
+	ctx->vtime = 0;
+	ctx->cur_vmin = 1;
+	ctx->flow = UART_FLOW_NONE;
+	ctx->ring = NULL;
+
+	pthread_mutex_init(&ctx->rx_lock, NULL);
+	pthread_mutex_init(&ctx->tx_lock, NULL);
+
 	return LIBCOMMBUS_SUCCESS;
 }
 
 
-int uart_read(int com, unsigned char *data, int len)
+int uart_ctx_read(struct uart_ctx_t *ctx, unsigned char *data, int len)
 {
 	int recv;
 	int remain;
 	int n;
 
-	if (com >= COM_MAX || com < 0)
-		return -LIBCOMMBUS_ERROR_NO_DEVICE;
+	if (ctx->ring)
+		return uart_ctx_rx_read(ctx, data, len, len, NULL);
+
+	pthread_mutex_lock(&ctx->rx_lock);
 
 	recv = 0;
 	remain = len;
 	do {
-		n = read(uart_fd[com], &data[recv], remain);
+		n = read(ctx->fd, &data[recv], remain);
 		if (n < 0) {
-			return recv;
+			break;
 		}
 
 		recv += n;
 		remain = len - recv;
 	} while (remain != 0);
 
+	pthread_mutex_unlock(&ctx->rx_lock);
+
 	return recv;
 }
 
-int uart_write(int com, unsigned char *data, int len)
+int uart_ctx_write(struct uart_ctx_t *ctx, unsigned char *data, int len)
 {
 	int sent;
 	int remain;
 	int n;
 
-	if (com >= COM_MAX || com < 0)
-		return -LIBCOMMBUS_ERROR_NO_DEVICE;
+	pthread_mutex_lock(&ctx->tx_lock);
 
 	sent = 0;
 	remain = len;
 	do {
-		n = write(uart_fd[com], &data[sent], remain);
+		n = write(ctx->fd, &data[sent], remain);
 		if (n < 0) {
-			return sent;
+			break;
 		}
 
 		sent += n;
 		remain = len - sent;
 	} while (remain != 0);
 
+	pthread_mutex_unlock(&ctx->tx_lock);
+
 	return sent;
 }
 
-int uart_flush(int com)
+/*
+ * Gather write, e.g. a protocol header and its payload, in one writev()
+ * instead of a write() per buffer or a copy into a bounce buffer. Short
+ * writes are resumed until everything is queued. The caller's iov array
+ * is left untouched. Returns the number of bytes written.
+ */
+int uart_ctx_writev(struct uart_ctx_t *ctx, const struct iovec *iov, int iovcnt)
+{
+	struct iovec vec[UART_IOV_MAX];
+	struct iovec *cur;
+	struct pollfd pfd;
+	size_t total;
+	size_t sent;
+	ssize_t n;
+	int i;
+
+	if (iovcnt < 0 || iovcnt > UART_IOV_MAX)
+		return -LIBCOMMBUS_ERROR_NOT_SUPPORT;
+
+	memcpy(vec, iov, iovcnt * sizeof(struct iovec));
+	cur = vec;
+
+	total = 0;
+	for (i = 0; i < iovcnt; i++)
+		total += vec[i].iov_len;
+
+	pthread_mutex_lock(&ctx->tx_lock);
+
+	for (sent = 0; sent < total; sent += n) {
+		n = writev(ctx->fd, cur, iovcnt);
+		if (n < 0) {
+			if (errno == EINTR) {
+				n = 0;
+				continue;
+			}
+			if (errno == EAGAIN) {
+				pfd.fd = ctx->fd;
+				pfd.events = POLLOUT;
+				poll(&pfd, 1, -1);
+				n = 0;
+				continue;
+			}
+			break;
+		}
+
+		commbus_iov_advance(&cur, &iovcnt, n);
+	}
+
+	pthread_mutex_unlock(&ctx->tx_lock);
+
+	return sent;
+}
+
+int uart_ctx_flush(struct uart_ctx_t *ctx)
 {
 	int ret;
 
-	if (com > (COM_MAX-1) || com < 0)
-		return -LIBCOMMBUS_ERROR_NO_DEVICE;
+	pthread_mutex_lock(&ctx->tx_lock);
+	pthread_mutex_lock(&ctx->rx_lock);
+
+	ret = tcflush(ctx->fd, TCIOFLUSH);
+
+	pthread_mutex_unlock(&ctx->rx_lock);
+	pthread_mutex_unlock(&ctx->tx_lock);
 
-	ret = tcflush(uart_fd[com], TCIOFLUSH);
 	if (ret != 0) {
 		perror("tcflush");
 		return -LIBCOMMBUS_ERROR_ACCESS;
@@ -250,14 +442,336 @@ int uart_flush(int com)
 	return LIBCOMMBUS_SUCCESS;
 }
 
-int uart_close(int com)
+int uart_ctx_get_fd(struct uart_ctx_t *ctx)
+{
+	return ctx->fd;
+}
+
+/* program VMIN/VTIME, the caller holds rx_lock */
+static int uart_apply_vmin_vtime(struct uart_ctx_t *ctx, int vmin, int vtime)
+{
+	struct termios setting;
+
+	if (tcgetattr(ctx->fd, &setting) != 0) {
+		perror("tcgetattr");
+		return -LIBCOMMBUS_ERROR_ACCESS;
+	}
+
+	setting.c_cc[VMIN] = vmin;
+	setting.c_cc[VTIME] = vtime;
+
+	if (tcsetattr(ctx->fd, TCSANOW, &setting) != 0) {
+		perror("tcsetattr");
+		return -LIBCOMMBUS_ERROR_ACCESS;
+	}
+
+	ctx->cur_vmin = vmin;
+
+	return LIBCOMMBUS_SUCCESS;
+}
+
+/*
+ * Set the non-canonical read thresholds: a read() returns once vmin bytes
+ * are in, or vtime tenths of a second after the last byte when vtime is
+ * not 0. Both are 0..255. The default after open is vmin 1, vtime 0.
+ */
+int uart_ctx_set_vmin_vtime(struct uart_ctx_t *ctx, int vmin, int vtime)
 {
 	int ret;
 
-	if (com >= COM_MAX || com < 0)
-		return -LIBCOMMBUS_ERROR_NO_DEVICE;
+	if (vmin < 0 || vmin > 255 || vtime < 0 || vtime > 255)
+		return -LIBCOMMBUS_ERROR_NOT_SUPPORT;
+
+	pthread_mutex_lock(&ctx->rx_lock);
+
+	ret = uart_apply_vmin_vtime(ctx, vmin, vtime);
+	if (ret == LIBCOMMBUS_SUCCESS) {
+		ctx->vmin = vmin;
+		ctx->vtime = vtime;
+	}
+
+	pthread_mutex_unlock(&ctx->rx_lock);
+
+	return ret;
+}
+
+/* fill deadline with the CLOCK_MONOTONIC time timeout_ms from now */
+void uart_deadline(struct timespec *deadline, int timeout_ms)
+{
+	clock_gettime(CLOCK_MONOTONIC, deadline);
+
+	deadline->tv_sec += timeout_ms / 1000;
+	deadline->tv_nsec += (long)(timeout_ms % 1000) * 1000000;
+	if (deadline->tv_nsec >= 1000000000) {
+		deadline->tv_sec++;
+		deadline->tv_nsec -= 1000000000;
+	}
+}
+
+/* time left until deadline, 0 once it has passed */
+static int uart_time_left(const struct timespec *deadline, struct timespec *left)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	left->tv_sec = deadline->tv_sec - now.tv_sec;
+	left->tv_nsec = deadline->tv_nsec - now.tv_nsec;
+	if (left->tv_nsec < 0) {
+		left->tv_sec--;
+		left->tv_nsec += 1000000000;
+	}
+
+	return left->tv_sec > 0 || (left->tv_sec == 0 && left->tv_nsec > 0);
+}
+
+/*
+ * Read up to len bytes, waiting until at least min of them arrived or the
+ * absolute CLOCK_MONOTONIC deadline (see uart_deadline(), NULL waits
+ * forever) passed. Bytes already buffered beyond min are returned too,
+ * but never waited for.
+ *
+ * With vtime 0 the kernel's VMIN is raised to the number of bytes still
+ * missing, so the tty layer wakes us once per response instead of once
+ * per byte. VMIN stays at that value afterwards; it only matters to
+ * callers that poll() the fd themselves, uart_ctx_set_vmin_vtime()
+ * restores it.
+ *
+ * Returns the number of bytes read, less than min (possibly 0) when the
+ * deadline passed, or -LIBCOMMBUS_ERROR_ACCESS.
+ */
+int uart_ctx_read_deadline(struct uart_ctx_t *ctx, unsigned char *data, int len, int min,
+		const struct timespec *deadline)
+{
+	struct timespec left;
+	struct pollfd pfd;
+	int recv = 0;
+	int avail;
+	int want;
+	int ret;
+	int n;
+
+	if (ctx->ring)
+		return uart_ctx_rx_read(ctx, data, len, min, deadline);
+
+	if (min > len)
+		min = len;
+
+	pfd.fd = ctx->fd;
+	pfd.events = POLLIN;
+
+	pthread_mutex_lock(&ctx->rx_lock);
+
+	while (recv < len) {
+		if (recv >= min) {
+			/* have enough, only pick up what is already here */
+			if (ioctl(ctx->fd, FIONREAD, &avail) != 0 || avail == 0)
+				break;
+		} else {
+			/*
+			 * Out of time. VMIN may have held back a partial
+			 * response, collect whatever is buffered and stop.
+			 */
+			if (deadline && !uart_time_left(deadline, &left)) {
+				min = recv;
+				continue;
+			}
+
+			want = min - recv;
+			if (want > 255)
+				want = 255;
+			if (ctx->vtime == 0 && ctx->cur_vmin != want)
+				uart_apply_vmin_vtime(ctx, want, 0);
+
+			ret = ppoll(&pfd, 1, deadline ? &left : NULL, NULL);
+			if (ret < 0 && errno == EINTR)
+				continue;
+			if (ret < 0) {
+				perror("ppoll");
+				recv = recv ? recv : -LIBCOMMBUS_ERROR_ACCESS;
+				break;
+			}
+			if (ret == 0) {
+				min = recv;
+				continue;
+			}
+
+			/*
+			 * Ask for no more than is buffered, a larger read()
+			 * could block on VMIN past the deadline.
+			 */
+			if (ioctl(ctx->fd, FIONREAD, &avail) != 0 || avail == 0)
+				avail = 1;
+		}
+
+		if (avail > len - recv)
+			avail = len - recv;
+
+		n = read(ctx->fd, &data[recv], avail);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0) {
+			if (n < 0 && recv == 0)
+				recv = -LIBCOMMBUS_ERROR_ACCESS;
+			break;
+		}
+
+		recv += n;
+	}
+
+	pthread_mutex_unlock(&ctx->rx_lock);
+
+	return recv;
+}
+
+/*
+ * Hand RS-485 direction control to the serial driver with TIOCSRS485.
+ * rs485 is overwritten with what TIOCGRS485 reads back, since drivers
+ * silently drop flags and clamp delays they cannot do.
+ *
+ * Returns -LIBCOMMBUS_ERROR_NOT_SUPPORT when the driver has no RS-485
+ * support or did not enable it; the port then still works but turnaround
+ * has to be handled by the caller.
+ */
+int uart_ctx_set_rs485(struct uart_ctx_t *ctx, struct uart_rs485_t *rs485)
+{
+	struct serial_rs485 conf;
+	int wanted = rs485->enable;
+	int ret = LIBCOMMBUS_SUCCESS;
+
+	memset(&conf, 0, sizeof(conf));
+
+	if (rs485->enable)
+		conf.flags |= SER_RS485_ENABLED;
+	if (rs485->rts_on_send)
+		conf.flags |= SER_RS485_RTS_ON_SEND;
+	if (rs485->rts_after_send)
+		conf.flags |= SER_RS485_RTS_AFTER_SEND;
+	if (rs485->rx_during_tx)
+		conf.flags |= SER_RS485_RX_DURING_TX;
+	conf.delay_rts_before_send = rs485->delay_before_send;
+	conf.delay_rts_after_send = rs485->delay_after_send;
+
+	pthread_mutex_lock(&ctx->tx_lock);
+
+	if (ioctl(ctx->fd, TIOCSRS485, &conf) != 0) {
+		perror("ioctl TIOCSRS485");
+		ret = -LIBCOMMBUS_ERROR_NOT_SUPPORT;
+	} else if (ioctl(ctx->fd, TIOCGRS485, &conf) != 0) {
+		perror("ioctl TIOCGRS485");
+		ret = -LIBCOMMBUS_ERROR_NOT_SUPPORT;
+	}
+
+	pthread_mutex_unlock(&ctx->tx_lock);
+
+	if (ret != LIBCOMMBUS_SUCCESS) {
+		rs485->enable = 0;
+		return ret;
+	}
+
+	rs485->enable = !!(conf.flags & SER_RS485_ENABLED);
+	rs485->rts_on_send = !!(conf.flags & SER_RS485_RTS_ON_SEND);
+	rs485->rts_after_send = !!(conf.flags & SER_RS485_RTS_AFTER_SEND);
+	rs485->rx_during_tx = !!(conf.flags & SER_RS485_RX_DURING_TX);
+	rs485->delay_before_send = conf.delay_rts_before_send;
+	rs485->delay_after_send = conf.delay_rts_after_send;
+
+	/* accepted the ioctl but did not switch to RS-485 */
+	if (wanted && !rs485->enable)
+		return -LIBCOMMBUS_ERROR_NOT_SUPPORT;
+
+	return LIBCOMMBUS_SUCCESS;
+}
+
+/*
+ * Switch flow control, flow is UART_FLOW_NONE or UART_FLOW_RTSCTS and/or
+ * UART_FLOW_XONXOFF. With flow control on, a background rx ring that
+ * fills up stops reading instead of discarding bytes, so the driver's
+ * buffer fills and the sender is held off rather than overrun.
+ *
+ * Returns -LIBCOMMBUS_ERROR_NOT_SUPPORT when the driver did not keep the
+ * setting, e.g. RTS/CTS on a port without the handshake lines.
+ */
+int uart_ctx_set_flowcontrol(struct uart_ctx_t *ctx, int flow)
+{
+	struct termios setting;
+	int ret = LIBCOMMBUS_SUCCESS;
+
+	if (flow & ~(UART_FLOW_RTSCTS | UART_FLOW_XONXOFF))
+		return -LIBCOMMBUS_ERROR_NOT_SUPPORT;
+
+	/* same order as uart_ctx_flush() */
+	pthread_mutex_lock(&ctx->tx_lock);
+	pthread_mutex_lock(&ctx->rx_lock);
+
+	if (tcgetattr(ctx->fd, &setting) != 0) {
+		perror("tcgetattr");
+		ret = -LIBCOMMBUS_ERROR_ACCESS;
+		goto out;
+	}
+
+	if (flow & UART_FLOW_RTSCTS)
+		setting.c_cflag |= CRTSCTS;
+	else
+		setting.c_cflag &= ~CRTSCTS;
+
+	if (flow & UART_FLOW_XONXOFF) {
+		setting.c_iflag |= IXON | IXOFF;
+		setting.c_iflag &= ~IXANY;
+		/* open cleared c_cc, put the usual characters back */
+		setting.c_cc[VSTART] = 0x11;
+		setting.c_cc[VSTOP] = 0x13;
+	} else {
+		setting.c_iflag &= ~(IXON | IXOFF | IXANY);
+	}
+
+	if (tcsetattr(ctx->fd, TCSANOW, &setting) != 0) {
+		perror("tcsetattr");
+		ret = -LIBCOMMBUS_ERROR_ACCESS;
+		goto out;
+	}
+
+	/* tcsetattr succeeds if any of the changes was made */
+	if (tcgetattr(ctx->fd, &setting) != 0) {
+		perror("tcgetattr");
+		ret = -LIBCOMMBUS_ERROR_ACCESS;
+		goto out;
+	}
+
+	if (!!(setting.c_cflag & CRTSCTS) != !!(flow & UART_FLOW_RTSCTS) ||
+	    !!(setting.c_iflag & IXON) != !!(flow & UART_FLOW_XONXOFF))
+		ret = -LIBCOMMBUS_ERROR_NOT_SUPPORT;
+
+	__atomic_store_n(&ctx->flow,
+			((setting.c_cflag & CRTSCTS) ? UART_FLOW_RTSCTS : 0) |
+			((setting.c_iflag & IXON) ? UART_FLOW_XONXOFF : 0), __ATOMIC_RELEASE);
+
+out:
+	pthread_mutex_unlock(&ctx->rx_lock);
+	pthread_mutex_unlock(&ctx->tx_lock);
+
+	return ret;
+}
+
+/* rate read back from the driver after open, may differ from the request */
+unsigned int uart_ctx_get_baudrate(struct uart_ctx_t *ctx)
+{
+	return ctx->actual_baud;
+}
+
+/* no other thread may still be using the context */
+int uart_ctx_close(struct uart_ctx_t *ctx)
+{
+	int ret;
+
+	uart_ctx_rx_stop(ctx);
+
+	ret = close(ctx->fd);
+	ctx->fd = -1;
+
+	pthread_mutex_destroy(&ctx->rx_lock);
+	pthread_mutex_destroy(&ctx->tx_lock);
 
-	ret = close(uart_fd[com]);
 	if (ret != 0) {
 		perror("close");
 		return -LIBCOMMBUS_ERROR_ACCESS;
@@ -266,3 +780,101 @@ int uart_close(int com)
 	return LIBCOMMBUS_SUCCESS;
 }
 
+int uart_open(int com, int baudrate, int parity, int databits, int stopbits)
+{
+	char path[32];
+
+	if (com >= COM_MAX || com < 0)
+		return -LIBCOMMBUS_ERROR_NO_DEVICE;
+
+	sprintf(path, "/dev/ttyS%d", com);
+
+	return uart_ctx_open(&uart_ctx[com], path, baudrate, parity, databits, stopbits);
+}
+
+int uart_read(int com, unsigned char *data, int len)
+{
+	if (com >= COM_MAX || com < 0)
+		return -LIBCOMMBUS_ERROR_NO_DEVICE;
+
+	return uart_ctx_read(&uart_ctx[com], data, len);
+}
+
+int uart_set_vmin_vtime(int com, int vmin, int vtime)
+{
+	if (com >= COM_MAX || com < 0)
+		return -LIBCOMMBUS_ERROR_NO_DEVICE;
+
+	return uart_ctx_set_vmin_vtime(&uart_ctx[com], vmin, vtime);
+}
+
+int uart_set_rs485(int com, struct uart_rs485_t *rs485)
+{
+	if (com >= COM_MAX || com < 0)
+		return -LIBCOMMBUS_ERROR_NO_DEVICE;
+
+	return uart_ctx_set_rs485(&uart_ctx[com], rs485);
+}
+
+int uart_set_flowcontrol(int com, int flow)
+{
+	if (com >= COM_MAX || com < 0)
+		return -LIBCOMMBUS_ERROR_NO_DEVICE;
+
+	return uart_ctx_set_flowcontrol(&uart_ctx[com], flow);
+}
+
+int uart_read_deadline(int com, unsigned char *data, int len, int min,
+		const struct timespec *deadline)
+{
+	if (com >= COM_MAX || com < 0)
+		return -LIBCOMMBUS_ERROR_NO_DEVICE;
+
+	return uart_ctx_read_deadline(&uart_ctx[com], data, len, min, deadline);
+}
+
+int uart_write(int com, unsigned char *data, int len)
+{
+	if (com >= COM_MAX || com < 0)
+		return -LIBCOMMBUS_ERROR_NO_DEVICE;
+
+	return uart_ctx_write(&uart_ctx[com], data, len);
+}
+
+int uart_writev(int com, const struct iovec *iov, int iovcnt)
+{
+	if (com >= COM_MAX || com < 0)
+		return -LIBCOMMBUS_ERROR_NO_DEVICE;
+
+	return uart_ctx_writev(&uart_ctx[com], iov, iovcnt);
+}
+
+int uart_flush(int com)
+{
+	if (com > (COM_MAX-1) || com < 0)
+		return -LIBCOMMBUS_ERROR_NO_DEVICE;
+
+	return uart_ctx_flush(&uart_ctx[com]);
+}
+
+int uart_get_fd(int com)
+{
+	if (com >= COM_MAX || com < 0)
+		return -LIBCOMMBUS_ERROR_NO_DEVICE;
+
+	if (uart_ctx[com].fd < 0)
+		return -LIBCOMMBUS_ERROR_NO_DEVICE;
+
+	return uart_ctx_get_fd(&uart_ctx[com]);
+}
+
+int uart_close(int com)
+{
+	if (com >= COM_MAX || com < 0)
+		return -LIBCOMMBUS_ERROR_NO_DEVICE;
+
+	if (uart_ctx[com].fd < 0)
+		return -LIBCOMMBUS_ERROR_NO_DEVICE;
+
+	return uart_ctx_close(&uart_ctx[com]);
+}
@@ -0,0 +1,493 @@
+/***************************************************************************
+ *   Copyright (C) 2015 by Tse-Lun Bien                                    *
+ *   allanbian@gmail.com                                                   *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/eventfd.h>
+#include <linux/serial.h>
+#include "commbus.h"
+#include "uart.h"
+
+#define UART_RING_DEFAULT_SIZE	(256 * 1024)
+#define UART_RING_DISCARD	4096
+
+static unsigned int uart_ring_round(unsigned int size)
+{
+	unsigned int page = sysconf(_SC_PAGESIZE);
+	unsigned int n = page;
+
+	while (n < size && n < 0x40000000)
+		n <<= 1;
+
+	return n;
+}
+
+/*
+ * Map the same pages twice, one copy right after the other, so a run of
+ * bytes that wraps around the end of the ring reads and writes as one
+ * contiguous block.
+ */
+static unsigned char *uart_ring_map(unsigned int size)
+{
+	unsigned char *base;
+	int fd;
+
+	fd = memfd_create("uart_ring", MFD_CLOEXEC);
+	if (fd == -1) {
+		perror("memfd_create");
+		return NULL;
+	}
+
+	if (ftruncate(fd, size) != 0) {
+		perror("ftruncate");
+		close(fd);
+		return NULL;
+	}
+
+	base = (unsigned char *)mmap(NULL, 2 * size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (base == MAP_FAILED) {
+		perror("mmap");
+		close(fd);
+		return NULL;
+	}
+
+	if (mmap(base, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED ||
+	    mmap(base + size, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED) {
+		perror("mmap");
+		munmap(base, 2 * size);
+		close(fd);
+		return NULL;
+	}
+
+	/* the mappings keep the memory alive */
+	close(fd);
+
+	return base;
+}
+
+static void uart_ring_wake(struct uart_ring_t *ring)
+{
+	uint64_t val = 1;
+
+	if (__atomic_load_n(&ring->waiting, __ATOMIC_SEQ_CST)) {
+		if (write(ring->evfd, &val, sizeof(val)) != sizeof(val) && errno != EAGAIN)
+			perror("write");
+	}
+}
+
+/* the rx thread sleeps here while the ring is full, until commit or stop */
+static int uart_ring_wait_space(struct uart_ring_t *ring, unsigned int head)
+{
+	struct pollfd pfd[2];
+	uint64_t val;
+
+	__atomic_store_n(&ring->throttled, ring->throttled + 1, __ATOMIC_RELAXED);
+
+	pfd[0].fd = ring->spacefd;
+	pfd[0].events = POLLIN;
+	pfd[1].fd = ring->stopfd;
+	pfd[1].events = POLLIN;
+
+	while (1) {
+		__atomic_store_n(&ring->full, 1, __ATOMIC_SEQ_CST);
+		if (head - __atomic_load_n(&ring->tail, __ATOMIC_SEQ_CST) != ring->size)
+			break;
+
+		if (poll(pfd, 2, -1) < 0 && errno != EINTR) {
+			perror("poll");
+			__atomic_store_n(&ring->status, -LIBCOMMBUS_ERROR_ACCESS, __ATOMIC_RELEASE);
+			return -1;
+		}
+		if (pfd[1].revents)
+			return -1;
+		while (read(ring->spacefd, &val, sizeof(val)) > 0)
+			;
+	}
+
+	__atomic_store_n(&ring->full, 0, __ATOMIC_RELAXED);
+
+	return 0;
+}
+
+static void *uart_rx_thread(void *arg)
+{
+	struct uart_ctx_t *ctx = (struct uart_ctx_t *)arg;
+	struct uart_ring_t *ring = ctx->ring;
+	unsigned char discard[UART_RING_DISCARD];
+	struct pollfd pfd[2];
+	unsigned int head;
+	unsigned int used;
+	ssize_t n;
+
+	pfd[0].fd = ctx->fd;
+	pfd[0].events = POLLIN;
+	pfd[1].fd = ring->stopfd;
+	pfd[1].events = POLLIN;
+
+	head = ring->head;
+	while (1) {
+		if (poll(pfd, 2, -1) < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("poll");
+			__atomic_store_n(&ring->status, -LIBCOMMBUS_ERROR_ACCESS, __ATOMIC_RELEASE);
+			break;
+		}
+
+		if (pfd[1].revents)
+			break;
+
+		used = head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+		if (used == ring->size && __atomic_load_n(&ctx->flow, __ATOMIC_ACQUIRE) != UART_FLOW_NONE) {
+			/*
+			 * Leave the bytes in the driver: its buffer fills, the
+			 * line discipline throttles and the sender is held off
+			 * by RTS or XOFF until the consumer makes room.
+			 */
+			if (uart_ring_wait_space(ring, head) < 0)
+				break;
+			continue;
+		} else if (used == ring->size) {
+			/* the consumer fell behind, keep the line moving */
+			n = read(ctx->fd, discard, sizeof(discard));
+			if (n > 0) {
+				__atomic_store_n(&ring->dropped, ring->dropped + n, __ATOMIC_RELAXED);
+				continue;
+			}
+		} else {
+			n = read(ctx->fd, &ring->buf[head & (ring->size - 1)], ring->size - used);
+		}
+
+		if (n < 0) {
+			if (errno == EINTR || errno == EAGAIN)
+				continue;
+			/* EIO is a hangup of a pty or USB adapter */
+			__atomic_store_n(&ring->status, errno == EIO ? -LIBCOMMBUS_ERROR_EOF :
+					-LIBCOMMBUS_ERROR_ACCESS, __ATOMIC_RELEASE);
+			break;
+		}
+		if (n == 0) {
+			__atomic_store_n(&ring->status, -LIBCOMMBUS_ERROR_EOF, __ATOMIC_RELEASE);
+			break;
+		}
+
+		/*
+		 * Only this thread writes the counters; the stores are atomic so
+		 * uart_ctx_get_rx_stats() never sees a torn 64-bit value.
+		 */
+		if (used + n > ring->high_water)
+			__atomic_store_n(&ring->high_water, used + n, __ATOMIC_RELAXED);
+		__atomic_store_n(&ring->bytes, ring->bytes + n, __ATOMIC_RELAXED);
+
+		head += n;
+		__atomic_store_n(&ring->head, head, __ATOMIC_SEQ_CST);
+		uart_ring_wake(ring);
+	}
+
+	/* let a blocked consumer see the status */
+	__atomic_store_n(&ring->waiting, 1, __ATOMIC_SEQ_CST);
+	uart_ring_wake(ring);
+
+	return NULL;
+}
+
+/*
+ * Start draining the port in a background thread into a ring of at least
+ * size bytes (rounded up to a power of two pages, 0 picks a default).
+ * From then on the port is read with uart_ctx_rx_peek()/commit() or
+ * uart_ctx_rx_read(); uart_ctx_read() and uart_ctx_read_deadline() are
+ * served from the ring too. VMIN/VTIME are reset to 1/0.
+ *
+ * When the ring is full, further bytes are read and thrown away so the
+ * kernel buffer does not overflow; they are counted as dropped. With flow
+ * control enabled (uart_ctx_set_flowcontrol()) the rx thread stops reading
+ * instead and lets the handshake hold the sender off; every such stall is
+ * counted as throttled.
+ */
+int uart_ctx_rx_start(struct uart_ctx_t *ctx, unsigned int size)
+{
+	struct uart_ring_t *ring;
+	int ret;
+
+	if (ctx->fd < 0)
+		return -LIBCOMMBUS_ERROR_NO_DEVICE;
+	if (ctx->ring)
+		return -LIBCOMMBUS_ERROR_ACCESS;
+
+	if (size == 0)
+		size = UART_RING_DEFAULT_SIZE;
+
+	ring = (struct uart_ring_t *)calloc(1, sizeof(*ring));
+	if (ring == NULL)
+		return -LIBCOMMBUS_ERROR_MALLOC;
+
+	ring->size = uart_ring_round(size);
+	ring->buf = uart_ring_map(ring->size);
+	if (ring->buf == NULL) {
+		ret = -LIBCOMMBUS_ERROR_MALLOC;
+		goto out_free;
+	}
+
+	ring->evfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	ring->spacefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	ring->stopfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (ring->evfd == -1 || ring->spacefd == -1 || ring->stopfd == -1) {
+		perror("eventfd");
+		ret = -LIBCOMMBUS_ERROR_ACCESS;
+		goto out_unmap;
+	}
+
+	ret = uart_ctx_set_vmin_vtime(ctx, 1, 0);
+	if (ret != LIBCOMMBUS_SUCCESS)
+		goto out_unmap;
+
+	ctx->ring = ring;
+	if (pthread_create(&ring->tid, NULL, uart_rx_thread, ctx) != 0) {
+		perror("pthread_create");
+		ctx->ring = NULL;
+		ret = -LIBCOMMBUS_ERROR_ACCESS;
+		goto out_unmap;
+	}
+
+	return LIBCOMMBUS_SUCCESS;
+
+out_unmap:
+	if (ring->evfd != -1)
+		close(ring->evfd);
+	if (ring->spacefd != -1)
+		close(ring->spacefd);
+	if (ring->stopfd != -1)
+		close(ring->stopfd);
+	munmap(ring->buf, 2 * ring->size);
+out_free:
+	free(ring);
+	return ret;
+}
+
+static int uart_ring_wait(struct uart_ring_t *ring, int min, const struct timespec *deadline)
+{
+	struct timespec now;
+	struct timespec left;
+	struct pollfd pfd;
+	uint64_t val;
+	unsigned int avail;
+	int status;
+	int ret;
+
+	pfd.fd = ring->evfd;
+	pfd.events = POLLIN;
+
+	while (1) {
+		/* the rx thread stores its last head before the status */
+		status = __atomic_load_n(&ring->status, __ATOMIC_ACQUIRE);
+		avail = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) - ring->tail;
+		if (avail >= (unsigned int)min || status != LIBCOMMBUS_SUCCESS)
+			return avail;
+
+		/* announce the wait, then look again before sleeping */
+		__atomic_store_n(&ring->waiting, 1, __ATOMIC_SEQ_CST);
+		avail = __atomic_load_n(&ring->head, __ATOMIC_SEQ_CST) - ring->tail;
+		if (avail >= (unsigned int)min) {
+			__atomic_store_n(&ring->waiting, 0, __ATOMIC_RELAXED);
+			return avail;
+		}
+
+		if (deadline) {
+			clock_gettime(CLOCK_MONOTONIC, &now);
+			left.tv_sec = deadline->tv_sec - now.tv_sec;
+			left.tv_nsec = deadline->tv_nsec - now.tv_nsec;
+			if (left.tv_nsec < 0) {
+				left.tv_sec--;
+				left.tv_nsec += 1000000000;
+			}
+			if (left.tv_sec < 0) {
+				__atomic_store_n(&ring->waiting, 0, __ATOMIC_RELAXED);
+				return avail;
+			}
+		}
+
+		ret = ppoll(&pfd, 1, deadline ? &left : NULL, NULL);
+		__atomic_store_n(&ring->waiting, 0, __ATOMIC_RELAXED);
+		if (ret < 0 && errno != EINTR) {
+			perror("ppoll");
+			return -LIBCOMMBUS_ERROR_ACCESS;
+		}
+		while (read(ring->evfd, &val, sizeof(val)) > 0)
+			;
+	}
+}
+
+/*
+ * Wait until at least min bytes are queued or the absolute
+ * CLOCK_MONOTONIC deadline passed (NULL waits forever), and point *data
+ * at all queued bytes. They stay queued until uart_ctx_rx_commit().
+ *
+ * Returns the number of bytes at *data, which is less than min when the
+ * deadline passed, or the rx thread's error once it stopped and the ring
+ * is empty.
+ */
+int uart_ctx_rx_peek(struct uart_ctx_t *ctx, unsigned char **data, int min,
+		const struct timespec *deadline)
+{
+	struct uart_ring_t *ring = ctx->ring;
+	int status;
+	int avail;
+
+	if (ring == NULL)
+		return -LIBCOMMBUS_ERROR_NO_DEVICE;
+
+	if (min > (int)ring->size)
+		min = ring->size;
+
+	avail = uart_ring_wait(ring, min, deadline);
+	if (avail == 0) {
+		/* look at head again after the status, bytes may have come first */
+		status = __atomic_load_n(&ring->status, __ATOMIC_ACQUIRE);
+		avail = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) - ring->tail;
+		if (avail == 0 && status != LIBCOMMBUS_SUCCESS)
+			return status;
+	}
+
+	*data = &ring->buf[ring->tail & (ring->size - 1)];
+
+	return avail;
+}
+
+/* Release len bytes returned by uart_ctx_rx_peek() */
+int uart_ctx_rx_commit(struct uart_ctx_t *ctx, int len)
+{
+	struct uart_ring_t *ring = ctx->ring;
+
+	if (ring == NULL)
+		return -LIBCOMMBUS_ERROR_NO_DEVICE;
+
+	if (len < 0 || (unsigned int)len > __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) - ring->tail)
+		return -LIBCOMMBUS_ERROR_ACCESS;
+
+	__atomic_store_n(&ring->tail, ring->tail + len, __ATOMIC_SEQ_CST);
+
+	/* a throttled rx thread waits for room */
+	if (len > 0 && __atomic_load_n(&ring->full, __ATOMIC_SEQ_CST)) {
+		uint64_t val = 1;
+
+		if (write(ring->spacefd, &val, sizeof(val)) != sizeof(val) && errno != EAGAIN)
+			perror("write");
+	}
+
+	return LIBCOMMBUS_SUCCESS;
+}
+
+/*
+ * Copying read from the ring with the semantics of
+ * uart_ctx_read_deadline(): up to len bytes, waiting for min of them
+ * until deadline.
+ */
+int uart_ctx_rx_read(struct uart_ctx_t *ctx, unsigned char *data, int len, int min,
+		const struct timespec *deadline)
+{
+	unsigned char *p;
+	int n;
+
+	if (min > len)
+		min = len;
+
+	pthread_mutex_lock(&ctx->rx_lock);
+
+	n = uart_ctx_rx_peek(ctx, &p, min, deadline);
+	if (n > 0) {
+		if (n > len)
+			n = len;
+		memcpy(data, p, n);
+		uart_ctx_rx_commit(ctx, n);
+	}
+
+	pthread_mutex_unlock(&ctx->rx_lock);
+
+	return n;
+}
+
+/*
+ * Stop the rx thread and free the ring. Queued bytes are lost, and no
+ * other thread may be inside a ring read at this point.
+ */
+int uart_ctx_rx_stop(struct uart_ctx_t *ctx)
+{
+	struct uart_ring_t *ring = ctx->ring;
+	uint64_t val = 1;
+
+	if (ring == NULL)
+		return LIBCOMMBUS_SUCCESS;
+
+	if (write(ring->stopfd, &val, sizeof(val)) != sizeof(val))
+		perror("write");
+	pthread_join(ring->tid, NULL);
+
+	ctx->ring = NULL;
+	close(ring->evfd);
+	close(ring->spacefd);
+	close(ring->stopfd);
+	munmap(ring->buf, 2 * ring->size);
+	free(ring);
+
+	return LIBCOMMBUS_SUCCESS;
+}
+
+/*
+ * Ring counters, zero without a ring, plus the driver's error counters.
+ * A ring that never drops while the driver counts overruns means the rx
+ * thread is not scheduled often enough, e.g. give it a realtime priority.
+ */
+int uart_ctx_get_rx_stats(struct uart_ctx_t *ctx, struct uart_rx_stats_t *stats)
+{
+	struct serial_icounter_struct icount;
+
+	memset(stats, 0, sizeof(*stats));
+
+	if (ctx->ring) {
+		stats->bytes = __atomic_load_n(&ctx->ring->bytes, __ATOMIC_RELAXED);
+		stats->dropped = __atomic_load_n(&ctx->ring->dropped, __ATOMIC_RELAXED);
+		stats->throttled = __atomic_load_n(&ctx->ring->throttled, __ATOMIC_RELAXED);
+		stats->high_water = __atomic_load_n(&ctx->ring->high_water, __ATOMIC_RELAXED);
+	}
+
+	memset(&icount, 0, sizeof(icount));
+	if (ioctl(ctx->fd, TIOCGICOUNT, &icount) == 0) {
+		stats->icount_valid = 1;
+		stats->rx = icount.rx;
+		stats->overrun = icount.overrun;
+		stats->buf_overrun = icount.buf_overrun;
+		stats->frame = icount.frame;
+		stats->parity = icount.parity;
+		stats->brk = icount.brk;
+	}
+
+	return LIBCOMMBUS_SUCCESS;
+}
@@ -0,0 +1,439 @@
+/***************************************************************************
+ *   Copyright (C) 2015 by Tse-Lun Bien                                    *
+ *   allanbian@gmail.com                                                   *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#include "commbus.h"
+#include "uring.h"
+
+struct uring_op {
+	int write;
+	int fd;
+	int index;
+	int len;
+	int link;
+	unsigned long long user_data;
+};
+
+struct uring_priv {
+	/* io_uring backend */
+	void *sq_ptr;
+	size_t sq_sz;
+	void *cq_ptr;
+	size_t cq_sz;
+	struct io_uring_sqe *sqes;
+	size_t sqes_sz;
+	unsigned int *sq_head;
+	unsigned int *sq_tail;
+	unsigned int *sq_mask;
+	unsigned int *sq_entries;
+	unsigned int *sq_array;
+	unsigned int *cq_head;
+	unsigned int *cq_tail;
+	unsigned int *cq_mask;
+	struct io_uring_cqe *cqes;
+	struct io_uring_sqe *last;
+	unsigned int tail;
+	unsigned int to_submit;
+	int fixed;
+
+	/* read()/write() fallback */
+	struct uring_op *ops;
+	unsigned int nops;
+	unsigned int max_ops;
+	struct uring_cqe_t *done;
+	unsigned int done_head;
+	unsigned int done_tail;
+};
+
+static int uring_errno(int err)
+{
+	switch (err) {
+		case EAGAIN:
+		case ECANCELED:
+			return -LIBCOMMBUS_ERROR_AGAIN;
+		case EPIPE:
+		case ECONNRESET:
+			return -LIBCOMMBUS_ERROR_EOF;
+		default:
+			return -LIBCOMMBUS_ERROR_ACCESS;
+	}
+}
+
+static int uring_setup(struct uring_t *ring, struct uring_priv *priv, unsigned int entries)
+{
+	struct io_uring_params p;
+	struct iovec *iov;
+	char *sq;
+	char *cq;
+	int i;
+
+	memset(&p, 0, sizeof(p));
+	ring->fd = syscall(__NR_io_uring_setup, entries, &p);
+	if (ring->fd < 0)
+		return -LIBCOMMBUS_ERROR_NOT_SUPPORT;
+
+	priv->sq_sz = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+	priv->cq_sz = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		if (priv->cq_sz > priv->sq_sz)
+			priv->sq_sz = priv->cq_sz;
+		priv->cq_sz = priv->sq_sz;
+	}
+
+	priv->sq_ptr = mmap(NULL, priv->sq_sz, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+	if (priv->sq_ptr == MAP_FAILED)
+		goto out_fd;
+
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		priv->cq_ptr = priv->sq_ptr;
+	} else {
+		priv->cq_ptr = mmap(NULL, priv->cq_sz, PROT_READ | PROT_WRITE,
+				MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+		if (priv->cq_ptr == MAP_FAILED)
+			goto out_sq;
+	}
+
+	priv->sqes_sz = p.sq_entries * sizeof(struct io_uring_sqe);
+	priv->sqes = (struct io_uring_sqe *)mmap(NULL, priv->sqes_sz, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+	if (priv->sqes == MAP_FAILED)
+		goto out_cq;
+
+	sq = (char *)priv->sq_ptr;
+	cq = (char *)priv->cq_ptr;
+	priv->sq_head = (unsigned int *)(sq + p.sq_off.head);
+	priv->sq_tail = (unsigned int *)(sq + p.sq_off.tail);
+	priv->sq_mask = (unsigned int *)(sq + p.sq_off.ring_mask);
+	priv->sq_entries = (unsigned int *)(sq + p.sq_off.ring_entries);
+	priv->sq_array = (unsigned int *)(sq + p.sq_off.array);
+	priv->cq_head = (unsigned int *)(cq + p.cq_off.head);
+	priv->cq_tail = (unsigned int *)(cq + p.cq_off.tail);
+	priv->cq_mask = (unsigned int *)(cq + p.cq_off.ring_mask);
+	priv->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+	priv->tail = *priv->sq_tail;
+
+	/* register the buffers once, requests then refer to them by index */
+	iov = (struct iovec *)calloc(ring->nbufs, sizeof(struct iovec));
+	if (iov) {
+		for (i = 0; i < ring->nbufs; i++) {
+			iov[i].iov_base = &ring->bufs[i * ring->buf_size];
+			iov[i].iov_len = ring->buf_size;
+		}
+		priv->fixed = syscall(__NR_io_uring_register, ring->fd,
+				IORING_REGISTER_BUFFERS, iov, ring->nbufs) == 0;
+		free(iov);
+	}
+
+	return LIBCOMMBUS_SUCCESS;
+
+out_cq:
+	if (priv->cq_ptr != priv->sq_ptr)
+		munmap(priv->cq_ptr, priv->cq_sz);
+out_sq:
+	munmap(priv->sq_ptr, priv->sq_sz);
+out_fd:
+	close(ring->fd);
+	ring->fd = -1;
+	return -LIBCOMMBUS_ERROR_NOT_SUPPORT;
+}
+
+/*
+ * Create a ring with room for entries requests in flight and nbufs
+ * buffers of buf_size bytes registered with the kernel. When io_uring is
+ * not available, or URING_DISABLE_ENV is set, requests are executed with
+ * plain read()/write() from uring_submit() instead.
+ */
+int uring_open(struct uring_t *ring, unsigned int entries, int nbufs, int buf_size)
+{
+	struct uring_priv *priv;
+
+	memset(ring, 0, sizeof(*ring));
+	ring->fd = -1;
+
+	if (entries == 0 || nbufs <= 0 || buf_size <= 0)
+		return -LIBCOMMBUS_ERROR_NOT_SUPPORT;
+
+	priv = (struct uring_priv *)calloc(1, sizeof(*priv));
+	if (!priv)
+		return -LIBCOMMBUS_ERROR_MALLOC;
+
+	if (posix_memalign((void **)&ring->bufs, 4096, (size_t)nbufs * buf_size) != 0) {
+		free(priv);
+		return -LIBCOMMBUS_ERROR_MALLOC;
+	}
+
+	ring->nbufs = nbufs;
+	ring->buf_size = buf_size;
+	ring->priv = priv;
+
+	if (getenv(URING_DISABLE_ENV) == NULL &&
+	    uring_setup(ring, priv, entries) == LIBCOMMBUS_SUCCESS)
+		return LIBCOMMBUS_SUCCESS;
+
+	ring->fallback = 1;
+	priv->max_ops = entries;
+	priv->ops = (struct uring_op *)calloc(entries, sizeof(struct uring_op));
+	priv->done = (struct uring_cqe_t *)calloc(entries * 2, sizeof(struct uring_cqe_t));
+	if (!priv->ops || !priv->done) {
+		free(priv->ops);
+		free(priv->done);
+		free(ring->bufs);
+		free(priv);
+		return -LIBCOMMBUS_ERROR_MALLOC;
+	}
+
+	return LIBCOMMBUS_SUCCESS;
+}
+
+unsigned char *uring_buf(struct uring_t *ring, int index)
+{
+	if (index < 0 || index >= ring->nbufs)
+		return NULL;
+
+	return &ring->bufs[index * ring->buf_size];
+}
+
+static int uring_prep(struct uring_t *ring, int write, int fd, int index, int len,
+		unsigned long long user_data)
+{
+	struct uring_priv *priv = (struct uring_priv *)ring->priv;
+	struct io_uring_sqe *sqe;
+	struct uring_op *op;
+	unsigned int head;
+
+	if (index < 0 || index >= ring->nbufs || len < 0 || len > ring->buf_size)
+		return -LIBCOMMBUS_ERROR_NOT_SUPPORT;
+
+	if (ring->fallback) {
+		if (priv->nops == priv->max_ops)
+			return -LIBCOMMBUS_ERROR_AGAIN;
+
+		op = &priv->ops[priv->nops++];
+		op->write = write;
+		op->fd = fd;
+		op->index = index;
+		op->len = len;
+		op->link = 0;
+		op->user_data = user_data;
+		return LIBCOMMBUS_SUCCESS;
+	}
+
+	head = __atomic_load_n(priv->sq_head, __ATOMIC_ACQUIRE);
+	if (priv->tail - head >= *priv->sq_entries)
+		return -LIBCOMMBUS_ERROR_AGAIN;
+
+	sqe = &priv->sqes[priv->tail & *priv->sq_mask];
+	memset(sqe, 0, sizeof(*sqe));
+	if (priv->fixed)
+		sqe->opcode = write ? IORING_OP_WRITE_FIXED : IORING_OP_READ_FIXED;
+	else
+		sqe->opcode = write ? IORING_OP_WRITE : IORING_OP_READ;
+	sqe->fd = fd;
+	sqe->addr = (unsigned long)uring_buf(ring, index);
+	sqe->len = len;
+	/* sockets and ttys are streams, use the current file position */
+	sqe->off = (unsigned long long)-1;
+	sqe->buf_index = index;
+	sqe->user_data = user_data;
+
+	priv->sq_array[priv->tail & *priv->sq_mask] = priv->tail & *priv->sq_mask;
+	priv->tail++;
+	priv->to_submit++;
+	priv->last = sqe;
+
+	return LIBCOMMBUS_SUCCESS;
+}
+
+int uring_prep_read(struct uring_t *ring, int fd, int index, int len,
+		unsigned long long user_data)
+{
+	return uring_prep(ring, 0, fd, index, len, user_data);
+}
+
+int uring_prep_write(struct uring_t *ring, int fd, int index, int len,
+		unsigned long long user_data)
+{
+	return uring_prep(ring, 1, fd, index, len, user_data);
+}
+
+/*
+ * Chain the last prepared request to the next one: the next request only
+ * starts once this one has fully completed. Use it to keep several writes
+ * to the same stream in order.
+ */
+int uring_link(struct uring_t *ring)
+{
+	struct uring_priv *priv = (struct uring_priv *)ring->priv;
+
+	if (ring->fallback) {
+		if (priv->nops == 0)
+			return -LIBCOMMBUS_ERROR_NOT_SUPPORT;
+		priv->ops[priv->nops - 1].link = 1;
+		return LIBCOMMBUS_SUCCESS;
+	}
+
+	if (priv->to_submit == 0 || priv->last == NULL)
+		return -LIBCOMMBUS_ERROR_NOT_SUPPORT;
+
+	priv->last->flags |= IOSQE_IO_LINK;
+	return LIBCOMMBUS_SUCCESS;
+}
+
+static int uring_fallback_submit(struct uring_t *ring)
+{
+	struct uring_priv *priv = (struct uring_priv *)ring->priv;
+	struct uring_cqe_t *cqe;
+	struct uring_op *op;
+	unsigned int i;
+	int broken = 0;
+	int n;
+
+	for (i = 0; i < priv->nops; i++) {
+		op = &priv->ops[i];
+
+		if (broken) {
+			n = -LIBCOMMBUS_ERROR_AGAIN;
+		} else {
+			do {
+				if (op->write)
+					n = write(op->fd, uring_buf(ring, op->index), op->len);
+				else
+					n = read(op->fd, uring_buf(ring, op->index), op->len);
+				ring->syscalls++;
+			} while (n < 0 && errno == EINTR);
+
+			if (n < 0)
+				n = uring_errno(errno);
+		}
+
+		/* like io_uring, a failed or short request breaks its chain */
+		broken = op->link && (broken || n != op->len);
+
+		cqe = &priv->done[priv->done_tail++ % (priv->max_ops * 2)];
+		cqe->user_data = op->user_data;
+		cqe->res = n;
+	}
+
+	n = priv->nops;
+	priv->nops = 0;
+
+	return n;
+}
+
+/*
+ * Hand all prepared requests to the kernel and, if wait_nr is non-zero,
+ * wait until at least wait_nr completions can be reaped. Submitting and
+ * waiting cost a single syscall. Returns the number of requests submitted.
+ */
+int uring_submit(struct uring_t *ring, int wait_nr)
+{
+	struct uring_priv *priv = (struct uring_priv *)ring->priv;
+	unsigned int ready;
+	unsigned int flags;
+	int ret;
+
+	if (ring->fallback)
+		return uring_fallback_submit(ring);
+
+	ready = __atomic_load_n(priv->cq_tail, __ATOMIC_ACQUIRE) - *priv->cq_head;
+	if (priv->to_submit == 0 && (wait_nr == 0 || ready >= (unsigned int)wait_nr))
+		return 0;
+
+	__atomic_store_n(priv->sq_tail, priv->tail, __ATOMIC_RELEASE);
+
+	flags = wait_nr ? IORING_ENTER_GETEVENTS : 0;
+	do {
+		ret = syscall(__NR_io_uring_enter, ring->fd, priv->to_submit, wait_nr, flags, NULL, 0);
+		ring->syscalls++;
+	} while (ret < 0 && errno == EINTR);
+
+	if (ret < 0) {
+		if (errno == EBUSY || errno == EAGAIN)
+			return -LIBCOMMBUS_ERROR_AGAIN;
+
+		perror("io_uring_enter");
+		return -LIBCOMMBUS_ERROR_ACCESS;
+	}
+
+	priv->to_submit -= ret;
+	if (priv->to_submit == 0)
+		priv->last = NULL;
+
+	return ret;
+}
+
+/* Collect up to max completions without blocking. */
+int uring_reap(struct uring_t *ring, struct uring_cqe_t *cqes, int max)
+{
+	struct uring_priv *priv = (struct uring_priv *)ring->priv;
+	struct io_uring_cqe *cqe;
+	unsigned int head;
+	unsigned int tail;
+	int n = 0;
+
+	if (ring->fallback) {
+		while (n < max && priv->done_head != priv->done_tail)
+			cqes[n++] = priv->done[priv->done_head++ % (priv->max_ops * 2)];
+		return n;
+	}
+
+	head = *priv->cq_head;
+	tail = __atomic_load_n(priv->cq_tail, __ATOMIC_ACQUIRE);
+	while (n < max && head != tail) {
+		cqe = &priv->cqes[head & *priv->cq_mask];
+		cqes[n].user_data = cqe->user_data;
+		cqes[n].res = cqe->res < 0 ? uring_errno(-cqe->res) : cqe->res;
+		head++;
+		n++;
+	}
+	__atomic_store_n(priv->cq_head, head, __ATOMIC_RELEASE);
+
+	return n;
+}
+
+int uring_close(struct uring_t *ring)
+{
+	struct uring_priv *priv = (struct uring_priv *)ring->priv;
+
+	if (ring->fallback) {
+		free(priv->ops);
+		free(priv->done);
+	} else {
+		munmap(priv->sqes, priv->sqes_sz);
+		if (priv->cq_ptr != priv->sq_ptr)
+			munmap(priv->cq_ptr, priv->cq_sz);
+		munmap(priv->sq_ptr, priv->sq_sz);
+		close(ring->fd);
+	}
+
+	free(ring->bufs);
+	free(priv);
+
+	return LIBCOMMBUS_SUCCESS;
+}
@@ -0,0 +1,236 @@
+#include <stdlib.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "arbiter.h"
+#include "xpt_internal.h"
+
+struct _arbiter {
+    xpt_arbiter_bus_t type;
+    unsigned int bus;
+    int refs; /**< protected by arbiters_lock */
+    pthread_mutex_t lock;
+    pthread_cond_t cond[XPT_ARBITER_PRIO_COUNT]; /**< one per class, signalled when it is its turn */
+    xpt_boolean_t busy;
+    unsigned long long next_ticket[XPT_ARBITER_PRIO_COUNT];
+    unsigned long long serving[XPT_ARBITER_PRIO_COUNT]; /**< ticket at the head of each class */
+    int waiting[XPT_ARBITER_PRIO_COUNT];
+    xpt_arbiter_stats_t stats[XPT_ARBITER_PRIO_COUNT];
+    struct _arbiter* next;
+};
+
+static struct _arbiter* arbiters = NULL;
+static pthread_mutex_t arbiters_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static unsigned long long
+arbiter_now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int
+arbiter_prio_index(xpt_arbiter_prio_t prio)
+{
+    if ((int) prio < 0 || prio >= XPT_ARBITER_PRIO_COUNT) {
+        return XPT_ARBITER_PRIO_NORMAL;
+    }
+    return prio;
+}
+
+xpt_arbiter_context
+xpt_arbiter_get(xpt_arbiter_bus_t type, unsigned int bus)
+{
+    xpt_arbiter_context arb;
+    int i;
+
+    pthread_mutex_lock(&arbiters_lock);
+
+    for (arb = arbiters; arb != NULL; arb = arb->next) {
+        if (arb->type == type && arb->bus == bus) {
+            arb->refs++;
+            pthread_mutex_unlock(&arbiters_lock);
+            return arb;
+        }
+    }
+
+    arb = (xpt_arbiter_context) calloc(1, sizeof(struct _arbiter));
+    if (arb == NULL) {
+        pthread_mutex_unlock(&arbiters_lock);
+        syslog(LOG_CRIT, "arbiter: Failed to allocate memory for context");
+        return NULL;
+    }
+
+    arb->type = type;
+    arb->bus = bus;
+    arb->refs = 1;
+    pthread_mutex_init(&arb->lock, NULL);
+    for (i = 0; i < XPT_ARBITER_PRIO_COUNT; i++) {
+        pthread_cond_init(&arb->cond[i], NULL);
+    }
+    arb->next = arbiters;
+    arbiters = arb;
+
+    pthread_mutex_unlock(&arbiters_lock);
+    return arb;
+}
+
+void
+xpt_arbiter_put(xpt_arbiter_context arb)
+{
+    struct _arbiter** p;
+    int i;
+
+    if (arb == NULL) {
+        return;
+    }
+
+    pthread_mutex_lock(&arbiters_lock);
+
+    if (--arb->refs > 0) {
+        pthread_mutex_unlock(&arbiters_lock);
+        return;
+    }
+
+    for (p = &arbiters; *p != NULL; p = &(*p)->next) {
+        if (*p == arb) {
+            *p = arb->next;
+            break;
+        }
+    }
+
+    pthread_mutex_unlock(&arbiters_lock);
+
+    for (i = 0; i < XPT_ARBITER_PRIO_COUNT; i++) {
+        pthread_cond_destroy(&arb->cond[i]);
+    }
+    pthread_mutex_destroy(&arb->lock);
+    free(arb);
+}
+
+// Whether the head of class p may take the bus now; arb->lock held
+static int
+arbiter_turn(xpt_arbiter_context arb, int p, unsigned long long ticket)
+{
+    int i;
+
+    if (arb->busy || arb->serving[p] != ticket) {
+        return 0;
+    }
+    for (i = 0; i < p; i++) {
+        if (arb->waiting[i] > 0) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+void
+xpt_arbiter_acquire(xpt_arbiter_context arb, xpt_arbiter_prio_t prio)
+{
+    int p = arbiter_prio_index(prio);
+    unsigned long long ticket;
+    unsigned long long start;
+    unsigned long long waited;
+
+    if (arb == NULL) {
+        return;
+    }
+
+    pthread_mutex_lock(&arb->lock);
+
+    ticket = arb->next_ticket[p]++;
+    arb->stats[p].acquired++;
+
+    if (!arbiter_turn(arb, p, ticket)) {
+        arb->stats[p].contended++;
+        arb->waiting[p]++;
+        start = arbiter_now_ns();
+
+        do {
+            pthread_cond_wait(&arb->cond[p], &arb->lock);
+        } while (!arbiter_turn(arb, p, ticket));
+
+        arb->waiting[p]--;
+        waited = arbiter_now_ns() - start;
+        arb->stats[p].wait_ns += waited;
+        if (waited > arb->stats[p].max_wait_ns) {
+            arb->stats[p].max_wait_ns = waited;
+        }
+    }
+
+    arb->serving[p]++;
+    arb->busy = 1;
+
+    pthread_mutex_unlock(&arb->lock);
+}
+
+void
+xpt_arbiter_release(xpt_arbiter_context arb)
+{
+    int i;
+
+    if (arb == NULL) {
+        return;
+    }
+
+    pthread_mutex_lock(&arb->lock);
+
+    arb->busy = 0;
+    for (i = 0; i < XPT_ARBITER_PRIO_COUNT; i++) {
+        if (arb->waiting[i] > 0) {
+            // all of the class wake, the one holding the next ticket goes
+            pthread_cond_broadcast(&arb->cond[i]);
+            break;
+        }
+    }
+
+    pthread_mutex_unlock(&arb->lock);
+}
+
+int
+xpt_arbiter_yield(xpt_arbiter_context arb, xpt_arbiter_prio_t prio)
+{
+    int p = arbiter_prio_index(prio);
+    int waiters = 0;
+    int i;
+
+    if (arb == NULL) {
+        return 0;
+    }
+
+    pthread_mutex_lock(&arb->lock);
+    for (i = 0; i <= p; i++) {
+        waiters += arb->waiting[i];
+    }
+    pthread_mutex_unlock(&arb->lock);
+
+    if (waiters == 0) {
+        return 0;
+    }
+
+    xpt_arbiter_release(arb);
+    xpt_arbiter_acquire(arb, prio);
+    return 1;
+}
+
+xpt_result_t
+xpt_arbiter_get_stats(xpt_arbiter_context arb, xpt_arbiter_prio_t prio, xpt_arbiter_stats_t* stats)
+{
+    if (arb == NULL || stats == NULL) {
+        syslog(LOG_ERR, "arbiter: get_stats: context is NULL");
+        return XPT_ERROR_INVALID_HANDLE;
+    }
+
+    if ((int) prio < 0 || prio >= XPT_ARBITER_PRIO_COUNT) {
+        syslog(LOG_ERR, "arbiter: get_stats: invalid priority %d", prio);
+        return XPT_ERROR_INVALID_PARAMETER;
+    }
+
+    pthread_mutex_lock(&arb->lock);
+    *stats = arb->stats[prio];
+    pthread_mutex_unlock(&arb->lock);
+    return XPT_SUCCESS;
+}
@@ -0,0 +1,398 @@
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#define FRAMING_HAVE_SIMD 1
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define FRAMING_HAVE_SIMD 1
+#else
+#define FRAMING_HAVE_SIMD 0
+#endif
+
+#include "framing.h"
+#include "xpt_internal.h"
+
+#define COBS_BLOCK 254
+// smallest read from the uart behind a partial frame
+#define FRAMING_MIN_READ 4096
+
+struct _framing {
+    xpt_uart_context uart;
+    xpt_framing_mode_t mode;
+    uint8_t delimiter;
+    size_t max_frame;
+    uint8_t* rx; /**< encoded bytes received, frames are decoded in place */
+    size_t rx_size;
+    size_t start; /**< first byte of the frame being received */
+    size_t scanned; /**< bytes up to here hold no delimiter */
+    size_t end; /**< end of received data */
+    xpt_boolean_t discard; /**< dropping the rest of an oversize frame */
+    uint8_t* tx;
+    size_t tx_size;
+    xpt_framing_stats_t stats;
+};
+
+static int framing_simd = FRAMING_HAVE_SIMD;
+
+// Index of the first byte equal to a or b, or len if there is none
+static size_t
+framing_scan(const uint8_t* p, size_t len, uint8_t a, uint8_t b)
+{
+    size_t i = 0;
+
+#if defined(__SSE2__)
+    if (framing_simd) {
+        const __m128i va = _mm_set1_epi8((char) a);
+        const __m128i vb = _mm_set1_epi8((char) b);
+
+        for (; i + 16 <= len; i += 16) {
+            __m128i v = _mm_loadu_si128((const __m128i*) (p + i));
+            int mask = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(v, va), _mm_cmpeq_epi8(v, vb)));
+            if (mask) {
+                return i + __builtin_ctz(mask);
+            }
+        }
+    }
+#elif FRAMING_HAVE_SIMD
+    if (framing_simd) {
+        const uint8x16_t va = vdupq_n_u8(a);
+        const uint8x16_t vb = vdupq_n_u8(b);
+
+        for (; i + 16 <= len; i += 16) {
+            uint8x16_t v = vld1q_u8(p + i);
+            uint8x16_t eq = vorrq_u8(vceqq_u8(v, va), vceqq_u8(v, vb));
+            // narrow to 4 bits per byte, NEON has no movemask
+            uint64_t mask = vget_lane_u64(vreinterpret_u64_u8(vshrn_n_u16(vreinterpretq_u16_u8(eq), 4)), 0);
+            if (mask) {
+                return i + (__builtin_ctzll(mask) >> 2);
+            }
+        }
+    }
+#endif
+
+    for (; i < len; i++) {
+        if (p[i] == a || p[i] == b) {
+            return i;
+        }
+    }
+
+    return len;
+}
+
+int
+xpt_framing_use_simd(xpt_boolean_t enable)
+{
+    framing_simd = FRAMING_HAVE_SIMD && enable;
+    return framing_simd;
+}
+
+size_t
+xpt_cobs_encode(const uint8_t* src, size_t len, uint8_t* dst)
+{
+    uint8_t* out = dst;
+    size_t limit;
+    size_t run;
+
+    while (1) {
+        limit = len < COBS_BLOCK ? len : COBS_BLOCK;
+        run = framing_scan(src, limit, 0, 0);
+
+        *out++ = (uint8_t) (run + 1);
+        memcpy(out, src, run);
+        out += run;
+        src += run;
+        len -= run;
+
+        if (run == COBS_BLOCK) {
+            // full block without a zero, the code itself implies none
+            if (len == 0) {
+                break;
+            }
+            continue;
+        }
+        if (len == 0) {
+            break;
+        }
+
+        // skip the zero the code stands for; a trailing zero still
+        // needs the empty block that follows it
+        src++;
+        len--;
+    }
+
+    *out++ = 0;
+    return out - dst;
+}
+
+int
+xpt_cobs_decode(uint8_t* buf, size_t len)
+{
+    size_t r = 0;
+    size_t w = 0;
+    size_t run;
+    uint8_t code;
+
+    while (r < len) {
+        code = buf[r++];
+        if (code == 0) {
+            return -1;
+        }
+
+        run = code - 1;
+        if (run > len - r) {
+            return -1;
+        }
+
+        memmove(buf + w, buf + r, run);
+        w += run;
+        r += run;
+
+        if (code != 0xff && r < len) {
+            buf[w++] = 0;
+        }
+    }
+
+    return (int) w;
+}
+
+size_t
+xpt_slip_encode(const uint8_t* src, size_t len, uint8_t* dst)
+{
+    uint8_t* out = dst;
+    size_t run;
+
+    // a leading END flushes line noise out of the receiver's frame
+    *out++ = XPT_SLIP_END;
+
+    while (len > 0) {
+        run = framing_scan(src, len, XPT_SLIP_END, XPT_SLIP_ESC);
+        memcpy(out, src, run);
+        out += run;
+        src += run;
+        len -= run;
+
+        if (len > 0) {
+            *out++ = XPT_SLIP_ESC;
+            *out++ = (*src == XPT_SLIP_END) ? XPT_SLIP_ESC_END : XPT_SLIP_ESC_ESC;
+            src++;
+            len--;
+        }
+    }
+
+    *out++ = XPT_SLIP_END;
+    return out - dst;
+}
+
+int
+xpt_slip_decode(uint8_t* buf, size_t len)
+{
+    size_t r = 0;
+    size_t w = 0;
+    size_t run;
+
+    while (r < len) {
+        run = framing_scan(buf + r, len - r, XPT_SLIP_ESC, XPT_SLIP_ESC);
+        memmove(buf + w, buf + r, run);
+        w += run;
+        r += run;
+
+        if (r == len) {
+            break;
+        }
+        if (r + 1 == len) {
+            return -1;
+        }
+
+        switch (buf[r + 1]) {
+            case XPT_SLIP_ESC_END:
+                buf[w++] = XPT_SLIP_END;
+                break;
+            case XPT_SLIP_ESC_ESC:
+                buf[w++] = XPT_SLIP_ESC;
+                break;
+            default:
+                return -1;
+        }
+        r += 2;
+    }
+
+    return (int) w;
+}
+
+xpt_framing_context
+xpt_framing_init(xpt_uart_context uart, xpt_framing_mode_t mode, size_t max_frame)
+{
+    xpt_framing_context dev;
+    size_t encoded;
+
+    if (uart == NULL) {
+        syslog(LOG_ERR, "framing: init: uart context is NULL");
+        return NULL;
+    }
+
+    if (max_frame == 0 || (mode != XPT_FRAMING_COBS && mode != XPT_FRAMING_SLIP)) {
+        syslog(LOG_ERR, "framing: init: invalid mode or frame size");
+        return NULL;
+    }
+
+    dev = (xpt_framing_context) calloc(1, sizeof(struct _framing));
+    if (dev == NULL) {
+        syslog(LOG_CRIT, "framing: init: Failed to allocate memory for context");
+        return NULL;
+    }
+
+    dev->uart = uart;
+    dev->mode = mode;
+    dev->delimiter = (mode == XPT_FRAMING_COBS) ? 0 : XPT_SLIP_END;
+    dev->max_frame = max_frame;
+
+    encoded = (mode == XPT_FRAMING_COBS) ? XPT_COBS_MAX_ENCODED(max_frame) : XPT_SLIP_MAX_ENCODED(max_frame);
+    dev->tx_size = encoded;
+    // room for a whole frame plus a large read behind it
+    dev->rx_size = encoded + (encoded > FRAMING_MIN_READ ? encoded : FRAMING_MIN_READ);
+
+    dev->rx = (uint8_t*) malloc(dev->rx_size);
+    dev->tx = (uint8_t*) malloc(dev->tx_size);
+    if (dev->rx == NULL || dev->tx == NULL) {
+        syslog(LOG_CRIT, "framing: init: Failed to allocate buffers");
+        free(dev->rx);
+        free(dev->tx);
+        free(dev);
+        return NULL;
+    }
+
+    return dev;
+}
+
+int
+xpt_framing_read_frame(xpt_framing_context dev, uint8_t** frame)
+{
+    size_t pos;
+    size_t len;
+    int ret;
+
+    if (dev == NULL || frame == NULL) {
+        syslog(LOG_ERR, "framing: read_frame: context is NULL");
+        return -1;
+    }
+
+    while (1) {
+        pos = dev->scanned + framing_scan(dev->rx + dev->scanned, dev->end - dev->scanned, dev->delimiter, dev->delimiter);
+        if (pos < dev->end) {
+            uint8_t* start = dev->rx + dev->start;
+
+            len = pos - dev->start;
+            dev->start = dev->scanned = pos + 1;
+
+            if (dev->discard) {
+                dev->discard = 0;
+                continue;
+            }
+            // back to back delimiters, or the leading END of SLIP
+            if (len == 0) {
+                continue;
+            }
+
+            ret = (dev->mode == XPT_FRAMING_COBS) ? xpt_cobs_decode(start, len) : xpt_slip_decode(start, len);
+            if (ret < 0) {
+                dev->stats.errors++;
+                continue;
+            }
+            if ((size_t) ret > dev->max_frame) {
+                dev->stats.oversize++;
+                continue;
+            }
+
+            dev->stats.frames++;
+            *frame = start;
+            return ret;
+        }
+        dev->scanned = dev->end;
+
+        // make room: move the partial frame to the front
+        if (dev->start > 0) {
+            memmove(dev->rx, dev->rx + dev->start, dev->end - dev->start);
+            dev->end -= dev->start;
+            dev->scanned = dev->end;
+            dev->start = 0;
+        }
+
+        // no delimiter in a full buffer, skip to the next one
+        if (dev->end - dev->start >= dev->tx_size) {
+            if (!dev->discard) {
+                dev->stats.oversize++;
+            }
+            dev->discard = 1;
+            dev->start = dev->scanned = dev->end = 0;
+        }
+
+        ret = xpt_uart_read(dev->uart, (char*) dev->rx + dev->end, dev->rx_size - dev->end);
+        if (ret <= 0) {
+            return -1;
+        }
+        dev->end += ret;
+    }
+}
+
+xpt_result_t
+xpt_framing_write_frame(xpt_framing_context dev, const uint8_t* data, size_t len)
+{
+    size_t encoded;
+    size_t sent = 0;
+    int ret;
+
+    if (dev == NULL) {
+        syslog(LOG_ERR, "framing: write_frame: context is NULL");
+        return XPT_ERROR_INVALID_HANDLE;
+    }
+
+    if (len > dev->max_frame) {
+        syslog(LOG_ERR, "framing: write_frame: frame of %zu bytes exceeds %zu", len, dev->max_frame);
+        return XPT_ERROR_INVALID_PARAMETER;
+    }
+
+    if (dev->mode == XPT_FRAMING_COBS) {
+        encoded = xpt_cobs_encode(data, len, dev->tx);
+    } else {
+        encoded = xpt_slip_encode(data, len, dev->tx);
+    }
+
+    while (sent < encoded) {
+        ret = xpt_uart_write(dev->uart, (const char*) dev->tx + sent, encoded - sent);
+        if (ret <= 0) {
+            syslog(LOG_ERR, "framing: write_frame: uart write failed");
+            return XPT_ERROR_UNSPECIFIED;
+        }
+        sent += ret;
+    }
+
+    return XPT_SUCCESS;
+}
+
+xpt_result_t
+xpt_framing_get_stats(xpt_framing_context dev, xpt_framing_stats_t* stats)
+{
+    if (dev == NULL || stats == NULL) {
+        syslog(LOG_ERR, "framing: get_stats: context is NULL");
+        return XPT_ERROR_INVALID_HANDLE;
+    }
+
+    *stats = dev->stats;
+    return XPT_SUCCESS;
+}
+
+xpt_result_t
+xpt_framing_stop(xpt_framing_context dev)
+{
+    if (dev == NULL) {
+        syslog(LOG_ERR, "framing: stop: context is NULL");
+        return XPT_ERROR_INVALID_HANDLE;
+    }
+
+    free(dev->rx);
+    free(dev->tx);
+    free(dev);
+    return XPT_SUCCESS;
+}
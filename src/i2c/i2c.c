@@ -44,6 +44,67 @@ int xpt_i2c_smbus_access(int fh, uint8_t read_write, uint8_t command, int size,
     return ioctl(fh, I2C_SMBUS, &args);
 }
 
+// one transaction with the bus held
+static int i2c_smbus(xpt_i2c_context dev, uint8_t read_write, uint8_t command, int size, i2c_smbus_data_t* data)
+{
+    xpt_arbiter_acquire(dev->arbiter, dev->prio);
+    int ret = xpt_i2c_smbus_access(dev->fh, read_write, command, size, data);
+    xpt_arbiter_release(dev->arbiter);
+    return ret;
+}
+
+static int i2c_rdwr(xpt_i2c_context dev, struct i2c_rdwr_ioctl_data* d)
+{
+    xpt_arbiter_acquire(dev->arbiter, dev->prio);
+    int ret = ioctl(dev->fh, I2C_RDWR, d);
+    xpt_arbiter_release(dev->arbiter);
+    return ret;
+}
+
+// Register read, in slices of dev->slice bytes if set; each slice is its
+// own transaction, so the bus is free for others in between
+static int i2c_read_reg(xpt_i2c_context dev, uint16_t reg, int reg_bytes, uint8_t* data, int length, const char* name)
+{
+    struct i2c_rdwr_ioctl_data d;
+    struct i2c_msg m[2];
+    uint8_t addr[2];
+    int done = 0;
+
+    do {
+        int chunk = length - done;
+        if (dev->slice > 0 && chunk > dev->slice) {
+            chunk = dev->slice;
+        }
+
+        if (reg_bytes == 2) {
+            addr[0] = (reg + done) >> 8;
+            addr[1] = (reg + done) & 0xff;
+        } else {
+            addr[0] = (reg + done) & 0xff;
+        }
+
+        m[0].addr = dev->addr;
+        m[0].flags = 0x00;
+        m[0].len = reg_bytes;
+        m[0].buf = (char*) addr;
+        m[1].addr = dev->addr;
+        m[1].flags = I2C_M_RD;
+        m[1].len = chunk;
+        m[1].buf = (char*) data + done;
+
+        d.msgs = m;
+        d.nmsgs = 2;
+
+        if (i2c_rdwr(dev, &d) < 0) {
+            syslog(LOG_ERR, "i2c%i: %s: Access error: %s", dev->busnum, name, strerror(errno));
+            return -1;
+        }
+        done += chunk;
+    } while (done < length);
+
+    return length;
+}
+
 static xpt_i2c_context xpt_i2c_init_internal(xpt_adv_func_t* advance_func, unsigned int bus)
 {
     xpt_result_t status = XPT_SUCCESS;
@@ -94,6 +155,8 @@ static xpt_i2c_context xpt_i2c_init_internal(xpt_adv_func_t* advance_func, unsig
 
 init_internal_cleanup:
     if (status == XPT_SUCCESS) {
+        dev->arbiter = xpt_arbiter_get(XPT_ARBITER_I2C, bus);
+        dev->prio = XPT_ARBITER_PRIO_NORMAL;
         return dev;
     } else {
         if (dev != NULL)
@@ -188,7 +251,9 @@ int xpt_i2c_read(xpt_i2c_context dev, uint8_t* data, int length)
         bytes_read = dev->advance_func->i2c_read_replace(dev, data, length);
     }
     else {
+        xpt_arbiter_acquire(dev->arbiter, dev->prio);
         bytes_read = read(dev->fh, data, length);
+        xpt_arbiter_release(dev->arbiter);
     }
     if (bytes_read == length) {
         return length;
@@ -207,7 +272,7 @@ int xpt_i2c_read_byte(xpt_i2c_context dev)
     if (IS_FUNC_DEFINED(dev, i2c_read_byte_replace))
         return dev->advance_func->i2c_read_byte_replace(dev);
     i2c_smbus_data_t d;
-    if (xpt_i2c_smbus_access(dev->fh, I2C_SMBUS_READ, I2C_NOCMD, I2C_SMBUS_BYTE, &d) < 0) {
+    if (i2c_smbus(dev, I2C_SMBUS_READ, I2C_NOCMD, I2C_SMBUS_BYTE, &d) < 0) {
         syslog(LOG_ERR, "i2c%i: read_byte: Access error: %s", dev->busnum, strerror(errno));
         return -1;
     }
@@ -224,7 +289,7 @@ int xpt_i2c_read_byte_data(xpt_i2c_context dev, uint8_t command)
     if (IS_FUNC_DEFINED(dev, i2c_read_byte_data_replace))
         return dev->advance_func->i2c_read_byte_data_replace(dev, command);
     i2c_smbus_data_t d;
-    if (xpt_i2c_smbus_access(dev->fh, I2C_SMBUS_READ, command, I2C_SMBUS_BYTE_DATA, &d) < 0) {
+    if (i2c_smbus(dev, I2C_SMBUS_READ, command, I2C_SMBUS_BYTE_DATA, &d) < 0) {
        syslog(LOG_ERR, "i2c%i: read_byte_data: Access error: %s", dev->busnum, strerror(errno));
        return -1;
     }
@@ -241,7 +306,7 @@ int xpt_i2c_read_word_data(xpt_i2c_context dev, uint8_t command)
     if (IS_FUNC_DEFINED(dev, i2c_read_word_data_replace))
         return dev->advance_func->i2c_read_word_data_replace(dev, command);
     i2c_smbus_data_t d;
-    if (xpt_i2c_smbus_access(dev->fh, I2C_SMBUS_READ, command, I2C_SMBUS_WORD_DATA, &d) < 0) {
+    if (i2c_smbus(dev, I2C_SMBUS_READ, command, I2C_SMBUS_WORD_DATA, &d) < 0) {
         syslog(LOG_ERR, "i2c%i: read_word_data: Access error: %s", dev->busnum, strerror(errno));
         return -1;
     }
@@ -257,29 +322,73 @@ int xpt_i2c_read_bytes_data(xpt_i2c_context dev, uint8_t command, uint8_t* data,
 
     if (IS_FUNC_DEFINED(dev, i2c_read_bytes_data_replace))
         return dev->advance_func->i2c_read_bytes_data_replace(dev, command, data, length);
+    return i2c_read_reg(dev, command, 1, data, length, "read_bytes_data");
+}
+
+int xpt_i2c_read_bytes_data16(xpt_i2c_context dev, uint16_t reg, uint8_t* data, int length)
+{
+    if (dev == NULL) {
+        syslog(LOG_ERR, "i2c: read_bytes_data16: context is invalid");
+        return -1;
+    }
+
+    if (length < 0 || length > 0xffff) {
+        syslog(LOG_ERR, "i2c%i: read_bytes_data16: invalid length %d", dev->busnum, length);
+        return -1;
+    }
+
+    return i2c_read_reg(dev, reg, 2, data, length, "read_bytes_data16");
+}
+
+xpt_result_t xpt_i2c_write_bytes_data16(xpt_i2c_context dev, uint16_t reg, const uint8_t* data, int length)
+{
     struct i2c_rdwr_ioctl_data d;
-    struct i2c_msg m[2];
+    struct i2c_msg m;
+    // address plus an EEPROM page fits without an allocation
+    uint8_t stack[2 + 256];
+    uint8_t* buf = stack;
+    int ret;
+
+    if (dev == NULL) {
+        syslog(LOG_ERR, "i2c: write_bytes_data16: context is invalid");
+        return XPT_ERROR_INVALID_HANDLE;
+    }
+
+    if (length < 0 || length > 0xffff - 2) {
+        syslog(LOG_ERR, "i2c%i: write_bytes_data16: invalid length %d", dev->busnum, length);
+        return XPT_ERROR_INVALID_PARAMETER;
+    }
 
-    m[0].addr = dev->addr;
-    m[0].flags = 0x00;
-    m[0].len = 1;
-    m[0].buf = (char*) &command;
-    m[1].addr = dev->addr;
-    m[1].flags = I2C_M_RD;
-    m[1].len = length;
-    m[1].buf = (char*) data;
+    if ((size_t) length + 2 > sizeof(stack)) {
+        buf = (uint8_t*) malloc(length + 2);
+        if (buf == NULL) {
+            syslog(LOG_CRIT, "i2c%i: write_bytes_data16: Failed to allocate buffer", dev->busnum);
+            return XPT_ERROR_NO_RESOURCES;
+        }
+    }
 
-    d.msgs = m;
-    d.nmsgs = 2;
+    buf[0] = reg >> 8;
+    buf[1] = reg & 0xff;
+    memcpy(buf + 2, data, length);
 
-    int ret = ioctl(dev->fh, I2C_RDWR, &d);
+    m.addr = dev->addr;
+    m.flags = 0x00;
+    m.len = length + 2;
+    m.buf = (char*) buf;
 
-    if (ret < 0)
-    {
-        syslog(LOG_ERR, "i2c%i: read_bytes_data: Access error: %s", dev->busnum, strerror(errno));
-        return -1;
+    d.msgs = &m;
+    d.nmsgs = 1;
+
+    ret = i2c_rdwr(dev, &d);
+    if (buf != stack) {
+        free(buf);
     }
-    return length;
+
+    if (ret < 0) {
+        syslog(LOG_ERR, "i2c%i: write_bytes_data16: Access error: %s", dev->busnum, strerror(errno));
+        return XPT_ERROR_UNSPECIFIED;
+    }
+    return XPT_SUCCESS;
 }
 
 xpt_result_t xpt_i2c_write(xpt_i2c_context dev, const uint8_t* data, int length)
@@ -306,7 +415,7 @@ xpt_result_t xpt_i2c_write(xpt_i2c_context dev, const uint8_t* data, int length)
     }
     d.block[0] = length;
 
-    if (xpt_i2c_smbus_access(dev->fh, I2C_SMBUS_WRITE, command, I2C_SMBUS_I2C_BLOCK_DATA, &d) < 0) {
+    if (i2c_smbus(dev, I2C_SMBUS_WRITE, command, I2C_SMBUS_I2C_BLOCK_DATA, &d) < 0) {
         syslog(LOG_ERR, "i2c%i: write: Access error: %s", dev->busnum, strerror(errno));
         return XPT_ERROR_UNSPECIFIED;
     }
@@ -323,7 +432,7 @@ xpt_result_t xpt_i2c_write_byte(xpt_i2c_context dev, const uint8_t data)
     if (IS_FUNC_DEFINED(dev, i2c_write_byte_replace)) {
         return dev->advance_func->i2c_write_byte_replace(dev, data);
     } else {
-        if (xpt_i2c_smbus_access(dev->fh, I2C_SMBUS_WRITE, data, I2C_SMBUS_BYTE, NULL) < 0) {
+        if (i2c_smbus(dev, I2C_SMBUS_WRITE, data, I2C_SMBUS_BYTE, NULL) < 0) {
             syslog(LOG_ERR, "i2c%i: write_byte: Access error: %s", dev->busnum, strerror(errno));
             return XPT_ERROR_UNSPECIFIED;
         }
@@ -342,7 +451,7 @@ xpt_result_t xpt_i2c_write_byte_data(xpt_i2c_context dev, const uint8_t data, co
         return dev->advance_func->i2c_write_byte_data_replace(dev, data, command);
     i2c_smbus_data_t d;
     d.byte = data;
-    if (xpt_i2c_smbus_access(dev->fh, I2C_SMBUS_WRITE, command, I2C_SMBUS_BYTE_DATA, &d) < 0) {
+    if (i2c_smbus(dev, I2C_SMBUS_WRITE, command, I2C_SMBUS_BYTE_DATA, &d) < 0) {
         syslog(LOG_ERR, "i2c%i: write_byte_data: Access error: %s", dev->busnum, strerror(errno));
         return XPT_ERROR_UNSPECIFIED;
     }
@@ -360,7 +469,7 @@ xpt_result_t xpt_i2c_write_word_data(xpt_i2c_context dev, const uint16_t data, c
         return dev->advance_func->i2c_write_word_data_replace(dev, data, command);
     i2c_smbus_data_t d;
     d.word = data;
-    if (xpt_i2c_smbus_access(dev->fh, I2C_SMBUS_WRITE, command, I2C_SMBUS_WORD_DATA, &d) < 0) {
+    if (i2c_smbus(dev, I2C_SMBUS_WRITE, command, I2C_SMBUS_WORD_DATA, &d) < 0) {
         syslog(LOG_ERR, "i2c%i: write_word_data: Access error: %s", dev->busnum, strerror(errno));
         return XPT_ERROR_UNSPECIFIED;
     }
@@ -387,6 +496,48 @@ xpt_result_t xpt_i2c_address(xpt_i2c_context dev, uint8_t addr)
 }
 
 
+xpt_result_t xpt_i2c_priority(xpt_i2c_context dev, xpt_arbiter_prio_t prio)
+{
+    if (dev == NULL) {
+        syslog(LOG_ERR, "i2c: priority: context is invalid");
+        return XPT_ERROR_INVALID_HANDLE;
+    }
+
+    if ((int) prio < 0 || prio >= XPT_ARBITER_PRIO_COUNT) {
+        syslog(LOG_ERR, "i2c%i: priority: invalid class %d", dev->busnum, prio);
+        return XPT_ERROR_INVALID_PARAMETER;
+    }
+
+    dev->prio = prio;
+    return XPT_SUCCESS;
+}
+
+xpt_result_t xpt_i2c_slice(xpt_i2c_context dev, int bytes)
+{
+    if (dev == NULL) {
+        syslog(LOG_ERR, "i2c: slice: context is invalid");
+        return XPT_ERROR_INVALID_HANDLE;
+    }
+
+    if (bytes < 0) {
+        syslog(LOG_ERR, "i2c%i: slice: invalid length %d", dev->busnum, bytes);
+        return XPT_ERROR_INVALID_PARAMETER;
+    }
+
+    dev->slice = bytes;
+    return XPT_SUCCESS;
+}
+
+xpt_arbiter_context xpt_i2c_get_arbiter(xpt_i2c_context dev)
+{
+    if (dev == NULL) {
+        syslog(LOG_ERR, "i2c: get_arbiter: context is invalid");
+        return NULL;
+    }
+
+    return dev->arbiter;
+}
+
 xpt_result_t xpt_i2c_stop(xpt_i2c_context dev)
 {
     if (dev == NULL) {
@@ -394,6 +545,9 @@ xpt_result_t xpt_i2c_stop(xpt_i2c_context dev)
         return XPT_ERROR_INVALID_HANDLE;
     }
 
+    xpt_arbiter_put(dev->arbiter);
+    dev->arbiter = NULL;
+
     if (IS_FUNC_DEFINED(dev, i2c_stop_replace)) {
         return dev->advance_func->i2c_stop_replace(dev);
     }
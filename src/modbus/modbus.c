@@ -0,0 +1,794 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <termios.h>
+#include <poll.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "modbus.h"
+#include "xpt_internal.h"
+
+#define MODBUS_MAX_ADU 256
+#define MODBUS_MIN_RESPONSE 5
+#define MODBUS_EXCEPTION_FLAG 0x80
+// Above 19200 baud the spec fixes the inter-frame gap instead of scaling it
+#define MODBUS_FIXED_GAP_BAUD 19200
+#define MODBUS_FIXED_GAP_US 1750
+#define MODBUS_DEFAULT_RESPONSE_MS 200
+#define MODBUS_DEFAULT_TURNAROUND_MS 100
+
+// One request/response cycle on the wire, answering one or more
+// coalesced requests chained through req->next.
+struct modbus_txn {
+    uint8_t slave;
+    uint8_t function;
+    uint16_t address;
+    uint16_t count;
+    xpt_modbus_request_t* reqs;
+    xpt_modbus_request_t* last;
+    struct modbus_txn* next;
+};
+
+struct _modbus {
+    xpt_uart_context uart;
+    pthread_mutex_t lock;
+    struct modbus_txn* head;
+    struct modbus_txn* tail;
+    unsigned int char_us; /**< time on the wire of one character */
+    unsigned int gap_us; /**< 3.5 character inter-frame gap */
+    unsigned int response_ms;
+    unsigned int slack_us;
+    unsigned int turnaround_ms;
+    xpt_boolean_t coalesce;
+    unsigned int max_hole;
+    xpt_boolean_t flush_rx;
+    struct timespec bus_idle; /**< earliest start of the next frame */
+    xpt_modbus_stats_t stats;
+};
+
+static const uint16_t modbus_crc_table[256] = {
+    0x0000, 0xc0c1, 0xc181, 0x0140, 0xc301, 0x03c0, 0x0280, 0xc241,
+    0xc601, 0x06c0, 0x0780, 0xc741, 0x0500, 0xc5c1, 0xc481, 0x0440,
+    0xcc01, 0x0cc0, 0x0d80, 0xcd41, 0x0f00, 0xcfc1, 0xce81, 0x0e40,
+    0x0a00, 0xcac1, 0xcb81, 0x0b40, 0xc901, 0x09c0, 0x0880, 0xc841,
+    0xd801, 0x18c0, 0x1980, 0xd941, 0x1b00, 0xdbc1, 0xda81, 0x1a40,
+    0x1e00, 0xdec1, 0xdf81, 0x1f40, 0xdd01, 0x1dc0, 0x1c80, 0xdc41,
+    0x1400, 0xd4c1, 0xd581, 0x1540, 0xd701, 0x17c0, 0x1680, 0xd641,
+    0xd201, 0x12c0, 0x1380, 0xd341, 0x1100, 0xd1c1, 0xd081, 0x1040,
+    0xf001, 0x30c0, 0x3180, 0xf141, 0x3300, 0xf3c1, 0xf281, 0x3240,
+    0x3600, 0xf6c1, 0xf781, 0x3740, 0xf501, 0x35c0, 0x3480, 0xf441,
+    0x3c00, 0xfcc1, 0xfd81, 0x3d40, 0xff01, 0x3fc0, 0x3e80, 0xfe41,
+    0xfa01, 0x3ac0, 0x3b80, 0xfb41, 0x3900, 0xf9c1, 0xf881, 0x3840,
+    0x2800, 0xe8c1, 0xe981, 0x2940, 0xeb01, 0x2bc0, 0x2a80, 0xea41,
+    0xee01, 0x2ec0, 0x2f80, 0xef41, 0x2d00, 0xedc1, 0xec81, 0x2c40,
+    0xe401, 0x24c0, 0x2580, 0xe541, 0x2700, 0xe7c1, 0xe681, 0x2640,
+    0x2200, 0xe2c1, 0xe381, 0x2340, 0xe101, 0x21c0, 0x2080, 0xe041,
+    0xa001, 0x60c0, 0x6180, 0xa141, 0x6300, 0xa3c1, 0xa281, 0x6240,
+    0x6600, 0xa6c1, 0xa781, 0x6740, 0xa501, 0x65c0, 0x6480, 0xa441,
+    0x6c00, 0xacc1, 0xad81, 0x6d40, 0xaf01, 0x6fc0, 0x6e80, 0xae41,
+    0xaa01, 0x6ac0, 0x6b80, 0xab41, 0x6900, 0xa9c1, 0xa881, 0x6840,
+    0x7800, 0xb8c1, 0xb981, 0x7940, 0xbb01, 0x7bc0, 0x7a80, 0xba41,
+    0xbe01, 0x7ec0, 0x7f80, 0xbf41, 0x7d00, 0xbdc1, 0xbc81, 0x7c40,
+    0xb401, 0x74c0, 0x7580, 0xb541, 0x7700, 0xb7c1, 0xb681, 0x7640,
+    0x7200, 0xb2c1, 0xb381, 0x7340, 0xb101, 0x71c0, 0x7080, 0xb041,
+    0x5000, 0x90c1, 0x9181, 0x5140, 0x9301, 0x53c0, 0x5280, 0x9241,
+    0x9601, 0x56c0, 0x5780, 0x9741, 0x5500, 0x95c1, 0x9481, 0x5440,
+    0x9c01, 0x5cc0, 0x5d80, 0x9d41, 0x5f00, 0x9fc1, 0x9e81, 0x5e40,
+    0x5a00, 0x9ac1, 0x9b81, 0x5b40, 0x9901, 0x59c0, 0x5880, 0x9841,
+    0x8801, 0x48c0, 0x4980, 0x8941, 0x4b00, 0x8bc1, 0x8a81, 0x4a40,
+    0x4e00, 0x8ec1, 0x8f81, 0x4f40, 0x8d01, 0x4dc0, 0x4c80, 0x8c41,
+    0x4400, 0x84c1, 0x8581, 0x4540, 0x8701, 0x47c0, 0x4680, 0x8641,
+    0x8201, 0x42c0, 0x4380, 0x8341, 0x4100, 0x81c1, 0x8081, 0x4040
+};
+
+uint16_t
+xpt_modbus_crc16(const uint8_t* buffer, uint16_t length)
+{
+    uint16_t crc = 0xffff;
+
+    while (length--) {
+        crc = (crc >> 8) ^ modbus_crc_table[(crc ^ *buffer++) & 0xff];
+    }
+    return crc;
+}
+
+static void
+ts_add_us(struct timespec* ts, long us)
+{
+    ts->tv_sec += us / 1000000;
+    ts->tv_nsec += (us % 1000000) * 1000;
+    if (ts->tv_nsec >= 1000000000) {
+        ts->tv_sec++;
+        ts->tv_nsec -= 1000000000;
+    }
+}
+
+// a - b in microseconds
+static long
+ts_diff_us(const struct timespec* a, const struct timespec* b)
+{
+    return (a->tv_sec - b->tv_sec) * 1000000L + (a->tv_nsec - b->tv_nsec) / 1000;
+}
+
+static xpt_boolean_t
+modbus_is_read(uint8_t function)
+{
+    return function >= XPT_MODBUS_READ_COILS && function <= XPT_MODBUS_READ_INPUT_REGISTERS;
+}
+
+static xpt_boolean_t
+modbus_is_bits(uint8_t function)
+{
+    return function == XPT_MODBUS_READ_COILS || function == XPT_MODBUS_READ_DISCRETE_INPUTS;
+}
+
+static unsigned int
+modbus_read_limit(uint8_t function)
+{
+    return modbus_is_bits(function) ? XPT_MODBUS_MAX_READ_BITS : XPT_MODBUS_MAX_READ_REGS;
+}
+
+xpt_result_t
+xpt_modbus_update_timing(xpt_modbus_context dev)
+{
+    struct termios termio;
+    unsigned int baud = 0;
+    unsigned int bits;
+
+    if (!dev) {
+        syslog(LOG_ERR, "modbus: update_timing: context is NULL");
+        return XPT_ERROR_INVALID_HANDLE;
+    }
+
+    xpt_uart_get_baudrate(dev->uart, &baud);
+    if (baud == 0) {
+        syslog(LOG_NOTICE, "modbus: baudrate unknown, assuming 9600");
+        baud = 9600;
+    }
+
+    // start bit + data bits + parity + stop bits
+    bits = 1 + 8 + 1;
+    if (tcgetattr(dev->uart->fd, &termio) == 0) {
+        switch (termio.c_cflag & CSIZE) {
+            case CS5:
+                bits = 1 + 5;
+                break;
+            case CS6:
+                bits = 1 + 6;
+                break;
+            case CS7:
+                bits = 1 + 7;
+                break;
+            default:
+                bits = 1 + 8;
+                break;
+        }
+        bits += (termio.c_cflag & PARENB) ? 1 : 0;
+        bits += (termio.c_cflag & CSTOPB) ? 2 : 1;
+    }
+
+    dev->char_us = (bits * 1000000 + baud - 1) / baud;
+    if (baud > MODBUS_FIXED_GAP_BAUD) {
+        dev->gap_us = MODBUS_FIXED_GAP_US;
+    } else {
+        dev->gap_us = (dev->char_us * 7 + 1) / 2;
+    }
+
+    return XPT_SUCCESS;
+}
+
+xpt_modbus_context
+xpt_modbus_init(xpt_uart_context uart)
+{
+    if (!uart) {
+        syslog(LOG_ERR, "modbus: init: uart context is NULL");
+        return NULL;
+    }
+
+    xpt_modbus_context dev = (xpt_modbus_context) calloc(1, sizeof(struct _modbus));
+    if (dev == NULL) {
+        syslog(LOG_CRIT, "modbus: Failed to allocate memory for context");
+        return NULL;
+    }
+
+    dev->uart = uart;
+    dev->response_ms = MODBUS_DEFAULT_RESPONSE_MS;
+    dev->turnaround_ms = MODBUS_DEFAULT_TURNAROUND_MS;
+    dev->coalesce = 1;
+    dev->max_hole = 0;
+    dev->flush_rx = 1;
+    pthread_mutex_init(&dev->lock, NULL);
+    clock_gettime(CLOCK_MONOTONIC, &dev->bus_idle);
+
+    xpt_modbus_update_timing(dev);
+
+    return dev;
+}
+
+static void
+modbus_complete(xpt_modbus_context dev, struct modbus_txn* txn, xpt_result_t status, uint8_t exception)
+{
+    xpt_modbus_request_t* req = txn->reqs;
+    xpt_modbus_request_t* next;
+
+    while (req != NULL) {
+        next = req->next;
+        req->next = NULL;
+        req->status = status;
+        req->exception = exception;
+        req->done = 1;
+        dev->stats.requests++;
+        if (req->callback != NULL) {
+            req->callback(req, req->arg);
+        }
+        req = next;
+    }
+    free(txn);
+}
+
+xpt_result_t
+xpt_modbus_stop(xpt_modbus_context dev)
+{
+    struct modbus_txn* txn;
+
+    if (!dev) {
+        syslog(LOG_ERR, "modbus: stop: context is NULL");
+        return XPT_ERROR_INVALID_HANDLE;
+    }
+
+    while ((txn = dev->head) != NULL) {
+        dev->head = txn->next;
+        modbus_complete(dev, txn, XPT_ERROR_INVALID_HANDLE, 0);
+    }
+
+    pthread_mutex_destroy(&dev->lock);
+    free(dev);
+
+    return XPT_SUCCESS;
+}
+
+xpt_result_t
+xpt_modbus_set_timeout(xpt_modbus_context dev, unsigned int response_ms, unsigned int slack_us)
+{
+    if (!dev) {
+        syslog(LOG_ERR, "modbus: set_timeout: context is NULL");
+        return XPT_ERROR_INVALID_HANDLE;
+    }
+
+    dev->response_ms = response_ms;
+    dev->slack_us = slack_us;
+
+    return XPT_SUCCESS;
+}
+
+xpt_result_t
+xpt_modbus_set_coalesce(xpt_modbus_context dev, xpt_boolean_t enable, unsigned int max_hole)
+{
+    if (!dev) {
+        syslog(LOG_ERR, "modbus: set_coalesce: context is NULL");
+        return XPT_ERROR_INVALID_HANDLE;
+    }
+
+    pthread_mutex_lock(&dev->lock);
+    dev->coalesce = enable;
+    dev->max_hole = max_hole;
+    pthread_mutex_unlock(&dev->lock);
+
+    return XPT_SUCCESS;
+}
+
+static xpt_result_t
+modbus_check_request(xpt_modbus_request_t* req)
+{
+    switch (req->function) {
+        case XPT_MODBUS_READ_COILS:
+        case XPT_MODBUS_READ_DISCRETE_INPUTS:
+            if (req->bits == NULL || req->count == 0 || req->count > XPT_MODBUS_MAX_READ_BITS) {
+                return XPT_ERROR_INVALID_PARAMETER;
+            }
+            break;
+        case XPT_MODBUS_READ_HOLDING_REGISTERS:
+        case XPT_MODBUS_READ_INPUT_REGISTERS:
+            if (req->regs == NULL || req->count == 0 || req->count > XPT_MODBUS_MAX_READ_REGS) {
+                return XPT_ERROR_INVALID_PARAMETER;
+            }
+            break;
+        case XPT_MODBUS_WRITE_SINGLE_COIL:
+            if (req->bits == NULL) {
+                return XPT_ERROR_INVALID_PARAMETER;
+            }
+            req->count = 1;
+            break;
+        case XPT_MODBUS_WRITE_SINGLE_REGISTER:
+            if (req->regs == NULL) {
+                return XPT_ERROR_INVALID_PARAMETER;
+            }
+            req->count = 1;
+            break;
+        case XPT_MODBUS_WRITE_MULTIPLE_REGISTERS:
+            if (req->regs == NULL || req->count == 0 || req->count > XPT_MODBUS_MAX_WRITE_REGS) {
+                return XPT_ERROR_INVALID_PARAMETER;
+            }
+            break;
+        default:
+            return XPT_ERROR_FEATURE_NOT_SUPPORTED;
+    }
+
+    // reads have nothing to broadcast back
+    if (req->slave == 0 && modbus_is_read(req->function)) {
+        return XPT_ERROR_INVALID_PARAMETER;
+    }
+    if (req->slave > 247) {
+        return XPT_ERROR_INVALID_PARAMETER;
+    }
+
+    return XPT_SUCCESS;
+}
+
+// Can a read of count items at address by slave be answered by txn once
+// txn is widened to cover both?
+static xpt_boolean_t
+modbus_can_merge(xpt_modbus_context dev, struct modbus_txn* txn, uint8_t slave, uint8_t function,
+                 unsigned int address, unsigned int count)
+{
+    unsigned int lo, hi, hole;
+    unsigned int end = address + count;
+    unsigned int txn_end = txn->address + txn->count;
+
+    if (txn->slave != slave || txn->function != function) {
+        return 0;
+    }
+
+    lo = address < txn->address ? address : txn->address;
+    hi = end > txn_end ? end : txn_end;
+    if (hi - lo > modbus_read_limit(function)) {
+        return 0;
+    }
+
+    hole = 0;
+    if (address > txn_end) {
+        hole = address - txn_end;
+    } else if (txn->address > end) {
+        hole = txn->address - end;
+    }
+
+    return hole <= dev->max_hole;
+}
+
+static void
+modbus_widen(struct modbus_txn* txn, unsigned int address, unsigned int count)
+{
+    unsigned int end = address + count;
+    unsigned int txn_end = txn->address + txn->count;
+
+    if (address < txn->address) {
+        txn->address = address;
+    }
+    txn->count = (end > txn_end ? end : txn_end) - txn->address;
+}
+
+// After target grew, fold other queued reads of the window into it that
+// now touch its range. The caller holds the lock.
+static void
+modbus_fold(xpt_modbus_context dev, struct modbus_txn* window, struct modbus_txn* target)
+{
+    struct modbus_txn* prev = NULL;
+    struct modbus_txn* txn;
+    xpt_boolean_t folded = 1;
+
+    while (folded) {
+        folded = 0;
+        prev = NULL;
+        for (txn = dev->head; txn != window; txn = txn->next) {
+            prev = txn;
+        }
+        for (txn = window; txn != NULL; prev = txn, txn = txn->next) {
+            if (txn->slave == target->slave && !modbus_is_read(txn->function)) {
+                break;
+            }
+            if (txn == target || !modbus_can_merge(dev, target, txn->slave, txn->function,
+                                                   txn->address, txn->count)) {
+                continue;
+            }
+
+            modbus_widen(target, txn->address, txn->count);
+            /* the others were counted when they joined txn */
+            dev->stats.coalesced++;
+            target->last->next = txn->reqs;
+            target->last = txn->last;
+
+            if (prev != NULL) {
+                prev->next = txn->next;
+            } else {
+                dev->head = txn->next;
+            }
+            if (dev->tail == txn) {
+                dev->tail = prev;
+            }
+            if (window == txn) {
+                window = txn->next;
+            }
+            free(txn);
+            folded = 1;
+            break;
+        }
+    }
+}
+
+xpt_result_t
+xpt_modbus_submit(xpt_modbus_context dev, xpt_modbus_request_t* req)
+{
+    struct modbus_txn* txn;
+    struct modbus_txn* window = NULL;
+    struct modbus_txn* target = NULL;
+    xpt_result_t ret;
+
+    if (!dev || !req) {
+        syslog(LOG_ERR, "modbus: submit: context is NULL");
+        return XPT_ERROR_INVALID_HANDLE;
+    }
+
+    ret = modbus_check_request(req);
+    if (ret != XPT_SUCCESS) {
+        return ret;
+    }
+
+    req->next = NULL;
+    req->done = 0;
+    req->status = XPT_SUCCESS;
+    req->exception = 0;
+
+    pthread_mutex_lock(&dev->lock);
+
+    // Only merge with reads queued after the last write to this slave,
+    // a read must neither overtake a write it was queued behind nor be
+    // held back behind one queued after it.
+    if (dev->coalesce && modbus_is_read(req->function)) {
+        window = dev->head;
+        for (txn = dev->head; txn != NULL; txn = txn->next) {
+            if (txn->slave == req->slave && !modbus_is_read(txn->function)) {
+                window = txn->next;
+                target = NULL;
+            } else if (modbus_can_merge(dev, txn, req->slave, req->function, req->address, req->count)) {
+                target = txn;
+            }
+        }
+    }
+
+    if (target != NULL) {
+        modbus_widen(target, req->address, req->count);
+        target->last->next = req;
+        target->last = req;
+        modbus_fold(dev, window, target);
+        dev->stats.coalesced++;
+        pthread_mutex_unlock(&dev->lock);
+        return XPT_SUCCESS;
+    }
+
+    txn = (struct modbus_txn*) calloc(1, sizeof(struct modbus_txn));
+    if (txn == NULL) {
+        pthread_mutex_unlock(&dev->lock);
+        syslog(LOG_CRIT, "modbus: Failed to allocate memory for request");
+        return XPT_ERROR_NO_RESOURCES;
+    }
+    txn->slave = req->slave;
+    txn->function = req->function;
+    txn->address = req->address;
+    txn->count = req->count;
+    txn->reqs = req;
+    txn->last = req;
+
+    if (dev->tail != NULL) {
+        dev->tail->next = txn;
+    } else {
+        dev->head = txn;
+    }
+    dev->tail = txn;
+
+    pthread_mutex_unlock(&dev->lock);
+
+    return XPT_SUCCESS;
+}
+
+// Build the request frame, returns its length and the expected response length
+static int
+modbus_build(struct modbus_txn* txn, uint8_t* adu, int* expected)
+{
+    xpt_modbus_request_t* req = txn->reqs;
+    uint16_t crc;
+    int len = 0;
+    int i;
+
+    adu[len++] = txn->slave;
+    adu[len++] = txn->function;
+    adu[len++] = txn->address >> 8;
+    adu[len++] = txn->address & 0xff;
+
+    switch (txn->function) {
+        case XPT_MODBUS_WRITE_SINGLE_COIL:
+            adu[len++] = req->bits[0] ? 0xff : 0x00;
+            adu[len++] = 0x00;
+            *expected = 8;
+            break;
+        case XPT_MODBUS_WRITE_SINGLE_REGISTER:
+            adu[len++] = req->regs[0] >> 8;
+            adu[len++] = req->regs[0] & 0xff;
+            *expected = 8;
+            break;
+        case XPT_MODBUS_WRITE_MULTIPLE_REGISTERS:
+            adu[len++] = txn->count >> 8;
+            adu[len++] = txn->count & 0xff;
+            adu[len++] = txn->count * 2;
+            for (i = 0; i < txn->count; i++) {
+                adu[len++] = req->regs[i] >> 8;
+                adu[len++] = req->regs[i] & 0xff;
+            }
+            *expected = 8;
+            break;
+        default:
+            adu[len++] = txn->count >> 8;
+            adu[len++] = txn->count & 0xff;
+            // slave, function, byte count, data, crc
+            if (modbus_is_bits(txn->function)) {
+                *expected = 3 + (txn->count + 7) / 8 + 2;
+            } else {
+                *expected = 3 + txn->count * 2 + 2;
+            }
+            break;
+    }
+
+    crc = xpt_modbus_crc16(adu, len);
+    adu[len++] = crc & 0xff;
+    adu[len++] = crc >> 8;
+
+    return len;
+}
+
+// Receive one response. The frame is over when the expected number of
+// bytes is in, an exception frame is complete, or the line stayed idle
+// for the inter-frame gap after the last byte.
+static int
+modbus_receive(xpt_modbus_context dev, uint8_t* adu, int expected, const struct timespec* tx_end,
+               struct timespec* last_rx)
+{
+    struct timespec deadline = *tx_end;
+    struct timespec now;
+    struct timespec left;
+    struct pollfd pfd;
+    long wait_us;
+    int len = 0;
+    int n;
+
+    ts_add_us(&deadline, dev->response_ms * 1000L);
+
+    pfd.fd = dev->uart->fd;
+    pfd.events = POLLIN;
+
+    while (len < MODBUS_MAX_ADU) {
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        if (len == 0) {
+            wait_us = ts_diff_us(&deadline, &now);
+        } else {
+            wait_us = ts_diff_us(last_rx, &now) + dev->gap_us + dev->slack_us;
+        }
+        if (wait_us <= 0) {
+            break;
+        }
+
+        left.tv_sec = wait_us / 1000000;
+        left.tv_nsec = (wait_us % 1000000) * 1000;
+        n = ppoll(&pfd, 1, &left, NULL);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            break;
+        }
+
+        n = xpt_uart_read(dev->uart, (char*) &adu[len], MODBUS_MAX_ADU - len);
+        if (n <= 0) {
+            break;
+        }
+        clock_gettime(CLOCK_MONOTONIC, last_rx);
+        len += n;
+
+        if (len >= expected) {
+            break;
+        }
+        if (len >= MODBUS_MIN_RESPONSE && (adu[1] & MODBUS_EXCEPTION_FLAG)) {
+            break;
+        }
+    }
+
+    return len;
+}
+
+static void
+modbus_unpack(struct modbus_txn* txn, const uint8_t* data)
+{
+    xpt_modbus_request_t* req;
+    int off;
+    int i;
+
+    for (req = txn->reqs; req != NULL; req = req->next) {
+        off = req->address - txn->address;
+        for (i = 0; i < req->count; i++) {
+            if (modbus_is_bits(txn->function)) {
+                req->bits[i] = (data[(off + i) / 8] >> ((off + i) % 8)) & 1;
+            } else {
+                req->regs[i] = (data[(off + i) * 2] << 8) | data[(off + i) * 2 + 1];
+            }
+        }
+    }
+}
+
+// Check a complete response frame, returns the status for the transaction
+static xpt_result_t
+modbus_check_response(xpt_modbus_context dev, struct modbus_txn* txn, const uint8_t* adu, int len,
+                      int expected, uint8_t* exception)
+{
+    uint16_t crc;
+
+    if (len == 0) {
+        dev->stats.timeouts++;
+        return XPT_ERROR_MODBUS_TIMEOUT;
+    }
+
+    if (len < MODBUS_MIN_RESPONSE) {
+        dev->stats.crc_errors++;
+        return XPT_ERROR_MODBUS_CRC;
+    }
+
+    crc = xpt_modbus_crc16(adu, len - 2);
+    if (adu[len - 2] != (crc & 0xff) || adu[len - 1] != (crc >> 8) || adu[0] != txn->slave) {
+        dev->stats.crc_errors++;
+        return XPT_ERROR_MODBUS_CRC;
+    }
+
+    if (adu[1] == (txn->function | MODBUS_EXCEPTION_FLAG)) {
+        *exception = adu[2];
+        dev->stats.exceptions++;
+        return XPT_ERROR_MODBUS_EXCEPTION;
+    }
+
+    if (adu[1] != txn->function || len != expected) {
+        dev->stats.crc_errors++;
+        return XPT_ERROR_MODBUS_CRC;
+    }
+
+    if (modbus_is_read(txn->function) && adu[2] != expected - 5) {
+        dev->stats.crc_errors++;
+        return XPT_ERROR_MODBUS_CRC;
+    }
+
+    return XPT_SUCCESS;
+}
+
+static xpt_result_t
+modbus_transact(xpt_modbus_context dev, struct modbus_txn* txn, uint8_t* exception)
+{
+    uint8_t adu[MODBUS_MAX_ADU];
+    struct timespec tx_end;
+    struct timespec last_rx;
+    xpt_result_t ret;
+    int expected = 0;
+    int len;
+
+    len = modbus_build(txn, adu, &expected);
+
+    // keep the line quiet for the inter-frame gap since the last frame
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &dev->bus_idle, NULL) == EINTR) {
+    }
+
+    // drop the tail of a corrupt or late response before the next request
+    if (dev->flush_rx) {
+        tcflush(dev->uart->fd, TCIFLUSH);
+        dev->flush_rx = 0;
+    }
+
+    if (xpt_uart_write(dev->uart, (const char*) adu, len) != len) {
+        syslog(LOG_ERR, "modbus: write to uart%i failed", dev->uart->index);
+        dev->flush_rx = 1;
+        return XPT_ERROR_INVALID_RESOURCE;
+    }
+    dev->stats.transactions++;
+
+    // the frame is still being shifted out after write() returns
+    clock_gettime(CLOCK_MONOTONIC, &tx_end);
+    ts_add_us(&tx_end, (long) len * dev->char_us);
+
+    if (txn->slave == 0) {
+        dev->bus_idle = tx_end;
+        ts_add_us(&dev->bus_idle, dev->turnaround_ms * 1000L);
+        return XPT_SUCCESS;
+    }
+
+    last_rx = tx_end;
+    len = modbus_receive(dev, adu, expected, &tx_end, &last_rx);
+
+    dev->bus_idle = last_rx;
+    ts_add_us(&dev->bus_idle, dev->gap_us);
+
+    ret = modbus_check_response(dev, txn, adu, len, expected, exception);
+    if (ret == XPT_SUCCESS) {
+        if (modbus_is_read(txn->function)) {
+            modbus_unpack(txn, &adu[3]);
+        }
+    } else if (ret != XPT_ERROR_MODBUS_EXCEPTION) {
+        dev->flush_rx = 1;
+    }
+
+    return ret;
+}
+
+int
+xpt_modbus_process(xpt_modbus_context dev, int max)
+{
+    struct modbus_txn* txn;
+    xpt_result_t ret;
+    uint8_t exception;
+    int done = 0;
+
+    if (!dev) {
+        syslog(LOG_ERR, "modbus: process: context is NULL");
+        return -1;
+    }
+
+    while (max == 0 || done < max) {
+        pthread_mutex_lock(&dev->lock);
+        txn = dev->head;
+        if (txn != NULL) {
+            dev->head = txn->next;
+            if (dev->head == NULL) {
+                dev->tail = NULL;
+            }
+        }
+        pthread_mutex_unlock(&dev->lock);
+
+        if (txn == NULL) {
+            break;
+        }
+
+        exception = 0;
+        ret = modbus_transact(dev, txn, &exception);
+        modbus_complete(dev, txn, ret, exception);
+        done++;
+    }
+
+    return done;
+}
+
+xpt_result_t
+xpt_modbus_execute(xpt_modbus_context dev, xpt_modbus_request_t* req)
+{
+    xpt_result_t ret;
+
+    ret = xpt_modbus_submit(dev, req);
+    if (ret != XPT_SUCCESS) {
+        return ret;
+    }
+
+    while (!req->done) {
+        if (xpt_modbus_process(dev, 1) <= 0) {
+            break;
+        }
+    }
+
+    return req->status;
+}
+
+xpt_result_t
+xpt_modbus_get_stats(xpt_modbus_context dev, xpt_modbus_stats_t* stats)
+{
+    if (!dev || !stats) {
+        syslog(LOG_ERR, "modbus: get_stats: context is NULL");
+        return XPT_ERROR_INVALID_HANDLE;
+    }
+
+    *stats = dev->stats;
+
+    return XPT_SUCCESS;
+}
@@ -0,0 +1,453 @@
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "regmap.h"
+#include "xpt_internal.h"
+
+/* most registers per write with an 8-bit address, the SMBus block limit */
+#define REGMAP_I2C_BLOCK_MAX 32
+/* most registers per transfer on the other buses unless configured */
+#define REGMAP_BURST_DEFAULT 256
+/*
+ * Longest run of clean registers rewritten to merge two dirty runs into
+ * one burst; a few more data bytes are cheaper than another transfer.
+ */
+#define REGMAP_MAX_GAP 4
+
+/* state bits */
+#define REGMAP_VALID 0x01
+#define REGMAP_DIRTY 0x02
+
+struct _regmap {
+    xpt_i2c_context i2c;
+    xpt_spi_context spi;
+    xpt_regmap_config_t config;
+    unsigned int max_burst;
+    pthread_mutex_t lock;
+    uint8_t* cache;
+    uint8_t* flags; /**< xpt_regmap_flag_t of each register */
+    uint8_t* state;
+    uint8_t* txbuf; /**< spi address plus data, max_burst + 2 bytes */
+    uint8_t* rxbuf;
+    xpt_regmap_stats_t stats;
+};
+
+static xpt_result_t
+regmap_bus_read(xpt_regmap_context map, unsigned int reg, uint8_t* data, unsigned int count)
+{
+    int len = map->config.reg_bits / 8;
+
+    map->stats.bus_reads++;
+
+    if (map->i2c != NULL) {
+        int ret;
+
+        if (len == 1) {
+            ret = xpt_i2c_read_bytes_data(map->i2c, reg, data, count);
+        } else {
+            ret = xpt_i2c_read_bytes_data16(map->i2c, reg, data, count);
+        }
+        return ret == (int) count ? XPT_SUCCESS : XPT_ERROR_UNSPECIFIED;
+    }
+
+    if (len == 1) {
+        map->txbuf[0] = reg | map->config.spi_read_flag;
+    } else {
+        map->txbuf[0] = (reg >> 8) | map->config.spi_read_flag;
+        map->txbuf[1] = reg & 0xff;
+    }
+    memset(map->txbuf + len, 0, count);
+    if (xpt_spi_transfer_buf(map->spi, map->txbuf, map->rxbuf, len + count) != XPT_SUCCESS) {
+        return XPT_ERROR_UNSPECIFIED;
+    }
+    memcpy(data, map->rxbuf + len, count);
+    return XPT_SUCCESS;
+}
+
+static xpt_result_t
+regmap_bus_write(xpt_regmap_context map, unsigned int reg, const uint8_t* data, unsigned int count)
+{
+    int len = map->config.reg_bits / 8;
+
+    map->stats.bus_writes++;
+
+    if (map->i2c != NULL) {
+        if (len == 1) {
+            map->txbuf[0] = reg;
+            memcpy(map->txbuf + 1, data, count);
+            return xpt_i2c_write(map->i2c, map->txbuf, count + 1);
+        }
+        return xpt_i2c_write_bytes_data16(map->i2c, reg, data, count);
+    }
+
+    if (len == 1) {
+        map->txbuf[0] = reg | map->config.spi_write_flag;
+    } else {
+        map->txbuf[0] = (reg >> 8) | map->config.spi_write_flag;
+        map->txbuf[1] = reg & 0xff;
+    }
+    memcpy(map->txbuf + len, data, count);
+    return xpt_spi_transfer_buf(map->spi, map->txbuf, NULL, len + count);
+}
+
+/* whether reg may be served from and kept in the cache */
+static int
+regmap_cacheable(xpt_regmap_context map, unsigned int reg)
+{
+    return !(map->flags[reg] & (XPT_REGMAP_VOLATILE | XPT_REGMAP_NO_ACCESS));
+}
+
+static void
+regmap_load_defaults(xpt_regmap_context map)
+{
+    unsigned int reg;
+
+    for (reg = 0; reg <= map->config.max_register; reg++) {
+        if (map->state[reg] & REGMAP_DIRTY) {
+            continue;
+        }
+        if (map->config.defaults != NULL && regmap_cacheable(map, reg)) {
+            map->cache[reg] = map->config.defaults[reg];
+            map->state[reg] = REGMAP_VALID;
+        } else {
+            map->state[reg] = 0;
+        }
+    }
+}
+
+static xpt_regmap_context
+regmap_init(xpt_i2c_context i2c, xpt_spi_context spi, const xpt_regmap_config_t* config)
+{
+    xpt_regmap_context map;
+    unsigned int nregs;
+    unsigned int reg;
+    int i;
+
+    if (config == NULL || (config->reg_bits != 8 && config->reg_bits != 16) ||
+        config->max_register >= (1U << config->reg_bits) || (config->num_ranges > 0 && config->ranges == NULL)) {
+        syslog(LOG_ERR, "regmap: init: invalid configuration");
+        return NULL;
+    }
+
+    map = (xpt_regmap_context) calloc(1, sizeof(struct _regmap));
+    if (map == NULL) {
+        syslog(LOG_CRIT, "regmap: init: Failed to allocate memory for context");
+        return NULL;
+    }
+
+    map->i2c = i2c;
+    map->spi = spi;
+    map->config = *config;
+
+    map->max_burst = config->max_burst != 0 ? config->max_burst : REGMAP_BURST_DEFAULT;
+    if (i2c != NULL && config->reg_bits == 8 && map->max_burst > REGMAP_I2C_BLOCK_MAX) {
+        map->max_burst = REGMAP_I2C_BLOCK_MAX;
+    }
+
+    nregs = config->max_register + 1;
+    map->cache = (uint8_t*) calloc(nregs, 3);
+    map->txbuf = (uint8_t*) malloc(2 * (map->max_burst + 2));
+    if (map->cache == NULL || map->txbuf == NULL) {
+        syslog(LOG_CRIT, "regmap: init: Failed to allocate memory for cache");
+        free(map->cache);
+        free(map->txbuf);
+        free(map);
+        return NULL;
+    }
+    map->flags = map->cache + nregs;
+    map->state = map->flags + nregs;
+    map->rxbuf = map->txbuf + map->max_burst + 2;
+
+    for (i = 0; i < config->num_ranges; i++) {
+        for (reg = config->ranges[i].first; reg <= config->ranges[i].last && reg < nregs; reg++) {
+            map->flags[reg] |= config->ranges[i].flags;
+        }
+    }
+    regmap_load_defaults(map);
+
+    pthread_mutex_init(&map->lock, NULL);
+    return map;
+}
+
+xpt_regmap_context
+xpt_regmap_init_i2c(xpt_i2c_context dev, const xpt_regmap_config_t* config)
+{
+    if (dev == NULL) {
+        syslog(LOG_ERR, "regmap: init_i2c: i2c context is invalid");
+        return NULL;
+    }
+    return regmap_init(dev, NULL, config);
+}
+
+xpt_regmap_context
+xpt_regmap_init_spi(xpt_spi_context dev, const xpt_regmap_config_t* config)
+{
+    if (dev == NULL) {
+        syslog(LOG_ERR, "regmap: init_spi: spi context is invalid");
+        return NULL;
+    }
+    return regmap_init(NULL, dev, config);
+}
+
+static xpt_result_t
+regmap_read(xpt_regmap_context map, unsigned int reg, uint8_t* data, int count)
+{
+    unsigned int end;
+    unsigned int run;
+    unsigned int i;
+    xpt_result_t ret;
+
+    if (count <= 0 || reg + count - 1 > map->config.max_register) {
+        return XPT_ERROR_INVALID_PARAMETER;
+    }
+    end = reg + count;
+
+    while (reg < end) {
+        if (map->flags[reg] & XPT_REGMAP_NO_ACCESS) {
+            return XPT_ERROR_INVALID_PARAMETER;
+        }
+        map->stats.reads++;
+        if (map->state[reg] & REGMAP_VALID) {
+            map->stats.cache_hits++;
+            *data++ = map->cache[reg++];
+            continue;
+        }
+        if (map->flags[reg] & XPT_REGMAP_WRITE_ONLY) {
+            /* never written, its value is unknown */
+            return XPT_ERROR_INVALID_PARAMETER;
+        }
+
+        /* one transfer for the registers up to the next cached one */
+        for (run = 1; reg + run < end && run < map->max_burst; run++) {
+            i = reg + run;
+            if ((map->state[i] & REGMAP_VALID) || (map->flags[i] & (XPT_REGMAP_NO_ACCESS | XPT_REGMAP_WRITE_ONLY))) {
+                break;
+            }
+        }
+        ret = regmap_bus_read(map, reg, data, run);
+        if (ret != XPT_SUCCESS) {
+            return ret;
+        }
+        map->stats.reads += run - 1;
+        for (i = 0; i < run; i++, reg++) {
+            if (regmap_cacheable(map, reg)) {
+                map->cache[reg] = data[i];
+                map->state[reg] |= REGMAP_VALID;
+            }
+        }
+        data += run;
+    }
+    return XPT_SUCCESS;
+}
+
+static xpt_result_t
+regmap_write(xpt_regmap_context map, unsigned int reg, uint8_t value)
+{
+    if (reg > map->config.max_register || (map->flags[reg] & (XPT_REGMAP_READ_ONLY | XPT_REGMAP_NO_ACCESS))) {
+        return XPT_ERROR_INVALID_PARAMETER;
+    }
+
+    map->stats.writes++;
+    if (map->flags[reg] & XPT_REGMAP_VOLATILE) {
+        return regmap_bus_write(map, reg, &value, 1);
+    }
+    if ((map->state[reg] & REGMAP_VALID) && map->cache[reg] == value) {
+        map->stats.skipped++;
+        return XPT_SUCCESS;
+    }
+    map->cache[reg] = value;
+    map->state[reg] = REGMAP_VALID | REGMAP_DIRTY;
+    return XPT_SUCCESS;
+}
+
+int
+xpt_regmap_read(xpt_regmap_context map, unsigned int reg)
+{
+    uint8_t value;
+    xpt_result_t ret;
+
+    if (map == NULL) {
+        syslog(LOG_ERR, "regmap: read: context is invalid");
+        return -1;
+    }
+
+    pthread_mutex_lock(&map->lock);
+    ret = regmap_read(map, reg, &value, 1);
+    pthread_mutex_unlock(&map->lock);
+
+    if (ret != XPT_SUCCESS) {
+        syslog(LOG_ERR, "regmap: read: register 0x%x failed", reg);
+        return -1;
+    }
+    return value;
+}
+
+xpt_result_t
+xpt_regmap_bulk_read(xpt_regmap_context map, unsigned int reg, uint8_t* data, int count)
+{
+    xpt_result_t ret;
+
+    if (map == NULL) {
+        syslog(LOG_ERR, "regmap: bulk_read: context is invalid");
+        return XPT_ERROR_INVALID_HANDLE;
+    }
+    if (data == NULL) {
+        return XPT_ERROR_INVALID_PARAMETER;
+    }
+
+    pthread_mutex_lock(&map->lock);
+    ret = regmap_read(map, reg, data, count);
+    pthread_mutex_unlock(&map->lock);
+
+    if (ret != XPT_SUCCESS) {
+        syslog(LOG_ERR, "regmap: bulk_read: registers 0x%x+%d failed", reg, count);
+    }
+    return ret;
+}
+
+xpt_result_t
+xpt_regmap_write(xpt_regmap_context map, unsigned int reg, uint8_t value)
+{
+    xpt_result_t ret;
+
+    if (map == NULL) {
+        syslog(LOG_ERR, "regmap: write: context is invalid");
+        return XPT_ERROR_INVALID_HANDLE;
+    }
+
+    pthread_mutex_lock(&map->lock);
+    ret = regmap_write(map, reg, value);
+    pthread_mutex_unlock(&map->lock);
+
+    if (ret != XPT_SUCCESS) {
+        syslog(LOG_ERR, "regmap: write: register 0x%x failed", reg);
+    }
+    return ret;
+}
+
+xpt_result_t
+xpt_regmap_update_bits(xpt_regmap_context map, unsigned int reg, uint8_t mask, uint8_t value)
+{
+    uint8_t old = 0;
+    xpt_result_t ret = XPT_SUCCESS;
+
+    if (map == NULL) {
+        syslog(LOG_ERR, "regmap: update_bits: context is invalid");
+        return XPT_ERROR_INVALID_HANDLE;
+    }
+
+    pthread_mutex_lock(&map->lock);
+    /* a full mask needs nothing of the old value */
+    if (mask != 0xff) {
+        ret = regmap_read(map, reg, &old, 1);
+    }
+    if (ret == XPT_SUCCESS) {
+        ret = regmap_write(map, reg, (old & ~mask) | (value & mask));
+    }
+    pthread_mutex_unlock(&map->lock);
+
+    if (ret != XPT_SUCCESS) {
+        syslog(LOG_ERR, "regmap: update_bits: register 0x%x failed", reg);
+    }
+    return ret;
+}
+
+/* whether a clean register may be rewritten to bridge two dirty runs */
+static int
+regmap_bridgeable(xpt_regmap_context map, unsigned int reg)
+{
+    return (map->state[reg] & REGMAP_VALID) &&
+           !(map->flags[reg] & (XPT_REGMAP_VOLATILE | XPT_REGMAP_READ_ONLY | XPT_REGMAP_NO_ACCESS));
+}
+
+xpt_result_t
+xpt_regmap_flush(xpt_regmap_context map)
+{
+    unsigned int reg;
+    unsigned int last;
+    unsigned int next;
+    xpt_result_t ret = XPT_SUCCESS;
+
+    if (map == NULL) {
+        syslog(LOG_ERR, "regmap: flush: context is invalid");
+        return XPT_ERROR_INVALID_HANDLE;
+    }
+
+    pthread_mutex_lock(&map->lock);
+
+    for (reg = 0; reg <= map->config.max_register; reg++) {
+        if (!(map->state[reg] & REGMAP_DIRTY)) {
+            continue;
+        }
+
+        /* extend the burst over dirty registers and short bridgeable gaps */
+        last = reg;
+        for (next = reg + 1; next <= map->config.max_register && next - reg < map->max_burst; next++) {
+            if (map->state[next] & REGMAP_DIRTY) {
+                last = next;
+            } else if (!regmap_bridgeable(map, next) || next - last > REGMAP_MAX_GAP) {
+                break;
+            }
+        }
+
+        ret = regmap_bus_write(map, reg, map->cache + reg, last - reg + 1);
+        if (ret != XPT_SUCCESS) {
+            syslog(LOG_ERR, "regmap: flush: registers 0x%x-0x%x failed", reg, last);
+            break;
+        }
+        for (; reg <= last; reg++) {
+            map->state[reg] &= ~REGMAP_DIRTY;
+        }
+        reg = last;
+    }
+
+    pthread_mutex_unlock(&map->lock);
+    return ret;
+}
+
+xpt_result_t
+xpt_regmap_invalidate(xpt_regmap_context map)
+{
+    if (map == NULL) {
+        syslog(LOG_ERR, "regmap: invalidate: context is invalid");
+        return XPT_ERROR_INVALID_HANDLE;
+    }
+
+    pthread_mutex_lock(&map->lock);
+    regmap_load_defaults(map);
+    pthread_mutex_unlock(&map->lock);
+    return XPT_SUCCESS;
+}
+
+xpt_result_t
+xpt_regmap_get_stats(xpt_regmap_context map, xpt_regmap_stats_t* stats)
+{
+    if (map == NULL) {
+        syslog(LOG_ERR, "regmap: get_stats: context is invalid");
+        return XPT_ERROR_INVALID_HANDLE;
+    }
+    if (stats == NULL) {
+        return XPT_ERROR_INVALID_PARAMETER;
+    }
+
+    pthread_mutex_lock(&map->lock);
+    *stats = map->stats;
+    pthread_mutex_unlock(&map->lock);
+    return XPT_SUCCESS;
+}
+
+xpt_result_t
+xpt_regmap_stop(xpt_regmap_context map)
+{
+    if (map == NULL) {
+        syslog(LOG_ERR, "regmap: stop: context is invalid");
+        return XPT_ERROR_INVALID_HANDLE;
+    }
+
+    pthread_mutex_destroy(&map->lock);
+    free(map->cache);
+    free(map->txbuf);
+    free(map);
+    return XPT_SUCCESS;
+}
@@ -17,12 +17,167 @@
 #include <fcntl.h>
 #include <unistd.h>
 #include <errno.h>
+#include <pthread.h>
+#include <time.h>
 
 #include "spi.h"
 #include "xpt_internal.h"
 
 #define MAX_SIZE 64
 #define SPI_MAX_LENGTH 4096
+#define SPI_MAX_SEGMENTS 32
+#define SPI_LANE_FLAGS (SPI_3WIRE | SPI_TX_DUAL | SPI_TX_QUAD | SPI_RX_DUAL | SPI_RX_QUAD)
+#define SPI_BUFSIZ_PATH "/sys/module/spidev/parameters/bufsiz"
+// spidev charges each transfer against bufsiz at its length rounded up to
+// ARCH_DMA_MINALIGN, which user space cannot query; 128 is the largest used
+#define SPI_XFER_ALIGN 128
+
+static unsigned int spi_bufsiz = SPI_MAX_LENGTH;
+static pthread_once_t spi_bufsiz_once = PTHREAD_ONCE_INIT;
+
+static void spi_read_bufsiz(void)
+{
+    FILE* fp = fopen(SPI_BUFSIZ_PATH, "r");
+    unsigned int n;
+
+    if (fp == NULL) {
+        return;
+    }
+    if (fscanf(fp, "%u", &n) == 1 && n > 0) {
+        spi_bufsiz = n;
+    }
+    fclose(fp);
+}
+
+unsigned int xpt_spi_get_bufsiz(void)
+{
+    pthread_once(&spi_bufsiz_once, spi_read_bufsiz);
+    return spi_bufsiz;
+}
+
+// one spidev message; unless it ends the transfer, the last cs_change is
+// flipped, as there it means "keep chip select asserted after the message"
+static int spi_message(xpt_spi_context dev, struct spi_ioc_transfer* msg, int count, int last)
+{
+    struct timespec start, end;
+
+    if (!last) {
+        msg[count - 1].cs_change = !msg[count - 1].cs_change;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    int ret = ioctl(dev->devfd, SPI_IOC_MESSAGE(count), msg);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    if (ret < 0) {
+        syslog(LOG_ERR, "spi: Failed to perform dev transfer: %s", strerror(errno));
+        return -1;
+    }
+
+    dev->stats.messages++;
+    dev->stats.bytes += ret;
+    dev->stats.busy_ns += (end.tv_sec - start.tv_sec) * 1000000000ULL + end.tv_nsec - start.tv_nsec;
+    return ret;
+}
+
+// Submit transfers in as few messages as bufsiz allows, cutting long ones
+// into pieces with chip select held between them. With a slice set, the
+// bus is offered to waiters at chip select cycle ends. Bus held.
+static xpt_result_t spi_submit_held(xpt_spi_context dev, struct spi_ioc_transfer* xfer, int n)
+{
+    struct spi_ioc_transfer msg[SPI_MAX_SEGMENTS];
+    unsigned int bufsiz = xpt_spi_get_bufsiz();
+    unsigned int tx_total = 0, rx_total = 0;
+    unsigned int moved = 0;
+    int count = 0;
+    int i;
+
+    dev->stats.calls++;
+
+    // a bufsiz this small only works where the alignment is smaller too
+    unsigned int align = bufsiz < SPI_XFER_ALIGN ? 1 : SPI_XFER_ALIGN;
+
+    for (i = 0; i < n; i++) {
+        struct spi_ioc_transfer piece = xfer[i];
+        unsigned int bits = piece.bits_per_word ? piece.bits_per_word : dev->bpw;
+        // never cut a word in half
+        unsigned int word = bits <= 8 ? 1 : (bits <= 16 ? 2 : 4);
+
+        while (1) {
+            unsigned int room = bufsiz;
+            if (piece.tx_buf) {
+                room -= tx_total;
+            }
+            if (piece.rx_buf && bufsiz - rx_total < room) {
+                room = bufsiz - rx_total;
+            }
+            room -= room % align;
+            room -= room % word;
+
+            if ((room == 0 && piece.len > 0) || count == SPI_MAX_SEGMENTS) {
+                if (spi_message(dev, msg, count, 0) < 0) {
+                    return XPT_ERROR_INVALID_RESOURCE;
+                }
+                count = 0;
+                tx_total = rx_total = 0;
+                continue;
+            }
+
+            unsigned int take = piece.len < room ? piece.len : room;
+            msg[count] = piece;
+            msg[count].len = take;
+            if (take < piece.len) {
+                msg[count].cs_change = 0;
+                msg[count].delay_usecs = 0;
+            }
+            count++;
+            // charged as spidev does, so an unaligned take is rounded up
+            unsigned int charge = (take + align - 1) / align * align;
+            if (piece.tx_buf) {
+                tx_total += charge;
+            }
+            if (piece.rx_buf) {
+                rx_total += charge;
+            }
+
+            moved += take;
+            if (take == piece.len) {
+                break;
+            }
+            piece.len -= take;
+            if (piece.tx_buf) {
+                piece.tx_buf += take;
+            }
+            if (piece.rx_buf) {
+                piece.rx_buf += take;
+            }
+        }
+
+        // chip select goes up here anyway, a safe point to let others in
+        if (dev->slice && moved >= dev->slice && xfer[i].cs_change && i != n - 1) {
+            if (spi_message(dev, msg, count, 0) < 0) {
+                return XPT_ERROR_INVALID_RESOURCE;
+            }
+            count = 0;
+            tx_total = rx_total = 0;
+            moved = 0;
+            xpt_arbiter_yield(dev->arbiter, dev->prio);
+        }
+    }
+
+    if (spi_message(dev, msg, count, 1) < 0) {
+        return XPT_ERROR_INVALID_RESOURCE;
+    }
+    return XPT_SUCCESS;
+}
+
+static xpt_result_t spi_submit(xpt_spi_context dev, struct spi_ioc_transfer* xfer, int n)
+{
+    xpt_arbiter_acquire(dev->arbiter, dev->prio);
+    xpt_result_t ret = spi_submit_held(dev, xfer, n);
+    xpt_arbiter_release(dev->arbiter);
+    return ret;
+}
 
 static xpt_spi_context xpt_spi_init_internal(xpt_adv_func_t* func_table)
 {
@@ -100,6 +255,7 @@ xpt_spi_context xpt_spi_init(int bus)
     if (plat->adv_func != NULL && plat->adv_func->spi_init_post != NULL) {
         xpt_result_t ret = plat->adv_func->spi_init_post(dev);
         if (ret != XPT_SUCCESS) {
+            xpt_arbiter_put(dev->arbiter);
             free(dev);
             return NULL;
         }
@@ -138,6 +294,10 @@ xpt_spi_context xpt_spi_init_raw(unsigned int bus, unsigned int cs)
         goto init_raw_cleanup;
     }
 
+    dev->bus = bus;
+    dev->arbiter = xpt_arbiter_get(XPT_ARBITER_SPI, bus);
+    dev->prio = XPT_ARBITER_PRIO_NORMAL;
+
     int speed = 0;
     if (ioctl(dev->devfd, SPI_IOC_RD_MAX_SPEED_HZ, &speed) != -1) {
         dev->clock = speed;
@@ -165,6 +325,7 @@ xpt_spi_context xpt_spi_init_raw(unsigned int bus, unsigned int cs)
 init_raw_cleanup:
     if (status != XPT_SUCCESS) {
         if (dev != NULL) {
+            xpt_arbiter_put(dev->arbiter);
             free(dev);
         }
         return NULL;
@@ -203,6 +364,17 @@ xpt_result_t xpt_spi_mode(xpt_spi_context dev, xpt_spi_mode_t mode)
             break;
     }
 
+    // the 8 bit ioctl would clear the lane flags
+    if (dev->mode & SPI_LANE_FLAGS) {
+        uint32_t mode32 = spi_mode | (dev->mode & SPI_LANE_FLAGS) | (dev->lsb ? SPI_LSB_FIRST : 0);
+        if (ioctl(dev->devfd, SPI_IOC_WR_MODE32, &mode32) < 0) {
+            syslog(LOG_ERR, "spi: Failed to set spi mode");
+            return XPT_ERROR_INVALID_RESOURCE;
+        }
+        dev->mode = mode32;
+        return XPT_SUCCESS;
+    }
+
     if (ioctl(dev->devfd, SPI_IOC_WR_MODE, &spi_mode) < 0) {
         syslog(LOG_ERR, "spi: Failed to set spi mode");
         return XPT_ERROR_INVALID_RESOURCE;
@@ -212,6 +384,56 @@ xpt_result_t xpt_spi_mode(xpt_spi_context dev, xpt_spi_mode_t mode)
     return XPT_SUCCESS;
 }
 
+xpt_result_t xpt_spi_mode_flags(xpt_spi_context dev, unsigned int flags)
+{
+    if (dev == NULL) {
+        syslog(LOG_ERR, "spi: mode_flags: context is invalid");
+        return XPT_ERROR_INVALID_HANDLE;
+    }
+
+    uint32_t lanes = 0;
+    if (flags & XPT_SPI_3WIRE) {
+        lanes |= SPI_3WIRE;
+    }
+    if (flags & XPT_SPI_TX_DUAL) {
+        lanes |= SPI_TX_DUAL;
+    }
+    if (flags & XPT_SPI_TX_QUAD) {
+        lanes |= SPI_TX_QUAD;
+    }
+    if (flags & XPT_SPI_RX_DUAL) {
+        lanes |= SPI_RX_DUAL;
+    }
+    if (flags & XPT_SPI_RX_QUAD) {
+        lanes |= SPI_RX_QUAD;
+    }
+    if (flags & ~(XPT_SPI_3WIRE | XPT_SPI_TX_DUAL | XPT_SPI_TX_QUAD | XPT_SPI_RX_DUAL | XPT_SPI_RX_QUAD)) {
+        syslog(LOG_ERR, "spi: mode_flags: unknown flags 0x%x", flags);
+        return XPT_ERROR_INVALID_PARAMETER;
+    }
+
+    uint32_t wanted = (dev->mode & (SPI_CPOL | SPI_CPHA)) | lanes;
+    if (dev->lsb) {
+        wanted |= SPI_LSB_FIRST;
+    }
+    uint32_t actual = 0;
+    if (ioctl(dev->devfd, SPI_IOC_WR_MODE32, &wanted) < 0 || ioctl(dev->devfd, SPI_IOC_RD_MODE32, &actual) < 0) {
+        syslog(LOG_ERR, "spi: mode_flags: Failed to set spi mode 0x%x: %s", wanted, strerror(errno));
+        return XPT_ERROR_FEATURE_NOT_SUPPORTED;
+    }
+
+    if ((actual & SPI_LANE_FLAGS) != lanes) {
+        syslog(LOG_ERR, "spi: mode_flags: controller does not support mode 0x%x, got 0x%x", wanted, actual);
+        // put the previous mode back
+        uint32_t previous = dev->mode | (dev->lsb ? SPI_LSB_FIRST : 0);
+        ioctl(dev->devfd, SPI_IOC_WR_MODE32, &previous);
+        return XPT_ERROR_FEATURE_NOT_SUPPORTED;
+    }
+
+    dev->mode = actual;
+    return XPT_SUCCESS;
+}
+
 xpt_result_t xpt_spi_frequency(xpt_spi_context dev, int hz)
 {
     if (dev == NULL) {
@@ -300,7 +522,10 @@ int xpt_spi_write(xpt_spi_context dev, uint8_t data)
     msg.bits_per_word = dev->bpw;
     msg.delay_usecs = 0;
     msg.len = length;
-    if (ioctl(dev->devfd, SPI_IOC_MESSAGE(1), &msg) < 0) {
+    xpt_arbiter_acquire(dev->arbiter, dev->prio);
+    int ret = ioctl(dev->devfd, SPI_IOC_MESSAGE(1), &msg);
+    xpt_arbiter_release(dev->arbiter);
+    if (ret < 0) {
         syslog(LOG_ERR, "spi: Failed to perform dev transfer");
         return -1;
     }
@@ -330,7 +555,10 @@ int xpt_spi_write_word(xpt_spi_context dev, uint16_t data)
     msg.bits_per_word = dev->bpw;
     msg.delay_usecs = 0;
     msg.len = length;
-    if (ioctl(dev->devfd, SPI_IOC_MESSAGE(1), &msg) < 0) {
+    xpt_arbiter_acquire(dev->arbiter, dev->prio);
+    int ret = ioctl(dev->devfd, SPI_IOC_MESSAGE(1), &msg);
+    xpt_arbiter_release(dev->arbiter);
+    if (ret < 0) {
         syslog(LOG_ERR, "spi: Failed to perform dev transfer");
         return -1;
     }
@@ -357,11 +585,64 @@ xpt_result_t xpt_spi_transfer_buf(xpt_spi_context dev, uint8_t* data, uint8_t* r
     msg.bits_per_word = dev->bpw;
     msg.delay_usecs = 0;
     msg.len = length;
-    if (ioctl(dev->devfd, SPI_IOC_MESSAGE(1), &msg) < 0) {
-        syslog(LOG_ERR, "spi: Failed to perform dev transfer");
-        return XPT_ERROR_INVALID_RESOURCE;
+    return spi_submit(dev, &msg, 1);
+}
+
+static int spi_nbits_ok(uint32_t mode, uint8_t nbits, uint32_t dual, uint32_t quad)
+{
+    switch (nbits) {
+        case 0:
+        case 1:
+            return 1;
+        case 2:
+            return (mode & (dual | quad)) != 0;
+        case 4:
+            return (mode & quad) != 0;
+        default:
+            return 0;
     }
-    return XPT_SUCCESS;
+}
+
+xpt_result_t xpt_spi_transfer_segments(xpt_spi_context dev, xpt_spi_segment_t* segs, int count)
+{
+    if (dev == NULL) {
+        syslog(LOG_ERR, "spi: transfer_segments: context is invalid");
+        return XPT_ERROR_INVALID_HANDLE;
+    }
+
+    if (segs == NULL || count < 1 || count > SPI_MAX_SEGMENTS) {
+        syslog(LOG_ERR, "spi: transfer_segments: invalid segment count %d", count);
+        return XPT_ERROR_INVALID_PARAMETER;
+    }
+
+    struct spi_ioc_transfer msg[SPI_MAX_SEGMENTS];
+    memset(msg, 0, sizeof(msg[0]) * count);
+
+    int i;
+    for (i = 0; i < count; i++) {
+        if (!spi_nbits_ok(dev->mode, segs[i].tx_nbits, SPI_TX_DUAL, SPI_TX_QUAD) ||
+            !spi_nbits_ok(dev->mode, segs[i].rx_nbits, SPI_RX_DUAL, SPI_RX_QUAD)) {
+            syslog(LOG_ERR, "spi: transfer_segments: segment %d needs data lines that are not enabled", i);
+            return XPT_ERROR_FEATURE_NOT_SUPPORTED;
+        }
+        if (segs[i].txbuf && segs[i].rxbuf &&
+            ((dev->mode & SPI_3WIRE) || segs[i].tx_nbits > 1 || segs[i].rx_nbits > 1)) {
+            syslog(LOG_ERR, "spi: transfer_segments: segment %d is full duplex on shared data lines", i);
+            return XPT_ERROR_INVALID_PARAMETER;
+        }
+
+        msg[i].tx_buf = (unsigned long) segs[i].txbuf;
+        msg[i].rx_buf = (unsigned long) segs[i].rxbuf;
+        msg[i].len = segs[i].length;
+        msg[i].speed_hz = dev->clock;
+        msg[i].bits_per_word = dev->bpw;
+        msg[i].delay_usecs = segs[i].delay_usecs;
+        msg[i].cs_change = segs[i].cs_change ? 1 : 0;
+        msg[i].tx_nbits = segs[i].tx_nbits;
+        msg[i].rx_nbits = segs[i].rx_nbits;
+    }
+
+    return spi_submit(dev, msg, count);
 }
 
 xpt_result_t xpt_spi_transfer_buf_word(xpt_spi_context dev, uint16_t* data, uint16_t* rxbuf, int length)
@@ -384,11 +665,7 @@ xpt_result_t xpt_spi_transfer_buf_word(xpt_spi_context dev, uint16_t* data, uint
     msg.bits_per_word = dev->bpw;
     msg.delay_usecs = 0;
     msg.len = length;
-    if (ioctl(dev->devfd, SPI_IOC_MESSAGE(1), &msg) < 0) {
-        syslog(LOG_ERR, "spi: Failed to perform dev transfer");
-        return XPT_ERROR_INVALID_RESOURCE;
-    }
-    return XPT_SUCCESS;
+    return spi_submit(dev, &msg, 1);
 }
 
 uint8_t* xpt_spi_write_buf(xpt_spi_context dev, uint8_t* data, int length)
@@ -423,6 +700,55 @@ uint16_t* xpt_spi_write_buf_word(xpt_spi_context dev, uint16_t* data, int length
     return recv;
 }
 
+xpt_result_t xpt_spi_get_stats(xpt_spi_context dev, xpt_spi_stats_t* stats)
+{
+    if (dev == NULL || stats == NULL) {
+        syslog(LOG_ERR, "spi: get_stats: context is invalid");
+        return XPT_ERROR_INVALID_HANDLE;
+    }
+
+    *stats = dev->stats;
+    stats->bytes_per_sec = stats->busy_ns ? (double) stats->bytes * 1e9 / stats->busy_ns : 0;
+    return XPT_SUCCESS;
+}
+
+xpt_result_t xpt_spi_priority(xpt_spi_context dev, xpt_arbiter_prio_t prio)
+{
+    if (dev == NULL) {
+        syslog(LOG_ERR, "spi: priority: context is invalid");
+        return XPT_ERROR_INVALID_HANDLE;
+    }
+
+    if ((int) prio < 0 || prio >= XPT_ARBITER_PRIO_COUNT) {
+        syslog(LOG_ERR, "spi: priority: invalid class %d", prio);
+        return XPT_ERROR_INVALID_PARAMETER;
+    }
+
+    dev->prio = prio;
+    return XPT_SUCCESS;
+}
+
+xpt_result_t xpt_spi_slice(xpt_spi_context dev, unsigned int bytes)
+{
+    if (dev == NULL) {
+        syslog(LOG_ERR, "spi: slice: context is invalid");
+        return XPT_ERROR_INVALID_HANDLE;
+    }
+
+    dev->slice = bytes;
+    return XPT_SUCCESS;
+}
+
+xpt_arbiter_context xpt_spi_get_arbiter(xpt_spi_context dev)
+{
+    if (dev == NULL) {
+        syslog(LOG_ERR, "spi: get_arbiter: context is invalid");
+        return NULL;
+    }
+
+    return dev->arbiter;
+}
+
 xpt_result_t xpt_spi_stop(xpt_spi_context dev)
 {
     if (dev == NULL) {
@@ -430,6 +756,9 @@ xpt_result_t xpt_spi_stop(xpt_spi_context dev)
         return XPT_ERROR_INVALID_HANDLE;
     }
 
+    xpt_arbiter_put(dev->arbiter);
+    dev->arbiter = NULL;
+
     if (IS_FUNC_DEFINED(dev, spi_stop_replace)) {
         return dev->advance_func->spi_stop_replace(dev);
     }
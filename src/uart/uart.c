@@ -4,7 +4,11 @@
 #include <string.h>
 #include <termios.h>
 #include <sys/select.h>
+#include <sys/ioctl.h>
 #include <errno.h>
+#if !defined(PERIPHERALMAN)
+#include <linux/serial.h>
+#endif
 #include <string.h>
 
 #include "uart.h"
@@ -14,6 +18,40 @@
 #define CMSPAR   010000000000
 #endif
 
+// Rates that have no B* constant are programmed through termios2 and
+// BOTHER. glibc does not export struct termios2, so it is declared here
+// with the kernel's layout on the architectures that provide TCGETS2.
+#if !defined(PERIPHERALMAN) && defined(TCGETS2)
+#define UART_HAVE_TERMIOS2
+
+#if defined(__mips__)
+#define UART_KERNEL_NCCS 23
+#elif defined(__sparc__)
+#define UART_KERNEL_NCCS 17
+#else
+#define UART_KERNEL_NCCS 19
+#endif
+
+#ifndef BOTHER
+#define BOTHER 0010000
+#endif
+
+#ifndef IBSHIFT
+#define IBSHIFT 16
+#endif
+
+struct termios2 {
+    tcflag_t c_iflag;
+    tcflag_t c_oflag;
+    tcflag_t c_cflag;
+    tcflag_t c_lflag;
+    cc_t c_line;
+    cc_t c_cc[UART_KERNEL_NCCS];
+    speed_t c_ispeed;
+    speed_t c_ospeed;
+};
+#endif
+
 // This function takes an unsigned int and converts it to a B* speed_t
 // that can be used with linux/posix termios
 static speed_t uint2speed(unsigned int speed)
@@ -136,6 +174,52 @@ static unsigned int speed_to_uint(speed_t speedt) {
     return 0;
 }
 
+// Rate the driver reports for fd, which also covers BOTHER rates that
+// cfgetospeed() cannot express. Returns 0 if it cannot be determined.
+static unsigned int uart_get_actual_baud(int fd)
+{
+#if defined(UART_HAVE_TERMIOS2)
+    struct termios2 tio;
+
+    if (ioctl(fd, TCGETS2, &tio) == 0 && tio.c_ospeed != 0) {
+        return tio.c_ospeed;
+    }
+#endif
+#if !defined(PERIPHERALMAN)
+    struct termios termio;
+
+    if (tcgetattr(fd, &termio) == 0) {
+        return speed_to_uint(cfgetospeed(&termio));
+    }
+#endif
+    return 0;
+}
+
+#if defined(UART_HAVE_TERMIOS2)
+// Program an arbitrary rate, all other settings are left alone.
+static xpt_result_t uart_set_custom_baud(xpt_uart_context dev, unsigned int baud)
+{
+    struct termios2 tio;
+
+    if (ioctl(dev->fd, TCGETS2, &tio) < 0) {
+        syslog(LOG_ERR, "uart%i: set_baudrate: TCGETS2 failed: %s", dev->index, strerror(errno));
+        return XPT_ERROR_INVALID_RESOURCE;
+    }
+
+    tio.c_cflag &= ~(CBAUD | (CBAUD << IBSHIFT));
+    tio.c_cflag |= BOTHER | (BOTHER << IBSHIFT);
+    tio.c_ispeed = baud;
+    tio.c_ospeed = baud;
+
+    if (ioctl(dev->fd, TCSETS2, &tio) < 0) {
+        syslog(LOG_ERR, "uart%i: set_baudrate: TCSETS2 %u failed: %s", dev->index, baud, strerror(errno));
+        return XPT_ERROR_FEATURE_NOT_SUPPORTED;
+    }
+
+    return XPT_SUCCESS;
+}
+#endif
+
 static xpt_uart_context xpt_uart_init_internal(xpt_adv_func_t* func_table)
 {
     xpt_uart_context dev = (xpt_uart_context) calloc(1, sizeof(struct _uart));
@@ -395,7 +479,7 @@ xpt_result_t xpt_uart_settings(int index, const char **devpath, const char **nam
        }
 
        if (baudrate != NULL) {
-           *baudrate = speed_to_uint(cfgetospeed(&term));
+           *baudrate = uart_get_actual_baud(fd);
        }
 
        if (ctsrts != NULL) {
@@ -468,12 +552,22 @@ xpt_result_t xpt_uart_set_baudrate(xpt_uart_context dev, unsigned int baud)
         return XPT_ERROR_INVALID_RESOURCE;
     }
 
-    // set our baud rates
+    // set our baud rates, anything off the B* table goes through termios2
     speed_t speed = uint2speed(baud);
+    int custom = 0;
     if (speed == B0)
     {
+#if defined(UART_HAVE_TERMIOS2)
+        if (baud == 0) {
+            syslog(LOG_ERR, "uart%i: set_baudrate: invalid baudrate: %i", dev->index, baud);
+            return XPT_ERROR_INVALID_PARAMETER;
+        }
+        speed = B38400;
+        custom = 1;
+#else
         syslog(LOG_ERR, "uart%i: set_baudrate: invalid baudrate: %i", dev->index, baud);
         return XPT_ERROR_INVALID_PARAMETER;
+#endif
     }
     cfsetispeed(&termio, speed);
     cfsetospeed(&termio, speed);
@@ -483,6 +577,97 @@ xpt_result_t xpt_uart_set_baudrate(xpt_uart_context dev, unsigned int baud)
         syslog(LOG_ERR, "uart%i: set_baudrate: tcsetattr() failed: %s", dev->index, strerror(errno));
         return XPT_ERROR_FEATURE_NOT_SUPPORTED;
     }
+
+#if defined(UART_HAVE_TERMIOS2)
+    if (custom) {
+        xpt_result_t ret = uart_set_custom_baud(dev, baud);
+        if (ret != XPT_SUCCESS) {
+            return ret;
+        }
+    }
+#endif
+
+    // the driver rounds to what its divisor can do, remember what we got
+    dev->baudrate = uart_get_actual_baud(dev->fd);
+    if (dev->baudrate == 0) {
+        dev->baudrate = baud;
+    }
+    if (dev->baudrate != baud) {
+        syslog(LOG_NOTICE, "uart%i: set_baudrate: requested %u, driver set %u", dev->index, baud, dev->baudrate);
+    }
+    return XPT_SUCCESS;
+}
+
+xpt_result_t xpt_uart_set_rs485(xpt_uart_context dev, xpt_uart_rs485_t* rs485)
+{
+    if (!dev || !rs485) {
+        syslog(LOG_ERR, "uart: set_rs485: context is NULL");
+        return XPT_ERROR_INVALID_HANDLE;
+    }
+
+    if (IS_FUNC_DEFINED(dev, uart_set_rs485_replace)) {
+        return dev->advance_func->uart_set_rs485_replace(dev, rs485);
+    }
+
+#if defined(PERIPHERALMAN) || !defined(TIOCSRS485)
+    return XPT_ERROR_FEATURE_NOT_SUPPORTED;
+#else
+    struct serial_rs485 conf;
+    xpt_boolean_t wanted = rs485->enabled;
+
+    memset(&conf, 0, sizeof(conf));
+    if (rs485->enabled) {
+        conf.flags |= SER_RS485_ENABLED;
+    }
+    if (rs485->rts_on_send) {
+        conf.flags |= SER_RS485_RTS_ON_SEND;
+    }
+    if (rs485->rts_after_send) {
+        conf.flags |= SER_RS485_RTS_AFTER_SEND;
+    }
+    if (rs485->rx_during_tx) {
+        conf.flags |= SER_RS485_RX_DURING_TX;
+    }
+    conf.delay_rts_before_send = rs485->delay_before_send;
+    conf.delay_rts_after_send = rs485->delay_after_send;
+
+    if (ioctl(dev->fd, TIOCSRS485, &conf) < 0) {
+        syslog(LOG_ERR, "uart%i: set_rs485: TIOCSRS485 failed: %s", dev->index, strerror(errno));
+        rs485->enabled = 0;
+        return XPT_ERROR_FEATURE_NOT_SUPPORTED;
+    }
+
+    // drivers drop flags and clamp delays they cannot do, report the truth
+    if (ioctl(dev->fd, TIOCGRS485, &conf) < 0) {
+        syslog(LOG_ERR, "uart%i: set_rs485: TIOCGRS485 failed: %s", dev->index, strerror(errno));
+        rs485->enabled = 0;
+        return XPT_ERROR_FEATURE_NOT_SUPPORTED;
+    }
+
+    rs485->enabled = (conf.flags & SER_RS485_ENABLED) ? 1 : 0;
+    rs485->rts_on_send = (conf.flags & SER_RS485_RTS_ON_SEND) ? 1 : 0;
+    rs485->rts_after_send = (conf.flags & SER_RS485_RTS_AFTER_SEND) ? 1 : 0;
+    rs485->rx_during_tx = (conf.flags & SER_RS485_RX_DURING_TX) ? 1 : 0;
+    rs485->delay_before_send = conf.delay_rts_before_send;
+    rs485->delay_after_send = conf.delay_rts_after_send;
+
+    if (wanted && !rs485->enabled) {
+        syslog(LOG_NOTICE, "uart%i: set_rs485: driver did not enable RS-485", dev->index);
+        return XPT_ERROR_FEATURE_NOT_SUPPORTED;
+    }
+
+    return XPT_SUCCESS;
+#endif
+}
+
+xpt_result_t xpt_uart_get_baudrate(xpt_uart_context dev, unsigned int* baud)
+{
+    if (!dev || !baud) {
+        syslog(LOG_ERR, "uart: get_baudrate: context is NULL");
+        return XPT_ERROR_INVALID_HANDLE;
+    }
+
+    *baud = dev->baudrate;
     return XPT_SUCCESS;
 }
 
@@ -558,6 +558,15 @@ xpt_result_print(xpt_result_t result)
         case XPT_ERROR_UART_OW_DATA_ERROR:
             fprintf(stdout, "XPT: UART OW: Data or Bus error detected.\n");
             break;
+        case XPT_ERROR_MODBUS_TIMEOUT:
+            fprintf(stdout, "XPT: Modbus: No response from slave.\n");
+            break;
+        case XPT_ERROR_MODBUS_CRC:
+            fprintf(stdout, "XPT: Modbus: Corrupt response frame.\n");
+            break;
+        case XPT_ERROR_MODBUS_EXCEPTION:
+            fprintf(stdout, "XPT: Modbus: Slave returned an exception.\n");
+            break;
         case XPT_ERROR_UNSPECIFIED:
             fprintf(stdout, "XPT: Unspecified Error.\n");
             break;
@@ -0,0 +1,279 @@
+/***************************************************************************
+ *   Copyright (C) 2015 by Tse-Lun Bien                                    *
+ *   allanbian@gmail.com                                                   *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+
+/*
+ * Serial-to-TCP bridge throughput on a pseudo-terminal pair and a loopback
+ * TCP connection. The pty slave plays the COM port and is bridged to the
+ * server side of the TCP connection; the benchmark pushes data through both
+ * directions at the same time from the pty master and the TCP client.
+ *
+ * "splice" runs bridge_run() in one thread, "copy" is the traditional
+ * two-thread read()/socket_write() pump through a userspace buffer.
+ *
+ * Before that, bridging a COM port that was never opened must fail with
+ * -LIBCOMMBUS_ERROR_NO_DEVICE instead of splicing whatever holds fd 0.
+ *
+ * usage: bridge_bench [mbytes]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <termios.h>
+#include <pty.h>
+#include <time.h>
+
+#include "commbus.h"
+#include "socket.h"
+#include "uart.h"
+#include "bridge.h"
+#include "test_util.h"
+
+#define TEST_HOST	"127.0.0.1"
+#define TEST_PORT	5003
+#define TEST_MBYTES	32
+#define XFER_LEN	4096
+#define TEST_COM	COM7
+
+struct xfer_arg {
+	int fd;
+	long long len;
+	double done;
+	pthread_t tid;
+};
+
+struct copy_arg {
+	int in;
+	int out;
+	pthread_t tid;
+};
+
+static int write_all(int fd, unsigned char *buf, int len)
+{
+	int sent = 0;
+	int n;
+
+	while (sent < len) {
+		n = write(fd, &buf[sent], len - sent);
+		if (n <= 0)
+			return -1;
+		sent += n;
+	}
+
+	return sent;
+}
+
+static void *writer_thread(void *arg)
+{
+	struct xfer_arg *x = (struct xfer_arg *)arg;
+	unsigned char buf[XFER_LEN];
+	long long sent;
+	int n;
+
+	memset(buf, 0x55, sizeof(buf));
+	for (sent = 0; sent < x->len; sent += n) {
+		n = x->len - sent > XFER_LEN ? XFER_LEN : x->len - sent;
+		if (write_all(x->fd, buf, n) != n)
+			break;
+	}
+
+	return NULL;
+}
+
+static void *reader_thread(void *arg)
+{
+	struct xfer_arg *x = (struct xfer_arg *)arg;
+	unsigned char buf[XFER_LEN];
+	long long recv;
+	int n;
+
+	for (recv = 0; recv < x->len; recv += n) {
+		n = read(x->fd, buf, sizeof(buf));
+		if (n <= 0)
+			break;
+	}
+	x->done = now_us();
+
+	return NULL;
+}
+
+/* today's gateway: one thread per direction, copy through userspace */
+static void *copy_thread(void *arg)
+{
+	struct copy_arg *c = (struct copy_arg *)arg;
+	unsigned char buf[XFER_LEN];
+	int n;
+
+	while (1) {
+		n = read(c->in, buf, sizeof(buf));
+		if (n <= 0)
+			break;
+		if (write_all(c->out, buf, n) != n)
+			break;
+	}
+
+	return NULL;
+}
+
+static void *bridge_thread(void *arg)
+{
+	bridge_run((struct bridge_t *)arg);
+	return NULL;
+}
+
+static void test_unopened(void)
+{
+	struct sock_info_t sock;
+	struct bridge_t bridge;
+	int ret;
+
+	if (socket_open(&sock, TYPE_TCP) != LIBCOMMBUS_SUCCESS) {
+		CHECK(0, "socket_open failed");
+		return;
+	}
+
+	ret = uart_get_fd(TEST_COM);
+	CHECK(ret == -LIBCOMMBUS_ERROR_NO_DEVICE, "fd of an unopened COM: %d", ret);
+	ret = bridge_open(&bridge, TEST_COM, &sock);
+	CHECK(ret == -LIBCOMMBUS_ERROR_NO_DEVICE, "bridge on an unopened COM: %d", ret);
+	if (ret == LIBCOMMBUS_SUCCESS)
+		bridge_close(&bridge);
+	ret = uart_close(TEST_COM);
+	CHECK(ret == -LIBCOMMBUS_ERROR_NO_DEVICE, "close of an unopened COM: %d", ret);
+
+	printf("unopened: fd=%d\n", uart_get_fd(TEST_COM));
+	socket_close(&sock);
+}
+
+static int run_bench(const char *mode, long long len)
+{
+	struct sock_info_t sock_listen;
+	struct sock_info_t sock_conn;
+	struct sock_info_t sock_client;
+	struct xfer_arg tx_net, rx_tty, tx_tty, rx_net;
+	struct copy_arg copy[2];
+	struct bridge_t bridge;
+	struct termios tio;
+	pthread_t bridge_tid;
+	char host[] = TEST_HOST;
+	double start;
+	int master;
+	int slave;
+	int one = 1;
+	int splice_mode;
+
+	splice_mode = strcmp(mode, "splice") == 0;
+
+	if (openpty(&master, &slave, NULL, NULL, NULL) != 0) {
+		perror("openpty");
+		return 1;
+	}
+	tcgetattr(slave, &tio);
+	cfmakeraw(&tio);
+	tcsetattr(slave, TCSANOW, &tio);
+
+	if (socket_open(&sock_listen, TYPE_TCP) != LIBCOMMBUS_SUCCESS)
+		return 1;
+	setsockopt(sock_listen.fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+	if (socket_bind(&sock_listen, TEST_PORT) != LIBCOMMBUS_SUCCESS ||
+	    socket_listen(&sock_listen) != LIBCOMMBUS_SUCCESS ||
+	    socket_open(&sock_client, TYPE_TCP) != LIBCOMMBUS_SUCCESS ||
+	    socket_connect(&sock_client, host, TEST_PORT) != LIBCOMMBUS_SUCCESS ||
+	    socket_accept(&sock_listen, &sock_conn) != LIBCOMMBUS_SUCCESS) {
+		debug_print("%s: tcp setup failed!\n", mode);
+		return 1;
+	}
+	socket_close(&sock_listen);
+
+	if (splice_mode) {
+		if (bridge_open_fd(&bridge, slave, &sock_conn) != LIBCOMMBUS_SUCCESS) {
+			debug_print("bridge_open_fd failed!\n");
+			return 1;
+		}
+		pthread_create(&bridge_tid, NULL, bridge_thread, &bridge);
+	} else {
+		copy[0].in = slave;
+		copy[0].out = sock_conn.fd;
+		copy[1].in = sock_conn.fd;
+		copy[1].out = slave;
+		pthread_create(&copy[0].tid, NULL, copy_thread, &copy[0]);
+		pthread_create(&copy[1].tid, NULL, copy_thread, &copy[1]);
+	}
+
+	tx_net.fd = sock_client.fd;
+	rx_tty.fd = master;
+	tx_tty.fd = master;
+	rx_net.fd = sock_client.fd;
+	tx_net.len = rx_tty.len = tx_tty.len = rx_net.len = len;
+
+	start = now_us();
+	pthread_create(&rx_tty.tid, NULL, reader_thread, &rx_tty);
+	pthread_create(&rx_net.tid, NULL, reader_thread, &rx_net);
+	pthread_create(&tx_net.tid, NULL, writer_thread, &tx_net);
+	pthread_create(&tx_tty.tid, NULL, writer_thread, &tx_tty);
+	pthread_join(tx_net.tid, NULL);
+	pthread_join(tx_tty.tid, NULL);
+	pthread_join(rx_tty.tid, NULL);
+	pthread_join(rx_net.tid, NULL);
+
+	printf("mode=%s bytes=%lld net_to_serial_mbps=%.1f serial_to_net_mbps=%.1f threads=%d\n",
+	       mode, len,
+	       len / (rx_tty.done - start),
+	       len / (rx_net.done - start),
+	       splice_mode ? 1 : 2);
+
+	/* closing the client and the master ends the pump on both sides */
+	socket_close(&sock_client);
+	close(master);
+	if (splice_mode) {
+		pthread_join(bridge_tid, NULL);
+		bridge_close(&bridge);
+	} else {
+		pthread_join(copy[1].tid, NULL);
+		pthread_join(copy[0].tid, NULL);
+	}
+	socket_close(&sock_conn);
+	close(slave);
+
+	return 0;
+}
+
+int main(int argc, char *argv[])
+{
+	long long len = (long long)TEST_MBYTES << 20;
+	int ret = 0;
+
+	if (argc > 1)
+		len = (long long)atoi(argv[1]) << 20;
+
+	signal(SIGPIPE, SIG_IGN);
+
+	test_unopened();
+
+	ret |= run_bench("copy", len);
+	ret |= run_bench("splice", len);
+	if (ret)
+		return ret;
+
+	return test_result();
+}
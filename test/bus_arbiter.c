@@ -0,0 +1,309 @@
+/***************************************************************************
+ *   Copyright (C) 2015 by Tse-Lun Bien                                    *
+ *   allanbian@gmail.com                                                   *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+
+/*
+ * Bus arbitration between contexts sharing a bus.
+ *
+ * The first test queues waiters of each priority class behind a holder
+ * and checks the order they get the bus in. The rest runs spi contexts
+ * on a simulated bus: open() hands out /dev/null for spidev paths and
+ * this program's ioctl() takes the time a message would at 10 MHz. A
+ * bulk context dumps a flash in 4 KB chip select cycles while a sensor
+ * context reads 8 bytes every millisecond at high priority; the
+ * sensor's worst latency is reported without and with a slice.
+ *
+ * usage: bus_arbiter [ms per run]
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/spi/spidev.h>
+
+#include "xpt/spi.h"
+#include "xpt/arbiter.h"
+
+#define TEST_FAKE_SPIDEV
+#include "test_util.h"
+
+#define TEST_MS		300
+#define TEST_BUS	1
+
+/* bulk transfer: command and 4 KB read per chip select cycle */
+#define DUMP_CYCLE	4096
+#define DUMP_CYCLES	16
+/* 10 MHz: 800 ns per byte */
+#define FAKE_BYTE_NS	800
+
+static unsigned long long fake_messages;
+
+int ioctl(int fd, unsigned long request, ...)
+{
+	struct spi_ioc_transfer *xfer;
+	struct timespec ts = { 0, 0 };
+	unsigned long long bytes = 0;
+	va_list ap;
+	void *arg;
+	int n;
+	int i;
+
+	va_start(ap, request);
+	arg = va_arg(ap, void *);
+	va_end(ap);
+
+	if (_IOC_TYPE(request) != SPI_IOC_MAGIC)
+		return syscall(SYS_ioctl, fd, request, arg);
+	if (_IOC_NR(request) != 0)
+		return 0;
+
+	xfer = arg;
+	n = _IOC_SIZE(request) / sizeof(*xfer);
+	for (i = 0; i < n; i++)
+		bytes += xfer[i].len;
+
+	__atomic_add_fetch(&fake_messages, 1, __ATOMIC_RELAXED);
+	ts.tv_sec = bytes * FAKE_BYTE_NS / 1000000000;
+	ts.tv_nsec = bytes * FAKE_BYTE_NS % 1000000000;
+	nanosleep(&ts, NULL);
+
+	return bytes;
+}
+
+/* priority order */
+
+struct waiter_t {
+	xpt_arbiter_context arb;
+	xpt_arbiter_prio_t prio;
+	int *order;
+	int *pos;
+};
+
+static pthread_mutex_t order_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void *waiter(void *arg)
+{
+	struct waiter_t *w = arg;
+
+	xpt_arbiter_acquire(w->arb, w->prio);
+	pthread_mutex_lock(&order_lock);
+	w->order[(*w->pos)++] = w->prio;
+	pthread_mutex_unlock(&order_lock);
+	xpt_arbiter_release(w->arb);
+
+	return NULL;
+}
+
+static void test_order(void)
+{
+	xpt_arbiter_context arb = xpt_arbiter_get(XPT_ARBITER_I2C, 7);
+	xpt_arbiter_prio_t queue[] = { XPT_ARBITER_PRIO_BULK, XPT_ARBITER_PRIO_NORMAL, XPT_ARBITER_PRIO_BULK,
+				       XPT_ARBITER_PRIO_HIGH };
+	int expect[] = { XPT_ARBITER_PRIO_HIGH, XPT_ARBITER_PRIO_NORMAL, XPT_ARBITER_PRIO_BULK,
+			 XPT_ARBITER_PRIO_BULK };
+	struct waiter_t w[4];
+	pthread_t tid[4];
+	xpt_arbiter_stats_t stats;
+	int order[4];
+	int pos = 0;
+	int i;
+
+	CHECK(xpt_arbiter_get(XPT_ARBITER_I2C, 7) == arb, "second get returned another arbiter");
+	xpt_arbiter_put(arb);
+
+	xpt_arbiter_acquire(arb, XPT_ARBITER_PRIO_NORMAL);
+	for (i = 0; i < 4; i++) {
+		w[i].arb = arb;
+		w[i].prio = queue[i];
+		w[i].order = order;
+		w[i].pos = &pos;
+		/* nobody of the holder's class or above is waiting yet */
+		if (queue[i] == XPT_ARBITER_PRIO_HIGH)
+			CHECK(xpt_arbiter_yield(arb, XPT_ARBITER_PRIO_HIGH) == 0, "yielded to lower classes");
+		pthread_create(&tid[i], NULL, waiter, &w[i]);
+		/* let it queue up */
+		usleep(20000);
+	}
+	xpt_arbiter_release(arb);
+
+	for (i = 0; i < 4; i++)
+		pthread_join(tid[i], NULL);
+	for (i = 0; i < 4; i++)
+		CHECK(order[i] == expect[i], "grant %d went to class %d, expected %d", i, order[i], expect[i]);
+
+	xpt_arbiter_get_stats(arb, XPT_ARBITER_PRIO_BULK, &stats);
+	CHECK(stats.acquired == 2 && stats.contended == 2 && stats.max_wait_ns >= 20000000,
+	      "bulk stats: %llu acquired, %llu contended, max wait %llu ns", stats.acquired, stats.contended,
+	      stats.max_wait_ns);
+
+	xpt_arbiter_put(arb);
+}
+
+/* bulk dump against a periodic sensor read */
+
+static volatile int running;
+
+static void *dump(void *arg)
+{
+	xpt_spi_context dev = arg;
+	xpt_spi_segment_t segs[2 * DUMP_CYCLES];
+	uint8_t cmd[DUMP_CYCLES][4];
+	uint8_t *data = malloc(DUMP_CYCLE * DUMP_CYCLES);
+	int i;
+
+	memset(segs, 0, sizeof(segs));
+	for (i = 0; i < DUMP_CYCLES; i++) {
+		cmd[i][0] = 0x03;
+		segs[2 * i].txbuf = cmd[i];
+		segs[2 * i].length = 4;
+		segs[2 * i + 1].rxbuf = data + i * DUMP_CYCLE;
+		segs[2 * i + 1].length = DUMP_CYCLE;
+		segs[2 * i + 1].cs_change = 1;
+	}
+
+	while (running) {
+		if (xpt_spi_transfer_segments(dev, segs, 2 * DUMP_CYCLES) != XPT_SUCCESS) {
+			CHECK(0, "dump transfer failed");
+			break;
+		}
+	}
+
+	free(data);
+	return NULL;
+}
+
+static void run(xpt_spi_context bulk, xpt_spi_context sensor, unsigned int slice, int ms)
+{
+	xpt_arbiter_stats_t before;
+	xpt_arbiter_stats_t after;
+	xpt_arbiter_context arb = xpt_spi_get_arbiter(sensor);
+	uint8_t tx[8] = { 0x80 | 0x28 };
+	uint8_t rx[8];
+	pthread_t tid;
+	double next;
+	double late;
+	double worst = 0;
+	double total = 0;
+	double end;
+	int samples = 0;
+
+	xpt_spi_slice(bulk, slice);
+	xpt_arbiter_get_stats(arb, XPT_ARBITER_PRIO_HIGH, &before);
+
+	running = 1;
+	pthread_create(&tid, NULL, dump, bulk);
+
+	next = now_us() + 1000;
+	end = next + ms * 1000.0;
+	while (next < end) {
+		while (now_us() < next)
+			usleep(next - now_us());
+
+		xpt_spi_transfer_buf(sensor, tx, rx, sizeof(tx));
+		late = now_us() - next;
+		total += late;
+		if (late > worst)
+			worst = late;
+		samples++;
+
+		/* the next period, or now if this one overran it */
+		next += 1000;
+		if (next < now_us())
+			next = now_us();
+	}
+
+	running = 0;
+	pthread_join(tid, NULL);
+	xpt_arbiter_get_stats(arb, XPT_ARBITER_PRIO_HIGH, &after);
+
+	printf("slice=%u samples=%d avg_latency_us=%.0f max_latency_us=%.0f contended=%llu avg_wait_us=%.0f\n",
+	       slice, samples, total / samples, worst, after.contended - before.contended,
+	       after.contended > before.contended ?
+	       (after.wait_ns - before.wait_ns) / 1e3 / (after.contended - before.contended) : 0.0);
+
+	/* one 4 KB cycle is 3.3 ms on the bus, plus scheduling */
+	if (slice)
+		CHECK(worst < 15000, "sensor waited %.0f us with slice %u", worst, slice);
+}
+
+static void test_slice(xpt_spi_context bulk)
+{
+	xpt_spi_segment_t segs[4];
+	uint8_t buf[4][64];
+
+	memset(segs, 0, sizeof(segs));
+	segs[0].txbuf = buf[0];
+	segs[0].length = 64;
+	segs[0].cs_change = 1;
+	segs[1].txbuf = buf[1];
+	segs[1].length = 64;
+	segs[2].txbuf = buf[2];
+	segs[2].length = 64;
+	segs[2].cs_change = 1;
+	segs[3].txbuf = buf[3];
+	segs[3].length = 64;
+
+	/* split only where chip select goes up anyway */
+	xpt_spi_slice(bulk, 1);
+	fake_messages = 0;
+	CHECK(xpt_spi_transfer_segments(bulk, segs, 4) == XPT_SUCCESS, "sliced transfer failed");
+	CHECK(fake_messages == 3, "sliced transfer took %llu messages", fake_messages);
+
+	xpt_spi_slice(bulk, 0);
+	fake_messages = 0;
+	xpt_spi_transfer_segments(bulk, segs, 4);
+	CHECK(fake_messages == 1, "unsliced transfer took %llu messages", fake_messages);
+}
+
+int main(int argc, char *argv[])
+{
+	xpt_spi_context bulk;
+	xpt_spi_context sensor;
+	int ms = argc > 1 ? atoi(argv[1]) : TEST_MS;
+
+	test_order();
+
+	bulk = xpt_spi_init_raw(TEST_BUS, 0);
+	sensor = xpt_spi_init_raw(TEST_BUS, 1);
+	if (bulk == NULL || sensor == NULL) {
+		printf("cannot open the simulated spi bus\n");
+		return 1;
+	}
+	CHECK(xpt_spi_get_arbiter(bulk) == xpt_spi_get_arbiter(sensor), "contexts on one bus have separate arbiters");
+
+	xpt_spi_priority(bulk, XPT_ARBITER_PRIO_BULK);
+	xpt_spi_priority(sensor, XPT_ARBITER_PRIO_HIGH);
+
+	test_slice(bulk);
+	run(bulk, sensor, 0, ms > 0 ? ms : 1);
+	run(bulk, sensor, DUMP_CYCLE, ms > 0 ? ms : 1);
+
+	xpt_spi_stop(bulk);
+	xpt_spi_stop(sensor);
+
+	return test_result();
+}
@@ -0,0 +1,397 @@
+/***************************************************************************
+ *   Copyright (C) 2015 by Tse-Lun Bien                                    *
+ *   allanbian@gmail.com                                                   *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+
+/*
+ * COBS and SLIP codec throughput and a framed stream over a pty.
+ *
+ * Random payloads with a fixed share of delimiter and escape bytes are
+ * round-tripped through the library codecs and byte-at-a-time reference
+ * decoders. Throughput is measured for the reference, the library with
+ * SIMD scanning disabled, and with SIMD scanning. Finally a writer thread
+ * feeds encoded frames in odd-sized chunks into a pty and the frames are
+ * read back through xpt_framing_read_frame().
+ *
+ * usage: framing_bench [payload_bytes] [special_per_mille]
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include <pty.h>
+
+#include "framing.h"
+#include "test_util.h"
+
+#define BENCH_PAYLOAD	1024
+#define BENCH_FRAMES	2048
+#define BENCH_SPECIAL	20
+#define BENCH_ROUNDS	20
+#define STREAM_FRAMES	500
+#define STREAM_MAX	600
+
+static void fill_payload(uint8_t *buf, int len, int special, unsigned int *seed)
+{
+	static const uint8_t specials[] = { 0x00, XPT_SLIP_END, XPT_SLIP_ESC };
+	int i;
+
+	for (i = 0; i < len; i++) {
+		if (rand_r(seed) % 1000 < (unsigned int) special)
+			buf[i] = specials[rand_r(seed) % 3];
+		else
+			buf[i] = rand_r(seed);
+	}
+}
+
+/* textbook decoders, one byte per iteration */
+static int ref_cobs_decode(const uint8_t *src, int len, uint8_t *dst)
+{
+	int r = 0;
+	int w = 0;
+	int code;
+	int i;
+
+	while (r < len) {
+		code = src[r++];
+		if (code == 0)
+			return -1;
+		for (i = 1; i < code; i++) {
+			if (r >= len)
+				return -1;
+			dst[w++] = src[r++];
+		}
+		if (code != 0xff && r < len)
+			dst[w++] = 0;
+	}
+
+	return w;
+}
+
+static int ref_slip_decode(const uint8_t *src, int len, uint8_t *dst)
+{
+	int w = 0;
+	int i;
+
+	for (i = 0; i < len; i++) {
+		if (src[i] != XPT_SLIP_ESC) {
+			dst[w++] = src[i];
+			continue;
+		}
+		if (++i == len)
+			return -1;
+		if (src[i] == XPT_SLIP_ESC_END)
+			dst[w++] = XPT_SLIP_END;
+		else if (src[i] == XPT_SLIP_ESC_ESC)
+			dst[w++] = XPT_SLIP_ESC;
+		else
+			return -1;
+	}
+
+	return w;
+}
+
+static void test_edges(void)
+{
+	static const int lens[] = { 0, 1, 2, 253, 254, 255, 508, 509, 1000 };
+	uint8_t src[1000];
+	uint8_t enc[XPT_SLIP_MAX_ENCODED(1000)];
+	size_t n;
+	int i;
+	int j;
+	int ret;
+
+	for (i = 0; i < (int) (sizeof(lens) / sizeof(lens[0])); i++) {
+		/* no zeros, all zeros, and zeros at both ends */
+		for (j = 0; j < 3; j++) {
+			memset(src, j == 1 ? 0 : 0x55, lens[i]);
+			if (j == 2 && lens[i] > 0)
+				src[0] = src[lens[i] - 1] = 0;
+
+			n = xpt_cobs_encode(src, lens[i], enc);
+			CHECK(n <= XPT_COBS_MAX_ENCODED(lens[i]), "cobs len %d grew to %zu", lens[i], n);
+			CHECK(memchr(enc, 0, n - 1) == NULL && enc[n - 1] == 0, "cobs len %d delimiter", lens[i]);
+			ret = xpt_cobs_decode(enc, n - 1);
+			CHECK(ret == lens[i] && memcmp(enc, src, lens[i]) == 0, "cobs len %d pattern %d", lens[i], j);
+		}
+	}
+
+	/* malformed input is rejected, not overrun */
+	enc[0] = 5;
+	enc[1] = 1;
+	CHECK(xpt_cobs_decode(enc, 2) < 0, "short cobs block accepted");
+	enc[0] = 0;
+	CHECK(xpt_cobs_decode(enc, 1) < 0, "cobs zero code accepted");
+	enc[0] = 'a';
+	enc[1] = XPT_SLIP_ESC;
+	CHECK(xpt_slip_decode(enc, 2) < 0, "trailing slip escape accepted");
+	enc[1] = XPT_SLIP_ESC;
+	enc[2] = 'x';
+	CHECK(xpt_slip_decode(enc, 3) < 0, "bad slip escape accepted");
+}
+
+struct corpus {
+	uint8_t *raw;
+	uint8_t *enc;
+	uint8_t *work;
+	size_t *off;
+	size_t *len;
+	size_t total;
+};
+
+static void corpus_build(struct corpus *c, int payload, int special, xpt_framing_mode_t mode)
+{
+	size_t max = mode == XPT_FRAMING_COBS ? XPT_COBS_MAX_ENCODED(payload) : XPT_SLIP_MAX_ENCODED(payload);
+
+	c->raw = malloc((size_t) payload * BENCH_FRAMES);
+	c->enc = malloc(max * BENCH_FRAMES);
+	c->work = malloc(max * BENCH_FRAMES);
+	c->off = malloc(sizeof(size_t) * BENCH_FRAMES);
+	c->len = malloc(sizeof(size_t) * BENCH_FRAMES);
+	c->total = 0;
+
+	unsigned int seed = 1;
+	int i;
+
+	fill_payload(c->raw, payload * BENCH_FRAMES, special, &seed);
+	for (i = 0; i < BENCH_FRAMES; i++) {
+		c->off[i] = c->total;
+		if (mode == XPT_FRAMING_COBS)
+			c->len[i] = xpt_cobs_encode(&c->raw[i * payload], payload, &c->enc[c->total]);
+		else
+			c->len[i] = xpt_slip_encode(&c->raw[i * payload], payload, &c->enc[c->total]);
+		c->total += c->len[i];
+	}
+}
+
+static void corpus_free(struct corpus *c)
+{
+	free(c->raw);
+	free(c->enc);
+	free(c->work);
+	free(c->off);
+	free(c->len);
+}
+
+/* 0: reference decoder, 1: library */
+static double run_decode(struct corpus *c, int payload, xpt_framing_mode_t mode, int lib)
+{
+	double start;
+	double us;
+	uint8_t *in;
+	size_t len;
+	int round;
+	int i;
+	int ret;
+
+	start = now_us();
+	for (round = 0; round < BENCH_ROUNDS; round++) {
+		if (lib)
+			memcpy(c->work, c->enc, c->total);
+		for (i = 0; i < BENCH_FRAMES; i++) {
+			/* strip the delimiters, as the stream reader does */
+			in = &c->enc[c->off[i]];
+			len = c->len[i] - 1;
+			if (mode == XPT_FRAMING_SLIP) {
+				in++;
+				len--;
+			}
+
+			if (!lib)
+				ret = mode == XPT_FRAMING_COBS ? ref_cobs_decode(in, len, c->work) : ref_slip_decode(in, len, c->work);
+			else {
+				in = c->work + (in - c->enc);
+				ret = mode == XPT_FRAMING_COBS ? xpt_cobs_decode(in, len) : xpt_slip_decode(in, len);
+			}
+
+			if (round == 0 && (ret != payload || memcmp(lib ? in : c->work, &c->raw[i * payload], payload) != 0)) {
+				CHECK(0, "%s frame %d decoded wrong (%d)", lib ? "library" : "reference", i, ret);
+				return 0;
+			}
+		}
+	}
+	us = now_us() - start;
+
+	return (double) payload * BENCH_FRAMES * BENCH_ROUNDS / us;
+}
+
+static double run_encode(struct corpus *c, int payload, xpt_framing_mode_t mode)
+{
+	double start;
+	size_t n;
+	int round;
+	int i;
+
+	start = now_us();
+	for (round = 0; round < BENCH_ROUNDS; round++) {
+		n = 0;
+		for (i = 0; i < BENCH_FRAMES; i++) {
+			if (mode == XPT_FRAMING_COBS)
+				n += xpt_cobs_encode(&c->raw[i * payload], payload, &c->work[n]);
+			else
+				n += xpt_slip_encode(&c->raw[i * payload], payload, &c->work[n]);
+		}
+	}
+	CHECK(n == c->total, "encoded length changed");
+
+	return (double) payload * BENCH_FRAMES * BENCH_ROUNDS / (now_us() - start);
+}
+
+static void bench(int payload, int special, xpt_framing_mode_t mode)
+{
+	const char *name = mode == XPT_FRAMING_COBS ? "cobs" : "slip";
+	struct corpus c;
+	double ref;
+	double scalar_dec;
+	double scalar_enc;
+	double simd_dec;
+	double simd_enc;
+
+	corpus_build(&c, payload, special, mode);
+
+	ref = run_decode(&c, payload, mode, 0);
+	xpt_framing_use_simd(0);
+	scalar_dec = run_decode(&c, payload, mode, 1);
+	scalar_enc = run_encode(&c, payload, mode);
+	if (xpt_framing_use_simd(1)) {
+		simd_dec = run_decode(&c, payload, mode, 1);
+		simd_enc = run_encode(&c, payload, mode);
+	} else {
+		simd_dec = simd_enc = 0;
+	}
+
+	/* bytes per microsecond is MB/s */
+	printf("%s payload=%d special_per_mille=%d ref_decode_MBps=%.0f scalar_decode_MBps=%.0f simd_decode_MBps=%.0f "
+	       "scalar_encode_MBps=%.0f simd_encode_MBps=%.0f\n",
+	       name, payload, special, ref, scalar_dec, simd_dec, scalar_enc, simd_enc);
+
+	corpus_free(&c);
+}
+
+static int pty_fd;
+static xpt_framing_mode_t stream_mode;
+
+static void *stream_writer(void *arg)
+{
+	uint8_t *out = malloc(STREAM_FRAMES * XPT_SLIP_MAX_ENCODED(STREAM_MAX) + 16);
+	uint8_t payload[STREAM_MAX];
+	size_t total = 0;
+	size_t off = 0;
+	size_t chunk;
+	unsigned int seed = 7;
+	int i;
+
+	/* line noise before the first frame is dropped by the reader */
+	out[total++] = XPT_SLIP_ESC;
+	out[total++] = 'x';
+	out[total++] = stream_mode == XPT_FRAMING_COBS ? 0 : XPT_SLIP_END;
+	for (i = 0; i < STREAM_FRAMES; i++) {
+		fill_payload(payload, i % STREAM_MAX + 1, BENCH_SPECIAL, &seed);
+		if (stream_mode == XPT_FRAMING_COBS)
+			total += xpt_cobs_encode(payload, i % STREAM_MAX + 1, &out[total]);
+		else
+			total += xpt_slip_encode(payload, i % STREAM_MAX + 1, &out[total]);
+	}
+
+	/* odd chunk sizes split frames and delimiters anywhere */
+	while (off < total) {
+		chunk = 1 + rand_r(&seed) % 700;
+		if (chunk > total - off)
+			chunk = total - off;
+		if (write(pty_fd, &out[off], chunk) != (ssize_t) chunk)
+			break;
+		off += chunk;
+	}
+
+	free(out);
+	return NULL;
+}
+
+static void test_stream(xpt_framing_mode_t mode)
+{
+	xpt_uart_context uart;
+	xpt_framing_context fr;
+	xpt_framing_stats_t stats;
+	pthread_t tid;
+	uint8_t expect[STREAM_MAX];
+	uint8_t *frame;
+	char name[64];
+	unsigned int seed = 7;
+	int slave;
+	int i;
+	int len;
+
+	if (openpty(&pty_fd, &slave, name, NULL, NULL) != 0) {
+		perror("openpty");
+		failures++;
+		return;
+	}
+
+	uart = xpt_uart_init_raw(name);
+	fr = uart ? xpt_framing_init(uart, mode, STREAM_MAX) : NULL;
+	if (fr == NULL) {
+		CHECK(0, "cannot open %s", name);
+		return;
+	}
+
+	stream_mode = mode;
+	pthread_create(&tid, NULL, stream_writer, NULL);
+
+	/* same sequence as the writer, consumed in the same order */
+	for (i = 0; i < STREAM_FRAMES; i++) {
+		fill_payload(expect, i % STREAM_MAX + 1, BENCH_SPECIAL, &seed);
+		len = xpt_framing_read_frame(fr, &frame);
+		if (len != i % STREAM_MAX + 1 || memcmp(frame, expect, len) != 0) {
+			CHECK(0, "stream frame %d: got %d bytes", i, len);
+			/* nobody drains the pty any more */
+			pthread_cancel(tid);
+			break;
+		}
+	}
+
+	pthread_join(tid, NULL);
+	xpt_framing_get_stats(fr, &stats);
+	CHECK(stats.frames == STREAM_FRAMES, "frames=%llu", stats.frames);
+	/* the line noise in front of the first frame */
+	CHECK(stats.errors == 1, "errors=%llu", stats.errors);
+	printf("stream %s frames=%llu errors=%llu oversize=%llu\n", mode == XPT_FRAMING_COBS ? "cobs" : "slip",
+	       stats.frames, stats.errors, stats.oversize);
+
+	xpt_framing_stop(fr);
+	xpt_uart_stop(uart);
+	close(slave);
+	close(pty_fd);
+}
+
+int main(int argc, char *argv[])
+{
+	int payload = argc > 1 ? atoi(argv[1]) : BENCH_PAYLOAD;
+	int special = argc > 2 ? atoi(argv[2]) : BENCH_SPECIAL;
+
+	test_edges();
+	bench(payload, special, XPT_FRAMING_COBS);
+	bench(payload, special, XPT_FRAMING_SLIP);
+	test_stream(XPT_FRAMING_COBS);
+	test_stream(XPT_FRAMING_SLIP);
+
+	return test_result();
+}
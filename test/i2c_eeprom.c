@@ -0,0 +1,324 @@
+/***************************************************************************
+ *   Copyright (C) 2015 by Tse-Lun Bien                                    *
+ *   allanbian@gmail.com                                                   *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+
+/*
+ * 24Cxx EEPROM engine against simulated chips.
+ *
+ * This program provides its own ioctl() that answers I2C_RDWR on
+ * /dev/null with a 24c256 (16-bit addresses) and a 24c16 (8-bit addresses,
+ * block select in the slave address). Like real parts they wrap writes
+ * inside the page, and after each write they stop acknowledging for the
+ * write cycle. Each transaction takes the time it would on a 400 kHz bus.
+ *
+ * The benchmark writes the 24c256 once sleeping the datasheet's worst
+ * case after each page, as drivers without polling do, and once through
+ * the engine, which polls for the acknowledge instead.
+ *
+ * usage: i2c_eeprom [kbytes]
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/i2c.h>
+#include <linux/i2c-dev.h>
+
+#include "commbus.h"
+#include "i2c.h"
+#include "i2c_eeprom.h"
+#include "test_util.h"
+
+#define TEST_KB		4
+#define TEST_PATH	"/dev/null"
+
+/* slave addresses of the simulated chips */
+#define ADDR_24C256	0x50
+#define ADDR_24C16	0x58
+
+/* write cycle of the simulation, and the worst case of the datasheet */
+#define FAKE_WRITE_US	3000
+#define WORST_WRITE_US	5000
+/* 9 bit times per byte at 400 kHz */
+#define FAKE_BYTE_NS	22500
+
+struct fake_chip_t {
+	unsigned short base;
+	int blocks;
+	int addr_bytes;
+	unsigned int size;
+	unsigned int page_size;
+	unsigned char *mem;
+	unsigned int ptr;
+	double busy_until;
+	unsigned long long naks;
+};
+
+static struct fake_chip_t fake_chips[2];
+
+static void fake_init(struct fake_chip_t *chip, unsigned short base, int blocks, int addr_bytes,
+		unsigned int size, unsigned int page_size)
+{
+	chip->base = base;
+	chip->blocks = blocks;
+	chip->addr_bytes = addr_bytes;
+	chip->size = size;
+	chip->page_size = page_size;
+	chip->mem = malloc(size);
+	memset(chip->mem, 0xff, size);
+}
+
+static struct fake_chip_t *fake_find(unsigned short addr, int *block)
+{
+	int i;
+
+	for (i = 0; i < 2; i++) {
+		if (addr >= fake_chips[i].base && addr < fake_chips[i].base + fake_chips[i].blocks) {
+			*block = addr - fake_chips[i].base;
+			return &fake_chips[i];
+		}
+	}
+
+	return NULL;
+}
+
+static void fake_bus_time(unsigned int bytes)
+{
+	struct timespec ts = { 0, bytes * FAKE_BYTE_NS };
+
+	nanosleep(&ts, NULL);
+}
+
+/* bytes on the bus and the chip written by the transfer in progress */
+static unsigned int fake_bytes;
+static struct fake_chip_t *fake_written;
+
+static int fake_msg(struct i2c_msg *msg)
+{
+	struct fake_chip_t *chip;
+	unsigned int page;
+	int block;
+	int j;
+
+	chip = fake_find(msg->addr, &block);
+	fake_bytes += 1;
+
+	/* no acknowledge: the transfer ends at the address byte */
+	if (chip == NULL || now_us() < chip->busy_until) {
+		if (chip)
+			chip->naks++;
+		return ENXIO;
+	}
+	fake_bytes += msg->len;
+
+	if (msg->flags & I2C_M_RD) {
+		for (j = 0; j < msg->len; j++) {
+			msg->buf[j] = chip->mem[chip->ptr];
+			chip->ptr = (chip->ptr + 1) % chip->size;
+		}
+		return 0;
+	}
+
+	if (msg->len < chip->addr_bytes)
+		return 0;
+	chip->ptr = block << (8 * chip->addr_bytes);
+	for (j = 0; j < chip->addr_bytes; j++)
+		chip->ptr |= msg->buf[j] << (8 * (chip->addr_bytes - 1 - j));
+	chip->ptr %= chip->size;
+
+	if (msg->len > chip->addr_bytes) {
+		/* data wraps inside the page */
+		page = chip->ptr - chip->ptr % chip->page_size;
+		for (j = chip->addr_bytes; j < msg->len; j++) {
+			chip->mem[chip->ptr] = msg->buf[j];
+			chip->ptr = page + (chip->ptr + 1) % chip->page_size;
+		}
+		fake_written = chip;
+	}
+
+	return 0;
+}
+
+static int fake_rdwr(struct i2c_rdwr_ioctl_data *rdwr)
+{
+	int ret;
+
+	fake_bytes = 0;
+	fake_written = NULL;
+	ret = fake_i2c_rdwr(rdwr, fake_msg);
+
+	fake_bus_time(fake_bytes);
+	/* the write cycle starts at the stop */
+	if (ret >= 0 && fake_written)
+		fake_written->busy_until = now_us() + FAKE_WRITE_US;
+
+	return ret;
+}
+
+int ioctl(int fd, unsigned long request, ...)
+{
+	va_list ap;
+	void *arg;
+
+	va_start(ap, request);
+	arg = va_arg(ap, void *);
+	va_end(ap);
+
+	if (request == I2C_RDWR)
+		return fake_rdwr((struct i2c_rdwr_ioctl_data *)arg);
+
+	return syscall(SYS_ioctl, fd, request, arg);
+}
+
+static void test_register16(struct i2c_ctx_t *ctx)
+{
+	unsigned char data[4] = { 1, 2, 3, 4 };
+	unsigned char back[4];
+	int ret;
+
+	usleep(FAKE_WRITE_US);
+	ret = i2c_ctx_write16(ctx, ADDR_24C256, 0x1234, data, sizeof(data));
+	CHECK(ret == 1, "16-bit write returned %d", ret);
+	CHECK(memcmp(&fake_chips[0].mem[0x1234], data, sizeof(data)) == 0, "16-bit write went elsewhere");
+
+	/* the chip is in its write cycle now */
+	ret = i2c_ctx_read16(ctx, ADDR_24C256, 0x1234, back, sizeof(back));
+	CHECK(ret == -LIBCOMMBUS_ERROR_NO_DEVICE, "read during the write cycle returned %d", ret);
+
+	usleep(FAKE_WRITE_US);
+	ret = i2c_ctx_read16(ctx, ADDR_24C256, 0x1234, back, sizeof(back));
+	CHECK(ret == 2 && memcmp(back, data, sizeof(data)) == 0, "16-bit read returned %d", ret);
+}
+
+static void test_eeprom(struct i2c_ctx_t *ctx, const char *name, unsigned short addr, struct fake_chip_t *fake)
+{
+	struct i2c_eeprom_t eep;
+	unsigned char *data = malloc(fake->size);
+	unsigned char *back = malloc(fake->size);
+	unsigned int seed = 7;
+	unsigned int off;
+	unsigned int len;
+	int ret;
+	int i;
+
+	ret = i2c_eeprom_open(&eep, ctx, addr, name);
+	CHECK(ret == LIBCOMMBUS_SUCCESS, "%s: open returned %d", name, ret);
+	if (ret != LIBCOMMBUS_SUCCESS)
+		return;
+
+	for (i = 0; i < (int)fake->size; i++)
+		data[i] = rand_r(&seed);
+
+	/* odd offsets and lengths, crossing pages and blocks */
+	for (i = 0; i < 40; i++) {
+		off = rand_r(&seed) % fake->size;
+		len = rand_r(&seed) % 600 + 1;
+		if (len > fake->size - off)
+			len = fake->size - off;
+
+		ret = i2c_eeprom_write(&eep, off, data + off, len);
+		CHECK(ret == LIBCOMMBUS_SUCCESS, "%s: write of %u at %u returned %d", name, len, off, ret);
+		CHECK(memcmp(&fake->mem[off], data + off, len) == 0, "%s: write of %u at %u differs", name, len, off);
+		CHECK(now_us() >= fake->busy_until, "%s: write returned during the write cycle", name);
+
+		ret = i2c_eeprom_read(&eep, off, back, len);
+		CHECK(ret == LIBCOMMBUS_SUCCESS && memcmp(back, data + off, len) == 0,
+		      "%s: read of %u at %u returned %d or differs", name, len, off, ret);
+		if (failures)
+			break;
+	}
+
+	ret = i2c_eeprom_read(&eep, fake->size - 1, back, 2);
+	CHECK(ret == -LIBCOMMBUS_ERROR_NOT_SUPPORT, "%s: read past the end returned %d", name, ret);
+	printf("chip=%s reads=%llu writes=%llu pages=%llu polls=%llu\n", name, eep.stats.reads,
+	       eep.stats.writes, eep.stats.pages, eep.stats.polls);
+
+	free(data);
+	free(back);
+}
+
+static void bench(struct i2c_ctx_t *ctx, unsigned int total)
+{
+	struct i2c_eeprom_t eep;
+	unsigned char *data = malloc(total);
+	unsigned int page = 64;
+	unsigned int off;
+	double start;
+	double us;
+	int ret;
+
+	memset(data, 0x3c, total);
+	usleep(FAKE_WRITE_US);
+
+	start = now_us();
+	for (off = 0; off < total; off += page) {
+		i2c_ctx_write16(ctx, ADDR_24C256, off, data + off, page);
+		usleep(WORST_WRITE_US);
+	}
+	us = now_us() - start;
+	printf("mode=sleep bytes=%u ms=%.1f KBps=%.1f\n", total, us / 1e3, total * 1e6 / 1024 / us);
+
+	memset(data, 0xc3, total);
+	i2c_eeprom_open(&eep, ctx, ADDR_24C256, "24c256");
+	start = now_us();
+	ret = i2c_eeprom_write(&eep, 0, data, total);
+	us = now_us() - start;
+	printf("mode=poll bytes=%u ms=%.1f KBps=%.1f polls=%llu\n", total, us / 1e3, total * 1e6 / 1024 / us,
+	       eep.stats.polls);
+	CHECK(ret == LIBCOMMBUS_SUCCESS && memcmp(fake_chips[0].mem, data, total) == 0, "bench: write failed");
+
+	free(data);
+}
+
+int main(int argc, char *argv[])
+{
+	struct i2c_ctx_t ctx;
+	struct i2c_eeprom_t eep;
+	unsigned int total = (argc > 1 ? atoi(argv[1]) : TEST_KB) * 1024;
+
+	fake_init(&fake_chips[0], ADDR_24C256, 1, 2, 32768, 64);
+	fake_init(&fake_chips[1], ADDR_24C16, 8, 1, 2048, 16);
+
+	if (i2c_ctx_open(&ctx, TEST_PATH) != LIBCOMMBUS_SUCCESS) {
+		printf("cannot open %s\n", TEST_PATH);
+		return 1;
+	}
+
+	CHECK(i2c_eeprom_open(&eep, &ctx, ADDR_24C256, "24c999") == -LIBCOMMBUS_ERROR_NOT_SUPPORT,
+	      "unknown chip opened");
+	CHECK(i2c_eeprom_open(&eep, &ctx, 0x20, "24c02") == -LIBCOMMBUS_ERROR_NO_DEVICE,
+	      "absent chip opened");
+
+	test_register16(&ctx);
+	test_eeprom(&ctx, "24c256", ADDR_24C256, &fake_chips[0]);
+	test_eeprom(&ctx, "24c16", ADDR_24C16, &fake_chips[1]);
+	if (total > fake_chips[0].size)
+		total = fake_chips[0].size;
+	bench(&ctx, total - total % 64);
+
+	i2c_ctx_close(&ctx);
+
+	return test_result();
+}
@@ -0,0 +1,265 @@
+/***************************************************************************
+ *   Copyright (C) 2015 by Tse-Lun Bien                                    *
+ *   allanbian@gmail.com                                                   *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+
+/*
+ * I2C transactions and allocation-free register writes.
+ *
+ * There is no adapter to test against, so this program provides its own
+ * ioctl() that answers I2C_RDWR on /dev/null: a few register-file
+ * devices with an auto-incrementing register pointer, like most sensors,
+ * and no acknowledge from any other address. malloc() and realloc() are
+ * counted as well, the register writes must not call them once the
+ * context's buffer is large enough.
+ *
+ * The benchmark polls three sensors the way a sampling loop does, a
+ * trigger write and a data read each, first with separate calls, then
+ * as one transaction per sample.
+ *
+ * usage: i2c_xact [samples]
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/i2c.h>
+#include <linux/i2c-dev.h>
+
+#include "commbus.h"
+#include "i2c.h"
+#include "test_util.h"
+
+#define TEST_SAMPLES	100000
+#define TEST_PATH	"/dev/null"
+
+/* the simulated devices answer at FAKE_ADDR and the next ones */
+#define FAKE_ADDR	0x48
+#define FAKE_DEVICES	3
+
+static unsigned char fake_regs[FAKE_DEVICES][256];
+static unsigned char fake_ptr[FAKE_DEVICES];
+static unsigned long long fake_ioctls;
+static unsigned long long allocs;
+
+extern void *__libc_malloc(size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+
+void *malloc(size_t size)
+{
+	allocs++;
+	return __libc_malloc(size);
+}
+
+void *realloc(void *ptr, size_t size)
+{
+	allocs++;
+	return __libc_realloc(ptr, size);
+}
+
+static int fake_msg(struct i2c_msg *msg)
+{
+	int dev = msg->addr - FAKE_ADDR;
+	int j;
+
+	if (dev < 0 || dev >= FAKE_DEVICES)
+		return ENXIO;
+
+	if (msg->flags & I2C_M_RD) {
+		for (j = 0; j < msg->len; j++)
+			msg->buf[j] = fake_regs[dev][fake_ptr[dev]++];
+	} else if (msg->len > 0) {
+		fake_ptr[dev] = msg->buf[0];
+		for (j = 1; j < msg->len; j++)
+			fake_regs[dev][fake_ptr[dev]++] = msg->buf[j];
+	}
+
+	return 0;
+}
+
+int ioctl(int fd, unsigned long request, ...)
+{
+	va_list ap;
+	void *arg;
+
+	va_start(ap, request);
+	arg = va_arg(ap, void *);
+	va_end(ap);
+
+	if (request == I2C_RDWR) {
+		fake_ioctls++;
+		return fake_i2c_rdwr((struct i2c_rdwr_ioctl_data *)arg, fake_msg);
+	}
+
+	return syscall(SYS_ioctl, fd, request, arg);
+}
+
+static void test_write_read(struct i2c_ctx_t *ctx)
+{
+	unsigned char data[200];
+	unsigned char back[200];
+	unsigned long long a;
+	int ret;
+	int i;
+
+	for (i = 0; i < (int)sizeof(data); i++)
+		data[i] = i * 13;
+
+	a = allocs;
+	fake_ioctls = 0;
+	ret = i2c_ctx_write(ctx, FAKE_ADDR, 0x10, data, 4);
+	CHECK(ret == 1, "write returned %d", ret);
+	CHECK(memcmp(&fake_regs[0][0x10], data, 4) == 0, "write did not reach the registers");
+	CHECK(allocs == a, "short write allocated %llu times", allocs - a);
+	CHECK(fake_ioctls == 1, "short write took %llu ioctls", fake_ioctls);
+
+	/* longer than the preallocated buffer: grown once, then reused */
+	a = allocs;
+	ret = i2c_ctx_write(ctx, FAKE_ADDR, 0x20, data, sizeof(data));
+	CHECK(ret == 1 && allocs == a + 1, "long write returned %d, %llu allocations", ret, allocs - a);
+	a = allocs;
+	ret = i2c_ctx_write(ctx, FAKE_ADDR, 0x20, data, sizeof(data));
+	CHECK(ret == 1 && allocs == a, "second long write returned %d, %llu allocations", ret, allocs - a);
+
+	a = allocs;
+	fake_ioctls = 0;
+	ret = i2c_ctx_read(ctx, FAKE_ADDR, 0x20, back, sizeof(back));
+	CHECK(ret == 2, "read returned %d", ret);
+	CHECK(memcmp(back, data, sizeof(data)) == 0, "read back differs");
+	CHECK(allocs == a && fake_ioctls == 1, "read: %llu allocations, %llu ioctls", allocs - a, fake_ioctls);
+
+	ret = i2c_ctx_write(ctx, FAKE_ADDR + FAKE_DEVICES, 0x00, data, 1);
+	CHECK(ret == -LIBCOMMBUS_ERROR_NO_DEVICE, "write without acknowledge returned %d", ret);
+}
+
+static void test_xact(struct i2c_ctx_t *ctx)
+{
+	struct i2c_xact_t xact;
+	unsigned char arena[16];
+	unsigned char cfg[2] = { 0x5a, 0xa5 };
+	unsigned char out[FAKE_DEVICES][2];
+	unsigned char raw[2] = { 0x30, 0x77 };
+	int ret;
+	int i;
+
+	for (i = 0; i < FAKE_DEVICES; i++) {
+		fake_regs[i][0x40] = i;
+		fake_regs[i][0x41] = 0x80 | i;
+	}
+
+	/* configure one device and read all of them under one stop */
+	i2c_xact_init(&xact, arena, sizeof(arena));
+	i2c_xact_write_reg(&xact, FAKE_ADDR, 0x50, cfg, sizeof(cfg));
+	for (i = 0; i < FAKE_DEVICES; i++)
+		i2c_xact_read_reg(&xact, FAKE_ADDR + i, 0x40, out[i], 2);
+	i2c_xact_write(&xact, FAKE_ADDR + 1, raw, sizeof(raw));
+
+	fake_ioctls = 0;
+	ret = i2c_ctx_submit(ctx, &xact);
+	CHECK(ret == 2 + 2 * FAKE_DEVICES, "transaction returned %d", ret);
+	CHECK(fake_ioctls == 1, "transaction took %llu ioctls", fake_ioctls);
+	for (i = 0; i < FAKE_DEVICES; i++)
+		CHECK(out[i][0] == i && out[i][1] == (0x80 | i), "device %d read %02x %02x", i, out[i][0], out[i][1]);
+	CHECK(fake_regs[0][0x50] == 0x5a && fake_regs[0][0x51] == 0xa5, "configuration not written");
+	CHECK(fake_regs[1][0x30] == 0x77, "raw write not written");
+
+	/* the message limit of the ioctl */
+	i2c_xact_reset(&xact);
+	for (i = 0; i < I2C_XACT_MSGS_MAX; i++)
+		i2c_xact_read(&xact, FAKE_ADDR, out[0], 1);
+	ret = i2c_xact_read(&xact, FAKE_ADDR, out[0], 1);
+	CHECK(ret == -LIBCOMMBUS_ERROR_NOT_SUPPORT, "message %d added: %d", I2C_XACT_MSGS_MAX + 1, ret);
+	fake_ioctls = 0;
+	ret = i2c_ctx_submit(ctx, &xact);
+	CHECK(ret == -LIBCOMMBUS_ERROR_NOT_SUPPORT && fake_ioctls == 0, "overlong transaction returned %d", ret);
+
+	/* and of the arena */
+	i2c_xact_reset(&xact);
+	ret = i2c_xact_write_reg(&xact, FAKE_ADDR, 0x00, arena, sizeof(arena));
+	CHECK(ret == -LIBCOMMBUS_ERROR_MALLOC, "write beyond the arena added: %d", ret);
+	ret = i2c_ctx_submit(ctx, &xact);
+	CHECK(ret == -LIBCOMMBUS_ERROR_MALLOC, "transaction beyond the arena returned %d", ret);
+}
+
+static void bench(struct i2c_ctx_t *ctx, int samples)
+{
+	struct i2c_xact_t xact;
+	unsigned char arena[2 * FAKE_DEVICES];
+	unsigned char trigger = 0x01;
+	unsigned char out[FAKE_DEVICES][6];
+	unsigned long long a;
+	double start;
+	double us;
+	int n;
+	int i;
+
+	a = allocs;
+	fake_ioctls = 0;
+	start = now_us();
+	for (n = 0; n < samples; n++) {
+		for (i = 0; i < FAKE_DEVICES; i++) {
+			i2c_ctx_write(ctx, FAKE_ADDR + i, 0x00, &trigger, 1);
+			i2c_ctx_read(ctx, FAKE_ADDR + i, 0x40, out[i], sizeof(out[i]));
+		}
+	}
+	us = now_us() - start;
+	printf("mode=calls samples=%d ioctls_per_sample=%.1f allocs=%llu ns_per_sample=%.0f\n",
+	       samples, (double)fake_ioctls / samples, allocs - a, us * 1e3 / samples);
+
+	a = allocs;
+	fake_ioctls = 0;
+	start = now_us();
+	i2c_xact_init(&xact, arena, sizeof(arena));
+	for (n = 0; n < samples; n++) {
+		i2c_xact_reset(&xact);
+		for (i = 0; i < FAKE_DEVICES; i++) {
+			i2c_xact_write_reg(&xact, FAKE_ADDR + i, 0x00, &trigger, 1);
+			i2c_xact_read(&xact, FAKE_ADDR + i, out[i], sizeof(out[i]));
+		}
+		i2c_ctx_submit(ctx, &xact);
+	}
+	us = now_us() - start;
+	printf("mode=xact samples=%d ioctls_per_sample=%.1f allocs=%llu ns_per_sample=%.0f\n",
+	       samples, (double)fake_ioctls / samples, allocs - a, us * 1e3 / samples);
+	CHECK(allocs == a, "transactions allocated");
+}
+
+int main(int argc, char *argv[])
+{
+	struct i2c_ctx_t ctx;
+	int samples = argc > 1 ? atoi(argv[1]) : TEST_SAMPLES;
+
+	if (i2c_ctx_open(&ctx, TEST_PATH) != LIBCOMMBUS_SUCCESS) {
+		printf("cannot open %s\n", TEST_PATH);
+		return 1;
+	}
+
+	test_write_read(&ctx);
+	test_xact(&ctx);
+	bench(&ctx, samples > 0 ? samples : 1);
+
+	i2c_ctx_close(&ctx);
+
+	return test_result();
+}
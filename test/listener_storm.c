@@ -0,0 +1,330 @@
+/***************************************************************************
+ *   Copyright (C) 2015 by Tse-Lun Bien                                    *
+ *   allanbian@gmail.com                                                   *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+
+/*
+ * Loopback connection storm against the SO_REUSEPORT listener.
+ *
+ * Client threads connect, send one small request, wait for the echo and
+ * reset the connection (SO_LINGER 0, so no TIME_WAIT piles up), as fast as
+ * they can. The same load is run against a listener with a single shard
+ * and one with a shard per cpu; accepted connections per shard show how
+ * the kernel spread them.
+ *
+ * Beforehand, the listener is run out of descriptors with connections
+ * queued: with its reserve descriptor they must be shed, the clients
+ * seeing the connection closed, and without it they must be accepted by
+ * the retry timer once descriptors are free again, with no new
+ * connection to trigger the listening socket.
+ *
+ * usage: listener_storm [conns] [clients] [shards]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <time.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/resource.h>
+
+#include "commbus.h"
+#include "socket.h"
+#include "reactor.h"
+#include "listener.h"
+#include "test_util.h"
+
+#define TEST_HOST	"127.0.0.1"
+#define TEST_PORT	5003
+#define TEST_CONNS	20000
+#define TEST_CLIENTS	8
+#define TEST_LEN	32
+/* connections queued while the listener is out of descriptors */
+#define EMFILE_CONNS	4
+
+struct storm_conn {
+	struct reactor_handler_t handler;
+	struct sock_info_t sock;
+};
+
+struct client_arg {
+	pthread_t tid;
+	int conns;
+	int errors;
+};
+
+static void conn_cb(struct reactor_t *reactor, struct reactor_handler_t *handler, int events)
+{
+	struct storm_conn *conn = (struct storm_conn *)handler->arg;
+	unsigned char buf[TEST_LEN];
+	int n;
+
+	while (1) {
+		n = socket_recv(&conn->sock, buf, sizeof(buf));
+		if (n == -LIBCOMMBUS_ERROR_AGAIN)
+			return;
+		if (n < 0)
+			break;
+
+		if (socket_send(&conn->sock, buf, n) != n)
+			break;
+	}
+
+	reactor_del(reactor, handler);
+	socket_close(&conn->sock);
+	free(conn);
+}
+
+static void on_conn(struct listener_t *listener, struct reactor_t *reactor,
+		struct sock_info_t *sock, void *arg)
+{
+	struct storm_conn *conn;
+
+	conn = (struct storm_conn *)calloc(1, sizeof(*conn));
+	if (conn == NULL) {
+		socket_close(sock);
+		return;
+	}
+
+	conn->sock = *sock;
+	conn->handler.cb = conn_cb;
+	conn->handler.arg = conn;
+	if (reactor_add(reactor, &conn->handler, &conn->sock, REACTOR_EV_READ) != LIBCOMMBUS_SUCCESS) {
+		socket_close(&conn->sock);
+		free(conn);
+		return;
+	}
+
+	/* the request may already be queued, the edge has passed */
+	conn_cb(reactor, &conn->handler, REACTOR_EV_READ);
+}
+
+static void *client_thread(void *arg)
+{
+	struct client_arg *client = (struct client_arg *)arg;
+	struct sock_info_t sock;
+	struct linger lg = { 1, 0 };
+	unsigned char tx[TEST_LEN];
+	unsigned char rx[TEST_LEN];
+	char host[] = TEST_HOST;
+	int i;
+
+	memset(tx, 0x5a, sizeof(tx));
+
+	for (i = 0; i < client->conns; i++) {
+		if (socket_open(&sock, TYPE_TCP) != LIBCOMMBUS_SUCCESS) {
+			client->errors++;
+			continue;
+		}
+		setsockopt(sock.fd, SOL_SOCKET, SO_LINGER, &lg, sizeof(lg));
+
+		if (socket_connect(&sock, host, TEST_PORT) != LIBCOMMBUS_SUCCESS) {
+			client->errors++;
+			continue;
+		}
+
+		if (socket_write(&sock, tx, sizeof(tx)) != sizeof(tx) ||
+		    socket_read(&sock, rx, sizeof(rx)) != sizeof(rx))
+			client->errors++;
+
+		socket_close(&sock);
+	}
+
+	return NULL;
+}
+
+static int run_storm(int shards, int conns, int clients)
+{
+	struct listener_t listener;
+	struct client_arg *client;
+	double start;
+	double elapsed;
+	int errors = 0;
+	int i;
+
+	if (listener_open(&listener, TEST_PORT, shards, on_conn, NULL) != LIBCOMMBUS_SUCCESS) {
+		debug_print("listener_open on port %d failed!\n", TEST_PORT);
+		return 1;
+	}
+	listener_start(&listener);
+
+	client = (struct client_arg *)calloc(clients, sizeof(*client));
+	for (i = 0; i < clients; i++)
+		client[i].conns = conns / clients + (i < conns % clients);
+
+	start = now_us();
+	for (i = 0; i < clients; i++)
+		pthread_create(&client[i].tid, NULL, client_thread, &client[i]);
+	for (i = 0; i < clients; i++) {
+		pthread_join(client[i].tid, NULL);
+		errors += client[i].errors;
+	}
+	elapsed = now_us() - start;
+
+	/* let the shards see the last resets before the loops stop */
+	usleep(100 * 1000);
+	listener_stop(&listener);
+
+	printf("shards=%-3d conns=%d conns/s=%.0f errors=%d accepted/shard=",
+	       listener.nshards, conns, conns / (elapsed / 1e6), errors);
+	for (i = 0; i < listener.nshards; i++)
+		printf("%s%llu", i ? "," : "", listener.shards[i].accepted);
+	printf("\n");
+
+	listener_close(&listener);
+	free(client);
+
+	return errors != 0;
+}
+
+/* use up every descriptor below the soft limit, returns how many were taken */
+static int exhaust_fds(int *fds, int max)
+{
+	int n;
+
+	for (n = 0; n < max; n++) {
+		fds[n] = open("/dev/null", O_RDONLY);
+		if (fds[n] < 0)
+			break;
+	}
+
+	return n;
+}
+
+/* whether a request on sock is echoed, 1; the connection closed, 0; nothing, -1 */
+static int echo_state(struct sock_info_t *sock)
+{
+	unsigned char buf[TEST_LEN];
+	struct timeval tv = { 1, 0 };
+	int n;
+
+	setsockopt(sock->fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+	memset(buf, 0x5a, sizeof(buf));
+	send(sock->fd, buf, sizeof(buf), MSG_NOSIGNAL);
+
+	n = recv(sock->fd, buf, sizeof(buf), MSG_WAITALL);
+	if (n == sizeof(buf))
+		return 1;
+	if (n == 0 || (n < 0 && (errno == ECONNRESET || errno == EPIPE)))
+		return 0;
+
+	return -1;
+}
+
+static int run_emfile(int reserve)
+{
+	struct listener_t listener;
+	struct listener_shard_t *shard;
+	struct sock_info_t sock[EMFILE_CONNS];
+	struct rlimit old;
+	struct rlimit lim;
+	char host[] = TEST_HOST;
+	int fds[256];
+	int nfds;
+	int state[EMFILE_CONNS];
+	int expect;
+	int fail = 0;
+	int i;
+
+	if (listener_open(&listener, TEST_PORT, 1, on_conn, NULL) != LIBCOMMBUS_SUCCESS) {
+		debug_print("listener_open on port %d failed!\n", TEST_PORT);
+		return 1;
+	}
+	shard = &listener.shards[0];
+	if (!reserve) {
+		close(shard->reserve_fd);
+		shard->reserve_fd = -1;
+	}
+	listener_start(&listener);
+
+	for (i = 0; i < EMFILE_CONNS; i++)
+		socket_open(&sock[i], TYPE_TCP);
+
+	/* no descriptor left for accept() */
+	getrlimit(RLIMIT_NOFILE, &old);
+	lim = old;
+	lim.rlim_cur = sock[EMFILE_CONNS - 1].fd + 64;
+	setrlimit(RLIMIT_NOFILE, &lim);
+	nfds = exhaust_fds(fds, sizeof(fds) / sizeof(fds[0]));
+
+	for (i = 0; i < EMFILE_CONNS; i++)
+		socket_connect(&sock[i], host, TEST_PORT);
+	/* let the shard hit the limit */
+	usleep(100 * 1000);
+
+	if (reserve) {
+		for (i = 0; i < EMFILE_CONNS; i++)
+			state[i] = echo_state(&sock[i]);
+	}
+
+	/* descriptors come back, the queue must move on its own */
+	while (nfds > 0)
+		close(fds[--nfds]);
+	setrlimit(RLIMIT_NOFILE, &old);
+
+	if (!reserve) {
+		for (i = 0; i < EMFILE_CONNS; i++)
+			state[i] = echo_state(&sock[i]);
+	}
+
+	expect = reserve ? 0 : 1;
+	for (i = 0; i < EMFILE_CONNS; i++) {
+		if (state[i] != expect)
+			fail = 1;
+		socket_close(&sock[i]);
+	}
+	if (shard->errors == 0 || (reserve && shard->shed != EMFILE_CONNS))
+		fail = 1;
+
+	listener_stop(&listener);
+	printf("emfile reserve=%d shed=%llu accepted=%llu errors=%llu %s\n", reserve, shard->shed,
+	       shard->accepted, shard->errors, fail ? "FAILED" : "ok");
+	listener_close(&listener);
+
+	return fail;
+}
+
+int main(int argc, char *argv[])
+{
+	int conns = TEST_CONNS;
+	int clients = TEST_CLIENTS;
+	int shards = 0;
+	int ret = 0;
+
+	if (argc > 1)
+		conns = atoi(argv[1]);
+	if (argc > 2)
+		clients = atoi(argv[2]);
+	if (argc > 3)
+		shards = atoi(argv[3]);
+	if (shards <= 0)
+		shards = sysconf(_SC_NPROCESSORS_ONLN);
+
+	printf("conns=%d clients=%d cpus=%ld\n", conns, clients, sysconf(_SC_NPROCESSORS_ONLN));
+
+	ret |= run_emfile(1);
+	ret |= run_emfile(0);
+	ret |= run_storm(1, conns, clients);
+	ret |= run_storm(shards, conns, clients);
+
+	return ret;
+}
@@ -0,0 +1,413 @@
+/***************************************************************************
+ *   Copyright (C) 2015 by Tse-Lun Bien                                    *
+ *   allanbian@gmail.com                                                   *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+
+/*
+ * Modbus TCP to RTU gateway against a simulated slave on a pty.
+ *
+ * The slave thread answers on the pty master side and delays every
+ * response by its time on the wire. Loopback clients poll through the
+ * gateway: half of them read the same block, the others each their own,
+ * and one greedy client keeps several requests in flight. The test checks
+ * the answers and the timeout exception of an absent unit, then reports
+ * throughput, bus transactions and each client's share with request
+ * deduplication off and on.
+ *
+ * usage: modbus_gateway [baudrate] [requests per client] [clients]
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include <pty.h>
+
+#include "commbus.h"
+#include "socket.h"
+#include "uart.h"
+#include "gateway.h"
+
+#define TEST_RTU_CRC16	gateway_crc16
+#include "test_util.h"
+
+#define TEST_HOST	"127.0.0.1"
+#define TEST_PORT	5020
+#define TEST_UNIT	17
+#define TEST_ABSENT	5
+#define TEST_REGS	512
+#define TEST_COUNT	10
+#define TEST_BAUD	115200
+#define TEST_REQUESTS	200
+#define TEST_CLIENTS	8
+#define TEST_PIPELINE	8
+
+struct client_arg {
+	pthread_t tid;
+	int index;
+	int requests;
+	int pipeline;
+	int shared;
+	int done;
+	int errors;
+	double elapsed;
+};
+
+static int slave_fd;
+static int slave_char_us;
+static volatile int slave_running = 1;
+static unsigned long slave_frames;
+static unsigned short slave_regs[TEST_REGS];
+
+/* read holding registers and write single register, 8 byte requests */
+static void *slave_thread(void *arg)
+{
+	unsigned char req[8];
+	unsigned char rsp[260];
+	unsigned short addr;
+	unsigned short count;
+	int i;
+
+	while (slave_running) {
+		if (read_full(slave_fd, req, sizeof(req)) < 0)
+			break;
+		slave_frames++;
+
+		if (gateway_crc16(req, sizeof(req)) != 0 || req[0] != TEST_UNIT)
+			continue;
+
+		addr = (req[2] << 8) | req[3];
+		count = (req[4] << 8) | req[5];
+
+		rsp[0] = req[0];
+		rsp[1] = req[1];
+
+		switch (req[1]) {
+		case 0x03:
+			if (count == 0 || count > 125 || addr + count > TEST_REGS) {
+				rsp[1] |= 0x80;
+				rsp[2] = 0x02;
+				rtu_send(slave_fd, rsp, 3, slave_char_us);
+				break;
+			}
+			rsp[2] = count * 2;
+			for (i = 0; i < count; i++) {
+				rsp[3 + i * 2] = slave_regs[addr + i] >> 8;
+				rsp[4 + i * 2] = slave_regs[addr + i] & 0xff;
+			}
+			rtu_send(slave_fd, rsp, 3 + count * 2, slave_char_us);
+			break;
+
+		case 0x06:
+			if (addr < TEST_REGS)
+				slave_regs[addr] = count;
+			memcpy(rsp, req, 6);
+			rtu_send(slave_fd, rsp, 6, slave_char_us);
+			break;
+
+		default:
+			rsp[1] |= 0x80;
+			rsp[2] = 0x01;
+			rtu_send(slave_fd, rsp, 3, slave_char_us);
+			break;
+		}
+	}
+
+	return NULL;
+}
+
+static void *gateway_thread(void *arg)
+{
+	gateway_run((struct gateway_t *)arg);
+
+	return NULL;
+}
+
+static int client_connect(struct sock_info_t *sock)
+{
+	char host[] = TEST_HOST;
+
+	if (socket_open(sock, TYPE_TCP) != LIBCOMMBUS_SUCCESS)
+		return -1;
+	if (socket_connect(sock, host, TEST_PORT) != LIBCOMMBUS_SUCCESS)
+		return -1;
+
+	return 0;
+}
+
+static int client_send(struct sock_info_t *sock, unsigned short tid, unsigned char unit,
+		unsigned char fc, unsigned short addr, unsigned short val)
+{
+	unsigned char adu[12];
+
+	adu[0] = tid >> 8;
+	adu[1] = tid & 0xff;
+	adu[2] = 0;
+	adu[3] = 0;
+	adu[4] = 0;
+	adu[5] = 6;
+	adu[6] = unit;
+	adu[7] = fc;
+	adu[8] = addr >> 8;
+	adu[9] = addr & 0xff;
+	adu[10] = val >> 8;
+	adu[11] = val & 0xff;
+
+	return socket_write(sock, adu, sizeof(adu)) == sizeof(adu) ? 0 : -1;
+}
+
+/* read one response, returns the PDU length or -1 */
+static int client_recv(struct sock_info_t *sock, unsigned short *tid, unsigned char *pdu)
+{
+	unsigned char mbap[7];
+	int len;
+
+	if (socket_read(sock, mbap, sizeof(mbap)) != sizeof(mbap))
+		return -1;
+
+	len = ((mbap[4] << 8) | mbap[5]) - 1;
+	if (len < 2 || len > GATEWAY_PDU_MAX)
+		return -1;
+	if (socket_read(sock, pdu, len) != len)
+		return -1;
+
+	*tid = (mbap[0] << 8) | mbap[1];
+	return len;
+}
+
+static int check_read(unsigned char *pdu, int len, unsigned short addr)
+{
+	int i;
+
+	if (len != 2 + TEST_COUNT * 2 || pdu[0] != 0x03 || pdu[1] != TEST_COUNT * 2)
+		return -1;
+
+	for (i = 0; i < TEST_COUNT; i++) {
+		if (((pdu[2 + i * 2] << 8) | pdu[3 + i * 2]) != slave_regs[addr + i])
+			return -1;
+	}
+
+	return 0;
+}
+
+static void *client_thread(void *arg)
+{
+	struct client_arg *client = (struct client_arg *)arg;
+	struct sock_info_t sock;
+	unsigned char pdu[GATEWAY_PDU_MAX];
+	unsigned short addr;
+	unsigned short tid;
+	unsigned short expect;
+	int sent = 0;
+	int len;
+	double start;
+
+	if (client_connect(&sock) != 0) {
+		client->errors = client->requests;
+		return NULL;
+	}
+
+	/* shared clients all poll block 0, the others one block each */
+	addr = client->shared ? 0 : (client->index + 1) * 32;
+
+	start = now_us();
+	expect = 0;
+	while (client->done < client->requests) {
+		while (sent < client->requests && sent - client->done < client->pipeline) {
+			if (client_send(&sock, sent, TEST_UNIT, 0x03, addr, TEST_COUNT) != 0)
+				goto out;
+			sent++;
+		}
+
+		len = client_recv(&sock, &tid, pdu);
+		if (len < 0)
+			goto out;
+		if (tid != expect++ || check_read(pdu, len, addr) != 0)
+			client->errors++;
+		client->done++;
+	}
+	client->elapsed = now_us() - start;
+
+out:
+	client->errors += client->requests - client->done;
+	socket_close(&sock);
+	return NULL;
+}
+
+static void test_basic(void)
+{
+	struct sock_info_t sock;
+	unsigned char pdu[GATEWAY_PDU_MAX];
+	unsigned short tid;
+	double start;
+	int len;
+
+	if (client_connect(&sock) != 0) {
+		CHECK(0, "connect failed");
+		return;
+	}
+
+	client_send(&sock, 1, TEST_UNIT, 0x03, 100, TEST_COUNT);
+	len = client_recv(&sock, &tid, pdu);
+	CHECK(tid == 1 && check_read(pdu, len, 100) == 0, "read through the gateway failed");
+
+	client_send(&sock, 2, TEST_UNIT, 0x06, 100, 0xbeef);
+	client_send(&sock, 3, TEST_UNIT, 0x03, 100, TEST_COUNT);
+	len = client_recv(&sock, &tid, pdu);
+	CHECK(tid == 2 && len == 5 && pdu[0] == 0x06, "write answer %d tid %u", len, tid);
+	len = client_recv(&sock, &tid, pdu);
+	CHECK(tid == 3 && len > 3 && pdu[2] == 0xbe && pdu[3] == 0xef,
+	      "read after write did not see the write");
+
+	client_send(&sock, 4, TEST_UNIT, 0x03, TEST_REGS - 1, TEST_COUNT);
+	len = client_recv(&sock, &tid, pdu);
+	CHECK(tid == 4 && len == 2 && pdu[0] == 0x83 && pdu[1] == 0x02,
+	      "slave exception not passed through");
+
+	start = now_us();
+	client_send(&sock, 5, TEST_ABSENT, 0x03, 0, TEST_COUNT);
+	len = client_recv(&sock, &tid, pdu);
+	CHECK(tid == 5 && len == 2 && pdu[0] == 0x83 && pdu[1] == GATEWAY_EX_NO_RESPONSE,
+	      "absent unit answered %d %02x", len, len > 1 ? pdu[1] : 0);
+	CHECK(now_us() - start < 1e6, "timeout took %.0f ms", (now_us() - start) / 1e3);
+
+	client_send(&sock, 6, TEST_UNIT, 0x03, 100, TEST_COUNT);
+	len = client_recv(&sock, &tid, pdu);
+	CHECK(tid == 6 && check_read(pdu, len, 100) == 0, "read after timeout failed");
+
+	socket_close(&sock);
+}
+
+static int run_bench(struct gateway_t *gw, int dedup, int requests, int clients)
+{
+	struct client_arg *client;
+	unsigned long frames = slave_frames;
+	unsigned long long transactions = gw->stats.transactions;
+	unsigned long long deduplicated = gw->stats.deduplicated;
+	double start;
+	double elapsed;
+	double greedy;
+	double polite = 0;
+	int errors = 0;
+	int total = 0;
+	int i;
+
+	gateway_set_dedup(gw, dedup);
+
+	client = (struct client_arg *)calloc(clients, sizeof(*client));
+	for (i = 0; i < clients; i++) {
+		client[i].index = i;
+		client[i].requests = requests;
+		client[i].pipeline = i == 0 ? TEST_PIPELINE : 1;
+		client[i].shared = i % 2;
+	}
+
+	start = now_us();
+	for (i = 0; i < clients; i++)
+		pthread_create(&client[i].tid, NULL, client_thread, &client[i]);
+	for (i = 0; i < clients; i++) {
+		pthread_join(client[i].tid, NULL);
+		errors += client[i].errors;
+		total += client[i].done;
+	}
+	elapsed = now_us() - start;
+
+	/* answers per second while everybody was still polling */
+	greedy = client[0].done / (client[0].elapsed / 1e6);
+	for (i = 1; i < clients; i++)
+		polite += client[i].done / (client[i].elapsed / 1e6);
+	polite /= clients - 1;
+
+	printf("dedup=%d clients=%d requests=%d req/s=%.0f transactions=%lu deduplicated=%llu "
+	       "greedy_req/s=%.0f polite_req/s=%.0f errors=%d\n",
+	       dedup, clients, total, total / (elapsed / 1e6),
+	       slave_frames - frames, gw->stats.deduplicated - deduplicated,
+	       greedy, polite, errors);
+	CHECK(errors == 0, "%d errors", errors);
+	CHECK(gw->stats.transactions - transactions >= slave_frames - frames,
+	      "gateway sent fewer frames than the slave saw");
+
+	free(client);
+	return total / (elapsed / 1e6);
+}
+
+int main(int argc, char *argv[])
+{
+	struct uart_ctx_t uart;
+	struct gateway_t gw;
+	pthread_t slave_tid;
+	pthread_t gw_tid;
+	char name[64];
+	int baud = argc > 1 ? atoi(argv[1]) : TEST_BAUD;
+	int requests = argc > 2 ? atoi(argv[2]) : TEST_REQUESTS;
+	int clients = argc > 3 ? atoi(argv[3]) : TEST_CLIENTS;
+	int pty;
+	int without;
+	int with;
+	int i;
+
+	if (clients < 2)
+		clients = 2;
+
+	if (openpty(&slave_fd, &pty, name, NULL, NULL) != 0) {
+		perror("openpty");
+		return 1;
+	}
+
+	if (uart_ctx_open(&uart, name, baud, PAR_NONE, DATBITS_8, STOPBITS_1) != LIBCOMMBUS_SUCCESS) {
+		printf("uart_ctx_open %s failed\n", name);
+		return 1;
+	}
+
+	for (i = 0; i < TEST_REGS; i++)
+		slave_regs[i] = i * 3 + 1;
+	slave_char_us = 10 * 1000000 / baud;
+	pthread_create(&slave_tid, NULL, slave_thread, NULL);
+
+	if (gateway_open(&gw, &uart, TEST_PORT, clients + 1) != LIBCOMMBUS_SUCCESS) {
+		printf("gateway_open on port %d failed\n", TEST_PORT);
+		return 1;
+	}
+	/* the simulated slave answers only once its whole frame is on the wire */
+	gateway_set_timeout(&gw, 50 + 256 * slave_char_us / 1000, 0);
+	pthread_create(&gw_tid, NULL, gateway_thread, &gw);
+
+	printf("baud=%d char_us=%u gap_us=%u\n", baud, gw.char_us, gw.gap_us);
+
+	test_basic();
+	without = run_bench(&gw, 0, requests, clients);
+	with = run_bench(&gw, 1, requests, clients);
+	printf("dedup_speedup=%.1fx timeouts=%llu crc_errors=%llu\n",
+	       (double)with / without, gw.stats.timeouts, gw.stats.crc_errors);
+
+	gateway_stop(&gw);
+	pthread_join(gw_tid, NULL);
+	gateway_close(&gw);
+
+	/* the slave's read() sees EIO once no one holds the tty side open */
+	slave_running = 0;
+	uart_ctx_close(&uart);
+	close(pty);
+	pthread_join(slave_tid, NULL);
+	close(slave_fd);
+
+	return test_result();
+}
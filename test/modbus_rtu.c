@@ -0,0 +1,354 @@
+/***************************************************************************
+ *   Copyright (C) 2015 by Tse-Lun Bien                                    *
+ *   allanbian@gmail.com                                                   *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+
+/*
+ * Modbus RTU master against a simulated slave on a pty.
+ *
+ * The slave thread answers on the pty master side, holding registers
+ * hold a known pattern and every response is delayed by its time on the
+ * wire at the configured baudrate. The test checks reads, coalescing,
+ * write ordering, exceptions and timeouts, then compares polling speed
+ * with a fixed-delay loop built on xpt_uart_data_available().
+ *
+ * usage: modbus_rtu [baudrate] [polls]
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include <pty.h>
+
+#include "modbus.h"
+
+#define TEST_RTU_CRC16	xpt_modbus_crc16
+#include "test_util.h"
+
+#define TEST_SLAVE	17
+#define TEST_REGS	512
+#define TEST_BAUD	115200
+#define TEST_POLLS	500
+/* what hand-written polling loops typically sleep after a request */
+#define NAIVE_DELAY_US	5000
+
+static int slave_fd;
+static int slave_char_us;
+static volatile int slave_running = 1;
+static unsigned long slave_frames;
+static unsigned short slave_regs[TEST_REGS];
+
+static void *slave_thread(void *arg)
+{
+	unsigned char req[260];
+	unsigned char rsp[260];
+	unsigned short addr;
+	unsigned short count;
+	int len;
+	int i;
+
+	while (slave_running) {
+		if (read_full(slave_fd, req, 8) < 0)
+			break;
+
+		len = 8;
+		if (req[1] == XPT_MODBUS_WRITE_MULTIPLE_REGISTERS) {
+			if (read_full(slave_fd, &req[8], req[6] + 1) < 0)
+				break;
+			len += req[6] + 1;
+		}
+		slave_frames++;
+
+		if (xpt_modbus_crc16(req, len) != 0 || req[0] != TEST_SLAVE)
+			continue;
+
+		addr = (req[2] << 8) | req[3];
+		count = (req[4] << 8) | req[5];
+
+		rsp[0] = req[0];
+		rsp[1] = req[1];
+
+		switch (req[1]) {
+		case XPT_MODBUS_READ_HOLDING_REGISTERS:
+			if (addr + count > TEST_REGS) {
+				rsp[1] |= 0x80;
+				rsp[2] = 0x02;
+				rtu_send(slave_fd, rsp, 3, slave_char_us);
+				break;
+			}
+			rsp[2] = count * 2;
+			for (i = 0; i < count; i++) {
+				rsp[3 + i * 2] = slave_regs[addr + i] >> 8;
+				rsp[4 + i * 2] = slave_regs[addr + i] & 0xff;
+			}
+			rtu_send(slave_fd, rsp, 3 + count * 2, slave_char_us);
+			break;
+
+		case XPT_MODBUS_WRITE_SINGLE_REGISTER:
+			slave_regs[addr] = count;
+			memcpy(rsp, req, 6);
+			rtu_send(slave_fd, rsp, 6, slave_char_us);
+			break;
+
+		case XPT_MODBUS_WRITE_MULTIPLE_REGISTERS:
+			for (i = 0; i < count; i++)
+				slave_regs[addr + i] = (req[7 + i * 2] << 8) | req[8 + i * 2];
+			memcpy(rsp, req, 6);
+			rtu_send(slave_fd, rsp, 6, slave_char_us);
+			break;
+
+		default:
+			rsp[1] |= 0x80;
+			rsp[2] = 0x01;
+			rtu_send(slave_fd, rsp, 3, slave_char_us);
+			break;
+		}
+	}
+
+	return NULL;
+}
+
+static void test_basic(xpt_modbus_context mb)
+{
+	xpt_modbus_request_t req;
+	unsigned short regs[XPT_MODBUS_MAX_READ_REGS];
+	xpt_result_t ret;
+	int i;
+
+	memset(&req, 0, sizeof(req));
+	req.slave = TEST_SLAVE;
+	req.function = XPT_MODBUS_READ_HOLDING_REGISTERS;
+	req.address = 10;
+	req.count = 20;
+	req.regs = regs;
+
+	ret = xpt_modbus_execute(mb, &req);
+	CHECK(ret == XPT_SUCCESS, "read returned %d", ret);
+	for (i = 0; i < 20; i++)
+		CHECK(regs[i] == slave_regs[10 + i], "reg %d = %04x", 10 + i, regs[i]);
+
+	/* exception from the slave */
+	req.address = TEST_REGS - 1;
+	req.count = 2;
+	ret = xpt_modbus_execute(mb, &req);
+	CHECK(ret == XPT_ERROR_MODBUS_EXCEPTION && req.exception == 2,
+	      "out of range read returned %d exception %d", ret, req.exception);
+
+	/* nobody answers, the next request must still work */
+	req.slave = TEST_SLAVE + 1;
+	req.address = 0;
+	req.count = 1;
+	ret = xpt_modbus_execute(mb, &req);
+	CHECK(ret == XPT_ERROR_MODBUS_TIMEOUT, "read from absent slave returned %d", ret);
+
+	req.slave = TEST_SLAVE;
+	ret = xpt_modbus_execute(mb, &req);
+	CHECK(ret == XPT_SUCCESS && regs[0] == slave_regs[0], "read after timeout returned %d", ret);
+}
+
+static void test_coalesce(xpt_modbus_context mb)
+{
+	xpt_modbus_request_t reqs[100];
+	xpt_modbus_stats_t before, after;
+	unsigned short regs[100];
+	int i;
+
+	xpt_modbus_get_stats(mb, &before);
+
+	/* 100 single register reads, submitted out of order */
+	memset(reqs, 0, sizeof(reqs));
+	for (i = 0; i < 100; i++) {
+		reqs[i].slave = TEST_SLAVE;
+		reqs[i].function = XPT_MODBUS_READ_HOLDING_REGISTERS;
+		reqs[i].address = 100 + (i * 37) % 100;
+		reqs[i].count = 1;
+		reqs[i].regs = &regs[i];
+		xpt_modbus_submit(mb, &reqs[i]);
+	}
+	xpt_modbus_process(mb, 0);
+
+	xpt_modbus_get_stats(mb, &after);
+	CHECK(after.transactions - before.transactions == 1,
+	      "100 adjacent reads took %llu transactions", after.transactions - before.transactions);
+
+	for (i = 0; i < 100; i++) {
+		CHECK(reqs[i].done && reqs[i].status == XPT_SUCCESS, "req %d status %d", i, reqs[i].status);
+		CHECK(regs[i] == slave_regs[reqs[i].address], "req %d reg %d = %04x",
+		      i, reqs[i].address, regs[i]);
+	}
+}
+
+static void test_write_order(xpt_modbus_context mb)
+{
+	xpt_modbus_request_t rd1, wr, rd2;
+	unsigned short v1, v2;
+	unsigned short val = 0xbeef;
+	unsigned short old = slave_regs[50];
+
+	memset(&rd1, 0, sizeof(rd1));
+	rd1.slave = TEST_SLAVE;
+	rd1.function = XPT_MODBUS_READ_HOLDING_REGISTERS;
+	rd1.address = 50;
+	rd1.count = 1;
+	rd1.regs = &v1;
+	rd2 = rd1;
+	rd2.regs = &v2;
+
+	memset(&wr, 0, sizeof(wr));
+	wr.slave = TEST_SLAVE;
+	wr.function = XPT_MODBUS_WRITE_SINGLE_REGISTER;
+	wr.address = 50;
+	wr.regs = &val;
+
+	/* the second read must not be folded into the first one */
+	xpt_modbus_submit(mb, &rd1);
+	xpt_modbus_submit(mb, &wr);
+	xpt_modbus_submit(mb, &rd2);
+	xpt_modbus_process(mb, 0);
+
+	CHECK(v1 == old && v2 == val, "read/write/read gave %04x %04x", v1, v2);
+}
+
+/* request/response with a conservative fixed sleep, as hand-written loops do */
+static int naive_poll(xpt_uart_context uart, unsigned short addr, unsigned short *reg)
+{
+	unsigned char adu[16];
+	unsigned short crc;
+	int len = 0;
+	int n;
+
+	adu[0] = TEST_SLAVE;
+	adu[1] = XPT_MODBUS_READ_HOLDING_REGISTERS;
+	adu[2] = addr >> 8;
+	adu[3] = addr & 0xff;
+	adu[4] = 0;
+	adu[5] = 1;
+	crc = xpt_modbus_crc16(adu, 6);
+	adu[6] = crc & 0xff;
+	adu[7] = crc >> 8;
+
+	usleep(NAIVE_DELAY_US);
+	xpt_uart_write(uart, (char *)adu, 8);
+	if (!xpt_uart_data_available(uart, 200))
+		return -1;
+	usleep(NAIVE_DELAY_US);
+
+	while (len < 7 && xpt_uart_data_available(uart, 0)) {
+		n = xpt_uart_read(uart, (char *)&adu[len], 7 - len);
+		if (n <= 0)
+			break;
+		len += n;
+	}
+	if (len != 7)
+		return -1;
+
+	*reg = (adu[3] << 8) | adu[4];
+	return 0;
+}
+
+static void bench(xpt_uart_context uart, xpt_modbus_context mb, int polls)
+{
+	xpt_modbus_request_t req;
+	unsigned short reg;
+	double t0;
+	double naive_us;
+	double engine_us;
+	int errors = 0;
+	int i;
+
+	t0 = now_us();
+	for (i = 0; i < polls; i++) {
+		if (naive_poll(uart, i % TEST_REGS, &reg) != 0 || reg != slave_regs[i % TEST_REGS])
+			errors++;
+	}
+	naive_us = now_us() - t0;
+	CHECK(errors == 0, "naive polling had %d errors", errors);
+
+	memset(&req, 0, sizeof(req));
+	req.slave = TEST_SLAVE;
+	req.function = XPT_MODBUS_READ_HOLDING_REGISTERS;
+	req.count = 1;
+	req.regs = &reg;
+
+	errors = 0;
+	t0 = now_us();
+	for (i = 0; i < polls; i++) {
+		req.address = i % TEST_REGS;
+		if (xpt_modbus_execute(mb, &req) != XPT_SUCCESS || reg != slave_regs[i % TEST_REGS])
+			errors++;
+	}
+	engine_us = now_us() - t0;
+	CHECK(errors == 0, "engine polling had %d errors", errors);
+
+	printf("polls=%d fixed_delay_polls_per_sec=%.0f engine_polls_per_sec=%.0f speedup=%.1fx\n",
+	       polls, polls / (naive_us / 1e6), polls / (engine_us / 1e6), naive_us / engine_us);
+}
+
+int main(int argc, char *argv[])
+{
+	xpt_uart_context uart;
+	xpt_modbus_context mb;
+	xpt_modbus_stats_t stats;
+	pthread_t tid;
+	char name[64];
+	int baud = argc > 1 ? atoi(argv[1]) : TEST_BAUD;
+	int polls = argc > 2 ? atoi(argv[2]) : TEST_POLLS;
+	int slave;
+	int i;
+
+	if (openpty(&slave_fd, &slave, name, NULL, NULL) != 0) {
+		perror("openpty");
+		return 1;
+	}
+
+	uart = xpt_uart_init_raw(name);
+	if (uart == NULL || xpt_uart_set_baudrate(uart, baud) != XPT_SUCCESS) {
+		printf("cannot open %s\n", name);
+		return 1;
+	}
+
+	for (i = 0; i < TEST_REGS; i++)
+		slave_regs[i] = i * 3 + 1;
+	slave_char_us = 10 * 1000000 / baud;
+	pthread_create(&tid, NULL, slave_thread, NULL);
+
+	mb = xpt_modbus_init(uart);
+	/* the simulated slave answers only once its whole frame is on the wire */
+	xpt_modbus_set_timeout(mb, 50 + 256 * slave_char_us / 1000, 0);
+
+	test_basic(mb);
+	test_coalesce(mb);
+	test_write_order(mb);
+	bench(uart, mb, polls);
+
+	xpt_modbus_get_stats(mb, &stats);
+	printf("requests=%llu transactions=%llu coalesced=%llu timeouts=%llu crc_errors=%llu exceptions=%llu\n",
+	       stats.requests, stats.transactions, stats.coalesced, stats.timeouts,
+	       stats.crc_errors, stats.exceptions);
+
+	slave_running = 0;
+	xpt_modbus_stop(mb);
+	xpt_uart_stop(uart);
+	close(slave_fd);
+
+	return test_result();
+}
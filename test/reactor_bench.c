@@ -0,0 +1,375 @@
+/***************************************************************************
+ *   Copyright (C) 2015 by Tse-Lun Bien                                    *
+ *   allanbian@gmail.com                                                   *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+
+/*
+ * Loopback benchmark of the epoll reactor against the blocking
+ * thread-per-connection path.
+ *
+ * Every client thread opens a batch of connections at once, runs a number
+ * of request/response rounds on each of them and closes them again, until
+ * its share of connections is used up. The same client load is run against
+ * a single-threaded reactor echo server and against a server that spawns
+ * one thread per accepted connection using socket_read()/socket_write().
+ *
+ * usage: reactor_bench [conns] [clients] [batch] [rounds] [len]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "commbus.h"
+#include "socket.h"
+#include "reactor.h"
+#include "test_util.h"
+
+#define TEST_HOST	"127.0.0.1"
+#define TEST_PORT	5000
+#define TEST_CONNS	2000
+#define TEST_CLIENTS	8
+#define TEST_BATCH	128
+#define TEST_ROUNDS	10
+#define TEST_LEN	64
+#define MAX_LEN		4096
+
+struct bench_conn {
+	struct reactor_handler_t handler;
+	struct sock_info_t sock;
+	int off;
+	int pending;
+	unsigned char buf[MAX_LEN];
+};
+
+struct client_arg {
+	int conns;
+	int errors;
+	int nlat;
+	double *lat;
+	pthread_t tid;
+};
+
+static int test_port;
+static int test_len;
+static int test_rounds;
+static int test_batch;
+
+static struct reactor_t server_reactor;
+static struct reactor_handler_t listen_handler;
+
+/* reactor echo server */
+static void conn_cb(struct reactor_t *reactor, struct reactor_handler_t *handler, int events)
+{
+	struct bench_conn *conn = (struct bench_conn *)handler->arg;
+	int n;
+
+	while (1) {
+		if (conn->pending > 0) {
+			n = socket_send(&conn->sock, &conn->buf[conn->off], conn->pending);
+			if (n == -LIBCOMMBUS_ERROR_AGAIN)
+				return;
+			if (n < 0)
+				goto out_close;
+
+			conn->off += n;
+			conn->pending -= n;
+			continue;
+		}
+
+		n = socket_recv(&conn->sock, conn->buf, sizeof(conn->buf));
+		if (n == -LIBCOMMBUS_ERROR_AGAIN)
+			return;
+		if (n < 0)
+			goto out_close;
+
+		conn->off = 0;
+		conn->pending = n;
+	}
+
+out_close:
+	reactor_del(reactor, handler);
+	socket_close(&conn->sock);
+	free(conn);
+}
+
+static void accept_cb(struct reactor_t *reactor, struct reactor_handler_t *handler, int events)
+{
+	struct bench_conn *conn;
+	int ret;
+
+	while (1) {
+		conn = (struct bench_conn *)calloc(1, sizeof(*conn));
+		if (conn == NULL)
+			return;
+
+		ret = socket_accept(handler->sock, &conn->sock);
+		if (ret != LIBCOMMBUS_SUCCESS) {
+			free(conn);
+			return;
+		}
+
+		socket_set_nonblock(&conn->sock, 1);
+
+		conn->handler.cb = conn_cb;
+		conn->handler.arg = conn;
+		ret = reactor_add(reactor, &conn->handler, &conn->sock,
+				REACTOR_EV_READ | REACTOR_EV_WRITE);
+		if (ret != LIBCOMMBUS_SUCCESS) {
+			socket_close(&conn->sock);
+			free(conn);
+		}
+	}
+}
+
+static void *reactor_server(void *arg)
+{
+	reactor_run(&server_reactor);
+	return NULL;
+}
+
+/* blocking server, one thread per connection */
+static void *blocking_conn(void *arg)
+{
+	struct sock_info_t *sock = (struct sock_info_t *)arg;
+	unsigned char buf[MAX_LEN];
+	int i;
+
+	for (i = 0; i < test_rounds; i++) {
+		if (socket_read(sock, buf, test_len) != test_len)
+			break;
+		if (socket_write(sock, buf, test_len) != test_len)
+			break;
+	}
+
+	socket_close(sock);
+	free(sock);
+	return NULL;
+}
+
+static void *blocking_server(void *arg)
+{
+	struct sock_info_t *sock_listen = (struct sock_info_t *)arg;
+	struct sock_info_t *sock_conn;
+	pthread_attr_t attr;
+	pthread_t tid;
+
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	pthread_attr_setstacksize(&attr, 64 * 1024);
+
+	while (1) {
+		sock_conn = (struct sock_info_t *)malloc(sizeof(*sock_conn));
+		if (sock_conn == NULL)
+			break;
+
+		if (socket_accept(sock_listen, sock_conn) != LIBCOMMBUS_SUCCESS) {
+			free(sock_conn);
+			break;
+		}
+
+		if (pthread_create(&tid, &attr, blocking_conn, sock_conn) != 0) {
+			socket_close(sock_conn);
+			free(sock_conn);
+		}
+	}
+
+	return NULL;
+}
+
+static void *client_thread(void *arg)
+{
+	struct client_arg *client = (struct client_arg *)arg;
+	struct sock_info_t *socks;
+	unsigned char tx[MAX_LEN];
+	unsigned char rx[MAX_LEN];
+	char host[] = TEST_HOST;
+	int *ok;
+	int done;
+	int batch;
+	int i;
+	int r;
+	double t0;
+
+	socks = (struct sock_info_t *)calloc(test_batch, sizeof(*socks));
+	ok = (int *)calloc(test_batch, sizeof(*ok));
+	memset(tx, 0x5a, sizeof(tx));
+
+	for (done = 0; done < client->conns; done += batch) {
+		batch = client->conns - done;
+		if (batch > test_batch)
+			batch = test_batch;
+
+		for (i = 0; i < batch; i++) {
+			ok[i] = socket_open(&socks[i], TYPE_TCP) == LIBCOMMBUS_SUCCESS &&
+				socket_connect(&socks[i], host, test_port) == LIBCOMMBUS_SUCCESS;
+			if (!ok[i])
+				client->errors++;
+		}
+
+		for (r = 0; r < test_rounds; r++) {
+			for (i = 0; i < batch; i++) {
+				if (!ok[i])
+					continue;
+
+				t0 = now_us();
+				if (socket_write(&socks[i], tx, test_len) != test_len ||
+				    socket_read(&socks[i], rx, test_len) != test_len) {
+					client->errors++;
+					ok[i] = 0;
+					continue;
+				}
+				client->lat[client->nlat++] = now_us() - t0;
+			}
+		}
+
+		for (i = 0; i < batch; i++) {
+			if (ok[i])
+				socket_close(&socks[i]);
+		}
+	}
+
+	free(ok);
+	free(socks);
+	return NULL;
+}
+
+static int run_bench(const char *mode, int conns, int clients)
+{
+	struct sock_info_t sock_listen;
+	struct client_arg *client;
+	pthread_t server_tid;
+	double *lat;
+	double start;
+	double elapsed;
+	int nlat;
+	int errors;
+	int one = 1;
+	int i;
+
+	if (socket_open(&sock_listen, TYPE_TCP) != LIBCOMMBUS_SUCCESS)
+		return 1;
+
+	/* the blocking server closes first, so its port sits in TIME_WAIT */
+	setsockopt(sock_listen.fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+	if (socket_bind(&sock_listen, test_port) != LIBCOMMBUS_SUCCESS ||
+	    socket_listen(&sock_listen) != LIBCOMMBUS_SUCCESS) {
+		debug_print("%s: listen on port %d failed!\n", mode, test_port);
+		return 1;
+	}
+
+	if (strcmp(mode, "reactor") == 0) {
+		if (reactor_open(&server_reactor, 0) != LIBCOMMBUS_SUCCESS)
+			return 1;
+
+		socket_set_nonblock(&sock_listen, 1);
+		listen_handler.cb = accept_cb;
+		reactor_add(&server_reactor, &listen_handler, &sock_listen, REACTOR_EV_READ);
+		pthread_create(&server_tid, NULL, reactor_server, NULL);
+	} else {
+		pthread_create(&server_tid, NULL, blocking_server, &sock_listen);
+	}
+
+	client = (struct client_arg *)calloc(clients, sizeof(*client));
+	for (i = 0; i < clients; i++) {
+		client[i].conns = conns / clients + (i < conns % clients);
+		client[i].lat = (double *)malloc(sizeof(double) * (client[i].conns * test_rounds + 1));
+	}
+
+	start = now_us();
+	for (i = 0; i < clients; i++)
+		pthread_create(&client[i].tid, NULL, client_thread, &client[i]);
+	for (i = 0; i < clients; i++)
+		pthread_join(client[i].tid, NULL);
+	elapsed = now_us() - start;
+
+	lat = (double *)malloc(sizeof(double) * (conns * test_rounds + 1));
+	nlat = 0;
+	errors = 0;
+	for (i = 0; i < clients; i++) {
+		memcpy(&lat[nlat], client[i].lat, sizeof(double) * client[i].nlat);
+		nlat += client[i].nlat;
+		errors += client[i].errors;
+		free(client[i].lat);
+	}
+	qsort(lat, nlat, sizeof(double), cmp_double);
+
+	printf("mode=%s conns=%d clients=%d batch=%d rounds=%d len=%d "
+	       "conn_per_sec=%.0f p50_us=%.1f p99_us=%.1f errors=%d\n",
+	       mode, conns, clients, test_batch, test_rounds, test_len,
+	       conns / (elapsed / 1e6),
+	       nlat ? lat[nlat / 2] : 0.0,
+	       nlat ? lat[(int)(nlat * 0.99)] : 0.0,
+	       errors);
+
+	if (strcmp(mode, "reactor") == 0) {
+		reactor_stop(&server_reactor);
+		pthread_join(server_tid, NULL);
+		reactor_close(&server_reactor);
+		socket_close(&sock_listen);
+	} else {
+		/* blocking acceptor stays in accept(), it goes away with the process */
+		pthread_detach(server_tid);
+	}
+
+	free(lat);
+	free(client);
+
+	return 0;
+}
+
+int main(int argc, char *argv[])
+{
+	int conns = TEST_CONNS;
+	int clients = TEST_CLIENTS;
+	int ret;
+
+	test_batch = TEST_BATCH;
+	test_rounds = TEST_ROUNDS;
+	test_len = TEST_LEN;
+
+	if (argc > 1)
+		conns = atoi(argv[1]);
+	if (argc > 2)
+		clients = atoi(argv[2]);
+	if (argc > 3)
+		test_batch = atoi(argv[3]);
+	if (argc > 4)
+		test_rounds = atoi(argv[4]);
+	if (argc > 5)
+		test_len = atoi(argv[5]);
+
+	if (test_len > MAX_LEN)
+		test_len = MAX_LEN;
+	if (clients < 1)
+		clients = 1;
+
+	signal(SIGPIPE, SIG_IGN);
+
+	test_port = TEST_PORT;
+	ret = run_bench("blocking", conns, clients);
+
+	test_port = TEST_PORT + 1;
+	ret |= run_bench("reactor", conns, clients);
+
+	return ret;
+}
@@ -0,0 +1,595 @@
+/***************************************************************************
+ *   Copyright (C) 2015 by Tse-Lun Bien                                    *
+ *   allanbian@gmail.com                                                   *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+
+/*
+ * Register map over a simulated spi sensor and simulated i2c chips.
+ *
+ * open() hands out /dev/null for spidev paths and this program's ioctl()
+ * plays a 64 register accelerometer: the first byte is the address,
+ * 0x80 reads, 0x40 increments the address after each data byte. The
+ * test checks what is cached, what always goes to the device and what
+ * is rejected, then runs a driver's configuration sequence of
+ * read-modify-write updates once with plain transfers and once through
+ * a register map, and compares the messages it took and the registers
+ * it left.
+ *
+ * On i2c, with a platform without hooks standing in for a board, the
+ * ioctl() plays two auto-incrementing chips, one with 8-bit and one
+ * with 16-bit register addresses. A flush longer than one SMBus block
+ * must be split into blocks of at most 32 bytes on the first, go out
+ * as I2C_RDWR writes with both address bytes on the second, and read
+ * back unchanged from either.
+ *
+ * usage: regmap
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/spi/spidev.h>
+
+#include "xpt/spi.h"
+#include "xpt/i2c.h"
+#include "xpt/regmap.h"
+#include "xpt_internal.h"
+#include "linux/i2c-dev.h"
+
+#define TEST_FAKE_SPIDEV
+#define TEST_FAKE_I2CDEV
+#include "test_util.h"
+
+#define TEST_BUS	1
+
+#define REG_WHO_AM_I	0x0f
+#define REG_TEMP_CFG	0x1f
+#define REG_CTRL1	0x20
+#define REG_STATUS	0x27
+#define REG_OUT_X_L	0x28
+#define REG_FIFO_CTRL	0x2e
+#define REG_FIFO_SRC	0x2f
+#define REG_INT1_CFG	0x30
+#define REG_INT1_SRC	0x31
+#define REG_INT2_SRC	0x35
+#define REG_TIME_LIMIT	0x3b
+#define REG_SECRET	0x3f
+#define NREGS		0x40
+
+#define FLAG_READ	0x80
+#define FLAG_INC	0x40
+
+#define I2C_BUS		2
+#define I2C_ADDR8	0x1d
+#define I2C_ADDR16	0x50
+#define I2C_NREGS	0x200
+#define I2C_BASE8	0x10
+#define I2C_RUN8	40	/* more than one SMBus block */
+#define I2C_BASE16	0x80
+#define I2C_RUN16	300	/* more than one default burst, across 0xff */
+
+static const xpt_regmap_range_t ranges[] = {
+	{ 0x00, 0x0e, XPT_REGMAP_NO_ACCESS },
+	{ REG_WHO_AM_I, REG_WHO_AM_I, XPT_REGMAP_READ_ONLY },
+	{ 0x10, 0x1e, XPT_REGMAP_NO_ACCESS },
+	{ REG_STATUS, REG_OUT_X_L + 5, XPT_REGMAP_VOLATILE | XPT_REGMAP_READ_ONLY },
+	{ REG_FIFO_SRC, REG_FIFO_SRC, XPT_REGMAP_VOLATILE | XPT_REGMAP_READ_ONLY },
+	{ REG_INT1_SRC, REG_INT1_SRC, XPT_REGMAP_VOLATILE | XPT_REGMAP_READ_ONLY },
+	{ REG_INT2_SRC, REG_INT2_SRC, XPT_REGMAP_VOLATILE | XPT_REGMAP_READ_ONLY },
+	{ REG_SECRET, REG_SECRET, XPT_REGMAP_WRITE_ONLY }
+};
+
+/* simulated device */
+
+static uint8_t dev_regs[NREGS];
+static unsigned long long fake_messages;
+static int fake_bad_writes;
+
+static void dev_reset(void)
+{
+	memset(dev_regs, 0, sizeof(dev_regs));
+	dev_regs[REG_WHO_AM_I] = 0x33;
+	dev_regs[REG_CTRL1] = 0x07;
+	fake_messages = 0;
+}
+
+static int dev_read_only(int reg)
+{
+	return reg == REG_WHO_AM_I || (reg >= REG_STATUS && reg <= REG_OUT_X_L + 5) || reg == REG_FIFO_SRC ||
+	       reg == REG_INT1_SRC || reg == REG_INT2_SRC || reg < REG_WHO_AM_I || (reg > 0x0f && reg < 0x1f);
+}
+
+static void dev_xfer(const uint8_t *tx, uint8_t *rx, unsigned int len)
+{
+	int reg = tx[0] & 0x3f;
+	unsigned int i;
+
+	for (i = 1; i < len; i++) {
+		if (tx[0] & FLAG_READ) {
+			if (rx != NULL)
+				rx[i] = reg == REG_SECRET ? 0xee : dev_regs[reg];
+			/* status and data change between reads */
+			if (reg >= REG_STATUS && reg <= REG_OUT_X_L + 5)
+				dev_regs[reg]++;
+		} else if (dev_read_only(reg)) {
+			fake_bad_writes++;
+		} else {
+			dev_regs[reg] = tx[i];
+		}
+		if (tx[0] & FLAG_INC)
+			reg = (reg + 1) & 0x3f;
+	}
+}
+
+/* simulated i2c chips, the register address auto-increments */
+
+struct fake_chip {
+	int addr;
+	int reg_bytes;
+	unsigned int ptr;
+	uint8_t regs[I2C_NREGS];
+};
+
+static struct fake_chip chips[] = {
+	{ I2C_ADDR8, 1 },
+	{ I2C_ADDR16, 2 },
+};
+
+static int i2c_slave;
+static unsigned long long i2c_block_writes;
+static unsigned int i2c_block_max;
+static unsigned long long i2c_rdwr_writes;
+static unsigned int i2c_rdwr_max;
+static unsigned long long i2c_reads;
+static int i2c_bad;
+
+static void i2c_reset(void)
+{
+	i2c_block_writes = 0;
+	i2c_block_max = 0;
+	i2c_rdwr_writes = 0;
+	i2c_rdwr_max = 0;
+	i2c_reads = 0;
+}
+
+static struct fake_chip *i2c_chip(int addr)
+{
+	unsigned int i;
+
+	for (i = 0; i < sizeof(chips) / sizeof(chips[0]); i++) {
+		if (chips[i].addr == addr)
+			return &chips[i];
+	}
+	return NULL;
+}
+
+/* the register maps only write i2c blocks over SMBus */
+static int i2c_smbus(struct i2c_smbus_ioctl_data *args)
+{
+	struct fake_chip *chip = i2c_chip(i2c_slave);
+	unsigned int len = args->data->block[0];
+	unsigned int i;
+
+	if (chip == NULL || chip->reg_bytes != 1 || args->read_write != I2C_SMBUS_WRITE ||
+	    args->size != I2C_SMBUS_I2C_BLOCK_DATA || len == 0 || len > I2C_SMBUS_BLOCK_MAX) {
+		i2c_bad++;
+		errno = EINVAL;
+		return -1;
+	}
+
+	for (i = 0; i < len; i++)
+		chip->regs[(args->command + i) % I2C_NREGS] = args->data->block[i + 1];
+	i2c_block_writes++;
+	if (len > i2c_block_max)
+		i2c_block_max = len;
+
+	return 0;
+}
+
+static int i2c_msg(struct i2c_msg *msg)
+{
+	struct fake_chip *chip = i2c_chip(msg->addr);
+	uint8_t *buf = (uint8_t *) msg->buf;
+	int i;
+
+	if (chip == NULL)
+		return ENXIO;
+
+	if (msg->flags & I2C_M_RD) {
+		for (i = 0; i < msg->len; i++)
+			buf[i] = chip->regs[chip->ptr++ % I2C_NREGS];
+		i2c_reads++;
+		return 0;
+	}
+
+	if (msg->len < chip->reg_bytes) {
+		i2c_bad++;
+		return EIO;
+	}
+	chip->ptr = chip->reg_bytes == 1 ? buf[0] : (buf[0] << 8 | buf[1]);
+	for (i = chip->reg_bytes; i < msg->len; i++)
+		chip->regs[chip->ptr++ % I2C_NREGS] = buf[i];
+	if (msg->len > chip->reg_bytes) {
+		i2c_rdwr_writes++;
+		if ((unsigned int) (msg->len - chip->reg_bytes) > i2c_rdwr_max)
+			i2c_rdwr_max = msg->len - chip->reg_bytes;
+	}
+
+	return 0;
+}
+
+int ioctl(int fd, unsigned long request, ...)
+{
+	struct spi_ioc_transfer *xfer;
+	unsigned long long bytes = 0;
+	va_list ap;
+	void *arg;
+	int n;
+	int i;
+
+	va_start(ap, request);
+	arg = va_arg(ap, void *);
+	va_end(ap);
+
+	switch (request) {
+		case I2C_FUNCS:
+			*(unsigned long *) arg = I2C_FUNC_I2C | I2C_FUNC_SMBUS_READ_I2C_BLOCK | I2C_FUNC_SMBUS_WRITE_I2C_BLOCK;
+			return 0;
+		case I2C_SLAVE_FORCE:
+			i2c_slave = (int) (unsigned long) arg;
+			return 0;
+		case I2C_SMBUS:
+			return i2c_smbus(arg);
+		case I2C_RDWR:
+			return fake_i2c_rdwr(arg, i2c_msg);
+	}
+
+	if (_IOC_TYPE(request) != SPI_IOC_MAGIC)
+		return syscall(SYS_ioctl, fd, request, arg);
+	if (_IOC_NR(request) != 0)
+		return 0;
+
+	xfer = arg;
+	n = _IOC_SIZE(request) / sizeof(*xfer);
+	for (i = 0; i < n; i++) {
+		dev_xfer((const uint8_t *) (unsigned long) xfer[i].tx_buf, (uint8_t *) (unsigned long) xfer[i].rx_buf,
+			 xfer[i].len);
+		bytes += xfer[i].len;
+	}
+	fake_messages++;
+
+	return bytes;
+}
+
+/* a driver's setup: register, mask, value */
+
+static const uint8_t setup[][3] = {
+	{ REG_CTRL1, 0xf0, 0x50 },	/* 100 Hz */
+	{ REG_CTRL1 + 3, 0x30, 0x10 },	/* +-4 g */
+	{ REG_CTRL1 + 3, 0x08, 0x08 },	/* high resolution */
+	{ REG_CTRL1 + 3, 0x80, 0x80 },	/* block data update */
+	{ REG_CTRL1 + 1, 0x0c, 0x08 },	/* high-pass filter on data */
+	{ REG_CTRL1 + 2, 0x40, 0x40 },	/* interrupt 1 on IA1 */
+	{ REG_CTRL1 + 2, 0x04, 0x04 },	/* and on FIFO watermark */
+	{ REG_CTRL1 + 4, 0x40, 0x40 },	/* FIFO enable */
+	{ REG_CTRL1 + 4, 0x08, 0x08 },	/* latch interrupt 1 */
+	{ REG_CTRL1 + 5, 0x02, 0x02 },	/* interrupt active low */
+	{ REG_FIFO_CTRL, 0xc0, 0x80 },	/* stream mode */
+	{ REG_FIFO_CTRL, 0x1f, 0x10 },	/* watermark 16 */
+	{ REG_INT1_CFG, 0x3f, 0x2a },	/* high events on x, y, z */
+	{ REG_INT1_CFG + 2, 0x7f, 0x10 },	/* threshold */
+	{ REG_INT1_CFG + 3, 0x7f, 0x02 },	/* duration */
+	{ REG_INT1_CFG + 4, 0x3f, 0x15 },	/* interrupt 2: low events */
+	{ REG_INT1_CFG + 6, 0x7f, 0x08 },
+	{ REG_INT1_CFG + 7, 0x7f, 0x01 },
+	{ REG_INT1_CFG + 8, 0x3f, 0x15 },	/* click on x, y, z */
+	{ REG_INT1_CFG + 10, 0x7f, 0x20 },	/* click threshold */
+	{ REG_TIME_LIMIT, 0x7f, 0x0a },
+	{ REG_TIME_LIMIT + 1, 0xff, 0x20 },
+	{ REG_TIME_LIMIT + 2, 0xff, 0x40 },
+	{ REG_TEMP_CFG, 0xc0, 0xc0 },	/* temperature sensor */
+	{ REG_CTRL1, 0x0f, 0x07 },	/* x, y, z on, already are */
+};
+
+#define NSETUP (sizeof(setup) / sizeof(setup[0]))
+
+static xpt_regmap_config_t config(void)
+{
+	xpt_regmap_config_t cfg;
+
+	memset(&cfg, 0, sizeof(cfg));
+	cfg.reg_bits = 8;
+	cfg.max_register = NREGS - 1;
+	cfg.ranges = ranges;
+	cfg.num_ranges = sizeof(ranges) / sizeof(ranges[0]);
+	cfg.spi_read_flag = FLAG_READ | FLAG_INC;
+	cfg.spi_write_flag = FLAG_INC;
+	return cfg;
+}
+
+static unsigned long long setup_plain(xpt_spi_context spi)
+{
+	uint8_t tx[2];
+	uint8_t rx[2];
+	unsigned int i;
+
+	dev_reset();
+	for (i = 0; i < NSETUP; i++) {
+		tx[0] = setup[i][0] | FLAG_READ;
+		tx[1] = 0;
+		xpt_spi_transfer_buf(spi, tx, rx, 2);
+		tx[0] = setup[i][0];
+		tx[1] = (rx[1] & ~setup[i][1]) | setup[i][2];
+		xpt_spi_transfer_buf(spi, tx, NULL, 2);
+	}
+	return fake_messages;
+}
+
+static unsigned long long setup_regmap(xpt_regmap_context map)
+{
+	unsigned int i;
+
+	dev_reset();
+	for (i = 0; i < NSETUP; i++)
+		CHECK(xpt_regmap_update_bits(map, setup[i][0], setup[i][1], setup[i][2]) == XPT_SUCCESS,
+		      "update of 0x%02x failed", setup[i][0]);
+	CHECK(xpt_regmap_flush(map) == XPT_SUCCESS, "flush failed");
+	return fake_messages;
+}
+
+static void test_access(xpt_spi_context spi)
+{
+	xpt_regmap_config_t cfg = config();
+	xpt_regmap_context map = xpt_regmap_init_spi(spi, &cfg);
+	xpt_regmap_stats_t stats;
+	uint8_t buf[14];
+	int v;
+
+	dev_reset();
+
+	/* cached after the first read */
+	CHECK(xpt_regmap_read(map, REG_WHO_AM_I) == 0x33, "who am i");
+	CHECK(xpt_regmap_read(map, REG_WHO_AM_I) == 0x33, "who am i, cached");
+	CHECK(fake_messages == 1, "two reads of a cached register took %llu messages", fake_messages);
+
+	/* volatile: every read reaches the device */
+	v = xpt_regmap_read(map, REG_STATUS);
+	CHECK(xpt_regmap_read(map, REG_STATUS) == v + 1, "status read from the cache");
+	CHECK(fake_messages == 3, "volatile reads took %llu messages", fake_messages - 1);
+
+	/* rejected */
+	CHECK(xpt_regmap_write(map, REG_WHO_AM_I, 0) != XPT_SUCCESS, "write to a read-only register accepted");
+	CHECK(xpt_regmap_read(map, 0x05) == -1, "read of a reserved register accepted");
+	CHECK(xpt_regmap_read(map, REG_SECRET) == -1, "write-only register read before written");
+	CHECK(xpt_regmap_read(map, NREGS) == -1, "read past max_register accepted");
+
+	/* write-only: reads return what was written */
+	CHECK(xpt_regmap_write(map, REG_SECRET, 0x5a) == XPT_SUCCESS, "write-only write failed");
+	CHECK(xpt_regmap_read(map, REG_SECRET) == 0x5a, "write-only register not cached");
+
+	/* writes wait for the flush, a rewrite of the same value is dropped */
+	fake_messages = 0;
+	CHECK(xpt_regmap_write(map, REG_CTRL1, 0x57) == XPT_SUCCESS, "write failed");
+	CHECK(xpt_regmap_read(map, REG_CTRL1) == 0x57, "read after write");
+	CHECK(fake_messages == 0 && dev_regs[REG_CTRL1] == 0x07, "write reached the device before the flush");
+	xpt_regmap_flush(map);
+	CHECK(dev_regs[REG_CTRL1] == 0x57, "flush did not write");
+	fake_messages = 0;
+	xpt_regmap_write(map, REG_CTRL1, 0x57);
+	xpt_regmap_flush(map);
+	CHECK(fake_messages == 0, "rewrite of the same value took %llu messages", fake_messages);
+
+	/* dirty runs separated by cached registers merge into one burst */
+	xpt_regmap_bulk_read(map, REG_CTRL1, buf, 4);
+	xpt_regmap_write(map, REG_CTRL1, 0x47);
+	xpt_regmap_write(map, REG_CTRL1 + 3, 0x88);
+	fake_messages = 0;
+	xpt_regmap_flush(map);
+	CHECK(fake_messages == 1, "gap of cached registers took %llu bursts", fake_messages);
+	CHECK(dev_regs[REG_CTRL1] == 0x47 && dev_regs[REG_CTRL1 + 3] == 0x88, "bridged flush lost a write");
+
+	/* but never across a read-only register */
+	xpt_regmap_write(map, REG_CTRL1 + 6, 0x01);
+	xpt_regmap_write(map, REG_FIFO_CTRL, 0x01);
+	fake_messages = 0;
+	xpt_regmap_flush(map);
+	CHECK(fake_messages == 2, "flush across volatile registers took %llu bursts", fake_messages);
+	CHECK(fake_bad_writes == 0, "%d writes to read-only registers", fake_bad_writes);
+
+	/* bulk read: one transfer for the uncached control registers, one for status and data */
+	fake_messages = 0;
+	CHECK(xpt_regmap_bulk_read(map, REG_CTRL1, buf, 14) == XPT_SUCCESS, "bulk read failed");
+	CHECK(fake_messages == 2, "bulk read took %llu messages", fake_messages);
+	CHECK(buf[0] == 0x47 && buf[7] == dev_regs[REG_STATUS] - 1, "bulk read data");
+
+	/* after a reset of the device nothing cached is trusted */
+	xpt_regmap_invalidate(map);
+	fake_messages = 0;
+	xpt_regmap_read(map, REG_CTRL1);
+	CHECK(fake_messages == 1, "read after invalidate took %llu messages", fake_messages);
+
+	xpt_regmap_get_stats(map, &stats);
+	printf("access: reads=%llu cache_hits=%llu writes=%llu skipped=%llu bus_reads=%llu bus_writes=%llu\n",
+	       stats.reads, stats.cache_hits, stats.writes, stats.skipped, stats.bus_reads, stats.bus_writes);
+
+	xpt_regmap_stop(map);
+}
+
+static void test_setup(xpt_spi_context spi)
+{
+	xpt_regmap_config_t cfg = config();
+	xpt_regmap_context map;
+	uint8_t plain[NREGS];
+	uint8_t defaults[NREGS];
+	unsigned long long n_plain;
+	unsigned long long n_map;
+	unsigned long long n_defaults;
+
+	n_plain = setup_plain(spi);
+	memcpy(plain, dev_regs, sizeof(plain));
+
+	map = xpt_regmap_init_spi(spi, &cfg);
+	n_map = setup_regmap(map);
+	CHECK(memcmp(plain, dev_regs, sizeof(plain)) == 0, "regmap setup left other register values");
+	xpt_regmap_stop(map);
+
+	/* with the reset values known the setup reads nothing */
+	dev_reset();
+	memcpy(defaults, dev_regs, sizeof(defaults));
+	cfg.defaults = defaults;
+	map = xpt_regmap_init_spi(spi, &cfg);
+	n_defaults = setup_regmap(map);
+	CHECK(memcmp(plain, dev_regs, sizeof(plain)) == 0, "regmap setup with defaults left other register values");
+	xpt_regmap_stop(map);
+
+	printf("setup: updates=%u plain_messages=%llu regmap_messages=%llu regmap_defaults_messages=%llu\n",
+	       (unsigned int) NSETUP, n_plain, n_map, n_defaults);
+	CHECK(n_map * 2 <= n_plain, "regmap setup took %llu messages", n_map);
+	/* one burst per run of writable registers: 0x1f-0x25, 0x2e, 0x30, 0x32-0x34, 0x36-0x3d */
+	CHECK(n_defaults == 5, "setup with defaults took %llu messages", n_defaults);
+}
+
+static xpt_i2c_context i2c_open(int addr)
+{
+	xpt_i2c_context i2c = xpt_i2c_init_raw(I2C_BUS);
+
+	if (i2c != NULL && xpt_i2c_address(i2c, addr) != XPT_SUCCESS) {
+		xpt_i2c_stop(i2c);
+		return NULL;
+	}
+	return i2c;
+}
+
+/* write count registers from base through the map, flush, read them back */
+static void i2c_run(xpt_regmap_context map, struct fake_chip *chip, unsigned int base, unsigned int count)
+{
+	uint8_t want[I2C_NREGS];
+	uint8_t buf[I2C_NREGS];
+	unsigned int i;
+
+	for (i = 0; i < count; i++) {
+		want[i] = i * 7 + 1;
+		CHECK(xpt_regmap_write(map, base + i, want[i]) == XPT_SUCCESS, "write of 0x%x failed", base + i);
+	}
+	CHECK(xpt_regmap_flush(map) == XPT_SUCCESS, "flush of %u registers failed", count);
+	CHECK(memcmp(chip->regs + base, want, count) == 0, "flush of %u registers left other values", count);
+
+	memset(chip->regs, 0, base);
+	memset(chip->regs + base + count, 0, I2C_NREGS - base - count);
+	xpt_regmap_invalidate(map);
+	CHECK(xpt_regmap_bulk_read(map, base, buf, count) == XPT_SUCCESS, "read of %u registers failed", count);
+	CHECK(memcmp(buf, want, count) == 0, "read of %u registers returned other values", count);
+}
+
+static void test_i2c8(void)
+{
+	xpt_i2c_context i2c = i2c_open(I2C_ADDR8);
+	xpt_regmap_config_t cfg;
+	xpt_regmap_context map;
+
+	CHECK(i2c != NULL, "cannot open the simulated i2c bus");
+	if (i2c == NULL)
+		return;
+
+	memset(&cfg, 0, sizeof(cfg));
+	cfg.reg_bits = 8;
+	cfg.max_register = 0xff;
+	cfg.max_burst = 64;	/* more than SMBus takes, the map caps it */
+	map = xpt_regmap_init_i2c(i2c, &cfg);
+	CHECK(map != NULL, "8-bit i2c map init failed");
+	if (map == NULL) {
+		xpt_i2c_stop(i2c);
+		return;
+	}
+
+	i2c_reset();
+	i2c_run(map, &chips[0], I2C_BASE8, I2C_RUN8);
+	printf("i2c8: registers=%d block_writes=%llu block_max=%u rdwr_writes=%llu reads=%llu\n",
+	       I2C_RUN8, i2c_block_writes, i2c_block_max, i2c_rdwr_writes, i2c_reads);
+	CHECK(i2c_block_writes == 2 && i2c_block_max == I2C_SMBUS_BLOCK_MAX,
+	      "%d registers took %llu SMBus blocks of up to %u bytes", I2C_RUN8, i2c_block_writes, i2c_block_max);
+	CHECK(i2c_rdwr_writes == 0, "8-bit map wrote through I2C_RDWR");
+	CHECK(i2c_reads == 2, "%d registers took %llu reads", I2C_RUN8, i2c_reads);
+
+	xpt_regmap_stop(map);
+	xpt_i2c_stop(i2c);
+}
+
+static void test_i2c16(void)
+{
+	xpt_i2c_context i2c = i2c_open(I2C_ADDR16);
+	xpt_regmap_config_t cfg;
+	xpt_regmap_context map;
+
+	CHECK(i2c != NULL, "cannot open the simulated i2c bus");
+	if (i2c == NULL)
+		return;
+
+	memset(&cfg, 0, sizeof(cfg));
+	cfg.reg_bits = 16;
+	cfg.max_register = I2C_NREGS - 1;
+	map = xpt_regmap_init_i2c(i2c, &cfg);
+	CHECK(map != NULL, "16-bit i2c map init failed");
+	if (map == NULL) {
+		xpt_i2c_stop(i2c);
+		return;
+	}
+
+	i2c_reset();
+	i2c_run(map, &chips[1], I2C_BASE16, I2C_RUN16);
+	printf("i2c16: registers=%d rdwr_writes=%llu rdwr_max=%u block_writes=%llu reads=%llu\n",
+	       I2C_RUN16, i2c_rdwr_writes, i2c_rdwr_max, i2c_block_writes, i2c_reads);
+	CHECK(i2c_rdwr_writes == 2 && i2c_rdwr_max == 256,
+	      "%d registers took %llu writes of up to %u bytes", I2C_RUN16, i2c_rdwr_writes, i2c_rdwr_max);
+	CHECK(i2c_block_writes == 0, "16-bit map wrote SMBus blocks");
+	CHECK(i2c_reads == 2, "%d registers took %llu reads", I2C_RUN16, i2c_reads);
+
+	xpt_regmap_stop(map);
+	xpt_i2c_stop(i2c);
+}
+
+int main(void)
+{
+	static xpt_adv_func_t no_hooks;
+	static xpt_board_t board;
+	xpt_spi_context spi = xpt_spi_init_raw(TEST_BUS, 0);
+
+	if (spi == NULL) {
+		printf("cannot open the simulated spi bus\n");
+		return 1;
+	}
+
+	test_access(spi);
+	test_setup(spi);
+
+	xpt_spi_stop(spi);
+
+	/* xpt i2c contexts need a platform, one without hooks will do */
+	board.adv_func = &no_hooks;
+	plat = &board;
+	test_i2c8();
+	test_i2c16();
+	CHECK(i2c_bad == 0, "%d requests the chips do not take", i2c_bad);
+
+	return test_result();
+}
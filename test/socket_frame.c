@@ -0,0 +1,143 @@
+/***************************************************************************
+ *   Copyright (C) 2015 by Tse-Lun Bien                                    *
+ *   allanbian@gmail.com                                                   *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+
+/*
+ * Length-prefixed framing over a stream socket pair: a writer thread sends
+ * frames of varying size, the reader checks every payload in place and
+ * expects -LIBCOMMBUS_ERROR_EOF once the writer has closed.
+ *
+ * usage: socket_frame [frames] [max_len]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/socket.h>
+
+#include "commbus.h"
+#include "socket.h"
+#include "frame.h"
+
+#define TEST_FRAMES	200000
+#define TEST_MAX_LEN	1500
+
+static int test_frames;
+static int test_max_len;
+
+static int frame_len(int seq)
+{
+	return (seq * 7919) % test_max_len;
+}
+
+static void *writer_thread(void *arg)
+{
+	struct sock_info_t *sock = (struct sock_info_t *)arg;
+	struct frame_t frame;
+	unsigned char *buf;
+	int len;
+	int i;
+
+	buf = (unsigned char *)malloc(test_max_len);
+	frame_open(&frame, sock, FRAME_HDR_16, 0);
+
+	for (i = 0; i < test_frames; i++) {
+		len = frame_len(i);
+		memset(buf, i & 0xff, len);
+		if (frame_write(&frame, buf, len) != len) {
+			debug_print("frame_write: frame %d failed!\n", i);
+			break;
+		}
+	}
+
+	frame_close(&frame);
+	socket_close(sock);
+	free(buf);
+	return NULL;
+}
+
+int main(int argc, char *argv[])
+{
+	struct sock_info_t tx;
+	struct sock_info_t rx;
+	struct frame_t frame;
+	struct timespec t0, t1;
+	unsigned char *payload;
+	pthread_t tid;
+	double elapsed;
+	int errors = 0;
+	int sv[2];
+	int ret;
+	int i;
+	int j;
+
+	test_frames = argc > 1 ? atoi(argv[1]) : TEST_FRAMES;
+	test_max_len = argc > 2 ? atoi(argv[2]) : TEST_MAX_LEN;
+
+	socketpair(AF_UNIX, SOCK_STREAM, 0, sv);
+	tx.fd = sv[0];
+	tx.type = TYPE_TCP;
+	rx.fd = sv[1];
+	rx.type = TYPE_TCP;
+
+	if (frame_open(&frame, &rx, FRAME_HDR_16, test_max_len + 16 * 1024) != LIBCOMMBUS_SUCCESS) {
+		debug_print("frame_open failed!\n");
+		return 1;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	pthread_create(&tid, NULL, writer_thread, &tx);
+
+	for (i = 0; i < test_frames; i++) {
+		ret = frame_read(&frame, &payload);
+		if (ret != frame_len(i)) {
+			debug_print("frame %d: len=%d expected %d\n", i, ret, frame_len(i));
+			errors++;
+			break;
+		}
+
+		for (j = 0; j < ret; j++) {
+			if (payload[j] != (i & 0xff)) {
+				errors++;
+				break;
+			}
+		}
+	}
+
+	ret = frame_read(&frame, &payload);
+	if (ret != -LIBCOMMBUS_ERROR_EOF) {
+		debug_print("expected EOF, got %d\n", ret);
+		errors++;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	pthread_join(tid, NULL);
+
+	elapsed = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+	printf("frames=%d max_len=%d frames_per_sec=%.0f errors=%d\n",
+	       i, test_max_len, i / elapsed, errors);
+
+	frame_close(&frame);
+	socket_close(&rx);
+
+	return errors != 0;
+}
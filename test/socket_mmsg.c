@@ -0,0 +1,288 @@
+/***************************************************************************
+ *   Copyright (C) 2015 by Tse-Lun Bien                                    *
+ *   allanbian@gmail.com                                                   *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+
+/*
+ * Datagram throughput over UDP and Unix-domain sockets, comparing one
+ * syscall per message (socket_write/socket_read) with the batched
+ * socket_sendmmsg/socket_recvmmsg path. Beforehand, a datagram longer
+ * than its receive buffer must come back flagged SOCK_MSG_TRUNC, and
+ * socket_bind_path() must replace a stale socket file but refuse to
+ * remove a regular file in its way.
+ *
+ * usage: socket_mmsg [count] [len] [batch]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/time.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "commbus.h"
+#include "socket.h"
+#include "test_util.h"
+
+#define TEST_HOST	"127.0.0.1"
+#define TEST_PORT	5002
+#define TEST_PATH	"/tmp/commbus_mmsg.sock"
+#define TEST_COUNT	200000
+#define TEST_LEN	64
+#define TEST_BATCH	32
+#define MAX_BATCH	256
+#define MAX_LEN		1024
+
+struct recv_arg {
+	struct sock_info_t *sock;
+	int batched;
+	int count;
+	int received;
+	double first;
+	double last;
+};
+
+static int test_len;
+static int test_batch;
+
+static void *recv_thread(void *arg)
+{
+	struct recv_arg *r = (struct recv_arg *)arg;
+	struct sock_msg_t msgs[MAX_BATCH];
+	unsigned char *buf;
+	int n;
+	int i;
+
+	buf = (unsigned char *)malloc(MAX_BATCH * MAX_LEN);
+	for (i = 0; i < MAX_BATCH; i++) {
+		msgs[i].data = &buf[i * MAX_LEN];
+		msgs[i].len = MAX_LEN;
+	}
+
+	while (r->received < r->count) {
+		if (r->batched)
+			n = socket_recvmmsg(r->sock, msgs, test_batch);
+		else
+			n = socket_read(r->sock, buf, MAX_LEN) > 0 ? 1 : -1;
+
+		/* receive timeout: the sender is done, the rest was dropped */
+		if (n <= 0)
+			break;
+
+		if (r->received == 0)
+			r->first = now_us();
+		r->received += n;
+		r->last = now_us();
+	}
+
+	free(buf);
+	return NULL;
+}
+
+static int run_bench(int type, int batched, int count)
+{
+	struct sock_info_t rx;
+	struct sock_info_t tx;
+	struct sock_msg_t msgs[MAX_BATCH];
+	struct recv_arg r;
+	struct timeval tv;
+	unsigned char buf[MAX_LEN];
+	char host[] = TEST_HOST;
+	pthread_t tid;
+	double start;
+	double elapsed;
+	int sent;
+	int n;
+	int i;
+
+	if (socket_open(&rx, type) != LIBCOMMBUS_SUCCESS ||
+	    socket_open(&tx, type) != LIBCOMMBUS_SUCCESS)
+		return 1;
+
+	if (type == TYPE_UDS) {
+		if (socket_bind_path(&rx, TEST_PATH) != LIBCOMMBUS_SUCCESS ||
+		    socket_connect_path(&tx, TEST_PATH) != LIBCOMMBUS_SUCCESS)
+			return 1;
+	} else {
+		if (socket_bind(&rx, TEST_PORT) != LIBCOMMBUS_SUCCESS ||
+		    socket_connect(&tx, host, TEST_PORT) != LIBCOMMBUS_SUCCESS)
+			return 1;
+	}
+
+	tv.tv_sec = 0;
+	tv.tv_usec = 300000;
+	setsockopt(rx.fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+	memset(&r, 0, sizeof(r));
+	r.sock = &rx;
+	r.batched = batched;
+	r.count = count;
+	pthread_create(&tid, NULL, recv_thread, &r);
+
+	memset(buf, 0xa5, sizeof(buf));
+	for (i = 0; i < MAX_BATCH; i++) {
+		msgs[i].data = buf;
+		msgs[i].len = test_len;
+	}
+
+	start = now_us();
+	for (sent = 0; sent < count; sent += n) {
+		if (batched) {
+			n = count - sent;
+			if (n > test_batch)
+				n = test_batch;
+			n = socket_sendmmsg(&tx, msgs, n);
+		} else {
+			n = socket_write(&tx, buf, test_len) == test_len ? 1 : -1;
+		}
+
+		if (n <= 0) {
+			debug_print("send failed after %d messages\n", sent);
+			break;
+		}
+	}
+	elapsed = now_us() - start;
+
+	pthread_join(tid, NULL);
+
+	printf("type=%s mode=%s count=%d len=%d batch=%d send_msgs_per_sec=%.0f "
+	       "recv_msgs_per_sec=%.0f received=%d\n",
+	       type == TYPE_UDS ? "uds" : "udp", batched ? "mmsg" : "single",
+	       count, test_len, batched ? test_batch : 1,
+	       sent / (elapsed / 1e6),
+	       r.last > r.first ? r.received / ((r.last - r.first) / 1e6) : 0.0,
+	       r.received);
+
+	socket_close(&tx);
+	socket_close(&rx);
+
+	return 0;
+}
+
+static int test_trunc(void)
+{
+	struct sock_info_t rx;
+	struct sock_info_t tx;
+	struct sock_msg_t msgs[2];
+	unsigned char out[64];
+	unsigned char in[2][32];
+	int ret = 1;
+
+	if (socket_open(&rx, TYPE_UDS) != LIBCOMMBUS_SUCCESS ||
+	    socket_open(&tx, TYPE_UDS) != LIBCOMMBUS_SUCCESS ||
+	    socket_bind_path(&rx, TEST_PATH) != LIBCOMMBUS_SUCCESS ||
+	    socket_connect_path(&tx, TEST_PATH) != LIBCOMMBUS_SUCCESS)
+		return 1;
+
+	/* one datagram that fits, one that does not */
+	memset(out, 0x5a, sizeof(out));
+	msgs[0].data = out;
+	msgs[0].len = 16;
+	msgs[1].data = out;
+	msgs[1].len = sizeof(out);
+	if (socket_sendmmsg(&tx, msgs, 2) != 2)
+		goto out;
+
+	msgs[0].data = in[0];
+	msgs[0].len = sizeof(in[0]);
+	msgs[1].data = in[1];
+	msgs[1].len = sizeof(in[1]);
+	if (socket_recvmmsg(&rx, msgs, 2) != 2)
+		goto out;
+
+	if (msgs[0].result == 16 && !(msgs[0].flags & SOCK_MSG_TRUNC) &&
+	    msgs[1].result == sizeof(in[1]) && (msgs[1].flags & SOCK_MSG_TRUNC))
+		ret = 0;
+
+out:
+	printf("trunc=%s\n", ret ? "FAILED" : "ok");
+	socket_close(&tx);
+	socket_close(&rx);
+	return ret;
+}
+
+static int test_bind_path(void)
+{
+	struct sock_info_t first;
+	struct sock_info_t second;
+	struct sock_info_t sock;
+	struct stat st;
+	int ret = 1;
+	int fd;
+
+	/* a regular file in the way stays where it is */
+	unlink(TEST_PATH);
+	fd = open(TEST_PATH, O_CREAT | O_WRONLY, 0600);
+	if (fd < 0 || socket_open(&sock, TYPE_UDS) != LIBCOMMBUS_SUCCESS)
+		goto out;
+	close(fd);
+	if (socket_bind_path(&sock, TEST_PATH) != -LIBCOMMBUS_ERROR_ACCESS ||
+	    lstat(TEST_PATH, &st) != 0 || !S_ISREG(st.st_mode))
+		goto out;
+	unlink(TEST_PATH);
+
+	/* the socket file a closed owner left behind is replaced */
+	if (socket_open(&first, TYPE_UDS) != LIBCOMMBUS_SUCCESS ||
+	    socket_bind_path(&first, TEST_PATH) != LIBCOMMBUS_SUCCESS)
+		goto out;
+	socket_close(&first);
+	if (socket_open(&second, TYPE_UDS) != LIBCOMMBUS_SUCCESS ||
+	    socket_bind_path(&second, TEST_PATH) != LIBCOMMBUS_SUCCESS)
+		goto out;
+	socket_close(&second);
+	ret = 0;
+
+out:
+	printf("bind_path=%s\n", ret ? "FAILED" : "ok");
+	unlink(TEST_PATH);
+	return ret;
+}
+
+int main(int argc, char *argv[])
+{
+	int count = TEST_COUNT;
+	int ret = 0;
+
+	test_len = TEST_LEN;
+	test_batch = TEST_BATCH;
+
+	if (argc > 1)
+		count = atoi(argv[1]);
+	if (argc > 2)
+		test_len = atoi(argv[2]);
+	if (argc > 3)
+		test_batch = atoi(argv[3]);
+
+	if (test_len > MAX_LEN)
+		test_len = MAX_LEN;
+	if (test_batch > MAX_BATCH)
+		test_batch = MAX_BATCH;
+
+	ret |= test_bind_path();
+	ret |= test_trunc();
+	ret |= run_bench(TYPE_UDS, 0, count);
+	ret |= run_bench(TYPE_UDS, 1, count);
+	ret |= run_bench(TYPE_UDP, 0, count);
+	ret |= run_bench(TYPE_UDP, 1, count);
+
+	return ret;
+}
@@ -0,0 +1,188 @@
+/***************************************************************************
+ *   Copyright (C) 2015 by Tse-Lun Bien                                    *
+ *   allanbian@gmail.com                                                   *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+
+/*
+ * Header + payload send over a stream socket pair, comparing two
+ * socket_write() calls, a malloc+memcpy into one buffer and a single
+ * socket_writev(). The receiver splits every message back into header and
+ * payload with socket_readv() and checks it.
+ *
+ * usage: socket_writev [count] [payload_len]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#include "commbus.h"
+#include "socket.h"
+
+#define TEST_COUNT	200000
+#define TEST_LEN	512
+
+enum {
+	MODE_WRITE2,
+	MODE_CONCAT,
+	MODE_WRITEV,
+	MODE_MAX
+};
+
+static const char *mode_name[MODE_MAX] = {
+	"write+write",
+	"malloc+memcpy",
+	"writev"
+};
+
+struct msg_hdr {
+	unsigned int seq;
+	unsigned int len;
+};
+
+struct recv_arg {
+	struct sock_info_t *sock;
+	int count;
+	int errors;
+};
+
+static int test_count;
+static int test_len;
+
+static void *recv_thread(void *arg)
+{
+	struct recv_arg *r = (struct recv_arg *)arg;
+	struct msg_hdr hdr;
+	struct iovec iov[2];
+	unsigned char *payload;
+	int i;
+
+	payload = (unsigned char *)malloc(test_len);
+	iov[0].iov_base = &hdr;
+	iov[0].iov_len = sizeof(hdr);
+	iov[1].iov_base = payload;
+	iov[1].iov_len = test_len;
+
+	for (i = 0; i < r->count; i++) {
+		if (socket_readv(r->sock, iov, 2) != (int)sizeof(hdr) + test_len) {
+			r->errors++;
+			break;
+		}
+		if (hdr.seq != (unsigned int)i || hdr.len != (unsigned int)test_len ||
+		    payload[0] != (i & 0xff) || payload[test_len - 1] != (i & 0xff))
+			r->errors++;
+	}
+
+	free(payload);
+	return NULL;
+}
+
+static void run(int mode)
+{
+	struct sock_info_t tx;
+	struct sock_info_t rx;
+	struct recv_arg r;
+	struct msg_hdr hdr;
+	struct iovec iov[2];
+	struct timespec t0, t1;
+	unsigned char *payload;
+	unsigned char *buf;
+	unsigned long long syscalls = 0;
+	unsigned long long copied = 0;
+	pthread_t tid;
+	double elapsed;
+	int sv[2];
+	int i;
+
+	socketpair(AF_UNIX, SOCK_STREAM, 0, sv);
+	tx.fd = sv[0];
+	tx.type = TYPE_TCP;
+	rx.fd = sv[1];
+	rx.type = TYPE_TCP;
+
+	payload = (unsigned char *)malloc(test_len);
+
+	r.sock = &rx;
+	r.count = test_count;
+	r.errors = 0;
+
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	pthread_create(&tid, NULL, recv_thread, &r);
+
+	for (i = 0; i < test_count; i++) {
+		hdr.seq = i;
+		hdr.len = test_len;
+		memset(payload, i & 0xff, test_len);
+
+		switch (mode) {
+		case MODE_WRITE2:
+			socket_write(&tx, (unsigned char *)&hdr, sizeof(hdr));
+			socket_write(&tx, payload, test_len);
+			syscalls += 2;
+			break;
+		case MODE_CONCAT:
+			buf = (unsigned char *)malloc(sizeof(hdr) + test_len);
+			memcpy(buf, &hdr, sizeof(hdr));
+			memcpy(&buf[sizeof(hdr)], payload, test_len);
+			socket_write(&tx, buf, sizeof(hdr) + test_len);
+			free(buf);
+			copied += sizeof(hdr) + test_len;
+			syscalls++;
+			break;
+		case MODE_WRITEV:
+			iov[0].iov_base = &hdr;
+			iov[0].iov_len = sizeof(hdr);
+			iov[1].iov_base = payload;
+			iov[1].iov_len = test_len;
+			socket_writev(&tx, iov, 2);
+			syscalls++;
+			break;
+		}
+	}
+
+	pthread_join(tid, NULL);
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+
+	elapsed = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+	printf("%-14s msgs/s=%9.0f send_syscalls/msg=%.2f copied_bytes/msg=%llu errors=%d\n",
+	       mode_name[mode], test_count / elapsed, (double)syscalls / test_count,
+	       copied / test_count, r.errors);
+
+	socket_close(&tx);
+	socket_close(&rx);
+	free(payload);
+}
+
+int main(int argc, char *argv[])
+{
+	int mode;
+
+	test_count = argc > 1 ? atoi(argv[1]) : TEST_COUNT;
+	test_len = argc > 2 ? atoi(argv[2]) : TEST_LEN;
+
+	printf("count=%d payload_len=%d\n", test_count, test_len);
+	for (mode = 0; mode < MODE_MAX; mode++)
+		run(mode);
+
+	return 0;
+}
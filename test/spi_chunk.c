@@ -0,0 +1,413 @@
+/***************************************************************************
+ *   Copyright (C) 2015 by Tse-Lun Bien                                    *
+ *   allanbian@gmail.com                                                   *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+
+/*
+ * Splitting of SPI transfers longer than spidev's bufsiz.
+ *
+ * There is no SPI controller to test against, so this program provides
+ * its own ioctl() that behaves like spidev for /dev/null: it rejects
+ * messages above bufsiz with EMSGSIZE as the real driver does, counting
+ * each transfer at its length rounded up to the DMA alignment, loops
+ * data back inverted, and tracks the chip select line across messages.
+ * Every transfer must arrive intact, in the fewest messages bufsiz
+ * allows, with chip select toggled only where the caller asked for it.
+ *
+ * usage: spi_chunk [kbytes]
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/spi/spidev.h>
+
+#include "commbus.h"
+#include "spi.h"
+#include "test_util.h"
+
+#define TEST_KB		1024
+#define TEST_PATH	"/dev/null"
+
+/* ARCH_DMA_MINALIGN on arm64, the largest spidev rounds transfers to */
+#define FAKE_ALIGN	128
+#define ALIGN(len)	(((len) + FAKE_ALIGN - 1) / FAKE_ALIGN * FAKE_ALIGN)
+
+/* the simulated device */
+static unsigned int fake_bufsiz;
+static int fake_cs;
+static unsigned long long fake_selects;
+static unsigned long long fake_messages;
+static unsigned long long fake_rejected;
+
+static int fake_message(struct spi_ioc_transfer *xfer, int n)
+{
+	unsigned int tx_total = 0;
+	unsigned int rx_total = 0;
+	unsigned char *tx;
+	unsigned char *rx;
+	int total = 0;
+	unsigned int j;
+	int i;
+
+	/* spidev checks each direction against bufsiz */
+	for (i = 0; i < n; i++) {
+		if (xfer[i].tx_buf)
+			tx_total += ALIGN(xfer[i].len);
+		if (xfer[i].rx_buf)
+			rx_total += ALIGN(xfer[i].len);
+	}
+	if (tx_total > fake_bufsiz || rx_total > fake_bufsiz) {
+		fake_rejected++;
+		errno = EMSGSIZE;
+		return -1;
+	}
+
+	fake_messages++;
+	if (!fake_cs) {
+		fake_cs = 1;
+		fake_selects++;
+	}
+
+	for (i = 0; i < n; i++) {
+		tx = (unsigned char *)(unsigned long)xfer[i].tx_buf;
+		rx = (unsigned char *)(unsigned long)xfer[i].rx_buf;
+		for (j = 0; j < xfer[i].len; j++) {
+			if (rx)
+				rx[j] = tx ? ~tx[j] : 0xa5;
+		}
+		total += xfer[i].len;
+
+		/* between transfers cs_change pulses chip select */
+		if (xfer[i].cs_change && i != n - 1)
+			fake_selects++;
+	}
+
+	/* on the last transfer it keeps chip select asserted */
+	if (!xfer[n - 1].cs_change)
+		fake_cs = 0;
+
+	return total;
+}
+
+int ioctl(int fd, unsigned long request, ...)
+{
+	va_list ap;
+	void *arg;
+
+	va_start(ap, request);
+	arg = va_arg(ap, void *);
+	va_end(ap);
+
+	if (_IOC_TYPE(request) != SPI_IOC_MAGIC)
+		return syscall(SYS_ioctl, fd, request, arg);
+
+	if (_IOC_NR(request) == 0)
+		return fake_message((struct spi_ioc_transfer *)arg,
+				_IOC_SIZE(request) / sizeof(struct spi_ioc_transfer));
+
+	/* mode, bits and speed setters are accepted as they are */
+	return 0;
+}
+
+static void reset_fake(void)
+{
+	fake_cs = 0;
+	fake_selects = 0;
+	fake_messages = 0;
+	fake_rejected = 0;
+}
+
+static int check_inverted(unsigned char *tx, unsigned char *rx, int len)
+{
+	int i;
+
+	for (i = 0; i < len; i++) {
+		if (rx[i] != (unsigned char)~tx[i])
+			return i;
+	}
+
+	return -1;
+}
+
+static void test_long_xfer(struct spi_ctx_t *ctx, int len)
+{
+	unsigned char *tx = malloc(len);
+	unsigned char *rx = malloc(len);
+	unsigned int messages = (len + fake_bufsiz - 1) / fake_bufsiz;
+	int ret;
+	int i;
+
+	for (i = 0; i < len; i++)
+		tx[i] = i * 31;
+	reset_fake();
+
+	ret = spi_ctx_xfer(ctx, tx, rx, len);
+	CHECK(ret == len, "xfer of %d returned %d", len, ret);
+	CHECK(check_inverted(tx, rx, len) < 0, "xfer of %d corrupt at %d", len, check_inverted(tx, rx, len));
+	CHECK(fake_messages == messages, "xfer of %d took %llu messages, expected %u", len, fake_messages, messages);
+	CHECK(fake_selects == 1 && fake_cs == 0, "xfer of %d: %llu selects, cs %d at the end",
+	      len, fake_selects, fake_cs);
+	CHECK(fake_rejected == 0, "%llu messages rejected", fake_rejected);
+
+	free(tx);
+	free(rx);
+}
+
+static void test_command_read(struct spi_ctx_t *ctx)
+{
+	unsigned char cmd[4] = { 0x0b, 0x00, 0x10, 0x00 };
+	int len = 5 * fake_bufsiz + 123;
+	unsigned char *rx = malloc(len);
+	struct spi_seg_t segs[2];
+	int ret;
+	int i;
+
+	memset(segs, 0, sizeof(segs));
+	segs[0].tx = cmd;
+	segs[0].len = sizeof(cmd);
+	segs[1].rx = rx;
+	segs[1].len = len;
+	reset_fake();
+
+	ret = spi_ctx_xfer_multi(ctx, segs, 2);
+	CHECK(ret == (int)sizeof(cmd) + len, "command read returned %d", ret);
+	for (i = 0; i < len && rx[i] == 0xa5; i++)
+		;
+	CHECK(i == len, "command read data corrupt at %d", i);
+	/* the command shares the first message with the first chunk */
+	CHECK(fake_messages == 6, "command read took %llu messages", fake_messages);
+	CHECK(fake_selects == 1 && fake_cs == 0, "command read: %llu selects", fake_selects);
+	CHECK(fake_rejected == 0, "command read: %llu messages rejected", fake_rejected);
+
+	free(rx);
+}
+
+static void test_cs_change(struct spi_ctx_t *ctx)
+{
+	unsigned char *tx = malloc(2 * fake_bufsiz);
+	unsigned char *rx = malloc(2 * fake_bufsiz);
+	struct spi_seg_t segs[2];
+	int ret;
+
+	memset(tx, 0x3c, 2 * fake_bufsiz);
+	memset(segs, 0, sizeof(segs));
+	segs[0].tx = tx;
+	segs[0].rx = rx;
+	segs[0].len = fake_bufsiz;
+	segs[1].tx = tx + fake_bufsiz;
+	segs[1].rx = rx + fake_bufsiz;
+	segs[1].len = fake_bufsiz;
+
+	/* held across the message boundary */
+	reset_fake();
+	ret = spi_ctx_xfer_multi(ctx, segs, 2);
+	CHECK(ret == 2 * (int)fake_bufsiz && fake_messages == 2 && fake_selects == 1,
+	      "held: ret %d, %llu messages, %llu selects", ret, fake_messages, fake_selects);
+
+	/* released between the segments, as asked */
+	segs[0].cs_change = 1;
+	reset_fake();
+	ret = spi_ctx_xfer_multi(ctx, segs, 2);
+	CHECK(ret == 2 * (int)fake_bufsiz && fake_messages == 2 && fake_selects == 2,
+	      "pulsed: ret %d, %llu messages, %llu selects", ret, fake_messages, fake_selects);
+
+	/* and kept asserted after the transfer when the last segment says so */
+	segs[0].cs_change = 0;
+	segs[1].cs_change = 1;
+	reset_fake();
+	spi_ctx_xfer_multi(ctx, segs, 2);
+	CHECK(fake_cs == 1 && fake_selects == 1, "kept: cs %d, %llu selects", fake_cs, fake_selects);
+
+	free(tx);
+	free(rx);
+}
+
+static void test_small_segments(struct spi_ctx_t *ctx)
+{
+	unsigned char *tx = malloc(SPI_SEG_MAX * 512);
+	struct spi_seg_t segs[SPI_SEG_MAX];
+	unsigned int per_msg = fake_bufsiz / 512;
+	int ret;
+	int i;
+
+	memset(segs, 0, sizeof(segs));
+	for (i = 0; i < SPI_SEG_MAX; i++) {
+		segs[i].tx = tx + i * 512;
+		segs[i].len = 512;
+	}
+	reset_fake();
+
+	ret = spi_ctx_xfer_multi(ctx, segs, SPI_SEG_MAX);
+	CHECK(ret == SPI_SEG_MAX * 512, "segments returned %d", ret);
+	if (per_msg > 0)
+		CHECK(fake_messages == (SPI_SEG_MAX + per_msg - 1) / per_msg,
+		      "%d segments took %llu messages", SPI_SEG_MAX, fake_messages);
+	CHECK(fake_selects == 1, "segments: %llu selects", fake_selects);
+	CHECK(fake_rejected == 0, "segments: %llu messages rejected", fake_rejected);
+
+	free(tx);
+}
+
+/* a short command takes a whole alignment unit of the first message */
+static void test_unaligned_command(struct spi_ctx_t *ctx)
+{
+	unsigned char cmd[4] = { 0x02, 0x00, 0x10, 0x00 };
+	int len = 2 * fake_bufsiz + 5;
+	unsigned char *tx = malloc(len);
+	unsigned char *rx = malloc(len);
+	unsigned int messages = (ALIGN(sizeof(cmd)) + len + fake_bufsiz - 1) / fake_bufsiz;
+	struct spi_seg_t segs[2];
+	int ret;
+	int i;
+
+	for (i = 0; i < len; i++)
+		tx[i] = i * 13;
+	memset(segs, 0, sizeof(segs));
+	segs[0].tx = cmd;
+	segs[0].len = sizeof(cmd);
+	segs[1].tx = tx;
+	segs[1].rx = rx;
+	segs[1].len = len;
+	reset_fake();
+
+	ret = spi_ctx_xfer_multi(ctx, segs, 2);
+	CHECK(ret == (int)sizeof(cmd) + len, "unaligned command returned %d", ret);
+	CHECK(fake_rejected == 0, "unaligned command: %llu messages rejected", fake_rejected);
+	CHECK(check_inverted(tx, rx, len) < 0, "unaligned command data corrupt at %d", check_inverted(tx, rx, len));
+	CHECK(fake_messages == messages, "unaligned command took %llu messages, expected %u",
+	      fake_messages, messages);
+	CHECK(fake_selects == 1 && fake_cs == 0, "unaligned command: %llu selects", fake_selects);
+
+	free(tx);
+	free(rx);
+}
+
+/* odd lengths, each rounded up on its own */
+static void test_odd_segments(struct spi_ctx_t *ctx)
+{
+	struct spi_seg_t segs[SPI_SEG_MAX];
+	unsigned char *tx;
+	unsigned char *rx;
+	int total = 0;
+	int off = 0;
+	int ret;
+	int i;
+
+	for (i = 0; i < SPI_SEG_MAX; i++)
+		total += 2 * i + 1 + fake_bufsiz / 16;
+	tx = malloc(total);
+	rx = malloc(total);
+	for (i = 0; i < total; i++)
+		tx[i] = i * 7;
+
+	memset(segs, 0, sizeof(segs));
+	for (i = 0; i < SPI_SEG_MAX; i++) {
+		segs[i].tx = tx + off;
+		segs[i].rx = rx + off;
+		segs[i].len = 2 * i + 1 + fake_bufsiz / 16;
+		off += segs[i].len;
+	}
+	reset_fake();
+
+	ret = spi_ctx_xfer_multi(ctx, segs, SPI_SEG_MAX);
+	CHECK(ret == total, "odd segments returned %d of %d", ret, total);
+	CHECK(fake_rejected == 0, "odd segments: %llu messages rejected", fake_rejected);
+	CHECK(check_inverted(tx, rx, total) < 0, "odd segments corrupt at %d", check_inverted(tx, rx, total));
+	CHECK(fake_selects == 1 && fake_cs == 0, "odd segments: %llu selects", fake_selects);
+
+	free(tx);
+	free(rx);
+}
+
+static void bench(struct spi_ctx_t *ctx, int total)
+{
+	struct spi_stats_t before;
+	struct spi_stats_t after;
+	unsigned char *tx = malloc(total);
+	unsigned char *rx = malloc(total);
+	double start;
+	double split_us;
+	double app_us;
+	int off;
+	int len;
+
+	memset(tx, 0x5a, total);
+
+	/* one call, the library splits */
+	spi_ctx_get_stats(ctx, &before);
+	start = now_us();
+	spi_ctx_xfer(ctx, tx, rx, total);
+	split_us = now_us() - start;
+	spi_ctx_get_stats(ctx, &after);
+
+	printf("mode=library bytes=%d calls=%llu messages=%llu MBps=%.1f ioctl_MBps=%.1f\n",
+	       total, after.calls - before.calls, after.messages - before.messages,
+	       total / split_us, (double)(after.bytes - before.bytes) * 1e3 /
+	       (after.busy_ns - before.busy_ns));
+
+	/* what the application used to do: bufsiz sized calls, chip select pulsed */
+	reset_fake();
+	start = now_us();
+	for (off = 0; off < total; off += len) {
+		len = total - off < (int)fake_bufsiz ? total - off : (int)fake_bufsiz;
+		spi_ctx_xfer(ctx, tx + off, rx + off, len);
+	}
+	app_us = now_us() - start;
+
+	printf("mode=application bytes=%d calls=%d selects=%llu MBps=%.1f\n",
+	       total, (total + fake_bufsiz - 1) / fake_bufsiz, fake_selects, total / app_us);
+
+	free(tx);
+	free(rx);
+}
+
+int main(int argc, char *argv[])
+{
+	struct spi_ctx_t ctx;
+	int total = (argc > 1 ? atoi(argv[1]) : TEST_KB) * 1024;
+
+	fake_bufsiz = spi_get_bufsiz();
+	printf("bufsiz=%u\n", fake_bufsiz);
+
+	if (spi_ctx_open(&ctx, TEST_PATH, SPI_MODE0, 10000000) != LIBCOMMBUS_SUCCESS) {
+		printf("cannot open %s\n", TEST_PATH);
+		return 1;
+	}
+
+	test_long_xfer(&ctx, 1);
+	test_long_xfer(&ctx, fake_bufsiz);
+	test_long_xfer(&ctx, fake_bufsiz + 1);
+	test_long_xfer(&ctx, 100000);
+	test_command_read(&ctx);
+	test_cs_change(&ctx);
+	test_small_segments(&ctx);
+	test_unaligned_command(&ctx);
+	test_odd_segments(&ctx);
+	bench(&ctx, total);
+
+	spi_ctx_close(&ctx);
+
+	return test_result();
+}
@@ -0,0 +1,491 @@
+/***************************************************************************
+ *   Copyright (C) 2015 by Tse-Lun Bien                                    *
+ *   allanbian@gmail.com                                                   *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+
+/*
+ * SPI memory driver against a simulated chip.
+ *
+ * The chip lives in this program behind struct spi_mem_ops_t: it decodes
+ * each chip select cycle like a real part would, latches WREN, programs
+ * NOR pages by clearing bits with the address wrapping inside the page,
+ * erases sectors to 0xff and stays busy for a while after each program
+ * or erase. Commands sent while it is busy, or without the write enable
+ * latch, are counted as violations. Bus time is simulated at the clock
+ * below plus a fixed cost per transfer for the syscall and the
+ * controller; busy time runs on that same clock.
+ *
+ * The tests compare the driver's view against a shadow copy through
+ * random reads, writes and erases. The benchmark then writes and reads
+ * back a log of small records, once with one command sequence per record
+ * as an application would without the driver, once through spi_mem.
+ *
+ * usage: spi_mem_bench [kbytes] [record bytes]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "commbus.h"
+#include "spi.h"
+#include "spi_mem.h"
+#include "test_util.h"
+
+#define TEST_KB		64
+#define TEST_RECORD	32
+#define TEST_ROUNDS	2000
+
+/* bus clock, cost of one transfer, and the chip's busy times */
+#define MOCK_CLOCK_HZ	20000000ULL
+#define MOCK_XFER_NS	15000ULL
+#define MOCK_PROGRAM_NS	400000ULL
+#define MOCK_ERASE_NS	30000000ULL
+
+struct mock_t {
+	const struct spi_mem_chip_t *chip;
+	unsigned char *array;
+
+	/* chip select cycle being decoded */
+	int pos;
+	int op;
+	unsigned int addr;
+
+	int wel;
+	unsigned long long busy_until;
+	unsigned long long start_ns;
+	unsigned long long bus_ns;
+
+	unsigned long long xfers;
+	unsigned long long violations;
+};
+
+static unsigned long long real_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* time on the chip: what really passed plus the simulated bus time */
+static unsigned long long mock_now(struct mock_t *m)
+{
+	return real_ns() - m->start_ns + m->bus_ns;
+}
+
+static const struct spi_mem_chip_t *find_chip(const char *name)
+{
+	const struct spi_mem_chip_t *chip;
+
+	for (chip = spi_mem_chips; chip->name; chip++) {
+		if (strcmp(chip->name, name) == 0)
+			return chip;
+	}
+
+	return NULL;
+}
+
+static void mock_init(struct mock_t *m, const struct spi_mem_chip_t *chip)
+{
+	memset(m, 0, sizeof(*m));
+	m->chip = chip;
+	m->array = malloc(chip->size);
+	memset(m->array, 0xff, chip->size);
+	m->start_ns = real_ns();
+}
+
+static void mock_begin(struct mock_t *m)
+{
+	m->pos = 0;
+	m->op = -1;
+	m->addr = 0;
+}
+
+static unsigned char mock_byte(struct mock_t *m, unsigned char in)
+{
+	const struct spi_mem_chip_t *chip = m->chip;
+	int busy = mock_now(m) < m->busy_until;
+	int pos = m->pos++;
+	int data;
+	unsigned int a;
+
+	if (pos == 0) {
+		if (busy && in != chip->rdsr) {
+			m->violations++;
+			return 0;
+		}
+		if ((in == chip->write || (chip->erase_size && in == chip->erase)) && !m->wel) {
+			m->violations++;
+			return 0;
+		}
+		m->op = in;
+		if (in == chip->wren)
+			m->wel = 1;
+		return 0;
+	}
+
+	if (m->op == chip->rdid)
+		return pos - 1 < chip->id_len ? chip->id[pos - 1] : 0;
+	if (m->op == chip->rdsr)
+		return (busy ? 0x01 : 0) | (m->wel ? 0x02 : 0);
+	if (m->op != chip->read && m->op != chip->write && m->op != chip->erase)
+		return 0;
+
+	if (pos <= chip->addr_bytes) {
+		m->addr = (m->addr << 8) | in;
+		return 0;
+	}
+
+	data = pos - 1 - chip->addr_bytes;
+	if (m->op == chip->read) {
+		if (data < chip->read_dummy)
+			return 0;
+		return m->array[(m->addr + data - chip->read_dummy) % chip->size];
+	}
+
+	if (m->op == chip->write) {
+		if (chip->page_size) {
+			if (data >= (int)chip->page_size)
+				m->violations++;
+			a = (m->addr & ~(chip->page_size - 1)) | ((m->addr + data) & (chip->page_size - 1));
+			m->array[a % chip->size] &= in;
+		} else {
+			m->array[(m->addr + data) % chip->size] = in;
+		}
+	}
+
+	return 0;
+}
+
+static void mock_end(struct mock_t *m)
+{
+	const struct spi_mem_chip_t *chip = m->chip;
+	unsigned int sector;
+
+	if (m->op == chip->write && m->pos > 1 + chip->addr_bytes) {
+		m->wel = 0;
+		if (chip->flags & SPI_MEM_POLL)
+			m->busy_until = mock_now(m) + MOCK_PROGRAM_NS;
+	} else if (chip->erase_size && m->op == chip->erase && m->pos == 1 + chip->addr_bytes) {
+		sector = m->addr % chip->size & ~(chip->erase_size - 1);
+		memset(&m->array[sector], 0xff, chip->erase_size);
+		m->wel = 0;
+		m->busy_until = mock_now(m) + MOCK_ERASE_NS;
+	}
+}
+
+static int mock_xfer(void *priv, struct spi_seg_t *segs, int nsegs)
+{
+	struct mock_t *m = priv;
+	unsigned char out;
+	int total = 0;
+	unsigned int j;
+	int i;
+
+	m->xfers++;
+	m->bus_ns += MOCK_XFER_NS;
+
+	mock_begin(m);
+	for (i = 0; i < nsegs; i++) {
+		for (j = 0; j < segs[i].len; j++) {
+			out = mock_byte(m, segs[i].tx ? segs[i].tx[j] : 0);
+			if (segs[i].rx)
+				segs[i].rx[j] = out;
+		}
+		m->bus_ns += segs[i].len * 8ULL * 1000000000ULL / MOCK_CLOCK_HZ;
+		total += segs[i].len;
+
+		if (segs[i].cs_change && i != nsegs - 1) {
+			mock_end(m);
+			mock_begin(m);
+		}
+	}
+	mock_end(m);
+
+	return total;
+}
+
+static const struct spi_mem_ops_t mock_ops = {
+	mock_xfer
+};
+
+static void test_probe(void)
+{
+	struct spi_mem_t mem;
+	struct mock_t m;
+	struct spi_mem_chip_t unknown;
+	const char *names[] = { "FM25V20", "MB85RS256B", "W25Q32", "MX25L3233F" };
+	unsigned int i;
+	int ret;
+
+	for (i = 0; i < sizeof(names) / sizeof(names[0]); i++) {
+		mock_init(&m, find_chip(names[i]));
+		ret = spi_mem_open(&mem, &mock_ops, &m, 0);
+		CHECK(ret == LIBCOMMBUS_SUCCESS && mem.chip == m.chip, "%s not identified: %d", names[i], ret);
+		if (ret == LIBCOMMBUS_SUCCESS)
+			spi_mem_close(&mem);
+		free(m.array);
+	}
+
+	unknown = *find_chip("W25Q32");
+	unknown.id[2] = 0x99;
+	mock_init(&m, &unknown);
+	ret = spi_mem_open(&mem, &mock_ops, &m, 0);
+	CHECK(ret == -LIBCOMMBUS_ERROR_NO_DEVICE, "unknown chip opened: %d", ret);
+	free(m.array);
+}
+
+/* the shadow copy applies writes the way the chip does */
+static void shadow_write(const struct spi_mem_chip_t *chip, unsigned char *shadow, unsigned int addr,
+		const unsigned char *buf, unsigned int len)
+{
+	unsigned int i;
+
+	for (i = 0; i < len; i++) {
+		if (chip->erase_size)
+			shadow[addr + i] &= buf[i];
+		else
+			shadow[addr + i] = buf[i];
+	}
+}
+
+static void test_random(const char *name, unsigned int span)
+{
+	struct spi_mem_t mem;
+	struct mock_t m;
+	const struct spi_mem_chip_t *chip = find_chip(name);
+	unsigned char *shadow = malloc(span);
+	unsigned char buf[3000];
+	unsigned int seed = 1;
+	unsigned int addr;
+	unsigned int len;
+	unsigned int sector;
+	int ret;
+	int i;
+	unsigned int j;
+
+	mock_init(&m, chip);
+	memset(shadow, 0xff, span);
+	ret = spi_mem_open(&mem, &mock_ops, &m, 1024);
+	CHECK(ret == LIBCOMMBUS_SUCCESS, "%s: open failed: %d", name, ret);
+	if (ret != LIBCOMMBUS_SUCCESS)
+		return;
+
+	/* a flash only erases whole sectors */
+	if (chip->erase_size) {
+		ret = spi_mem_erase(&mem, 100, chip->erase_size);
+		CHECK(ret == -LIBCOMMBUS_ERROR_NOT_SUPPORT, "%s: unaligned erase returned %d", name, ret);
+	}
+	ret = spi_mem_read(&mem, chip->size - 10, buf, 11);
+	CHECK(ret == -LIBCOMMBUS_ERROR_NOT_SUPPORT, "%s: read past the end returned %d", name, ret);
+
+	for (i = 0; i < TEST_ROUNDS; i++) {
+		addr = rand_r(&seed) % span;
+		len = rand_r(&seed) % sizeof(buf) + 1;
+		if (len > span - addr)
+			len = span - addr;
+
+		/* erases are slow on flash, keep them rare */
+		switch (rand_r(&seed) % 16) {
+		case 0:
+			if (chip->erase_size) {
+				sector = addr - addr % chip->erase_size;
+				ret = spi_mem_erase(&mem, sector, chip->erase_size);
+				memset(&shadow[sector], 0xff, chip->erase_size);
+			} else {
+				ret = spi_mem_erase(&mem, addr, len);
+				memset(&shadow[addr], 0xff, len);
+			}
+			CHECK(ret == LIBCOMMBUS_SUCCESS, "%s: erase at %u returned %d", name, addr, ret);
+			break;
+		case 1:
+		case 2:
+		case 3:
+		case 4:
+		case 5:
+		case 6:
+			for (j = 0; j < len; j++)
+				buf[j] = rand_r(&seed);
+			/* small writes in a row, to be combined */
+			for (j = 0; j < len; j += 7) {
+				ret = spi_mem_write(&mem, addr + j, buf + j, len - j < 7 ? len - j : 7);
+				CHECK(ret == LIBCOMMBUS_SUCCESS, "%s: write at %u returned %d", name, addr + j, ret);
+			}
+			shadow_write(chip, shadow, addr, buf, len);
+			break;
+		default:
+			ret = spi_mem_read(&mem, addr, buf, len);
+			CHECK(ret == LIBCOMMBUS_SUCCESS, "%s: read at %u returned %d", name, addr, ret);
+			CHECK(memcmp(buf, &shadow[addr], len) == 0, "%s: read of %u at %u differs", name, len, addr);
+			break;
+		}
+		if (failures)
+			break;
+	}
+
+	spi_mem_close(&mem);
+	CHECK(memcmp(m.array, shadow, span) == 0, "%s: chip contents differ after close", name);
+	CHECK(m.violations == 0, "%s: %llu protocol violations", name, m.violations);
+	printf("chip=%s rounds=%d reads=%llu cache_hits=%llu writes=%llu programs=%llu erases=%llu polls=%llu xfers=%llu\n",
+	       name, i, mem.stats.reads, mem.stats.cache_hits, mem.stats.writes, mem.stats.programs,
+	       mem.stats.erases, mem.stats.polls, mem.stats.xfers);
+
+	free(m.array);
+	free(shadow);
+}
+
+/* one command sequence per record, what the application did before */
+static void naive_write(struct mock_t *m, unsigned int addr, unsigned char *buf, unsigned int len)
+{
+	const struct spi_mem_chip_t *chip = m->chip;
+	struct spi_seg_t segs[2];
+	unsigned char cmd[5];
+	unsigned char sr;
+
+	memset(segs, 0, sizeof(segs));
+	cmd[0] = chip->wren;
+	segs[0].tx = cmd;
+	segs[0].len = 1;
+	mock_xfer(m, segs, 1);
+
+	cmd[0] = chip->write;
+	cmd[1] = addr >> 16;
+	cmd[2] = addr >> 8;
+	cmd[3] = addr;
+	segs[0].len = 4;
+	segs[1].tx = buf;
+	segs[1].len = len;
+	mock_xfer(m, segs, 2);
+
+	cmd[0] = chip->rdsr;
+	segs[0].len = 1;
+	segs[1].tx = NULL;
+	segs[1].rx = &sr;
+	segs[1].len = 1;
+	do {
+		mock_xfer(m, segs, 2);
+	} while (sr & 0x01);
+}
+
+static void naive_read(struct mock_t *m, unsigned int addr, unsigned char *buf, unsigned int len)
+{
+	struct spi_seg_t segs[2];
+	unsigned char cmd[5] = { m->chip->read, addr >> 16, addr >> 8, addr, 0 };
+
+	memset(segs, 0, sizeof(segs));
+	segs[0].tx = cmd;
+	segs[0].len = 5;
+	segs[1].rx = buf;
+	segs[1].len = len;
+	mock_xfer(m, segs, 2);
+}
+
+static void report(const char *mode, const char *op, struct mock_t *m, unsigned long long xfers,
+		unsigned long long t0, unsigned int bytes)
+{
+	double ms = (mock_now(m) - t0) / 1e6;
+
+	printf("mode=%s op=%s bytes=%u xfers=%llu ms=%.1f MBps=%.2f\n",
+	       mode, op, bytes, m->xfers - xfers, ms, bytes / ms / 1e3);
+}
+
+static void bench(unsigned int total, unsigned int record)
+{
+	const struct spi_mem_chip_t *chip = find_chip("W25Q32");
+	struct spi_mem_t mem;
+	struct mock_t m;
+	unsigned char *data = malloc(total);
+	unsigned char *back = malloc(total);
+	unsigned long long xfers;
+	unsigned long long t0;
+	unsigned int addr;
+	unsigned int i;
+
+	total -= total % chip->erase_size;
+	for (i = 0; i < total; i++)
+		data[i] = i * 7 + i / 251;
+
+	mock_init(&m, chip);
+	if (spi_mem_open(&mem, &mock_ops, &m, 0) != LIBCOMMBUS_SUCCESS) {
+		CHECK(0, "bench: open failed");
+		return;
+	}
+
+	/* records never straddle a page in the naive writer */
+	record = record > chip->page_size ? chip->page_size : record;
+	while (chip->page_size % record)
+		record--;
+
+	xfers = m.xfers;
+	t0 = mock_now(&m);
+	spi_mem_erase(&mem, 0, total);
+	report("spi_mem", "erase", &m, xfers, t0, total);
+
+	xfers = m.xfers;
+	t0 = mock_now(&m);
+	for (addr = 0; addr < total; addr += record)
+		naive_write(&m, addr, data + addr, record);
+	report("naive", "write", &m, xfers, t0, total);
+
+	xfers = m.xfers;
+	t0 = mock_now(&m);
+	for (addr = 0; addr < total; addr += record)
+		naive_read(&m, addr, back + addr, record);
+	report("naive", "read", &m, xfers, t0, total);
+	CHECK(memcmp(data, back, total) == 0, "naive: data differs");
+
+	spi_mem_erase(&mem, 0, total);
+
+	xfers = m.xfers;
+	t0 = mock_now(&m);
+	for (addr = 0; addr < total; addr += record)
+		spi_mem_write(&mem, addr, data + addr, record);
+	spi_mem_flush(&mem);
+	report("spi_mem", "write", &m, xfers, t0, total);
+
+	memset(back, 0, total);
+	xfers = m.xfers;
+	t0 = mock_now(&m);
+	for (addr = 0; addr < total; addr += record)
+		spi_mem_read(&mem, addr, back + addr, record);
+	report("spi_mem", "read", &m, xfers, t0, total);
+	CHECK(memcmp(data, back, total) == 0, "spi_mem: data differs");
+
+	spi_mem_close(&mem);
+	CHECK(m.violations == 0, "bench: %llu protocol violations", m.violations);
+	printf("record=%u cache_hits=%llu programs=%llu\n", record, mem.stats.cache_hits, mem.stats.programs);
+
+	free(m.array);
+	free(data);
+	free(back);
+}
+
+int main(int argc, char *argv[])
+{
+	unsigned int total = (argc > 1 ? atoi(argv[1]) : TEST_KB) * 1024;
+	unsigned int record = argc > 2 ? atoi(argv[2]) : TEST_RECORD;
+
+	test_probe();
+	test_random("FM25V02A", 32 * 1024);
+	test_random("W25Q32", 64 * 1024);
+	bench(total, record ? record : 1);
+
+	return test_result();
+}
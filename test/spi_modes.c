@@ -0,0 +1,271 @@
+/***************************************************************************
+ *   Copyright (C) 2015 by Tse-Lun Bien                                    *
+ *   allanbian@gmail.com                                                   *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+
+/*
+ * 3-wire, dual and quad SPI modes through both SPI layers.
+ *
+ * There is no SPI controller to test against, so this program provides
+ * its own ioctl() in place of spidev. Like the SPI core, the simulated
+ * controller silently drops the lane flags it cannot do from the mode
+ * it is given, so opening with one of them must fail, segments may only
+ * use the data lines the device was opened with, and full duplex on
+ * shared data lines must be refused before it reaches the bus. On the
+ * xpt side a partly accepted xpt_spi_mode_flags() must put the previous
+ * mode back, and xpt_spi_mode() must keep the lane flags.
+ *
+ * usage: spi_modes
+ */
+
+#define _GNU_SOURCE
+#define TEST_FAKE_SPIDEV
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/spi/spidev.h>
+
+#include "commbus.h"
+#include "spi.h"
+#include "xpt/spi.h"
+#include "test_util.h"
+
+#define TEST_PATH	"/dev/spidev0.0"
+#define TEST_SPEED	1000000
+#define TEST_LEN	16
+
+#define LANE_FLAGS	(SPI_3WIRE | SPI_TX_DUAL | SPI_TX_QUAD | SPI_RX_DUAL | SPI_RX_QUAD)
+
+/* the simulated controller */
+static unsigned int fake_lanes;
+static unsigned int fake_mode;
+static unsigned long long fake_messages;
+
+int ioctl(int fd, unsigned long request, ...)
+{
+	va_list ap;
+	void *arg;
+
+	va_start(ap, request);
+	arg = va_arg(ap, void *);
+	va_end(ap);
+
+	if (_IOC_TYPE(request) != SPI_IOC_MAGIC)
+		return syscall(SYS_ioctl, fd, request, arg);
+
+	if (_IOC_NR(request) == 0) {
+		fake_messages++;
+		return ((struct spi_ioc_transfer *)arg)->len;
+	}
+
+	switch (request) {
+		case SPI_IOC_WR_MODE:
+			fake_mode = *(unsigned char *)arg;
+			break;
+		case SPI_IOC_RD_MODE:
+			*(unsigned char *)arg = fake_mode;
+			break;
+		case SPI_IOC_WR_MODE32:
+			/* what the controller cannot do is dropped, not refused */
+			fake_mode = *(unsigned int *)arg & (~LANE_FLAGS | fake_lanes);
+			break;
+		case SPI_IOC_RD_MODE32:
+			*(unsigned int *)arg = fake_mode;
+			break;
+		case SPI_IOC_RD_MAX_SPEED_HZ:
+			*(unsigned int *)arg = TEST_SPEED;
+			break;
+		case SPI_IOC_RD_LSB_FIRST:
+			*(unsigned char *)arg = 0;
+			break;
+	}
+
+	/* bits, speed and bit order setters are accepted as they are */
+	return 0;
+}
+
+static int seg_xfer(struct spi_ctx_t *ctx, int tx_nbits, int rx_nbits, int duplex)
+{
+	static unsigned char tx[TEST_LEN];
+	static unsigned char rx[TEST_LEN];
+	struct spi_seg_t seg;
+
+	memset(&seg, 0, sizeof(seg));
+	seg.len = TEST_LEN;
+	seg.tx_nbits = tx_nbits;
+	seg.rx_nbits = rx_nbits;
+	if (duplex || tx_nbits)
+		seg.tx = tx;
+	if (duplex || rx_nbits)
+		seg.rx = rx;
+
+	return spi_ctx_xfer_multi(ctx, &seg, 1);
+}
+
+/* an open asking for lanes the controller dropped fails */
+static void test_open(void)
+{
+	struct spi_ctx_t ctx;
+	int ret;
+
+	fake_lanes = SPI_TX_DUAL | SPI_RX_DUAL;
+
+	ret = spi_ctx_open(&ctx, TEST_PATH, SPI_MODE0 | SPI_FLAG_RX_QUAD, TEST_SPEED);
+	CHECK(ret == -LIBCOMMBUS_ERROR_NOT_SUPPORT, "open with dropped quad: %d", ret);
+	ret = spi_ctx_open(&ctx, TEST_PATH, SPI_MODE0 | SPI_FLAG_3WIRE, TEST_SPEED);
+	CHECK(ret == -LIBCOMMBUS_ERROR_NOT_SUPPORT, "open with dropped 3-wire: %d", ret);
+
+	ret = spi_ctx_open(&ctx, TEST_PATH, SPI_MODE3 | SPI_FLAG_TX_DUAL | SPI_FLAG_RX_DUAL, TEST_SPEED);
+	CHECK(ret == LIBCOMMBUS_SUCCESS, "open with dual: %d", ret);
+	CHECK(fake_mode == (SPI_MODE_3 | SPI_TX_DUAL | SPI_RX_DUAL), "dual open set mode 0x%x", fake_mode);
+	if (ret == LIBCOMMBUS_SUCCESS)
+		spi_ctx_close(&ctx);
+}
+
+/* segments use the data lines the device was opened with, and no more */
+static void test_lanes(void)
+{
+	struct spi_ctx_t ctx;
+	int ret;
+
+	fake_lanes = LANE_FLAGS;
+
+	ret = spi_ctx_open(&ctx, TEST_PATH, SPI_MODE0 | SPI_FLAG_TX_DUAL | SPI_FLAG_RX_QUAD, TEST_SPEED);
+	CHECK(ret == LIBCOMMBUS_SUCCESS, "open with tx dual, rx quad: %d", ret);
+	if (ret != LIBCOMMBUS_SUCCESS)
+		return;
+
+	fake_messages = 0;
+	CHECK(seg_xfer(&ctx, 1, 0, 0) == TEST_LEN, "tx on 1 line refused");
+	CHECK(seg_xfer(&ctx, 2, 0, 0) == TEST_LEN, "tx on 2 lines refused");
+	CHECK(seg_xfer(&ctx, 0, 2, 0) == TEST_LEN, "rx on 2 lines refused with quad");
+	CHECK(seg_xfer(&ctx, 0, 4, 0) == TEST_LEN, "rx on 4 lines refused");
+	CHECK(seg_xfer(&ctx, 0, 0, 1) == TEST_LEN, "full duplex on 1 line refused");
+	CHECK(fake_messages == 5, "%llu messages for 5 segments", fake_messages);
+
+	fake_messages = 0;
+	ret = seg_xfer(&ctx, 4, 0, 0);
+	CHECK(ret == -LIBCOMMBUS_ERROR_NOT_SUPPORT, "tx on 4 lines with dual: %d", ret);
+	ret = seg_xfer(&ctx, 3, 0, 0);
+	CHECK(ret == -LIBCOMMBUS_ERROR_NOT_SUPPORT, "tx on 3 lines: %d", ret);
+	ret = seg_xfer(&ctx, 0, 8, 0);
+	CHECK(ret == -LIBCOMMBUS_ERROR_NOT_SUPPORT, "rx on 8 lines: %d", ret);
+	ret = seg_xfer(&ctx, 2, 2, 1);
+	CHECK(ret == -LIBCOMMBUS_ERROR_NOT_SUPPORT, "full duplex on 2 lines: %d", ret);
+	CHECK(fake_messages == 0, "refused segments sent %llu messages", fake_messages);
+
+	spi_ctx_close(&ctx);
+
+	ret = spi_ctx_open(&ctx, TEST_PATH, SPI_MODE0, TEST_SPEED);
+	CHECK(ret == LIBCOMMBUS_SUCCESS, "plain open: %d", ret);
+	if (ret != LIBCOMMBUS_SUCCESS)
+		return;
+	ret = seg_xfer(&ctx, 0, 2, 0);
+	CHECK(ret == -LIBCOMMBUS_ERROR_NOT_SUPPORT, "rx on 2 lines without dual: %d", ret);
+	spi_ctx_close(&ctx);
+}
+
+/* one shared data line: either direction, never both */
+static void test_3wire(void)
+{
+	unsigned char tx[TEST_LEN];
+	unsigned char rx[TEST_LEN];
+	struct spi_ctx_t ctx;
+	int ret;
+
+	fake_lanes = LANE_FLAGS;
+
+	ret = spi_ctx_open(&ctx, TEST_PATH, SPI_MODE0 | SPI_FLAG_3WIRE, TEST_SPEED);
+	CHECK(ret == LIBCOMMBUS_SUCCESS, "3-wire open: %d", ret);
+	if (ret != LIBCOMMBUS_SUCCESS)
+		return;
+
+	memset(tx, 0x5a, sizeof(tx));
+	fake_messages = 0;
+	ret = spi_ctx_xfer(&ctx, tx, rx, TEST_LEN);
+	CHECK(ret == -LIBCOMMBUS_ERROR_NOT_SUPPORT, "3-wire xfer full duplex: %d", ret);
+	ret = seg_xfer(&ctx, 0, 0, 1);
+	CHECK(ret == -LIBCOMMBUS_ERROR_NOT_SUPPORT, "3-wire segment full duplex: %d", ret);
+	CHECK(fake_messages == 0, "3-wire full duplex sent %llu messages", fake_messages);
+
+	CHECK(spi_ctx_xfer(&ctx, tx, NULL, TEST_LEN) == TEST_LEN, "3-wire write refused");
+	CHECK(spi_ctx_xfer(&ctx, NULL, rx, TEST_LEN) == TEST_LEN, "3-wire read refused");
+	CHECK(seg_xfer(&ctx, 1, 0, 0) == TEST_LEN, "3-wire write segment refused");
+	CHECK(seg_xfer(&ctx, 0, 1, 0) == TEST_LEN, "3-wire read segment refused");
+	CHECK(fake_messages == 4, "%llu messages for 4 transfers", fake_messages);
+
+	spi_ctx_close(&ctx);
+}
+
+static void test_xpt(void)
+{
+	xpt_spi_context dev;
+	unsigned int before;
+	xpt_result_t res;
+
+	fake_lanes = SPI_TX_DUAL | SPI_RX_DUAL;
+
+	dev = xpt_spi_init_raw(0, 0);
+	CHECK(dev != NULL, "xpt_spi_init_raw failed");
+	if (dev == NULL)
+		return;
+
+	res = xpt_spi_mode(dev, XPT_SPI_MODE3);
+	CHECK(res == XPT_SUCCESS && fake_mode == SPI_MODE_3, "mode 3: %d, mode 0x%x", res, fake_mode);
+
+	res = xpt_spi_mode_flags(dev, XPT_SPI_RX_DUAL);
+	CHECK(res == XPT_SUCCESS, "rx dual: %d", res);
+	CHECK(fake_mode == (SPI_MODE_3 | SPI_RX_DUAL), "rx dual set mode 0x%x", fake_mode);
+
+	/* the clock mode changes, the lanes stay */
+	res = xpt_spi_mode(dev, XPT_SPI_MODE1);
+	CHECK(res == XPT_SUCCESS, "mode 1: %d", res);
+	CHECK(fake_mode == (SPI_MODE_1 | SPI_RX_DUAL), "mode 1 set mode 0x%x", fake_mode);
+
+	/* rx quad is dropped, the rest must not stay half applied */
+	before = fake_mode;
+	res = xpt_spi_mode_flags(dev, XPT_SPI_TX_DUAL | XPT_SPI_RX_QUAD);
+	CHECK(res == XPT_ERROR_FEATURE_NOT_SUPPORTED, "tx dual, rx quad: %d", res);
+	CHECK(fake_mode == before, "partial accept left mode 0x%x, was 0x%x", fake_mode, before);
+
+	res = xpt_spi_mode_flags(dev, 0x1000);
+	CHECK(res == XPT_ERROR_INVALID_PARAMETER, "unknown flag: %d", res);
+	CHECK(fake_mode == before, "unknown flag left mode 0x%x, was 0x%x", fake_mode, before);
+
+	/* back to plain SPI, and the mode change after it stays plain */
+	res = xpt_spi_mode_flags(dev, 0);
+	CHECK(res == XPT_SUCCESS && fake_mode == SPI_MODE_1, "no flags: %d, mode 0x%x", res, fake_mode);
+	res = xpt_spi_mode(dev, XPT_SPI_MODE2);
+	CHECK(res == XPT_SUCCESS && fake_mode == SPI_MODE_2, "mode 2: %d, mode 0x%x", res, fake_mode);
+
+	xpt_spi_stop(dev);
+}
+
+int main(void)
+{
+	test_open();
+	test_lanes();
+	test_3wire();
+	test_xpt();
+
+	return test_result();
+}
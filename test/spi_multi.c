@@ -0,0 +1,211 @@
+/***************************************************************************
+ *   Copyright (C) 2015 by Tse-Lun Bien                                    *
+ *   allanbian@gmail.com                                                   *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+
+/*
+ * Multi-segment SPI transfers.
+ *
+ * There is no SPI controller to test against, so this program provides
+ * its own ioctl() in place of spidev and records every message it is
+ * handed. The segments of one spi_xfer_multi() must arrive as a single
+ * SPI_IOC_MESSAGE(N) with each segment's settings copied to its
+ * transfer, and segment counts out of range must be refused before
+ * anything reaches the bus.
+ *
+ * usage: spi_multi
+ */
+
+#define _GNU_SOURCE
+#define TEST_FAKE_SPIDEV
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/spi/spidev.h>
+
+#include "commbus.h"
+#include "spi.h"
+#include "test_util.h"
+
+#define TEST_BUS	0
+#define TEST_CS		0
+#define TEST_SPEED	1000000
+#define TEST_SEG_LEN	8
+
+/* the simulated device, the last message it was handed */
+static unsigned long long fake_messages;
+static struct spi_ioc_transfer fake_xfer[SPI_SEG_MAX];
+static int fake_n;
+static unsigned int fake_mode;
+
+static int fake_message(struct spi_ioc_transfer *xfer, int n)
+{
+	int total = 0;
+	int i;
+
+	fake_messages++;
+	fake_n = n;
+	if (n <= SPI_SEG_MAX)
+		memcpy(fake_xfer, xfer, n * sizeof(*xfer));
+
+	for (i = 0; i < n; i++)
+		total += xfer[i].len;
+
+	return total;
+}
+
+int ioctl(int fd, unsigned long request, ...)
+{
+	va_list ap;
+	void *arg;
+
+	va_start(ap, request);
+	arg = va_arg(ap, void *);
+	va_end(ap);
+
+	if (_IOC_TYPE(request) != SPI_IOC_MAGIC)
+		return syscall(SYS_ioctl, fd, request, arg);
+
+	if (_IOC_NR(request) == 0)
+		return fake_message((struct spi_ioc_transfer *)arg,
+				_IOC_SIZE(request) / sizeof(struct spi_ioc_transfer));
+
+	/* the controller keeps whatever mode it is given */
+	if (request == SPI_IOC_WR_MODE32)
+		fake_mode = *(unsigned int *)arg;
+	else if (request == SPI_IOC_RD_MODE32)
+		*(unsigned int *)arg = fake_mode;
+
+	/* bits and speed setters are accepted as they are */
+	return 0;
+}
+
+static void reset_fake(void)
+{
+	fake_messages = 0;
+	fake_n = 0;
+	memset(fake_xfer, 0, sizeof(fake_xfer));
+}
+
+/* a command, a dual-line read of its answer and a trailing write */
+static void test_fields(void)
+{
+	unsigned char cmd[4] = { 0x3b, 0x00, 0x10, 0x00 };
+	unsigned char rx[16];
+	unsigned char tx[6];
+	struct spi_seg_t segs[3];
+	int ret;
+	int i;
+
+	memset(segs, 0, sizeof(segs));
+	segs[0].tx = cmd;
+	segs[0].len = sizeof(cmd);
+	segs[0].delay_us = 10;
+	segs[0].cs_change = 0;
+	segs[1].rx = rx;
+	segs[1].len = sizeof(rx);
+	segs[1].speed = 500000;
+	segs[1].bits = 16;
+	segs[1].rx_nbits = 2;
+	segs[1].cs_change = 7;
+	segs[2].tx = tx;
+	segs[2].len = sizeof(tx);
+	segs[2].tx_nbits = 1;
+	segs[2].delay_us = 3;
+	reset_fake();
+
+	ret = spi_xfer_multi(TEST_BUS, TEST_CS, segs, 3);
+	CHECK(ret == (int)(sizeof(cmd) + sizeof(rx) + sizeof(tx)), "fields: returned %d", ret);
+	CHECK(fake_messages == 1 && fake_n == 3, "fields: %llu messages, last of %d transfers",
+	      fake_messages, fake_n);
+
+	for (i = 0; i < 3 && i < fake_n; i++) {
+		CHECK(fake_xfer[i].tx_buf == (unsigned long)segs[i].tx, "seg %d: tx_buf", i);
+		CHECK(fake_xfer[i].rx_buf == (unsigned long)segs[i].rx, "seg %d: rx_buf", i);
+		CHECK(fake_xfer[i].len == segs[i].len, "seg %d: len %u", i, fake_xfer[i].len);
+		CHECK(fake_xfer[i].speed_hz == segs[i].speed, "seg %d: speed_hz %u", i, fake_xfer[i].speed_hz);
+		CHECK(fake_xfer[i].bits_per_word == segs[i].bits, "seg %d: bits_per_word %u",
+		      i, fake_xfer[i].bits_per_word);
+		CHECK(fake_xfer[i].tx_nbits == segs[i].tx_nbits, "seg %d: tx_nbits %u", i, fake_xfer[i].tx_nbits);
+		CHECK(fake_xfer[i].rx_nbits == segs[i].rx_nbits, "seg %d: rx_nbits %u", i, fake_xfer[i].rx_nbits);
+		CHECK(fake_xfer[i].delay_usecs == segs[i].delay_us, "seg %d: delay_usecs %u",
+		      i, fake_xfer[i].delay_usecs);
+		/* any nonzero cs_change reaches the kernel as 1 */
+		CHECK(fake_xfer[i].cs_change == (segs[i].cs_change ? 1 : 0), "seg %d: cs_change %u",
+		      i, fake_xfer[i].cs_change);
+	}
+}
+
+/* up to SPI_SEG_MAX segments go in one message, no more are taken */
+static void test_bounds(void)
+{
+	unsigned char tx[(SPI_SEG_MAX + 1) * TEST_SEG_LEN];
+	struct spi_seg_t segs[SPI_SEG_MAX + 1];
+	int ret;
+	int i;
+
+	memset(tx, 0x5a, sizeof(tx));
+	memset(segs, 0, sizeof(segs));
+	for (i = 0; i < SPI_SEG_MAX + 1; i++) {
+		segs[i].tx = tx + i * TEST_SEG_LEN;
+		segs[i].len = TEST_SEG_LEN;
+	}
+
+	reset_fake();
+	ret = spi_xfer_multi(TEST_BUS, TEST_CS, segs, SPI_SEG_MAX);
+	CHECK(ret == SPI_SEG_MAX * TEST_SEG_LEN, "max segments: returned %d", ret);
+	CHECK(fake_messages == 1 && fake_n == SPI_SEG_MAX, "max segments: %llu messages, last of %d",
+	      fake_messages, fake_n);
+
+	reset_fake();
+	ret = spi_xfer_multi(TEST_BUS, TEST_CS, segs, SPI_SEG_MAX + 1);
+	CHECK(ret == -LIBCOMMBUS_ERROR_NOT_SUPPORT, "too many segments: returned %d", ret);
+	ret = spi_xfer_multi(TEST_BUS, TEST_CS, segs, 0);
+	CHECK(ret == -LIBCOMMBUS_ERROR_NOT_SUPPORT, "no segments: returned %d", ret);
+	ret = spi_xfer_multi(TEST_BUS, TEST_CS, segs, -1);
+	CHECK(ret == -LIBCOMMBUS_ERROR_NOT_SUPPORT, "negative segments: returned %d", ret);
+	CHECK(fake_messages == 0, "refused counts sent %llu messages", fake_messages);
+
+	ret = spi_xfer_multi(SPI_BUS_MAX, TEST_CS, segs, 1);
+	CHECK(ret == -LIBCOMMBUS_ERROR_NO_DEVICE, "bad bus: returned %d", ret);
+	ret = spi_xfer_multi(TEST_BUS, -1, segs, 1);
+	CHECK(ret == -LIBCOMMBUS_ERROR_NO_DEVICE, "bad cs: returned %d", ret);
+	CHECK(fake_messages == 0, "bad bus or cs sent %llu messages", fake_messages);
+}
+
+int main(void)
+{
+	int ret;
+
+	ret = spi_open(TEST_BUS, TEST_CS, SPI_MODE0 | SPI_FLAG_RX_DUAL, TEST_SPEED);
+	if (ret != LIBCOMMBUS_SUCCESS) {
+		printf("spi_open: %d\n", ret);
+		return 1;
+	}
+
+	test_fields();
+	test_bounds();
+
+	spi_close(TEST_BUS, TEST_CS);
+
+	return test_result();
+}
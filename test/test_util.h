@@ -0,0 +1,173 @@
+/***************************************************************************
+ *   Copyright (C) 2015 by Tse-Lun Bien                                    *
+ *   allanbian@gmail.com                                                   *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+
+/*
+ * Helpers shared by the test programs in this directory. Every test is a
+ * single source file built on its own, so everything here is static.
+ *
+ * Optional parts, enabled by what the test defines before including this:
+ *   TEST_FAKE_SPIDEV  an open() that hands out /dev/null for spidev paths,
+ *                     for tests simulating the device in their ioctl()
+ *   TEST_FAKE_I2CDEV  the same for i2c-dev paths
+ *   TEST_RTU_CRC16    the CRC function rtu_send() appends to slave replies
+ *   I2C_RDWR          (from i2c-dev.h) fake_i2c_rdwr() for simulated buses
+ */
+
+#ifndef TEST_UTIL_H
+#define TEST_UTIL_H
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+
+static int failures __attribute__((unused));
+
+/* count a failed check and say where, the test goes on */
+#define CHECK(cond, ...) do { \
+	if (!(cond)) { \
+		printf("FAIL %s:%d: ", __FILE__, __LINE__); \
+		printf(__VA_ARGS__); \
+		printf("\n"); \
+		failures++; \
+	} \
+} while (0)
+
+/* the last line of a checking test, and its exit status */
+static inline int test_result(void)
+{
+	printf("%s\n", failures ? "FAILED" : "PASSED");
+	return failures != 0;
+}
+
+static inline double now_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+/* qsort() order of latency samples */
+static inline int cmp_double(const void *a, const void *b)
+{
+	double x = *(const double *)a;
+	double y = *(const double *)b;
+
+	return (x > y) - (x < y);
+}
+
+/* byte pos of a test stream, so lost or repeated bytes show up */
+static inline unsigned char pattern(unsigned long long pos)
+{
+	return (pos * 7 + (pos >> 8) + (pos >> 16)) & 0xff;
+}
+
+/* read exactly len bytes, -1 on end of file or error */
+static inline int read_full(int fd, unsigned char *buf, int len)
+{
+	int got = 0;
+	int n;
+
+	while (got < len) {
+		n = read(fd, &buf[got], len - got);
+		if (n <= 0)
+			return -1;
+		got += n;
+	}
+
+	return got;
+}
+
+#ifdef TEST_RTU_CRC16
+/*
+ * Send a simulated slave's reply: append the CRC and take as long as the
+ * frame would on the wire at char_us per character. Returns what write()
+ * does.
+ */
+static inline int rtu_send(int fd, unsigned char *adu, int len, int char_us)
+{
+	unsigned short crc = TEST_RTU_CRC16(adu, len);
+
+	adu[len++] = crc & 0xff;
+	adu[len++] = crc >> 8;
+
+	usleep(len * char_us);
+	return write(fd, adu, len);
+}
+#endif
+
+#if defined(TEST_FAKE_SPIDEV) || defined(TEST_FAKE_I2CDEV)
+#include <stdarg.h>
+#include <fcntl.h>
+#include <sys/syscall.h>
+
+int open(const char *path, int flags, ...)
+{
+	va_list ap;
+	int mode;
+
+	va_start(ap, flags);
+	mode = va_arg(ap, int);
+	va_end(ap);
+
+#ifdef TEST_FAKE_SPIDEV
+	if (strncmp(path, "/dev/spidev", 11) == 0)
+		path = "/dev/null";
+#endif
+#ifdef TEST_FAKE_I2CDEV
+	if (strncmp(path, "/dev/i2c-", 9) == 0)
+		path = "/dev/null";
+#endif
+
+	return syscall(SYS_openat, AT_FDCWD, path, flags, mode);
+}
+#endif
+
+#ifdef I2C_RDWR
+/*
+ * I2C_RDWR on a simulated bus. msg_cb plays one message and returns 0, or
+ * an errno that ends the transfer there, e.g. ENXIO for a missing
+ * acknowledge.
+ */
+static inline int fake_i2c_rdwr(struct i2c_rdwr_ioctl_data *rdwr, int (*msg_cb)(struct i2c_msg *msg))
+{
+	unsigned int i;
+	int err;
+
+	if (rdwr->nmsgs > I2C_RDRW_IOCTL_MAX_MSGS) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	for (i = 0; i < rdwr->nmsgs; i++) {
+		err = msg_cb(&rdwr->msgs[i]);
+		if (err) {
+			errno = err;
+			return -1;
+		}
+	}
+
+	return rdwr->nmsgs;
+}
+#endif
+
+#endif
@@ -0,0 +1,218 @@
+/***************************************************************************
+ *   Copyright (C) 2015 by Tse-Lun Bien                                    *
+ *   allanbian@gmail.com                                                   *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+
+/*
+ * Flow control stress on a pty.
+ *
+ * A writer pushes a position dependent pattern into the pty master as
+ * fast as the pty takes it, the uart side drains it into a small rx ring
+ * and a consumer that stalls now and then. Without flow control the ring
+ * overruns and the lost bytes are counted as dropped; with flow control
+ * the rx thread stops reading while the ring is full, the pty buffer
+ * fills and the writer is held off, as RTS/CTS would hold off a real
+ * transmitter, and every byte must arrive in order.
+ *
+ * The driver's overrun counters are printed too where the port has them,
+ * which a pty does not.
+ *
+ * usage: uart_flow [megabytes]
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include <pty.h>
+#include <termios.h>
+
+#include "commbus.h"
+#include "uart.h"
+#include "test_util.h"
+
+#define TEST_MB		8
+#define TEST_BURST	4096
+#define TEST_RING	(64 * 1024)
+/* the consumer stalls for STALL_US after every STALL_EVERY bytes */
+#define STALL_EVERY	(512 * 1024)
+#define STALL_US	20000
+
+struct writer_arg {
+	int fd;
+	unsigned long long total;
+	unsigned long long written;
+};
+
+static void *writer_thread(void *arg)
+{
+	struct writer_arg *writer = (struct writer_arg *)arg;
+	unsigned char buf[TEST_BURST];
+	unsigned long long pos = 0;
+	int len;
+	int n;
+	int i;
+
+	while (pos < writer->total) {
+		len = TEST_BURST;
+		if (len > writer->total - pos)
+			len = writer->total - pos;
+		for (i = 0; i < len; i++)
+			buf[i] = pattern(pos + i);
+
+		n = write(writer->fd, buf, len);
+		if (n <= 0)
+			break;
+		pos += n;
+	}
+	writer->written = pos;
+
+	return NULL;
+}
+
+static void run(unsigned long long total, int flow, const char *name)
+{
+	struct uart_ctx_t uart;
+	struct uart_rx_stats_t stats;
+	struct writer_arg writer;
+	struct timespec deadline;
+	pthread_t tid;
+	char path[64];
+	unsigned char *p;
+	unsigned long long pos = 0;
+	unsigned long long stall = STALL_EVERY;
+	double start;
+	double elapsed;
+	int errors = 0;
+	int slave;
+	int ret;
+	int n;
+	int i;
+
+	if (openpty(&writer.fd, &slave, path, NULL, NULL) != 0) {
+		perror("openpty");
+		failures++;
+		return;
+	}
+	if (uart_ctx_open(&uart, path, 115200, PAR_NONE, DATBITS_8, STOPBITS_1) != LIBCOMMBUS_SUCCESS) {
+		CHECK(0, "cannot open %s", path);
+		return;
+	}
+	close(slave);
+
+	ret = uart_ctx_set_flowcontrol(&uart, flow);
+	CHECK(ret == LIBCOMMBUS_SUCCESS, "%s: uart_ctx_set_flowcontrol returned %d", name, ret);
+	CHECK(uart_ctx_rx_start(&uart, TEST_RING) == LIBCOMMBUS_SUCCESS, "uart_ctx_rx_start failed");
+	writer.total = total;
+
+	start = now_us();
+	pthread_create(&tid, NULL, writer_thread, &writer);
+	while (pos < total) {
+		uart_deadline(&deadline, 500);
+		n = uart_ctx_rx_peek(&uart, &p, 1, &deadline);
+		if (n <= 0)
+			break;
+		/* once bytes were dropped the pattern no longer lines up */
+		if (flow != UART_FLOW_NONE) {
+			for (i = 0; i < n; i++)
+				errors += p[i] != pattern(pos + i);
+		}
+		uart_ctx_rx_commit(&uart, n);
+		pos += n;
+
+		if (pos >= stall) {
+			usleep(STALL_US);
+			stall += STALL_EVERY;
+		}
+	}
+	elapsed = now_us() - start;
+	pthread_join(tid, NULL);
+
+	uart_ctx_get_rx_stats(&uart, &stats);
+	printf("flow=%s bytes=%llu MB/s=%.1f dropped=%llu throttled=%llu high_water=%u errors=%d",
+	       name, pos, pos / elapsed, stats.dropped, stats.throttled, stats.high_water, errors);
+	if (stats.icount_valid)
+		printf(" overrun=%u buf_overrun=%u", stats.overrun, stats.buf_overrun);
+	printf("\n");
+
+	CHECK(writer.written == total, "%s: writer stopped at %llu", name, writer.written);
+	CHECK(pos + stats.dropped == total, "%s: bytes unaccounted for", name);
+	if (flow == UART_FLOW_NONE) {
+		CHECK(stats.dropped > 0, "consumer stalls did not overrun the ring");
+	} else {
+		CHECK(pos == total && errors == 0, "%s: got %llu bytes, %d errors", name, pos, errors);
+		CHECK(stats.dropped == 0 && stats.throttled > 0, "%s: dropped %llu, throttled %llu",
+		      name, stats.dropped, stats.throttled);
+	}
+
+	uart_ctx_close(&uart);
+	close(writer.fd);
+}
+
+/* XON/XOFF eats 0x11/0x13 from binary data, only check the termios bits */
+static void check_settings(void)
+{
+	struct uart_ctx_t uart;
+	struct termios tio;
+	char path[64];
+	int master;
+	int slave;
+
+	if (openpty(&master, &slave, path, NULL, NULL) != 0) {
+		perror("openpty");
+		failures++;
+		return;
+	}
+	if (uart_ctx_open(&uart, path, 115200, PAR_NONE, DATBITS_8, STOPBITS_1) != LIBCOMMBUS_SUCCESS) {
+		CHECK(0, "cannot open %s", path);
+		return;
+	}
+	close(slave);
+
+	CHECK(uart_ctx_set_flowcontrol(&uart, UART_FLOW_RTSCTS | UART_FLOW_XONXOFF) == LIBCOMMBUS_SUCCESS,
+	      "enabling both failed");
+	tcgetattr(uart_ctx_get_fd(&uart), &tio);
+	CHECK((tio.c_cflag & CRTSCTS) && (tio.c_iflag & IXON) && (tio.c_iflag & IXOFF) &&
+	      tio.c_cc[VSTART] == 0x11 && tio.c_cc[VSTOP] == 0x13, "flow control not set");
+
+	CHECK(uart_ctx_set_flowcontrol(&uart, UART_FLOW_NONE) == LIBCOMMBUS_SUCCESS, "disabling failed");
+	tcgetattr(uart_ctx_get_fd(&uart), &tio);
+	CHECK(!(tio.c_cflag & CRTSCTS) && !(tio.c_iflag & (IXON | IXOFF)), "flow control not cleared");
+
+	CHECK(uart_ctx_set_flowcontrol(&uart, 4) == -LIBCOMMBUS_ERROR_NOT_SUPPORT, "bad flag accepted");
+
+	uart_ctx_close(&uart);
+	close(master);
+}
+
+int main(int argc, char *argv[])
+{
+	unsigned long long total = (unsigned long long)TEST_MB << 20;
+
+	if (argc > 1)
+		total = (unsigned long long)atoi(argv[1]) << 20;
+
+	check_settings();
+	run(total, UART_FLOW_NONE, "none");
+	run(total, UART_FLOW_RTSCTS, "rtscts");
+
+	return test_result();
+}
@@ -18,69 +18,58 @@
  *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
  ***************************************************************************/
 
+/*
+ * Echo responder for running uart_send's measurements over a real cable:
+ * everything received is written straight back, in whatever chunks it
+ * arrives, so the far end sees the same echo the pty benchmark uses.
+ *
+ * usage: uart_resp [device] [baudrate]
+ */
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include "commbus.h"
 #include "uart.h"
 
-#define TEST_LEN    1
-
-void check_pattern(unsigned char *buf, unsigned char pattern, int len)
-{
-	int i;
-
-	for (i = 0; i < len; i++) {
-		if (buf[i] != pattern) {
-			printf("(%d)RX = %x Pattern = %x\n", i, buf[i], pattern);
-		}
-	}
-}
+#define TEST_DEVICE	"/dev/ttyS0"
+#define TEST_BAUD	115200
+#define TEST_BUF	4096
 
 int main(int argc, char *argv[])
 {
+	struct uart_ctx_t uart;
+	unsigned char buf[TEST_BUF];
+	unsigned long long total = 0;
+	const char *path = argc > 1 ? argv[1] : TEST_DEVICE;
+	int baud = argc > 2 ? atoi(argv[2]) : TEST_BAUD;
 	int ret;
-	int len;
-	unsigned char *buf = NULL;
+	int n;
 
-	if (argc == 2) {
-		len = atoi(argv[1]);
-	} else {
-		len = TEST_LEN;
-	}
-
-	buf = (unsigned char *)malloc(sizeof(unsigned char)*len);
-	if (buf == NULL) {
-		debug_print("malloc failed!\n");
-		return 1;        
-	}
-
-	ret = uart_open(COM0, 115200, PAR_NONE, DATBITS_8, STOPBITS_1);
+	ret = uart_ctx_open(&uart, path, baud, PAR_NONE, DATBITS_8, STOPBITS_1);
 	if (ret != LIBCOMMBUS_SUCCESS) {
-		debug_print("open failed!\n");
+		printf("cannot open %s: %d\n", path, ret);
 		return 1;
 	}
-	debug_print("--Ready to Run Test--\n");
+	printf("echoing on %s at %u baud\n", path, uart_ctx_get_baudrate(&uart));
 
 	while (1) {
-		ret = uart_read(COM0, buf, len);
-		if (ret != len) {
-			debug_print("uart_read: len=%d error!\n", ret);
+		/* whatever is there, at least one byte */
+		n = uart_ctx_read_deadline(&uart, buf, sizeof(buf), 1, NULL);
+		if (n <= 0) {
+			printf("uart read returned %d after %llu bytes\n", n, total);
+			break;
 		}
 
-		check_pattern(buf, buf[0], len);
-
-		ret = uart_write(COM0, buf, len);
-		if (ret != len) {
-			debug_print("uart_write: len=%d error!\n", ret);
+		ret = uart_ctx_write(&uart, buf, n);
+		if (ret != n) {
+			printf("uart write returned %d after %llu bytes\n", ret, total);
+			break;
 		}
-
-		debug_print("RX: %x\n", buf[0]);
+		total += n;
 	}
 
-	free(buf);
+	uart_ctx_close(&uart);
 
-	return 0;
+	return 1;
 }
-
-
@@ -0,0 +1,304 @@
+/***************************************************************************
+ *   Copyright (C) 2015 by Tse-Lun Bien                                    *
+ *   allanbian@gmail.com                                                   *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+
+/*
+ * Background rx ring on a pty.
+ *
+ * A writer thread pushes a position dependent pattern into the pty master
+ * at a fixed line rate while the consumer works in batches and stalls now
+ * and then, as an application that processes records would. The same
+ * stream is read once with plain reads and once with peek/commit on the
+ * ring, checking every byte.
+ *
+ * A pty blocks the writer instead of losing data when the reader falls
+ * behind; a real UART cannot hold back the far end, so the time the
+ * writer spent blocked is what would have overflowed the tty buffer.
+ * A last run with a tiny ring checks that overflow is counted and
+ * nothing else is lost.
+ *
+ * usage: uart_ring [megabytes]
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include <pty.h>
+
+#include "commbus.h"
+#include "uart.h"
+#include "test_util.h"
+
+#define TEST_MB		4
+#define TEST_BURST	4096
+#define TEST_BATCH	512
+/* bytes per second on the simulated line, about 20 Mbaud */
+#define TEST_RATE	(2 * 1024 * 1024)
+/* the consumer stalls for STALL_US after every STALL_EVERY bytes */
+#define STALL_EVERY	(256 * 1024)
+#define STALL_US	20000
+
+struct writer_arg {
+	int fd;
+	unsigned long long total;
+	int paced;
+	double max_block_us;
+};
+
+static void *writer_thread(void *arg)
+{
+	struct writer_arg *writer = (struct writer_arg *)arg;
+	unsigned char buf[TEST_BURST];
+	unsigned long long pos = 0;
+	struct timespec next;
+	double start;
+	int len;
+	int n;
+	int i;
+
+	clock_gettime(CLOCK_MONOTONIC, &next);
+	writer->max_block_us = 0;
+
+	while (pos < writer->total) {
+		len = TEST_BURST - (pos % 1000);
+		if (len > writer->total - pos)
+			len = writer->total - pos;
+		for (i = 0; i < len; i++)
+			buf[i] = pattern(pos + i);
+
+		start = now_us();
+		n = write(writer->fd, buf, len);
+		if (n <= 0)
+			break;
+		if (now_us() - start > writer->max_block_us)
+			writer->max_block_us = now_us() - start;
+		pos += n;
+
+		if (writer->paced) {
+			/* bytes leave at the line rate, not in one go */
+			next.tv_nsec += (long long)n * 1000000000 / TEST_RATE;
+			while (next.tv_nsec >= 1000000000) {
+				next.tv_nsec -= 1000000000;
+				next.tv_sec++;
+			}
+			clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL);
+		}
+	}
+
+	return NULL;
+}
+
+static int open_pair(struct uart_ctx_t *uart, int *master)
+{
+	char name[64];
+	int slave;
+
+	if (openpty(master, &slave, name, NULL, NULL) != 0) {
+		perror("openpty");
+		return -1;
+	}
+
+	if (uart_ctx_open(uart, name, 115200, PAR_NONE, DATBITS_8, STOPBITS_1) != LIBCOMMBUS_SUCCESS) {
+		close(*master);
+		close(slave);
+		return -1;
+	}
+
+	/* uart keeps its own descriptor of the tty side */
+	close(slave);
+	return 0;
+}
+
+static void run_plain(unsigned long long total)
+{
+	struct uart_ctx_t uart;
+	struct writer_arg writer;
+	struct timespec deadline;
+	pthread_t tid;
+	unsigned char buf[TEST_BATCH];
+	unsigned long long pos = 0;
+	unsigned long long stall = STALL_EVERY;
+	unsigned long long calls = 0;
+	double start;
+	int errors = 0;
+	int n;
+	int i;
+
+	if (open_pair(&uart, &writer.fd) != 0) {
+		CHECK(0, "pty setup failed");
+		return;
+	}
+	writer.total = total;
+	writer.paced = 1;
+
+	start = now_us();
+	pthread_create(&tid, NULL, writer_thread, &writer);
+	while (pos < total) {
+		uart_deadline(&deadline, 1000);
+		n = uart_ctx_read_deadline(&uart, buf, sizeof(buf), 1, &deadline);
+		if (n <= 0)
+			break;
+		calls++;
+		for (i = 0; i < n; i++)
+			errors += buf[i] != pattern(pos + i);
+		pos += n;
+
+		if (pos >= stall) {
+			usleep(STALL_US);
+			stall += STALL_EVERY;
+		}
+	}
+	pthread_join(tid, NULL);
+
+	printf("mode=plain bytes=%llu MB/s=%.1f reads=%llu writer_blocked_ms=%.1f errors=%d\n",
+	       pos, pos / (now_us() - start), calls, writer.max_block_us / 1e3, errors);
+	CHECK(pos == total && errors == 0, "plain read got %llu bytes, %d errors", pos, errors);
+
+	uart_ctx_close(&uart);
+	close(writer.fd);
+}
+
+static void run_ring(unsigned long long total)
+{
+	struct uart_ctx_t uart;
+	struct uart_rx_stats_t stats;
+	struct writer_arg writer;
+	struct timespec deadline;
+	pthread_t tid;
+	unsigned char *p;
+	unsigned long long pos = 0;
+	unsigned long long stall = STALL_EVERY;
+	unsigned long long calls = 0;
+	double start;
+	int errors = 0;
+	int n;
+	int i;
+
+	if (open_pair(&uart, &writer.fd) != 0) {
+		CHECK(0, "pty setup failed");
+		return;
+	}
+	writer.total = total;
+	writer.paced = 1;
+
+	CHECK(uart_ctx_rx_start(&uart, 0) == LIBCOMMBUS_SUCCESS, "uart_ctx_rx_start failed");
+
+	start = now_us();
+	pthread_create(&tid, NULL, writer_thread, &writer);
+	while (pos < total) {
+		/* a whole batch at once, wrapped or not */
+		uart_deadline(&deadline, 1000);
+		n = uart_ctx_rx_peek(&uart, &p, 1, &deadline);
+		if (n <= 0)
+			break;
+		calls++;
+		for (i = 0; i < n; i++)
+			errors += p[i] != pattern(pos + i);
+		uart_ctx_rx_commit(&uart, n);
+		pos += n;
+
+		if (pos >= stall) {
+			usleep(STALL_US);
+			stall += STALL_EVERY;
+		}
+	}
+	pthread_join(tid, NULL);
+
+	uart_ctx_get_rx_stats(&uart, &stats);
+	printf("mode=ring bytes=%llu MB/s=%.1f peeks=%llu writer_blocked_ms=%.1f high_water=%u "
+	       "dropped=%llu errors=%d\n",
+	       pos, pos / (now_us() - start), calls, writer.max_block_us / 1e3, stats.high_water,
+	       stats.dropped, errors);
+	CHECK(writer.max_block_us < STALL_US / 2, "writer blocked with the ring running");
+	CHECK(pos == total && errors == 0, "ring read got %llu bytes, %d errors", pos, errors);
+	CHECK(stats.dropped == 0 && stats.bytes == total, "ring dropped %llu bytes", stats.dropped);
+
+	uart_ctx_close(&uart);
+	close(writer.fd);
+}
+
+static void run_overflow(void)
+{
+	struct uart_ctx_t uart;
+	struct uart_rx_stats_t stats;
+	struct writer_arg writer;
+	struct timespec deadline;
+	pthread_t tid;
+	unsigned char *p;
+	unsigned long long pos = 0;
+	unsigned int size;
+	int n;
+
+	if (open_pair(&uart, &writer.fd) != 0) {
+		CHECK(0, "pty setup failed");
+		return;
+	}
+
+	CHECK(uart_ctx_rx_start(&uart, 1) == LIBCOMMBUS_SUCCESS, "uart_ctx_rx_start failed");
+	size = uart.ring->size;
+	writer.total = size * 8;
+	writer.paced = 0;
+
+	/* the consumer is away while far more than the ring arrives */
+	pthread_create(&tid, NULL, writer_thread, &writer);
+	pthread_join(tid, NULL);
+	usleep(100 * 1000);
+
+	while (1) {
+		uart_deadline(&deadline, 100);
+		n = uart_ctx_rx_peek(&uart, &p, size, &deadline);
+		if (n <= 0)
+			break;
+		/* the oldest bytes are kept, the ones that did not fit are gone */
+		if (pos == 0)
+			CHECK(p[0] == pattern(0) && p[n - 1] == pattern(n - 1), "ring lost its head");
+		uart_ctx_rx_commit(&uart, n);
+		pos += n;
+		if (n < (int)size)
+			break;
+	}
+
+	uart_ctx_get_rx_stats(&uart, &stats);
+	printf("mode=overflow ring=%u written=%llu read=%llu dropped=%llu\n",
+	       size, writer.total, pos, stats.dropped);
+	CHECK(pos == size, "read %llu bytes from a full ring of %u", pos, size);
+	CHECK(pos + stats.dropped == writer.total, "bytes unaccounted for: %llu",
+	      writer.total - pos - stats.dropped);
+
+	uart_ctx_close(&uart);
+	close(writer.fd);
+}
+
+int main(int argc, char *argv[])
+{
+	unsigned long long total = (unsigned long long)TEST_MB << 20;
+
+	if (argc > 1)
+		total = (unsigned long long)atoi(argv[1]) << 20;
+
+	run_plain(total);
+	run_ring(total);
+	run_overflow();
+
+	return test_result();
+}
@@ -0,0 +1,140 @@
+/***************************************************************************
+ *   Copyright (C) 2015 by Tse-Lun Bien                                    *
+ *   allanbian@gmail.com                                                   *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+
+/*
+ * RS-485 direction control through both UART layers on a pty.
+ *
+ * A pty has no RS-485 support and rejects TIOCSRS485, so asking for it
+ * must fail with -LIBCOMMBUS_ERROR_NOT_SUPPORT or
+ * XPT_ERROR_FEATURE_NOT_SUPPORTED and report the mode as off, while the
+ * port stays usable. A platform replace hook on the xpt context must be
+ * called instead of the ioctl.
+ *
+ * usage: uart_rs485
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pty.h>
+
+#include "commbus.h"
+#include "uart.h"
+#include "xpt/uart.h"
+#include "xpt_internal.h"
+#include "test_util.h"
+
+static int hook_calls;
+
+static xpt_result_t rs485_replace(xpt_uart_context dev, xpt_uart_rs485_t *rs485)
+{
+	hook_calls++;
+	rs485->delay_before_send = 1;
+	return XPT_SUCCESS;
+}
+
+/* the port still carries data after the failed request */
+static void check_echo(int master, int fd, const char *api)
+{
+	unsigned char buf[4];
+
+	CHECK(write(fd, "ping", 4) == 4 && read_full(master, buf, 4) == 4 && memcmp(buf, "ping", 4) == 0,
+	      "%s: port unusable after set_rs485", api);
+}
+
+static void test_commbus(const char *path, int master)
+{
+	struct uart_ctx_t ctx;
+	struct uart_rs485_t rs485;
+	int ret;
+
+	if (uart_ctx_open(&ctx, path, 115200, PAR_NONE, DATBITS_8, STOPBITS_1) != LIBCOMMBUS_SUCCESS) {
+		CHECK(0, "commbus: cannot open %s", path);
+		return;
+	}
+
+	memset(&rs485, 0, sizeof(rs485));
+	rs485.enable = 1;
+	rs485.rts_on_send = 1;
+	ret = uart_ctx_set_rs485(&ctx, &rs485);
+	CHECK(ret == -LIBCOMMBUS_ERROR_NOT_SUPPORT, "commbus: set_rs485 returned %d", ret);
+	CHECK(rs485.enable == 0, "commbus: RS-485 reported on");
+	check_echo(master, uart_ctx_get_fd(&ctx), "commbus");
+
+	uart_ctx_close(&ctx);
+}
+
+static void test_xpt(const char *path, int master)
+{
+	xpt_adv_func_t adv;
+	xpt_adv_func_t *saved;
+	xpt_uart_context dev;
+	xpt_uart_rs485_t rs485;
+	xpt_result_t ret;
+
+	dev = xpt_uart_init_raw(path);
+	if (dev == NULL) {
+		CHECK(0, "xpt: cannot open %s", path);
+		return;
+	}
+
+	memset(&rs485, 0, sizeof(rs485));
+	rs485.enabled = 1;
+	ret = xpt_uart_set_rs485(dev, &rs485);
+	CHECK(ret == XPT_ERROR_FEATURE_NOT_SUPPORTED, "xpt: set_rs485 returned %d", ret);
+	CHECK(rs485.enabled == 0, "xpt: RS-485 reported on");
+	CHECK(xpt_uart_set_rs485(NULL, &rs485) == XPT_ERROR_INVALID_HANDLE, "xpt: NULL context accepted");
+	check_echo(master, dev->fd, "xpt");
+
+	/* a platform hook replaces the ioctl */
+	memset(&adv, 0, sizeof(adv));
+	adv.uart_set_rs485_replace = rs485_replace;
+	saved = dev->advance_func;
+	dev->advance_func = &adv;
+	rs485.enabled = 1;
+	ret = xpt_uart_set_rs485(dev, &rs485);
+	CHECK(ret == XPT_SUCCESS && hook_calls == 1 && rs485.delay_before_send == 1,
+	      "xpt: replace hook not used, returned %d after %d calls", ret, hook_calls);
+	dev->advance_func = saved;
+
+	xpt_uart_stop(dev);
+}
+
+int main(void)
+{
+	char path[64];
+	int master;
+	int slave;
+
+	if (openpty(&master, &slave, path, NULL, NULL) != 0) {
+		perror("openpty");
+		return 1;
+	}
+
+	test_commbus(path, master);
+	test_xpt(path, master);
+
+	close(slave);
+	close(master);
+
+	return test_result();
+}
@@ -18,103 +18,295 @@
  *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
  ***************************************************************************/
 
+/*
+ * UART latency and throughput benchmark on pseudo-terminal pairs.
+ *
+ * An echo thread sits on the pty master and sends back whatever the
+ * port under test writes. For each message size the benchmark measures
+ * the round trip of single messages (percentiles over many samples) and
+ * the sustained rate of a stream of back to back messages, once through
+ * the commbus uart_ctx_* API and once through xpt_uart_*. A pty moves
+ * bytes at memory speed, so the numbers are the software overhead of
+ * each layer, the part a regression would show up in.
+ *
+ * Every result is one line of key=value pairs on stdout:
+ *
+ *   api=commbus test=latency size=64 samples=2000 min_us=... p50_us=...
+ *   api=commbus test=throughput size=64 bytes=... MBps=... msgs_per_sec=...
+ *
+ * To exercise real hardware instead, run uart_resp on the far end of a
+ * cable.
+ *
+ * usage: uart_send [samples] [throughput_kbytes]
+ */
+
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-
-#ifdef __linux__ 
 #include <unistd.h>
-#else
-#include <windows.h>
-#endif
+#include <pthread.h>
+#include <time.h>
+#include <pty.h>
 
 #include "commbus.h"
 #include "uart.h"
+#include "xpt/uart.h"
+#include "test_util.h"
+
+#define TEST_SAMPLES	2000
+#define TEST_STREAM_KB	4096
+#define TEST_MAX_SIZE	4096
+
+static const int test_sizes[] = { 1, 16, 64, 256, 1024, 4096 };
+
+/* the API under test, behind a common read/write pair */
+struct port {
+	const char *api;
+	int (*write)(struct port *port, unsigned char *buf, int len);
+	int (*read)(struct port *port, unsigned char *buf, int len);
+	struct uart_ctx_t ctx;
+	xpt_uart_context xpt;
+};
 
-#define TEST_LEN    1
+struct stream_arg {
+	struct port *port;
+	int size;
+	unsigned long long total;
+};
 
-int check_pattern(unsigned char *buf, unsigned char pattern, int len)
+static int ctx_write(struct port *port, unsigned char *buf, int len)
 {
-	int i;
+	return uart_ctx_write(&port->ctx, buf, len);
+}
 
-	for (i = 0; i < len; i++) {
-		if (buf[i] != pattern)
-			return -1;
+/* uart_ctx_read() returns once all len bytes are in */
+static int ctx_read(struct port *port, unsigned char *buf, int len)
+{
+	return uart_ctx_read(&port->ctx, buf, len);
+}
+
+static int xpt_write(struct port *port, unsigned char *buf, int len)
+{
+	int sent = 0;
+	int n;
+
+	while (sent < len) {
+		n = xpt_uart_write(port->xpt, (const char *)&buf[sent], len - sent);
+		if (n <= 0)
+			return sent;
+		sent += n;
 	}
 
-	return 0;
+	return sent;
 }
 
-int main(int argc, char *argv[])
+static int xpt_read(struct port *port, unsigned char *buf, int len)
+{
+	int got = 0;
+	int n;
+
+	while (got < len) {
+		n = xpt_uart_read(port->xpt, (char *)&buf[got], len - got);
+		if (n <= 0)
+			return got;
+		got += n;
+	}
+
+	return got;
+}
+
+/* the far end: echo until the port side is closed */
+static void *echo_thread(void *arg)
 {
-	int ret;
+	int fd = *(int *)arg;
+	unsigned char buf[TEST_MAX_SIZE];
+	int sent;
+	int n;
+	int w;
+
+	while (1) {
+		n = read(fd, buf, sizeof(buf));
+		if (n <= 0)
+			break;
+		for (sent = 0; sent < n; sent += w) {
+			w = write(fd, &buf[sent], n - sent);
+			if (w <= 0)
+				return NULL;
+		}
+	}
+
+	return NULL;
+}
+
+static void bench_latency(struct port *port, int size, int samples)
+{
+	unsigned char tx[TEST_MAX_SIZE];
+	unsigned char rx[TEST_MAX_SIZE];
+	double *lat;
+	double start;
+	double sum = 0;
+	int errors = 0;
 	int i;
-	int len;
-	unsigned char *tx_buf;
-	unsigned char *rx_buf;
-	unsigned char pattern;
-
-	if (argc == 2) {
-		len = atoi(argv[1]);
-	} else {
-		len = TEST_LEN;
+	int j;
+
+	lat = malloc(sizeof(double) * samples);
+	if (lat == NULL)
+		return;
+
+	for (i = 0; i < samples; i++) {
+		for (j = 0; j < size; j++)
+			tx[j] = i + j;
+
+		start = now_us();
+		if (port->write(port, tx, size) != size || port->read(port, rx, size) != size) {
+			CHECK(0, "%s: round trip %d of %d bytes failed", port->api, i, size);
+			break;
+		}
+		lat[i] = now_us() - start;
+		sum += lat[i];
+
+		errors += memcmp(tx, rx, size) != 0;
 	}
+	CHECK(errors == 0, "%s: %d corrupt echoes of %d bytes", port->api, errors, size);
 
-	tx_buf = (unsigned char *)malloc(sizeof(unsigned char)*len);
-	if (tx_buf == NULL) {
-		debug_print("malloc failed!\n");
-		return 1;        
+	if (i == samples) {
+		qsort(lat, samples, sizeof(double), cmp_double);
+		printf("api=%s test=latency size=%d samples=%d min_us=%.1f p50_us=%.1f p90_us=%.1f "
+		       "p99_us=%.1f max_us=%.1f mean_us=%.1f\n",
+		       port->api, size, samples, lat[0], lat[samples / 2], lat[samples * 9 / 10],
+		       lat[samples * 99 / 100], lat[samples - 1], sum / samples);
 	}
 
-	rx_buf = (unsigned char *)malloc(sizeof(unsigned char)*len);
-	if (rx_buf == NULL) {
-		free(tx_buf);
-		debug_print("malloc failed!\n");
-		return 1;        
+	free(lat);
+}
+
+static void *stream_writer(void *arg)
+{
+	struct stream_arg *stream = (struct stream_arg *)arg;
+	unsigned char buf[TEST_MAX_SIZE];
+	unsigned long long pos = 0;
+	int len;
+	int i;
+
+	while (pos < stream->total) {
+		len = stream->size;
+		if (len > stream->total - pos)
+			len = stream->total - pos;
+		for (i = 0; i < len; i++)
+			buf[i] = (pos + i) * 13;
+		if (stream->port->write(stream->port, buf, len) != len)
+			break;
+		pos += len;
 	}
 
-	ret = uart_open(COM1, 115200, PAR_NONE, DATBITS_8, STOPBITS_1);
-	if (ret != LIBCOMMBUS_SUCCESS) {
-		debug_print("open failed!\n");
-		getchar();
-		return 1;
+	return NULL;
+}
+
+static void bench_throughput(struct port *port, int size, unsigned long long total)
+{
+	struct stream_arg stream;
+	unsigned char buf[TEST_MAX_SIZE];
+	unsigned long long pos = 0;
+	pthread_t tid;
+	double start;
+	double elapsed;
+	int errors = 0;
+	int len;
+	int i;
+
+	/* whole messages only */
+	total -= total % size;
+	stream.port = port;
+	stream.size = size;
+	stream.total = total;
+
+	start = now_us();
+	pthread_create(&tid, NULL, stream_writer, &stream);
+	while (pos < total) {
+		len = size;
+		if (port->read(port, buf, len) != len)
+			break;
+		for (i = 0; i < len; i++)
+			errors += buf[i] != (unsigned char)((pos + i) * 13);
+		pos += len;
 	}
-	printf("--Ready to Run Test--\n");
+	elapsed = now_us() - start;
+	pthread_join(tid, NULL);
 
-	pattern = 0;
-	while (1) {
-		memset(tx_buf, pattern, len);
+	CHECK(pos == total && errors == 0, "%s: stream of %d byte messages got %llu of %llu bytes, %d errors",
+	      port->api, size, pos, total, errors);
+	printf("api=%s test=throughput size=%d bytes=%llu MBps=%.2f msgs_per_sec=%.0f\n",
+	       port->api, size, pos, pos / elapsed, pos / size / (elapsed / 1e6));
+}
 
-		ret = uart_write(COM1, tx_buf, len);
-		if (ret != len) {
-			debug_print("uart_write: len=%d error!\n", ret);
-		}
+static int port_open(struct port *port, const char *api, const char *path)
+{
+	memset(port, 0, sizeof(*port));
+	port->api = api;
 
-		ret = uart_read(COM1, rx_buf, len);
-		if (ret != len) {
-			debug_print("uart_read: len=%d error!\n", ret);
-		}
+	if (strcmp(api, "commbus") == 0) {
+		port->write = ctx_write;
+		port->read = ctx_read;
+		return uart_ctx_open(&port->ctx, path, 115200, PAR_NONE, DATBITS_8, STOPBITS_1);
+	}
 
-		if (check_pattern(rx_buf, pattern, len) == 0) {
-			pattern++;
-		} else {
-			for (i = 0; i < len; i++) {
-				printf("(%d)TX: %x, RX: %x\n", i, tx_buf[i], rx_buf[i]);
-			}
+	port->write = xpt_write;
+	port->read = xpt_read;
+	port->xpt = xpt_uart_init_raw(path);
+	return port->xpt ? 0 : -1;
+}
 
-			while (1);
-		}
-		debug_print("RX:%x\n", rx_buf[0]);
+static void port_close(struct port *port)
+{
+	if (port->xpt)
+		xpt_uart_stop(port->xpt);
+	else
+		uart_ctx_close(&port->ctx);
+}
 
-#ifdef __linux__ 
-		usleep(1000);
-#else
-		Sleep(1);
-#endif
+static void run(const char *api, int samples, unsigned long long total)
+{
+	struct port port;
+	pthread_t tid;
+	char path[64];
+	int master;
+	int slave;
+	int i;
+
+	if (openpty(&master, &slave, path, NULL, NULL) != 0) {
+		perror("openpty");
+		failures++;
+		return;
 	}
 
-	free(tx_buf);
-	free(rx_buf);
+	if (port_open(&port, api, path) != 0) {
+		CHECK(0, "%s: cannot open %s", api, path);
+		close(master);
+		close(slave);
+		return;
+	}
+	/* the port has its own descriptor, the echo sees EIO once it is closed */
+	close(slave);
+	pthread_create(&tid, NULL, echo_thread, &master);
 
-	return 0;
-} 
+	for (i = 0; i < (int)(sizeof(test_sizes) / sizeof(test_sizes[0])); i++)
+		bench_latency(&port, test_sizes[i], samples);
+	for (i = 0; i < (int)(sizeof(test_sizes) / sizeof(test_sizes[0])); i++)
+		bench_throughput(&port, test_sizes[i], total);
+
+	port_close(&port);
+	pthread_join(tid, NULL);
+	close(master);
+}
+
+int main(int argc, char *argv[])
+{
+	int samples = argc > 1 ? atoi(argv[1]) : TEST_SAMPLES;
+	unsigned long long total = (unsigned long long)(argc > 2 ? atoi(argv[2]) : TEST_STREAM_KB) << 10;
+
+	run("commbus", samples, total);
+	run("xpt", samples, total);
+
+	return test_result();
+}
@@ -0,0 +1,273 @@
+/***************************************************************************
+ *   Copyright (C) 2015 by Tse-Lun Bien                                    *
+ *   allanbian@gmail.com                                                   *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+
+/*
+ * Compare the io_uring submission path with the one-syscall-per-chunk
+ * socket path.
+ *
+ * "stream": NFDS stream socket pairs are fed in rounds of one chunk per
+ * fd and drained by a sink thread; reports syscalls per MB on the sender.
+ * "pingpong": 64 byte request/response against an echo thread; reports
+ * syscalls per round trip and the p50/p99 round-trip latency.
+ *
+ * Set COMMBUS_NO_IO_URING=1 to measure the read()/write() fallback.
+ *
+ * usage: uring_bench [mbytes] [chunk] [iterations]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <unistd.h>
+#include <poll.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/socket.h>
+
+#include "commbus.h"
+#include "socket.h"
+#include "uring.h"
+#include "test_util.h"
+
+#define NFDS		8
+#define TEST_MBYTES	64
+#define TEST_CHUNK	(16 * 1024)
+#define TEST_ITER	10000
+#define PING_LEN	64
+
+struct sink_arg {
+	int fds[NFDS];
+	long long len;
+};
+
+static int test_chunk;
+
+static void *sink_thread(void *arg)
+{
+	struct sink_arg *s = (struct sink_arg *)arg;
+	struct pollfd pfd[NFDS];
+	unsigned char *buf;
+	long long recv = 0;
+	int n;
+	int i;
+
+	buf = (unsigned char *)malloc(test_chunk);
+	for (i = 0; i < NFDS; i++) {
+		pfd[i].fd = s->fds[i];
+		pfd[i].events = POLLIN;
+	}
+
+	while (recv < s->len) {
+		if (poll(pfd, NFDS, 1000) <= 0)
+			break;
+		for (i = 0; i < NFDS; i++) {
+			if (!(pfd[i].revents & POLLIN))
+				continue;
+			n = read(pfd[i].fd, buf, test_chunk);
+			if (n > 0)
+				recv += n;
+		}
+	}
+
+	free(buf);
+	return NULL;
+}
+
+static void *echo_thread(void *arg)
+{
+	struct sock_info_t sock;
+	unsigned char buf[PING_LEN];
+	int n;
+
+	sock.fd = *(int *)arg;
+	sock.type = TYPE_TCP;
+	while ((n = socket_recv(&sock, buf, sizeof(buf))) > 0) {
+		if (socket_write(&sock, buf, n) != n)
+			break;
+	}
+
+	return NULL;
+}
+
+static void bench_stream(struct uring_t *ring, int use_ring, long long len)
+{
+	struct sock_info_t sock[NFDS];
+	struct uring_cqe_t cqes[NFDS];
+	struct sink_arg sink;
+	unsigned long long syscalls = 0;
+	unsigned char *buf;
+	long long sent = 0;
+	pthread_t tid;
+	double start;
+	double elapsed;
+	int sv[2];
+	int n;
+	int i;
+
+	for (i = 0; i < NFDS; i++) {
+		socketpair(AF_UNIX, SOCK_STREAM, 0, sv);
+		sock[i].fd = sv[0];
+		sock[i].type = TYPE_TCP;
+		sink.fds[i] = sv[1];
+	}
+	sink.len = len;
+	pthread_create(&tid, NULL, sink_thread, &sink);
+
+	buf = (unsigned char *)malloc(test_chunk);
+	memset(buf, 0x3c, test_chunk);
+
+	if (use_ring)
+		syscalls = ring->syscalls;
+
+	start = now_us();
+	while (sent < len) {
+		if (use_ring) {
+			for (i = 0; i < NFDS; i++)
+				uring_prep_write(ring, sock[i].fd, i, test_chunk, i);
+			uring_submit(ring, NFDS);
+			n = uring_reap(ring, cqes, NFDS);
+			for (i = 0; i < n; i++) {
+				if (cqes[i].res > 0)
+					sent += cqes[i].res;
+			}
+		} else {
+			for (i = 0; i < NFDS; i++) {
+				n = socket_send(&sock[i], buf, test_chunk);
+				syscalls++;
+				if (n > 0)
+					sent += n;
+			}
+		}
+	}
+	pthread_join(tid, NULL);
+	elapsed = now_us() - start;
+
+	if (use_ring)
+		syscalls = ring->syscalls - syscalls;
+
+	printf("test=stream backend=%s fds=%d chunk=%d mbytes=%.0f syscalls_per_mb=%.1f mbps=%.1f\n",
+	       use_ring ? (ring->fallback ? "fallback" : "io_uring") : "socket",
+	       NFDS, test_chunk, sent / 1048576.0,
+	       syscalls / (sent / 1048576.0), sent / elapsed);
+
+	for (i = 0; i < NFDS; i++) {
+		close(sock[i].fd);
+		close(sink.fds[i]);
+	}
+	free(buf);
+}
+
+static void bench_pingpong(struct uring_t *ring, int use_ring, int iter)
+{
+	struct sock_info_t sock;
+	struct uring_cqe_t cqes[2];
+	unsigned long long syscalls = 0;
+	unsigned char buf[PING_LEN];
+	double *lat;
+	double t0;
+	pthread_t tid;
+	int sv[2];
+	int got;
+	int n;
+	int i;
+
+	socketpair(AF_UNIX, SOCK_STREAM, 0, sv);
+	sock.fd = sv[0];
+	sock.type = TYPE_TCP;
+	pthread_create(&tid, NULL, echo_thread, &sv[1]);
+
+	lat = (double *)malloc(sizeof(double) * iter);
+	memset(buf, 0x11, sizeof(buf));
+	memset(uring_buf(ring, 0), 0x11, PING_LEN);
+
+	if (use_ring)
+		syscalls = ring->syscalls;
+
+	for (i = 0; i < iter; i++) {
+		t0 = now_us();
+		if (use_ring) {
+			uring_prep_write(ring, sock.fd, 0, PING_LEN, 0);
+			uring_link(ring);
+			uring_prep_read(ring, sock.fd, 1, PING_LEN, 1);
+			uring_submit(ring, 2);
+			got = 0;
+			while (got < 2)
+				got += uring_reap(ring, &cqes[got], 2 - got);
+		} else {
+			socket_send(&sock, buf, PING_LEN);
+			syscalls++;
+			for (got = 0; got < PING_LEN; got += n) {
+				n = socket_recv(&sock, buf, PING_LEN - got);
+				syscalls++;
+				if (n <= 0)
+					break;
+			}
+		}
+		lat[i] = now_us() - t0;
+	}
+
+	if (use_ring)
+		syscalls = ring->syscalls - syscalls;
+
+	qsort(lat, iter, sizeof(double), cmp_double);
+	printf("test=pingpong backend=%s len=%d iter=%d syscalls_per_rt=%.2f p50_us=%.1f p99_us=%.1f\n",
+	       use_ring ? (ring->fallback ? "fallback" : "io_uring") : "socket",
+	       PING_LEN, iter, (double)syscalls / iter,
+	       lat[iter / 2], lat[(int)(iter * 0.99)]);
+
+	close(sock.fd);
+	pthread_join(tid, NULL);
+	close(sv[1]);
+	free(lat);
+}
+
+int main(int argc, char *argv[])
+{
+	struct uring_t ring;
+	long long len = (long long)TEST_MBYTES << 20;
+	int iter = TEST_ITER;
+
+	test_chunk = TEST_CHUNK;
+
+	if (argc > 1)
+		len = (long long)atoi(argv[1]) << 20;
+	if (argc > 2)
+		test_chunk = atoi(argv[2]);
+	if (argc > 3)
+		iter = atoi(argv[3]);
+
+	signal(SIGPIPE, SIG_IGN);
+
+	if (uring_open(&ring, 64, NFDS, test_chunk > PING_LEN ? test_chunk : PING_LEN) != LIBCOMMBUS_SUCCESS) {
+		debug_print("uring_open failed!\n");
+		return 1;
+	}
+	memset(ring.bufs, 0x3c, (size_t)ring.nbufs * ring.buf_size);
+
+	bench_stream(&ring, 0, len);
+	bench_stream(&ring, 1, len);
+	bench_pingpong(&ring, 0, iter);
+	bench_pingpong(&ring, 1, iter);
+
+	uring_close(&ring);
+
+	return 0;
+}